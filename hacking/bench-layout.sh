@@ -0,0 +1,61 @@
+#!/bin/bash
+# Compare the cold-cache metadata walk cost of the mkcomposefs layouts.
+#
+# Usage: bench-layout.sh BINDIR DUMPFILE [SUBDIR] [RUNS]
+#
+# For each layout this builds an image from DUMPFILE, loop-mounts it
+# with the kernel erofs driver, drops the page cache and times a
+# find(1) walk that stats every file below SUBDIR (default: the whole
+# image). It also reports how much data the walk read from the loop
+# device, with readahead disabled. Walking a subtree shows the effect
+# of the layout best, as a full walk reads all metadata anyway.
+# Needs root.
+
+set -euo pipefail
+
+BINDIR="$1"
+DUMP="$2"
+SUBDIR="${3:-}"
+RUNS="${4:-5}"
+
+workdir=$(mktemp -d /tmp/lcfs-bench.XXXXXX)
+trap 'umount "$workdir/mnt" 2>/dev/null || true; rm -rf -- "$workdir"' EXIT
+mkdir "$workdir/mnt"
+
+loop_read_kb() {
+    # Field 3 of the block device stat is sectors read
+    echo $(( $(awk '{print $3}' /sys/block/$1/stat) / 2 ))
+}
+
+printf "%-14s %10s %10s %12s\n" layout image-kb read-kb walk-ms
+for layout in bfs dfs dir-children; do
+    img="$workdir/$layout.img"
+    if [[ $DUMP == *.gz ]]; then
+        zcat "$DUMP" | "$BINDIR/mkcomposefs" --layout=$layout --from-file - "$img"
+    else
+        "$BINDIR/mkcomposefs" --layout=$layout --from-file "$DUMP" "$img"
+    fi
+
+    total_ms=0
+    total_kb=0
+    for run in $(seq "$RUNS"); do
+        loopdev=$(losetup --find --show --read-only "$img")
+        # Without readahead the reads show how many pages the walk touches
+        blockdev --setra 0 "$loopdev"
+        mount -t erofs -o ro "$loopdev" "$workdir/mnt"
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+        before=$(loop_read_kb "${loopdev#/dev/}")
+        start=$(date +%s%N)
+        find "$workdir/mnt/$SUBDIR" -printf "%s %m\n" > /dev/null
+        end=$(date +%s%N)
+        after=$(loop_read_kb "${loopdev#/dev/}")
+        umount "$workdir/mnt"
+        losetup -d "$loopdev"
+        total_ms=$(( total_ms + (end - start) / 1000000 ))
+        total_kb=$(( total_kb + after - before ))
+    done
+
+    printf "%-14s %10d %10d %12d\n" $layout $(( $(stat -c %s "$img") / 1024 )) \
+           $(( total_kb / RUNS )) $(( total_ms / RUNS ))
+done
@@ -46,7 +46,8 @@ static inline __u64 le64_to_cpu(__u64 val)
 #define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2 * !!(condition)]))
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
-/* We use a fixed block size for all arches of 4k */
+/* The default block size, images can use larger blocks with
+ * lcfs_write_options_s.block_size_bits */
 #define EROFS_BLKSIZ 4096
 #define EROFS_BLKSIZ_BITS 12
 
@@ -18,8 +18,10 @@
 #define _LCFS_EROFS_INTERNAL_H
 
 #include <string.h>
+#include <sys/sysmacros.h>
 
 #include "lcfs-internal.h"
+#include "lcfs-utils.h"
 #include "lcfs-erofs.h"
 #include "erofs_fs_wrapper.h"
 
@@ -67,6 +69,69 @@ static inline bool erofs_inode_is_flat(const erofs_inode *cino)
 	       erofs_inode_datalayout(cino) == EROFS_INODE_FLAT_PLAIN;
 }
 
+static inline void erofs_inode_get_info(const erofs_inode *cino, uint32_t *mode,
+					uint64_t *file_size, uint16_t *xattr_icount,
+					uint32_t *raw_blkaddr, size_t *isize)
+{
+	if (erofs_inode_is_compact(cino)) {
+		const struct erofs_inode_compact *c = &cino->compact;
+
+		*mode = lcfs_u16_from_file(c->i_mode);
+		*file_size = lcfs_u32_from_file(c->i_size);
+		*xattr_icount = lcfs_u16_from_file(c->i_xattr_icount);
+		*raw_blkaddr = lcfs_u32_from_file(c->i_u.raw_blkaddr);
+		*isize = sizeof(struct erofs_inode_compact);
+	} else {
+		const struct erofs_inode_extended *e = &cino->extended;
+		*mode = lcfs_u16_from_file(e->i_mode);
+		*file_size = lcfs_u64_from_file(e->i_size);
+		*xattr_icount = lcfs_u16_from_file(e->i_xattr_icount);
+		*raw_blkaddr = lcfs_u32_from_file(e->i_u.raw_blkaddr);
+		*isize = sizeof(struct erofs_inode_extended);
+	}
+}
+
+static inline bool erofs_inode_is_whiteout(const erofs_inode *cino)
+{
+	uint32_t mode;
+	uint32_t rdev;
+
+	if (erofs_inode_is_compact(cino)) {
+		const struct erofs_inode_compact *c = &cino->compact;
+		mode = lcfs_u16_from_file(c->i_mode);
+		rdev = lcfs_u32_from_file(c->i_u.rdev);
+	} else {
+		const struct erofs_inode_extended *e = &cino->extended;
+		mode = lcfs_u16_from_file(e->i_mode);
+		rdev = lcfs_u32_from_file(e->i_u.rdev);
+	}
+
+	int type = mode & S_IFMT;
+	return (type == S_IFCHR || type == S_IFBLK) && rdev == makedev(0, 0);
+}
+
+static inline uint32_t erofs_file_type_to_mode(int file_type)
+{
+	switch (file_type) {
+	case EROFS_FT_SYMLINK:
+		return S_IFLNK;
+	case EROFS_FT_DIR:
+		return S_IFDIR;
+	case EROFS_FT_REG_FILE:
+		return S_IFREG;
+	case EROFS_FT_BLKDEV:
+		return S_IFBLK;
+	case EROFS_FT_CHRDEV:
+		return S_IFCHR;
+	case EROFS_FT_SOCK:
+		return S_IFSOCK;
+	case EROFS_FT_FIFO:
+		return S_IFIFO;
+	default:
+		return 0;
+	}
+}
+
 static inline size_t erofs_xattr_inode_size(uint16_t xattr_icount)
 {
 	size_t xattr_size = 0;
@@ -104,7 +169,257 @@ static inline int erofs_get_xattr_prefix(const char *str)
 	return 0;
 }
 
-static inline char *erofs_get_xattr_name(uint8_t index, const char *name,
+/* This is essentially strcmp() for non-null-terminated strings */
+static inline int memcmp2(const void *a, const size_t a_size, const void *b,
+			  size_t b_size)
+{
+	size_t common_size = a_size < b_size ? a_size : b_size;
+	int res;
+
+	res = memcmp(a, b, common_size);
+	if (res != 0 || a_size == b_size)
+		return res;
+
+	return a_size < b_size ? -1 : 1;
+}
+
+/* Returns the number of dirents in a directory block, or 0 if the
+ * block is invalid */
+static inline size_t erofs_dirent_block_count(const uint8_t *block,
+					      size_t block_size)
+{
+	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
+	size_t dirents_size;
+
+	if (block_size < sizeof(struct erofs_dirent))
+		return 0;
+
+	dirents_size = lcfs_u16_from_file(dirents[0].nameoff);
+	if (dirents_size % sizeof(struct erofs_dirent) != 0 ||
+	    dirents_size > block_size)
+		return 0;
+
+	return dirents_size / sizeof(struct erofs_dirent);
+}
+
+/* Gets the name of dirent i of the n_dirents in a directory block.
+ * The name of the last dirent is nul-terminated, unless it fills the
+ * block. Returns false if the name is out of bounds. */
+static inline bool erofs_dirent_get_name(const uint8_t *block, size_t block_size,
+					 size_t n_dirents, size_t i,
+					 const char **name_out, size_t *name_len_out)
+{
+	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
+	uint16_t nameoff = lcfs_u16_from_file(dirents[i].nameoff);
+	size_t name_len;
+
+	if (nameoff >= block_size)
+		return false;
+
+	if (i + 1 < n_dirents) {
+		uint16_t next_nameoff = lcfs_u16_from_file(dirents[i + 1].nameoff);
+		if (next_nameoff < nameoff || next_nameoff > block_size)
+			return false;
+		name_len = next_nameoff - nameoff;
+	} else {
+		name_len = strnlen((const char *)block + nameoff,
+				   block_size - nameoff);
+	}
+
+	*name_out = (const char *)block + nameoff;
+	*name_len_out = name_len;
+	return true;
+}
+
+/* Binary search for name in a directory block. Returns the index of
+ * the dirent, or -1 if it's not there, in which case cmp_out is set to
+ * <0 if the name sorts before the block, >0 if it sorts after it and 0
+ * if it should have been inside it. */
+static inline ssize_t erofs_dirent_block_lookup(const uint8_t *block,
+						size_t block_size, const char *name,
+						size_t name_len, int *cmp_out)
+{
+	size_t n_dirents = erofs_dirent_block_count(block, block_size);
+	ssize_t start_dirent, end_dirent;
+
+	start_dirent = 0;
+	end_dirent = n_dirents - 1;
+	while (start_dirent <= end_dirent) {
+		ssize_t mid_dirent = start_dirent + (end_dirent - start_dirent) / 2;
+		const char *child_name;
+		size_t child_name_len;
+		int cmp;
+
+		if (!erofs_dirent_get_name(block, block_size, n_dirents,
+					   mid_dirent, &child_name, &child_name_len))
+			break;
+
+		cmp = memcmp2(name, name_len, child_name, child_name_len);
+		if (cmp == 0)
+			return mid_dirent;
+		else if (cmp > 0)
+			start_dirent = mid_dirent + 1;
+		else
+			end_dirent = mid_dirent - 1;
+	}
+
+	if (end_dirent < 0) {
+		*cmp_out = -1;
+	} else if (start_dirent >= (ssize_t)n_dirents) {
+		*cmp_out = 1;
+	} else {
+		*cmp_out = 0; /* inside the block */
+	}
+
+	return -1;
+}
+
+/* Looks up name in the data of a directory of file_size bytes, which is
+ * stored in blocks at oob_data, with the last block at tail_data if
+ * it is tailpacked. Returns false if the name isn't found. */
+static inline bool erofs_dir_lookup(const uint8_t *oob_data,
+				    const uint8_t *tail_data, uint64_t file_size,
+				    uint64_t blksz, bool tailpacked, const char *name,
+				    size_t name_len, uint64_t *nid_out)
+{
+	uint64_t n_blocks = round_up(file_size, blksz) / blksz;
+	uint64_t last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
+	int64_t start_block, end_block;
+
+	/* First search the out-of-band blocks */
+	start_block = 0;
+	end_block = (int64_t)last_oob_block - 1;
+	while (start_block <= end_block) {
+		int64_t mid_block = start_block + (end_block - start_block) / 2;
+		const uint8_t *block_data = oob_data + mid_block * blksz;
+		size_t block_size = min(blksz, file_size - mid_block * blksz);
+		ssize_t i;
+		int cmp;
+
+		i = erofs_dirent_block_lookup(block_data, block_size, name,
+					      name_len, &cmp);
+		if (i >= 0) {
+			const struct erofs_dirent *dirents =
+				(struct erofs_dirent *)block_data;
+			*nid_out = lcfs_u64_from_file(dirents[i].nid);
+			return true;
+		}
+
+		if (cmp == 0)
+			/* The name should have been in this block,
+			   but wasn't */
+			return false;
+		else if (cmp > 0)
+			start_block = mid_block + 1;
+		else
+			end_block = mid_block - 1;
+	}
+
+	if (tailpacked) {
+		size_t tail_size = file_size - last_oob_block * blksz;
+		ssize_t i;
+		int cmp;
+
+		i = erofs_dirent_block_lookup(tail_data, tail_size, name,
+					      name_len, &cmp);
+		if (i >= 0) {
+			const struct erofs_dirent *dirents =
+				(struct erofs_dirent *)tail_data;
+			*nid_out = lcfs_u64_from_file(dirents[i].nid);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Max number of long xattr name prefixes an image can have */
+#define EROFS_N_LONG_XATTR_PREFIXES_MAX (EROFS_XATTR_LONG_PREFIX_MASK + 1)
+
+/* A long xattr name prefix, pointing into the image */
+struct erofs_long_xattr_prefix {
+	uint8_t base_index;
+	const char *infix;
+	size_t infix_len;
+};
+
+/* Parses the long xattr name prefix table of an image into prefixes,
+ * which must have room for EROFS_N_LONG_XATTR_PREFIXES_MAX entries.
+ * Returns the number of prefixes, or -1 if the table is invalid. */
+static inline int erofs_read_long_xattr_prefixes(const uint8_t *image_data,
+						 size_t image_data_size,
+						 const struct erofs_super_block *super,
+						 struct erofs_long_xattr_prefix *prefixes)
+{
+	uint32_t incompat = lcfs_u32_from_file(super->feature_incompat);
+	uint64_t pos;
+	int n;
+
+	if ((incompat & EROFS_FEATURE_INCOMPAT_XATTR_PREFIXES) == 0)
+		return 0;
+
+	if (super->xattr_prefix_count > EROFS_N_LONG_XATTR_PREFIXES_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pos = (uint64_t)lcfs_u32_from_file(super->xattr_prefix_start) *
+	      sizeof(uint32_t);
+	for (n = 0; n < super->xattr_prefix_count; n++) {
+		uint16_t len;
+
+		if (pos + sizeof(uint16_t) > image_data_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		len = lcfs_u16_from_file(*(const __le16 *)(image_data + pos));
+		pos += sizeof(uint16_t);
+
+		if (len < sizeof(struct erofs_xattr_long_prefix) ||
+		    pos + len > image_data_size ||
+		    image_data[pos] >= EROFS_N_XATTR_PREFIXES) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		prefixes[n].base_index = image_data[pos];
+		prefixes[n].infix = (const char *)image_data + pos + 1;
+		prefixes[n].infix_len = len - 1;
+
+		pos = round_up(pos + len, sizeof(uint32_t));
+	}
+
+	return n;
+}
+
+/* Resolves the name index of an xattr entry into the base prefix index
+ * and the infix, which is empty unless a long prefix is used. */
+static inline int erofs_xattr_entry_prefix(uint8_t name_index,
+					   const struct erofs_long_xattr_prefix *prefixes,
+					   size_t n_prefixes, uint8_t *base_index,
+					   const char **infix, size_t *infix_len)
+{
+	if (name_index & EROFS_XATTR_LONG_PREFIX) {
+		size_t i = name_index & EROFS_XATTR_LONG_PREFIX_MASK;
+
+		if (i >= n_prefixes) {
+			errno = EINVAL;
+			return -1;
+		}
+		*base_index = prefixes[i].base_index;
+		*infix = prefixes[i].infix;
+		*infix_len = prefixes[i].infix_len;
+	} else {
+		*base_index = name_index;
+		*infix = "";
+		*infix_len = 0;
+	}
+
+	return 0;
+}
+
+static inline char *erofs_get_xattr_name(uint8_t index, const char *infix,
+					 size_t infix_len, const char *name,
 					 size_t name_len)
 {
 	char *res;
@@ -119,14 +434,15 @@ static inline char *erofs_get_xattr_name(uint8_t index, const char *name,
 	prefix = erofs_xattr_prefixes[index];
 	prefix_len = strlen(prefix);
 
-	res = malloc(prefix_len + name_len + 1);
+	res = malloc(prefix_len + infix_len + name_len + 1);
 	if (res == NULL) {
 		errno = ENOMEM;
 		return NULL;
 	}
 	memcpy(res, prefix, prefix_len);
-	memcpy(res + prefix_len, name, name_len);
-	res[prefix_len + name_len] = 0;
+	memcpy(res + prefix_len, infix, infix_len);
+	memcpy(res + prefix_len + infix_len, name, name_len);
+	res[prefix_len + infix_len + name_len] = 0;
 
 	return res;
 }
@@ -0,0 +1,1678 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-image.h"
+#include "lcfs-internal.h"
+#include "lcfs-erofs-internal.h"
+#include "lcfs-utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+
+struct lcfs_image_s {
+	const uint8_t *data;
+	size_t data_size;
+	void *mapping; /* Unmapped on close, if set */
+	const uint8_t *metadata;
+	const uint8_t *xattrdata;
+	uint32_t blkszbits;
+	uint64_t blksz;
+	uint64_t root_nid;
+	uint64_t build_time;
+	uint32_t build_time_nsec;
+	struct erofs_long_xattr_prefix long_prefixes[EROFS_N_LONG_XATTR_PREFIXES_MAX];
+	size_t n_long_prefixes;
+	/* A bit for each nid that is a validated inode. Set up to the
+	 * highest one by lcfs_image_validate(), or for the directories
+	 * checked so far by lcfs_image_validate_dir_entries(). */
+	uint8_t *valid_nids;
+	size_t n_nids;
+	bool validated; /* The whole image, so bounds aren't checked */
+};
+
+/* The bounds checked layout of an inode in the image */
+struct lcfs_image_inode_s {
+	const erofs_inode *cino;
+	uint32_t mode;
+	uint64_t size;
+	uint16_t xattr_icount;
+	const uint8_t *xattrs;
+	size_t xattr_size;
+	bool tailpacked;
+	const uint8_t *tail_data;
+	size_t tail_size;
+	const uint8_t *oob_data; /* Only set for flat inodes */
+};
+
+bool lcfs_image_nid_is_valid(lcfs_image_t *image, uint64_t nid)
+{
+	return image->valid_nids != NULL && nid < image->n_nids &&
+	       (image->valid_nids[nid / 8] & (1 << (nid % 8))) != 0;
+}
+
+uint64_t lcfs_image_get_n_nids(lcfs_image_t *image)
+{
+	return image->validated ? image->n_nids : 0;
+}
+
+/* Validated images only need to check the nid */
+static int lcfs_image_get_inode(lcfs_image_t *image, uint64_t nid,
+				struct lcfs_image_inode_s *inode)
+{
+	size_t remaining = image->data + image->data_size - image->metadata;
+	bool check = !image->validated;
+	uint32_t raw_blkaddr;
+	size_t isize;
+
+	if (!check) {
+		if (!lcfs_image_nid_is_valid(image, nid)) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else if (nid > (remaining >> EROFS_ISLOTBITS) ||
+		   remaining - (nid << EROFS_ISLOTBITS) <
+			   sizeof(struct erofs_inode_compact)) {
+		errno = EINVAL;
+		return -1;
+	}
+	remaining -= nid << EROFS_ISLOTBITS;
+
+	inode->cino = (const erofs_inode *)(image->metadata + (nid << EROFS_ISLOTBITS));
+	if (check && !erofs_inode_is_compact(inode->cino) &&
+	    remaining < sizeof(struct erofs_inode_extended)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	erofs_inode_get_info(inode->cino, &inode->mode, &inode->size,
+			     &inode->xattr_icount, &raw_blkaddr, &isize);
+
+	inode->xattrs = (const uint8_t *)inode->cino + isize;
+	inode->xattr_size = erofs_xattr_inode_size(inode->xattr_icount);
+	if (check && remaining < isize + inode->xattr_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	remaining -= isize + inode->xattr_size;
+
+	inode->tailpacked = erofs_inode_is_tailpacked(inode->cino);
+	inode->tail_data = inode->xattrs + inode->xattr_size;
+	inode->tail_size = inode->tailpacked ? inode->size % image->blksz : 0;
+	if (check && remaining < inode->tail_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	inode->oob_data = NULL;
+	if (erofs_inode_is_flat(inode->cino)) {
+		uint64_t oob_offset = (uint64_t)raw_blkaddr * image->blksz;
+		uint64_t oob_size = inode->size - inode->tail_size;
+
+		if (check && oob_size > 0 &&
+		    (oob_offset > image->data_size ||
+		     oob_size > image->data_size - oob_offset)) {
+			errno = EINVAL;
+			return -1;
+		}
+		inode->oob_data = image->data + oob_offset;
+	}
+
+	return 0;
+}
+
+static int lcfs_image_get_dir_inode(lcfs_image_t *image, uint64_t nid,
+				    struct lcfs_image_inode_s *inode)
+{
+	if (lcfs_image_get_inode(image, nid, inode) < 0)
+		return -1;
+
+	if ((inode->mode & S_IFMT) != S_IFDIR) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if (inode->oob_data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Iterates over the xattr entries of an inode, inline ones first. The
+ * cursor is the offset of the next inline entry, followed by
+ * xattr_size + index for the shared ones. */
+static int lcfs_image_next_xattr_entry(lcfs_image_t *image,
+				       struct lcfs_image_inode_s *inode,
+				       uint64_t *cursor,
+				       const struct erofs_xattr_entry **entry_out)
+{
+	const struct erofs_xattr_ibody_header *xattr_header;
+	const struct erofs_xattr_entry *entry;
+	bool check = !image->validated;
+	size_t inline_start;
+	uint64_t offset;
+	uint64_t i;
+	uint32_t idx;
+
+	if (inode->xattr_icount == 0)
+		return 0;
+
+	xattr_header = (const struct erofs_xattr_ibody_header *)inode->xattrs;
+	inline_start = sizeof(struct erofs_xattr_ibody_header) +
+		       xattr_header->h_shared_count * 4;
+	if (check && inline_start > inode->xattr_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (*cursor < inline_start)
+		*cursor = inline_start;
+
+	/* Inline xattrs */
+	if (*cursor < inode->xattr_size) {
+		if (*cursor + sizeof(struct erofs_xattr_entry) < inode->xattr_size) {
+			size_t entry_size;
+
+			entry = (const struct erofs_xattr_entry *)(inode->xattrs +
+								   *cursor);
+			entry_size = sizeof(struct erofs_xattr_entry) +
+				     entry->e_name_len +
+				     lcfs_u16_from_file(entry->e_value_size);
+			if (check && *cursor + entry_size > inode->xattr_size) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			*cursor = min(*cursor + round_up(entry_size, 4),
+				      inode->xattr_size);
+			*entry_out = entry;
+			return 1;
+		}
+
+		*cursor = inode->xattr_size;
+	}
+
+	/* Shared xattrs */
+	i = *cursor - inode->xattr_size;
+	if (i >= xattr_header->h_shared_count)
+		return 0;
+
+	idx = lcfs_u32_from_file(xattr_header->h_shared_xattrs[i]);
+	offset = (image->xattrdata - image->data) + (uint64_t)idx * 4;
+	if (check && offset + sizeof(struct erofs_xattr_entry) > image->data_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	entry = (const struct erofs_xattr_entry *)(image->data + offset);
+	if (check && offset + sizeof(struct erofs_xattr_entry) + entry->e_name_len +
+			     lcfs_u16_from_file(entry->e_value_size) >
+		     image->data_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*cursor += 1;
+	*entry_out = entry;
+	return 1;
+}
+
+static int lcfs_image_decode_xattr(lcfs_image_t *image,
+				   const struct erofs_xattr_entry *entry,
+				   struct lcfs_image_xattr_s *xattr)
+{
+	uint8_t base_index;
+
+	if (erofs_xattr_entry_prefix(entry->e_name_index, image->long_prefixes,
+				     image->n_long_prefixes, &base_index,
+				     &xattr->infix, &xattr->infix_len) < 0)
+		return -1;
+
+	if (base_index >= EROFS_N_XATTR_PREFIXES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	xattr->prefix = erofs_xattr_prefixes[base_index];
+	xattr->name = (const char *)(entry + 1);
+	xattr->name_len = entry->e_name_len;
+	xattr->value = xattr->name + xattr->name_len;
+	xattr->value_len = lcfs_u16_from_file(entry->e_value_size);
+
+	return 0;
+}
+
+/* Compares the full name of the xattr with str, or only checks if it
+ * starts with str */
+static bool xattr_name_matches(const struct lcfs_image_xattr_s *xattr,
+			       const char *str, bool prefix_only)
+{
+	const char *parts[] = { xattr->prefix, xattr->infix, xattr->name };
+	size_t part_lens[] = { strlen(xattr->prefix), xattr->infix_len,
+			       xattr->name_len };
+	size_t str_len = strlen(str);
+
+	for (size_t i = 0; i < 3; i++) {
+		size_t n = min(part_lens[i], str_len);
+
+		if (memcmp(parts[i], str, n) != 0)
+			return false;
+		if (n < part_lens[i])
+			return prefix_only;
+
+		str += n;
+		str_len -= n;
+	}
+
+	return str_len == 0;
+}
+
+/* Finds a raw xattr, including the internal overlay ones */
+static int lcfs_image_find_xattr(lcfs_image_t *image,
+				 struct lcfs_image_inode_s *inode, const char *name,
+				 struct lcfs_image_xattr_s *xattr)
+{
+	const struct erofs_xattr_entry *entry;
+	uint64_t cursor = 0;
+	int r;
+
+	while ((r = lcfs_image_next_xattr_entry(image, inode, &cursor, &entry)) > 0) {
+		if (lcfs_image_decode_xattr(image, entry, xattr) < 0)
+			return -1;
+		if (xattr_name_matches(xattr, name, false))
+			return 1;
+	}
+
+	return r;
+}
+
+/* Regular files with an escaped whiteout xattr are whiteouts in the
+ * original tree */
+static int lcfs_image_is_escaped_whiteout(lcfs_image_t *image,
+					  struct lcfs_image_inode_s *inode)
+{
+	struct lcfs_image_xattr_s xattr;
+
+	if ((inode->mode & S_IFMT) != S_IFREG || inode->xattr_icount == 0)
+		return 0;
+
+	return lcfs_image_find_xattr(image, inode,
+				     OVERLAY_XATTR_ESCAPED_WHITEOUT, &xattr);
+}
+
+lcfs_image_t *lcfs_image_open_data(const void *data, size_t size)
+{
+	cleanup_free lcfs_image_t *image = NULL;
+	const struct lcfs_erofs_header_s *cfs_header;
+	const struct erofs_super_block *erofs_super;
+	uint64_t meta_offset, xattr_offset;
+	int n_long_prefixes;
+
+	if (size < EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cfs_header = (const struct lcfs_erofs_header_s *)data;
+	if (lcfs_u32_from_file(cfs_header->magic) != LCFS_EROFS_MAGIC) {
+		errno = EINVAL; /* Wrong cfs magic */
+		return NULL;
+	}
+
+	if (lcfs_u32_from_file(cfs_header->version) != LCFS_EROFS_VERSION) {
+		errno = ENOTSUP; /* Wrong cfs version */
+		return NULL;
+	}
+
+	erofs_super = (const struct erofs_super_block *)((const uint8_t *)data +
+							 EROFS_SUPER_OFFSET);
+	if (lcfs_u32_from_file(erofs_super->magic) != EROFS_SUPER_MAGIC_V1) {
+		errno = EINVAL; /* Wrong erofs magic */
+		return NULL;
+	}
+
+	if (erofs_super->blkszbits < LCFS_BLOCK_SIZE_BITS_MIN ||
+	    erofs_super->blkszbits > LCFS_BLOCK_SIZE_BITS_MAX) {
+		errno = EINVAL; /* Unsupported block size */
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(lcfs_image_t));
+	if (image == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	image->data = data;
+	image->data_size = size;
+	image->blkszbits = erofs_super->blkszbits;
+	image->blksz = 1ULL << image->blkszbits;
+
+	meta_offset = (uint64_t)lcfs_u32_from_file(erofs_super->meta_blkaddr)
+		      << image->blkszbits;
+	xattr_offset = (uint64_t)lcfs_u32_from_file(erofs_super->xattr_blkaddr)
+		       << image->blkszbits;
+	if (meta_offset >= size || xattr_offset >= size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	image->metadata = image->data + meta_offset;
+	image->xattrdata = image->data + xattr_offset;
+
+	image->root_nid = lcfs_u16_from_file(erofs_super->root_nid);
+	image->build_time = lcfs_u64_from_file(erofs_super->build_time);
+	image->build_time_nsec = lcfs_u32_from_file(erofs_super->build_time_nsec);
+
+	n_long_prefixes = erofs_read_long_xattr_prefixes(data, size, erofs_super,
+							 image->long_prefixes);
+	if (n_long_prefixes < 0)
+		return NULL;
+	image->n_long_prefixes = n_long_prefixes;
+
+	return steal_pointer(&image);
+}
+
+lcfs_image_t *lcfs_image_open_fd(int fd)
+{
+	lcfs_image_t *image;
+	void *mapping;
+	struct stat s;
+	int errsv;
+
+	if (fstat(fd, &s) < 0)
+		return NULL;
+
+	if (s.st_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mapping = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	image = lcfs_image_open_data(mapping, s.st_size);
+	if (image == NULL) {
+		errsv = errno;
+		munmap(mapping, s.st_size);
+		errno = errsv;
+		return NULL;
+	}
+	image->mapping = mapping;
+
+	return image;
+}
+
+void lcfs_image_close(lcfs_image_t *image)
+{
+	if (image->mapping)
+		munmap(image->mapping, image->data_size);
+	free(image->valid_nids);
+	free(image);
+}
+
+uint64_t lcfs_image_get_root_nid(lcfs_image_t *image)
+{
+	return image->root_nid;
+}
+
+static int lcfs_image_lookup_len(lcfs_image_t *image, uint64_t dir_nid,
+				 const char *name, size_t name_len,
+				 uint64_t *nid_out)
+{
+	struct lcfs_image_inode_s dir;
+	struct lcfs_image_inode_s child;
+	uint64_t nid;
+
+	if (lcfs_image_get_dir_inode(image, dir_nid, &dir) < 0)
+		return -1;
+
+	if (!erofs_dir_lookup(dir.oob_data, dir.tail_data, dir.size, image->blksz,
+			      dir.tailpacked, name, name_len, &nid)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (lcfs_image_get_inode(image, nid, &child) < 0)
+		return -1;
+
+	if (erofs_inode_is_whiteout(child.cino)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*nid_out = nid;
+	return 0;
+}
+
+int lcfs_image_lookup(lcfs_image_t *image, uint64_t dir_nid, const char *name,
+		      uint64_t *nid_out)
+{
+	return lcfs_image_lookup_len(image, dir_nid, name, strlen(name), nid_out);
+}
+
+int lcfs_image_lookup_path(lcfs_image_t *image, const char *path, uint64_t *nid_out)
+{
+	uint64_t nid = image->root_nid;
+
+	while (*path != 0) {
+		size_t len = strchrnul(path, '/') - path;
+
+		if (len > 0 && !(len == 1 && path[0] == '.')) {
+			if (lcfs_image_lookup_len(image, nid, path, len, &nid) < 0)
+				return -1;
+		}
+
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+
+	*nid_out = nid;
+	return 0;
+}
+
+int lcfs_image_stat(lcfs_image_t *image, uint64_t nid, struct stat *st)
+{
+	struct lcfs_image_inode_s inode;
+	const erofs_inode *cino;
+	int r;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return -1;
+
+	cino = inode.cino;
+	memset(st, 0, sizeof(*st));
+	st->st_ino = nid;
+
+	if (erofs_inode_is_compact(cino)) {
+		const struct erofs_inode_compact *c = &cino->compact;
+
+		st->st_mode = lcfs_u16_from_file(c->i_mode);
+		st->st_nlink = lcfs_u16_from_file(c->i_nlink);
+		st->st_size = lcfs_u32_from_file(c->i_size);
+		st->st_uid = lcfs_u16_from_file(c->i_uid);
+		st->st_gid = lcfs_u16_from_file(c->i_gid);
+		st->st_mtim.tv_sec = image->build_time;
+		st->st_mtim.tv_nsec = image->build_time_nsec;
+
+		int type = st->st_mode & S_IFMT;
+		if (type == S_IFCHR || type == S_IFBLK)
+			st->st_rdev = lcfs_u32_from_file(c->i_u.rdev);
+	} else {
+		const struct erofs_inode_extended *e = &cino->extended;
+
+		st->st_mode = lcfs_u16_from_file(e->i_mode);
+		st->st_nlink = lcfs_u32_from_file(e->i_nlink);
+		st->st_size = lcfs_u64_from_file(e->i_size);
+		st->st_uid = lcfs_u32_from_file(e->i_uid);
+		st->st_gid = lcfs_u32_from_file(e->i_gid);
+		st->st_mtim.tv_sec = lcfs_u64_from_file(e->i_mtime);
+		st->st_mtim.tv_nsec = lcfs_u32_from_file(e->i_mtime_nsec);
+
+		int type = st->st_mode & S_IFMT;
+		if (type == S_IFCHR || type == S_IFBLK)
+			st->st_rdev = lcfs_u32_from_file(e->i_u.rdev);
+	}
+
+	st->st_atim = st->st_mtim;
+	st->st_ctim = st->st_mtim;
+
+	r = lcfs_image_is_escaped_whiteout(image, &inode);
+	if (r < 0)
+		return -1;
+	if (r > 0) {
+		st->st_mode = (st->st_mode & ~S_IFMT) | S_IFCHR;
+		st->st_rdev = makedev(0, 0);
+		st->st_size = 0;
+	}
+
+	return 0;
+}
+
+const char *lcfs_image_readlink(lcfs_image_t *image, uint64_t nid, size_t *len_out)
+{
+	struct lcfs_image_inode_s inode;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return NULL;
+
+	if ((inode.mode & S_IFMT) != S_IFLNK) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!inode.tailpacked || inode.tail_size != inode.size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*len_out = inode.size;
+	return (const char *)inode.tail_data;
+}
+
+const char *lcfs_image_get_payload(lcfs_image_t *image, uint64_t nid,
+				   size_t *len_out)
+{
+	struct lcfs_image_inode_s inode;
+	struct lcfs_image_xattr_s xattr;
+	int r;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return NULL;
+
+	if ((inode.mode & S_IFMT) == S_IFLNK)
+		return lcfs_image_readlink(image, nid, len_out);
+
+	if ((inode.mode & S_IFMT) != S_IFREG) {
+		errno = ENODATA;
+		return NULL;
+	}
+
+	r = lcfs_image_find_xattr(image, &inode, OVERLAY_XATTR_REDIRECT, &xattr);
+	if (r < 0)
+		return NULL;
+	if (r == 0) {
+		errno = ENODATA;
+		return NULL;
+	}
+
+	if (xattr.value_len > 1 && xattr.value[0] == '/') {
+		xattr.value++;
+		xattr.value_len--;
+	}
+
+	*len_out = xattr.value_len;
+	return xattr.value;
+}
+
+const uint8_t *lcfs_image_get_fsverity_digest(lcfs_image_t *image, uint64_t nid)
+{
+	struct lcfs_image_inode_s inode;
+	struct lcfs_image_xattr_s xattr;
+	int r;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return NULL;
+
+	if ((inode.mode & S_IFMT) != S_IFREG) {
+		errno = ENODATA;
+		return NULL;
+	}
+
+	r = lcfs_image_find_xattr(image, &inode, OVERLAY_XATTR_METACOPY, &xattr);
+	if (r < 0)
+		return NULL;
+	if (r == 0 || xattr.value_len != 4 + LCFS_DIGEST_SIZE) {
+		errno = ENODATA;
+		return NULL;
+	}
+
+	return (const uint8_t *)xattr.value + 4;
+}
+
+int lcfs_image_get_content(lcfs_image_t *image, uint64_t nid,
+			   const uint8_t **data_out, size_t *data_len_out,
+			   const uint8_t **tail_out, size_t *tail_len_out)
+{
+	struct lcfs_image_inode_s inode;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return -1;
+
+	if ((inode.mode & S_IFMT) != S_IFREG || inode.size == 0 ||
+	    inode.oob_data == NULL) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	*data_out = inode.oob_data;
+	*data_len_out = inode.size - inode.tail_size;
+	*tail_out = inode.tail_data;
+	*tail_len_out = inode.tail_size;
+	return 0;
+}
+
+/* The cursor is the offset of the next dirent in the directory data,
+ * where dirents past the last one in a block continue at the next
+ * block. */
+int lcfs_image_readdir(lcfs_image_t *image, uint64_t dir_nid, uint64_t *cursor,
+		       struct lcfs_image_dirent_s *dirent)
+{
+	struct lcfs_image_inode_s dir;
+
+	if (lcfs_image_get_dir_inode(image, dir_nid, &dir) < 0)
+		return -1;
+
+	while (*cursor < dir.size) {
+		uint64_t block = *cursor >> image->blkszbits;
+		uint64_t block_start = block << image->blkszbits;
+		size_t block_size = min(image->blksz, dir.size - block_start);
+		const uint8_t *block_data;
+		const struct erofs_dirent *dirents;
+		size_t n_dirents, i;
+		const char *name;
+		size_t name_len;
+		uint64_t nid;
+		uint32_t type;
+
+		if (dir.tailpacked && dir.size - block_start == dir.tail_size)
+			block_data = dir.tail_data;
+		else
+			block_data = dir.oob_data + block_start;
+
+		n_dirents = erofs_dirent_block_count(block_data, block_size);
+		if (n_dirents == 0) {
+			/* This should not happen for valid filesystems */
+			errno = EINVAL;
+			return -1;
+		}
+
+		i = (*cursor - block_start + sizeof(struct erofs_dirent) - 1) /
+		    sizeof(struct erofs_dirent);
+		if (i >= n_dirents) {
+			*cursor = block_start + image->blksz;
+			continue;
+		}
+
+		if (i + 1 < n_dirents)
+			*cursor = block_start + (i + 1) * sizeof(struct erofs_dirent);
+		else
+			*cursor = block_start + image->blksz;
+
+		if (!erofs_dirent_get_name(block_data, block_size, n_dirents, i,
+					   &name, &name_len)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if ((name_len == 1 && name[0] == '.') ||
+		    (name_len == 2 && name[0] == '.' && name[1] == '.'))
+			continue;
+
+		dirents = (const struct erofs_dirent *)block_data;
+		nid = lcfs_u64_from_file(dirents[i].nid);
+		type = erofs_file_type_to_mode(dirents[i].file_type);
+
+		if (type == S_IFCHR || type == S_IFREG) {
+			struct lcfs_image_inode_s child;
+			int r;
+
+			if (lcfs_image_get_inode(image, nid, &child) < 0)
+				return -1;
+
+			/* Skip the whiteouts added for overlayfs */
+			if (erofs_inode_is_whiteout(child.cino))
+				continue;
+
+			r = lcfs_image_is_escaped_whiteout(image, &child);
+			if (r < 0)
+				return -1;
+			if (r > 0)
+				type = S_IFCHR;
+		}
+
+		dirent->nid = nid;
+		dirent->name = name;
+		dirent->name_len = name_len;
+		dirent->type = type;
+		return 1;
+	}
+
+	return 0;
+}
+
+int lcfs_image_next_xattr(lcfs_image_t *image, uint64_t nid, uint64_t *cursor,
+			  struct lcfs_image_xattr_s *xattr)
+{
+	struct lcfs_image_inode_s inode;
+	const struct erofs_xattr_entry *entry;
+	int r;
+
+	if (lcfs_image_get_inode(image, nid, &inode) < 0)
+		return -1;
+
+	while ((r = lcfs_image_next_xattr_entry(image, &inode, cursor, &entry)) > 0) {
+		if (lcfs_image_decode_xattr(image, entry, xattr) < 0)
+			return -1;
+
+		/* These are exposed by lcfs_image_get_payload() and
+		 * lcfs_image_get_fsverity_digest() */
+		if (xattr_name_matches(xattr, OVERLAY_XATTR_REDIRECT, false) ||
+		    xattr_name_matches(xattr, OVERLAY_XATTR_METACOPY, false))
+			continue;
+
+		if (xattr_name_matches(xattr, OVERLAY_XATTR_ESCAPED_WHITEOUT, false) &&
+		    (inode.mode & S_IFMT) == S_IFREG)
+			continue;
+
+		if (xattr_name_matches(xattr, OVERLAY_XATTR_ESCAPED_WHITEOUTS, false) ||
+		    xattr_name_matches(xattr, OVERLAY_XATTR_USERXATTR_WHITEOUT, false) ||
+		    xattr_name_matches(xattr, OVERLAY_XATTR_USERXATTR_WHITEOUTS, false))
+			continue;
+
+		if (xattr_name_matches(xattr, OVERLAY_XATTR_PREFIX, true)) {
+			size_t skip = strlen(OVERLAY_XATTR_PARTIAL_PREFIX);
+			size_t n;
+
+			if (!xattr_name_matches(xattr, OVERLAY_XATTR_ESCAPE_PREFIX, true))
+				continue;
+
+			/* Unescape, by dropping one "overlay." after the prefix */
+			n = min(skip, xattr->infix_len);
+			xattr->infix += n;
+			xattr->infix_len -= n;
+			xattr->name += skip - n;
+			xattr->name_len -= skip - n;
+		}
+
+		return 1;
+	}
+
+	return r;
+}
+
+struct lcfs_image_validate_dir_s {
+	uint64_t nid;
+	uint64_t parent_nid;
+};
+
+struct lcfs_image_validate_s {
+	lcfs_image_t *image;
+	uint8_t *valid_nids;
+	size_t n_nids;
+	uint64_t max_nid;
+	/* Only check one directory, whose parent and subdirectories may
+	 * have been seen before */
+	bool shallow;
+	/* Directories left to check */
+	struct lcfs_image_validate_dir_s *dirs;
+	size_t n_dirs;
+	size_t dirs_size;
+};
+
+/* The chunk-based layout is used for files without data in the image,
+ * followed by the chunk indexes */
+static int lcfs_image_validate_chunks(lcfs_image_t *image,
+				      struct lcfs_image_inode_s *inode)
+{
+	const uint8_t *end = image->data + image->data_size;
+	uint16_t format;
+	uint32_t chunkbits;
+	uint64_t n_chunks;
+	size_t index_size;
+
+	if ((inode->mode & S_IFMT) != S_IFREG)
+		return -1;
+
+	if (erofs_inode_is_compact(inode->cino))
+		format = lcfs_u16_from_file(inode->cino->compact.i_u.c.format);
+	else
+		format = lcfs_u16_from_file(inode->cino->extended.i_u.c.format);
+
+	if (format & ~EROFS_CHUNK_FORMAT_ALL)
+		return -1;
+
+	chunkbits = image->blkszbits + (format & EROFS_CHUNK_FORMAT_BLKBITS_MASK);
+	n_chunks = (inode->size >> chunkbits) +
+		   ((inode->size & ((1ULL << chunkbits) - 1)) != 0);
+	index_size = (format & EROFS_CHUNK_FORMAT_INDEXES) ?
+			     sizeof(struct erofs_inode_chunk_index) :
+			     sizeof(uint32_t);
+
+	if (n_chunks > (size_t)(end - inode->tail_data) / index_size)
+		return -1;
+
+	return 0;
+}
+
+static int lcfs_image_validate_inode(lcfs_image_t *image, uint64_t nid,
+				     struct lcfs_image_inode_s *inode)
+{
+	const struct erofs_xattr_entry *entry;
+	struct lcfs_image_xattr_s xattr;
+	uint64_t cursor = 0;
+	int r;
+
+	if (lcfs_image_get_inode(image, nid, inode) < 0)
+		return -1;
+
+	switch (inode->mode & S_IFMT) {
+	case S_IFDIR:
+		if (inode->size == 0 || inode->oob_data == NULL)
+			return -1;
+		break;
+	case S_IFREG:
+	case S_IFLNK:
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		break;
+	default:
+		return -1;
+	}
+
+	if (!erofs_inode_is_flat(inode->cino)) {
+		if (erofs_inode_datalayout(inode->cino) != EROFS_INODE_CHUNK_BASED ||
+		    lcfs_image_validate_chunks(image, inode) < 0)
+			return -1;
+	}
+
+	while ((r = lcfs_image_next_xattr_entry(image, inode, &cursor, &entry)) > 0) {
+		if (lcfs_image_decode_xattr(image, entry, &xattr) < 0)
+			return -1;
+	}
+
+	return r;
+}
+
+static int lcfs_image_validate_push_dir(struct lcfs_image_validate_s *v,
+					uint64_t nid, uint64_t parent_nid)
+{
+	if (v->n_dirs == v->dirs_size) {
+		size_t new_size = v->dirs_size == 0 ? 64 : v->dirs_size * 2;
+		struct lcfs_image_validate_dir_s *new_dirs =
+			reallocarray(v->dirs, new_size,
+				     sizeof(struct lcfs_image_validate_dir_s));
+		if (new_dirs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		v->dirs = new_dirs;
+		v->dirs_size = new_size;
+	}
+
+	v->dirs[v->n_dirs].nid = nid;
+	v->dirs[v->n_dirs].parent_nid = parent_nid;
+	v->n_dirs++;
+	return 0;
+}
+
+/* Inodes are only validated the first time they are seen. Only
+ * directories can't be seen twice, which also rules out loops, unless
+ * the caller checks that itself. */
+static int lcfs_image_validate_child(struct lcfs_image_validate_s *v,
+				     uint64_t nid, uint32_t type, uint64_t dir_nid)
+{
+	struct lcfs_image_inode_s child;
+	bool seen;
+
+	seen = nid < v->n_nids && (v->valid_nids[nid / 8] & (1 << (nid % 8))) != 0;
+	if (seen) {
+		if ((type == S_IFDIR && !v->shallow) ||
+		    lcfs_image_get_inode(v->image, nid, &child) < 0)
+			return -1;
+	} else {
+		if (lcfs_image_validate_inode(v->image, nid, &child) < 0)
+			return -1;
+		v->valid_nids[nid / 8] |= 1 << (nid % 8);
+		v->max_nid = max(v->max_nid, nid);
+	}
+
+	if ((child.mode & S_IFMT) != type)
+		return -1;
+
+	if (type == S_IFDIR && !v->shallow)
+		return lcfs_image_validate_push_dir(v, nid, dir_nid);
+
+	return 0;
+}
+
+/* Checks the dirents are well formed and sorted, as lookups rely on
+ * that, and validates their inodes */
+static int lcfs_image_validate_dir(struct lcfs_image_validate_s *v,
+				   uint64_t dir_nid, uint64_t parent_nid)
+{
+	lcfs_image_t *image = v->image;
+	struct lcfs_image_inode_s dir;
+	const char *prev_name = NULL;
+	size_t prev_name_len = 0;
+
+	if (lcfs_image_get_dir_inode(image, dir_nid, &dir) < 0)
+		return -1;
+
+	for (uint64_t block_start = 0; block_start < dir.size;
+	     block_start += image->blksz) {
+		size_t block_size = min(image->blksz, dir.size - block_start);
+		const struct erofs_dirent *dirents;
+		const uint8_t *block_data;
+		size_t n_dirents;
+
+		if (dir.tailpacked && dir.size - block_start == dir.tail_size)
+			block_data = dir.tail_data;
+		else
+			block_data = dir.oob_data + block_start;
+
+		n_dirents = erofs_dirent_block_count(block_data, block_size);
+		if (n_dirents == 0)
+			return -1;
+
+		dirents = (const struct erofs_dirent *)block_data;
+		for (size_t i = 0; i < n_dirents; i++) {
+			uint64_t nid = lcfs_u64_from_file(dirents[i].nid);
+			uint32_t type = erofs_file_type_to_mode(dirents[i].file_type);
+			const char *name;
+			size_t name_len;
+
+			if (!erofs_dirent_get_name(block_data, block_size, n_dirents,
+						   i, &name, &name_len) ||
+			    name_len == 0 || type == 0)
+				return -1;
+
+			if (prev_name != NULL &&
+			    memcmp2(prev_name, prev_name_len, name, name_len) >= 0)
+				return -1;
+			prev_name = name;
+			prev_name_len = name_len;
+
+			if (name_len == 1 && name[0] == '.') {
+				if (nid != dir_nid || type != S_IFDIR)
+					return -1;
+			} else if (name_len == 2 && name[0] == '.' && name[1] == '.') {
+				if ((nid != parent_nid && !v->shallow) ||
+				    type != S_IFDIR)
+					return -1;
+			} else if (memchr(name, '/', name_len) != NULL ||
+				   lcfs_image_validate_child(v, nid, type, dir_nid) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int lcfs_image_validate_tree(struct lcfs_image_validate_s *v)
+{
+	lcfs_image_t *image = v->image;
+	struct lcfs_image_inode_s root;
+
+	if (lcfs_image_validate_inode(image, image->root_nid, &root) < 0 ||
+	    (root.mode & S_IFMT) != S_IFDIR)
+		return -1;
+	v->valid_nids[image->root_nid / 8] |= 1 << (image->root_nid % 8);
+	v->max_nid = image->root_nid;
+
+	if (lcfs_image_validate_push_dir(v, image->root_nid, image->root_nid) < 0)
+		return -1;
+
+	while (v->n_dirs > 0) {
+		struct lcfs_image_validate_dir_s dir = v->dirs[--v->n_dirs];
+
+		if (lcfs_image_validate_dir(v, dir.nid, dir.parent_nid) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int lcfs_image_validate(lcfs_image_t *image)
+{
+	size_t n_nids = (image->data + image->data_size - image->metadata) >>
+			EROFS_ISLOTBITS;
+	struct lcfs_image_validate_s v = {
+		.image = image,
+		.n_nids = n_nids,
+	};
+	int r;
+
+	if (image->validated)
+		return 0;
+
+	if (image->root_nid >= n_nids) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	v.valid_nids = calloc(DIV_ROUND_UP(n_nids, 8), 1);
+	if (v.valid_nids == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	r = lcfs_image_validate_tree(&v);
+	free(v.dirs);
+	if (r < 0) {
+		free(v.valid_nids);
+		if (errno != ENOMEM)
+			errno = EINVAL;
+		return -1;
+	}
+
+	/* The rest of the image are shared xattrs and data blocks */
+	free(image->valid_nids);
+	image->n_nids = v.max_nid + 1;
+	image->valid_nids = v.valid_nids;
+	image->validated = true;
+	return 0;
+}
+
+/* The bitmap for lcfs_image_validate_dir_entries() covers every nid
+ * that could be an inode, but its pages are only touched for the
+ * directories that are checked */
+static int lcfs_image_init_valid_nids(lcfs_image_t *image)
+{
+	if (image->valid_nids != NULL)
+		return 0;
+
+	image->n_nids = (image->data + image->data_size - image->metadata) >>
+			EROFS_ISLOTBITS;
+	image->valid_nids = calloc(DIV_ROUND_UP(image->n_nids, 8), 1);
+	if (image->valid_nids == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+int lcfs_image_validate_root(lcfs_image_t *image)
+{
+	struct lcfs_image_inode_s root;
+
+	if (lcfs_image_init_valid_nids(image) < 0)
+		return -1;
+
+	if (lcfs_image_nid_is_valid(image, image->root_nid))
+		return 0;
+
+	if (lcfs_image_validate_inode(image, image->root_nid, &root) < 0 ||
+	    (root.mode & S_IFMT) != S_IFDIR) {
+		errno = EINVAL;
+		return -1;
+	}
+	image->valid_nids[image->root_nid / 8] |= 1 << (image->root_nid % 8);
+
+	return 0;
+}
+
+int lcfs_image_validate_dir_entries(lcfs_image_t *image, uint64_t dir_nid)
+{
+	struct lcfs_image_validate_s v = {
+		.image = image,
+		.shallow = true,
+	};
+
+	if (!lcfs_image_nid_is_valid(image, dir_nid)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (image->validated)
+		return 0;
+
+	v.valid_nids = image->valid_nids;
+	v.n_nids = image->n_nids;
+	if (lcfs_image_validate_dir(&v, dir_nid, dir_nid) < 0) {
+		if (errno != ENOMEM)
+			errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sets the path to the path of length path_len followed by "/name",
+ * growing it if needed */
+static int lcfs_image_path_append(char **path, size_t *path_size,
+				  size_t path_len, const char *name,
+				  size_t name_len)
+{
+	size_t new_len = path_len + 1 + name_len;
+
+	if (new_len >= *path_size) {
+		size_t new_size = max(new_len + 1, *path_size * 2);
+		char *new_path = realloc(*path, new_size);
+		if (new_path == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*path = new_path;
+		*path_size = new_size;
+	}
+
+	(*path)[path_len] = '/';
+	memcpy(*path + path_len + 1, name, name_len);
+	(*path)[new_len] = 0;
+
+	return 0;
+}
+
+struct lcfs_image_visit_dir_s {
+	uint64_t nid;
+	uint64_t cursor;
+	size_t path_len;
+};
+
+struct lcfs_image_visit_s {
+	lcfs_image_t *image;
+	lcfs_image_visit_cb_t cb;
+	void *data;
+	char *path;
+	size_t path_size;
+
+	/* Directories being listed, from the root down */
+	struct lcfs_image_visit_dir_s *dirs;
+	size_t n_dirs;
+	size_t dirs_size;
+};
+
+static int lcfs_image_visit_push_dir(struct lcfs_image_visit_s *visit,
+				     uint64_t nid, size_t path_len)
+{
+	if (visit->n_dirs == visit->dirs_size) {
+		size_t new_size = visit->dirs_size == 0 ? 64 : visit->dirs_size * 2;
+		struct lcfs_image_visit_dir_s *new_dirs =
+			reallocarray(visit->dirs, new_size,
+				     sizeof(struct lcfs_image_visit_dir_s));
+		if (new_dirs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		visit->dirs = new_dirs;
+		visit->dirs_size = new_size;
+	}
+
+	visit->dirs[visit->n_dirs].nid = nid;
+	visit->dirs[visit->n_dirs].cursor = 0;
+	visit->dirs[visit->n_dirs].path_len = path_len;
+	visit->n_dirs++;
+	return 0;
+}
+
+/* Walks the tree with an explicit stack, as images can be nested
+ * deeper than the C stack allows. The image is validated, so each
+ * directory is only reached once. */
+static int lcfs_image_visit_tree(struct lcfs_image_visit_s *visit)
+{
+	struct lcfs_image_dirent_s dirent;
+
+	if (lcfs_image_visit_push_dir(visit, visit->image->root_nid, 0) < 0)
+		return -1;
+
+	while (visit->n_dirs > 0) {
+		struct lcfs_image_visit_dir_s *dir = &visit->dirs[visit->n_dirs - 1];
+		size_t path_len = dir->path_len;
+		int r;
+
+		r = lcfs_image_readdir(visit->image, dir->nid, &dir->cursor, &dirent);
+		if (r < 0)
+			return -1;
+		if (r == 0) {
+			visit->n_dirs--;
+			continue;
+		}
+
+		if (lcfs_image_path_append(&visit->path, &visit->path_size, path_len,
+					   dirent.name, dirent.name_len) < 0)
+			return -1;
+
+		if (visit->cb(visit->image, visit->path, &dirent, visit->data) < 0)
+			return -1;
+
+		if (dirent.type == S_IFDIR &&
+		    lcfs_image_visit_push_dir(visit, dirent.nid,
+					      path_len + 1 + dirent.name_len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int lcfs_image_visit(lcfs_image_t *image, lcfs_image_visit_cb_t cb, void *data)
+{
+	struct lcfs_image_visit_s visit = {
+		.image = image,
+		.cb = cb,
+		.data = data,
+	};
+	struct lcfs_image_dirent_s root = {
+		.nid = image->root_nid,
+		.name = "",
+		.name_len = 0,
+		.type = S_IFDIR,
+	};
+	int r;
+
+	if (lcfs_image_validate(image) < 0)
+		return -1;
+
+	visit.path_size = PATH_MAX;
+	visit.path = malloc(visit.path_size);
+	if (visit.path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strcpy(visit.path, "/");
+	r = cb(image, visit.path, &root, data);
+	if (r >= 0)
+		r = lcfs_image_visit_tree(&visit);
+
+	free(visit.dirs);
+	free(visit.path);
+	return r < 0 ? -1 : 0;
+}
+
+/* The full name of an xattr fits as the parts have 8 bit lengths */
+#define LCFS_IMAGE_XATTR_NAME_MAX (32 + 2 * 256)
+
+static size_t lcfs_image_xattr_full_name(const struct lcfs_image_xattr_s *xattr,
+					 char *buf)
+{
+	size_t prefix_len = strlen(xattr->prefix);
+
+	memcpy(buf, xattr->prefix, prefix_len);
+	memcpy(buf + prefix_len, xattr->infix, xattr->infix_len);
+	memcpy(buf + prefix_len + xattr->infix_len, xattr->name, xattr->name_len);
+
+	return prefix_len + xattr->infix_len + xattr->name_len;
+}
+
+static bool lcfs_image_xattr_equal(const struct lcfs_image_xattr_s *a,
+				   const struct lcfs_image_xattr_s *b)
+{
+	char a_name[LCFS_IMAGE_XATTR_NAME_MAX];
+	char b_name[LCFS_IMAGE_XATTR_NAME_MAX];
+	size_t a_len, b_len;
+
+	if (memcmp2(a->value, a->value_len, b->value, b->value_len) != 0)
+		return false;
+
+	/* The same name can be split differently between the parts */
+	a_len = lcfs_image_xattr_full_name(a, a_name);
+	b_len = lcfs_image_xattr_full_name(b, b_name);
+	return memcmp2(a_name, a_len, b_name, b_len) == 0;
+}
+
+/* Compares the xattrs as sets, as the order depends on which ones are
+ * shared in each image. Inodes have few xattrs. */
+static int lcfs_image_xattrs_equal(lcfs_image_t *a_image, uint64_t a_nid,
+				   lcfs_image_t *b_image, uint64_t b_nid)
+{
+	struct lcfs_image_xattr_s a, b;
+	uint64_t a_cursor = 0, b_cursor;
+	size_t n_a = 0, n_b = 0;
+	int r;
+
+	while ((r = lcfs_image_next_xattr(a_image, a_nid, &a_cursor, &a)) > 0) {
+		bool found = false;
+
+		n_a++;
+		b_cursor = 0;
+		while (!found &&
+		       (r = lcfs_image_next_xattr(b_image, b_nid, &b_cursor, &b)) > 0)
+			found = lcfs_image_xattr_equal(&a, &b);
+		if (r < 0)
+			return -1;
+		if (!found)
+			return 0;
+	}
+	if (r < 0)
+		return -1;
+
+	b_cursor = 0;
+	while ((r = lcfs_image_next_xattr(b_image, b_nid, &b_cursor, &b)) > 0)
+		n_b++;
+	if (r < 0)
+		return -1;
+
+	return n_a == n_b;
+}
+
+/* If the encoded inodes are identical, nothing about them differs.
+ * The inode refers to its data blocks, shared xattrs and possibly the
+ * build time elsewhere in the image, so those are checked too. */
+static int lcfs_image_inodes_identical(lcfs_image_t *a_image,
+				       struct lcfs_image_inode_s *a,
+				       lcfs_image_t *b_image,
+				       struct lcfs_image_inode_s *b)
+{
+	const struct erofs_xattr_entry *a_entry, *b_entry;
+	struct lcfs_image_xattr_s a_xattr, b_xattr;
+	uint64_t a_cursor = 0, b_cursor = 0;
+	size_t a_size = a->tail_data + a->tail_size - (const uint8_t *)a->cino;
+	size_t b_size = b->tail_data + b->tail_size - (const uint8_t *)b->cino;
+	int r;
+
+	if (memcmp2(a->cino, a_size, b->cino, b_size) != 0)
+		return 0;
+
+	if (erofs_inode_is_compact(a->cino) &&
+	    (a_image->build_time != b_image->build_time ||
+	     a_image->build_time_nsec != b_image->build_time_nsec))
+		return 0;
+
+	if ((a->oob_data == NULL) != (b->oob_data == NULL) ||
+	    (a->oob_data != NULL &&
+	     memcmp(a->oob_data, b->oob_data, a->size - a->tail_size) != 0))
+		return 0;
+
+	while ((r = lcfs_image_next_xattr_entry(a_image, a, &a_cursor, &a_entry)) > 0) {
+		if (lcfs_image_next_xattr_entry(b_image, b, &b_cursor, &b_entry) <= 0 ||
+		    lcfs_image_decode_xattr(a_image, a_entry, &a_xattr) < 0 ||
+		    lcfs_image_decode_xattr(b_image, b_entry, &b_xattr) < 0)
+			return -1;
+		if (!lcfs_image_xattr_equal(&a_xattr, &b_xattr))
+			return 0;
+	}
+
+	return r < 0 ? -1 : 1;
+}
+
+static bool lcfs_image_data_equal(const void *a, size_t a_len, const void *b,
+				  size_t b_len)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return memcmp2(a, a_len, b, b_len) == 0;
+}
+
+/* Compares content split between data blocks and tail, where the split
+ * depends on the block size of the image */
+static bool lcfs_image_content_equal(const uint8_t *a_data, size_t a_data_len,
+				     const uint8_t *a_tail, size_t a_tail_len,
+				     const uint8_t *b_data, size_t b_data_len,
+				     const uint8_t *b_tail, size_t b_tail_len)
+{
+	size_t size = a_data_len + a_tail_len;
+	size_t offset = 0;
+
+	if (size != b_data_len + b_tail_len)
+		return false;
+
+	while (offset < size) {
+		const uint8_t *a = offset < a_data_len ? a_data + offset :
+							 a_tail + (offset - a_data_len);
+		const uint8_t *b = offset < b_data_len ? b_data + offset :
+							 b_tail + (offset - b_data_len);
+		size_t a_len = offset < a_data_len ? a_data_len - offset : size - offset;
+		size_t b_len = offset < b_data_len ? b_data_len - offset : size - offset;
+		size_t len = min(a_len, b_len);
+
+		if (memcmp(a, b, len) != 0)
+			return false;
+		offset += len;
+	}
+
+	return true;
+}
+
+/* Sets changes to the LCFS_IMAGE_DIFF_* flags for what differs
+ * between two entries of the same type */
+static int lcfs_image_diff_inodes(lcfs_image_t *a_image, uint64_t a_nid,
+				  lcfs_image_t *b_image, uint64_t b_nid,
+				  uint32_t *changes)
+{
+	struct lcfs_image_inode_s a, b;
+	struct stat a_st, b_st;
+	int r;
+
+	*changes = 0;
+
+	if (lcfs_image_get_inode(a_image, a_nid, &a) < 0 ||
+	    lcfs_image_get_inode(b_image, b_nid, &b) < 0)
+		return -1;
+
+	r = lcfs_image_inodes_identical(a_image, &a, b_image, &b);
+	if (r != 0)
+		return r < 0 ? -1 : 0;
+
+	if (lcfs_image_stat(a_image, a_nid, &a_st) < 0 ||
+	    lcfs_image_stat(b_image, b_nid, &b_st) < 0)
+		return -1;
+
+	if ((a_st.st_mode & 07777) != (b_st.st_mode & 07777))
+		*changes |= LCFS_IMAGE_DIFF_MODE;
+	if (a_st.st_uid != b_st.st_uid || a_st.st_gid != b_st.st_gid)
+		*changes |= LCFS_IMAGE_DIFF_OWNER;
+	if (a_st.st_mtim.tv_sec != b_st.st_mtim.tv_sec ||
+	    a_st.st_mtim.tv_nsec != b_st.st_mtim.tv_nsec)
+		*changes |= LCFS_IMAGE_DIFF_MTIME;
+
+	/* The size of directories depends on the encoding */
+	if (!S_ISDIR(a_st.st_mode) &&
+	    (a_st.st_size != b_st.st_size || a_st.st_rdev != b_st.st_rdev))
+		*changes |= LCFS_IMAGE_DIFF_CONTENT;
+
+	if (S_ISREG(a_st.st_mode) && !(*changes & LCFS_IMAGE_DIFF_CONTENT)) {
+		const uint8_t *a_data = NULL, *a_tail = NULL;
+		const uint8_t *b_data = NULL, *b_tail = NULL;
+		size_t a_data_len = 0, a_tail_len = 0;
+		size_t b_data_len = 0, b_tail_len = 0;
+
+		if ((lcfs_image_get_content(a_image, a_nid, &a_data, &a_data_len,
+					    &a_tail, &a_tail_len) < 0 &&
+		     errno != ENODATA) ||
+		    (lcfs_image_get_content(b_image, b_nid, &b_data, &b_data_len,
+					    &b_tail, &b_tail_len) < 0 &&
+		     errno != ENODATA))
+			return -1;
+
+		if ((a_data == NULL) != (b_data == NULL) ||
+		    (a_data != NULL &&
+		     !lcfs_image_content_equal(a_data, a_data_len, a_tail, a_tail_len,
+					       b_data, b_data_len, b_tail, b_tail_len)))
+			*changes |= LCFS_IMAGE_DIFF_CONTENT;
+	}
+
+	if (S_ISREG(a_st.st_mode) || S_ISLNK(a_st.st_mode)) {
+		const char *a_payload, *b_payload;
+		size_t a_len = 0, b_len = 0;
+
+		a_payload = lcfs_image_get_payload(a_image, a_nid, &a_len);
+		if (a_payload == NULL && errno != ENODATA)
+			return -1;
+		b_payload = lcfs_image_get_payload(b_image, b_nid, &b_len);
+		if (b_payload == NULL && errno != ENODATA)
+			return -1;
+		if (!lcfs_image_data_equal(a_payload, a_len, b_payload, b_len))
+			*changes |= LCFS_IMAGE_DIFF_PAYLOAD;
+	}
+
+	if (S_ISREG(a_st.st_mode)) {
+		const uint8_t *a_digest, *b_digest;
+
+		a_digest = lcfs_image_get_fsverity_digest(a_image, a_nid);
+		if (a_digest == NULL && errno != ENODATA)
+			return -1;
+		b_digest = lcfs_image_get_fsverity_digest(b_image, b_nid);
+		if (b_digest == NULL && errno != ENODATA)
+			return -1;
+		if (!lcfs_image_data_equal(a_digest, LCFS_DIGEST_SIZE, b_digest,
+					   LCFS_DIGEST_SIZE))
+			*changes |= LCFS_IMAGE_DIFF_DIGEST;
+	}
+
+	r = lcfs_image_xattrs_equal(a_image, a_nid, b_image, b_nid);
+	if (r < 0)
+		return -1;
+	if (r == 0)
+		*changes |= LCFS_IMAGE_DIFF_XATTRS;
+
+	return 0;
+}
+
+struct lcfs_image_diff_s {
+	lcfs_image_t *old_image;
+	lcfs_image_t *new_image;
+	lcfs_image_diff_cb_t cb;
+	void *data;
+	char *path;
+	size_t path_size;
+};
+
+/* The path of the current entry, which is "/" for the root */
+static const char *lcfs_image_diff_path(struct lcfs_image_diff_s *diff,
+					size_t path_len)
+{
+	if (path_len == 0)
+		return "/";
+	diff->path[path_len] = 0;
+	return diff->path;
+}
+
+/* Reports an entry that is only in one of the images, and everything
+ * below it */
+static int lcfs_image_diff_one_side(struct lcfs_image_diff_s *diff, bool removed,
+				    const struct lcfs_image_dirent_s *dirent,
+				    size_t path_len)
+{
+	lcfs_image_t *image = removed ? diff->old_image : diff->new_image;
+	struct lcfs_image_dirent_s child;
+	uint64_t cursor = 0;
+	int r;
+
+	if (diff->cb(lcfs_image_diff_path(diff, path_len), removed ? dirent : NULL,
+		     removed ? NULL : dirent, 0, diff->data) < 0)
+		return -1;
+
+	if (dirent->type != S_IFDIR)
+		return 0;
+
+	while ((r = lcfs_image_readdir(image, dirent->nid, &cursor, &child)) > 0) {
+		if (lcfs_image_path_append(&diff->path, &diff->path_size, path_len,
+					   child.name, child.name_len) < 0 ||
+		    lcfs_image_diff_one_side(diff, removed, &child,
+					     path_len + 1 + child.name_len) < 0)
+			return -1;
+	}
+
+	return r;
+}
+
+static int lcfs_image_diff_entry(struct lcfs_image_diff_s *diff,
+				 const struct lcfs_image_dirent_s *old_dirent,
+				 const struct lcfs_image_dirent_s *new_dirent,
+				 size_t path_len);
+
+static int lcfs_image_diff_dir(struct lcfs_image_diff_s *diff, uint64_t old_nid,
+			       uint64_t new_nid, size_t path_len)
+{
+	struct lcfs_image_dirent_s a, b;
+	uint64_t a_cursor = 0, b_cursor = 0;
+	int ra, rb;
+
+	/* Both are sorted by name, so they can be merged */
+	ra = lcfs_image_readdir(diff->old_image, old_nid, &a_cursor, &a);
+	rb = lcfs_image_readdir(diff->new_image, new_nid, &b_cursor, &b);
+	while (ra > 0 || rb > 0) {
+		const struct lcfs_image_dirent_s *dirent;
+		int cmp;
+		int r;
+
+		if (ra > 0 && rb > 0)
+			cmp = memcmp2(a.name, a.name_len, b.name, b.name_len);
+		else
+			cmp = ra > 0 ? -1 : 1;
+
+		dirent = cmp <= 0 ? &a : &b;
+		if (lcfs_image_path_append(&diff->path, &diff->path_size, path_len,
+					   dirent->name, dirent->name_len) < 0)
+			return -1;
+
+		if (cmp < 0)
+			r = lcfs_image_diff_one_side(diff, true, &a,
+						     path_len + 1 + a.name_len);
+		else if (cmp > 0)
+			r = lcfs_image_diff_one_side(diff, false, &b,
+						     path_len + 1 + b.name_len);
+		else
+			r = lcfs_image_diff_entry(diff, &a, &b,
+						  path_len + 1 + a.name_len);
+		if (r < 0)
+			return -1;
+
+		if (cmp <= 0)
+			ra = lcfs_image_readdir(diff->old_image, old_nid, &a_cursor, &a);
+		if (cmp >= 0)
+			rb = lcfs_image_readdir(diff->new_image, new_nid, &b_cursor, &b);
+	}
+
+	return ra < 0 || rb < 0 ? -1 : 0;
+}
+
+static int lcfs_image_diff_entry(struct lcfs_image_diff_s *diff,
+				 const struct lcfs_image_dirent_s *old_dirent,
+				 const struct lcfs_image_dirent_s *new_dirent,
+				 size_t path_len)
+{
+	uint32_t changes;
+
+	if (old_dirent->type != new_dirent->type) {
+		if (lcfs_image_diff_one_side(diff, true, old_dirent, path_len) < 0)
+			return -1;
+		return lcfs_image_diff_one_side(diff, false, new_dirent, path_len);
+	}
+
+	if (lcfs_image_diff_inodes(diff->old_image, old_dirent->nid,
+				   diff->new_image, new_dirent->nid, &changes) < 0)
+		return -1;
+
+	if (changes != 0 &&
+	    diff->cb(lcfs_image_diff_path(diff, path_len), old_dirent,
+		     new_dirent, changes, diff->data) < 0)
+		return -1;
+
+	if (old_dirent->type == S_IFDIR)
+		return lcfs_image_diff_dir(diff, old_dirent->nid, new_dirent->nid,
+					   path_len);
+
+	return 0;
+}
+
+int lcfs_image_diff(lcfs_image_t *old_image, lcfs_image_t *new_image,
+		    lcfs_image_diff_cb_t cb, void *data)
+{
+	struct lcfs_image_diff_s diff = {
+		.old_image = old_image,
+		.new_image = new_image,
+		.cb = cb,
+		.data = data,
+	};
+	struct lcfs_image_dirent_s old_root = {
+		.nid = old_image->root_nid,
+		.name = "",
+		.name_len = 0,
+		.type = S_IFDIR,
+	};
+	struct lcfs_image_dirent_s new_root = {
+		.nid = new_image->root_nid,
+		.name = "",
+		.name_len = 0,
+		.type = S_IFDIR,
+	};
+	int r;
+
+	diff.path_size = PATH_MAX;
+	diff.path = malloc(diff.path_size);
+	if (diff.path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	r = lcfs_image_diff_entry(&diff, &old_root, &new_root, 0);
+
+	free(diff.path);
+	return r < 0 ? -1 : 0;
+}
@@ -0,0 +1,157 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_IMAGE_H
+#define _LCFS_IMAGE_H
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef LCFS_EXTERN
+#define LCFS_EXTERN extern
+#endif
+
+/* A read-only view of a composefs image, which decodes the image data
+ * in place. Inodes are referred to by nid, and strings and data
+ * returned from the image point into it, so they stay valid until the
+ * image is closed. Such strings are not nul-terminated.
+ *
+ * Like lcfs_load_node_from_image(), the view hides the overlayfs
+ * details of the image: whiteouts added for overlayfs are not listed,
+ * escaped whiteouts are returned as whiteouts, and the internal
+ * overlay xattrs are only exposed as payload and digest.
+ */
+typedef struct lcfs_image_s lcfs_image_t;
+
+struct lcfs_image_dirent_s {
+	uint64_t nid;
+	const char *name;
+	size_t name_len;
+	uint32_t type; /* S_IFMT bits of the mode */
+};
+
+/* The full xattr name is prefix (nul-terminated), infix and name */
+struct lcfs_image_xattr_s {
+	const char *prefix;
+	const char *infix;
+	size_t infix_len;
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+};
+
+LCFS_EXTERN lcfs_image_t *lcfs_image_open_fd(int fd);
+/* The data must be kept alive until the image is closed */
+LCFS_EXTERN lcfs_image_t *lcfs_image_open_data(const void *data, size_t size);
+LCFS_EXTERN void lcfs_image_close(lcfs_image_t *image);
+
+/* Checks everything reachable from the root in one pass: the inodes,
+ * their xattrs and data, and the dirents, which must be sorted and
+ * refer to the right inode types. Fails with EINVAL if the image is
+ * invalid. Afterwards the other functions don't repeat the bounds
+ * checks, other than checking that nids are validated inodes. */
+LCFS_EXTERN int lcfs_image_validate(lcfs_image_t *image);
+/* Returns true if nid was checked by lcfs_image_validate(), so the
+ * image data it refers to can be used without bounds checks */
+LCFS_EXTERN bool lcfs_image_nid_is_valid(lcfs_image_t *image, uint64_t nid);
+/* Returns one more than the highest validated nid, or 0 if the image
+ * wasn't validated */
+LCFS_EXTERN uint64_t lcfs_image_get_n_nids(lcfs_image_t *image);
+/* For users that only look at some directories, instead of paying for
+ * lcfs_image_validate() up front: checks the root inode, or the dirents
+ * of an already validated directory and the inodes they refer to.
+ * Afterwards lcfs_image_nid_is_valid() is true for those nids. As
+ * subdirectories are only checked when they are listed themselves,
+ * finding directories with more than one parent is up to the caller. */
+LCFS_EXTERN int lcfs_image_validate_root(lcfs_image_t *image);
+LCFS_EXTERN int lcfs_image_validate_dir_entries(lcfs_image_t *image,
+						uint64_t dir_nid);
+
+LCFS_EXTERN uint64_t lcfs_image_get_root_nid(lcfs_image_t *image);
+LCFS_EXTERN int lcfs_image_lookup(lcfs_image_t *image, uint64_t dir_nid,
+				  const char *name, uint64_t *nid_out);
+/* Path is relative to the root, symlinks are not followed */
+LCFS_EXTERN int lcfs_image_lookup_path(lcfs_image_t *image, const char *path,
+				       uint64_t *nid_out);
+LCFS_EXTERN int lcfs_image_stat(lcfs_image_t *image, uint64_t nid,
+				struct stat *st);
+LCFS_EXTERN const char *lcfs_image_readlink(lcfs_image_t *image, uint64_t nid,
+					    size_t *len_out);
+/* Returns the backing file path of a file, or the target of a symlink */
+LCFS_EXTERN const char *lcfs_image_get_payload(lcfs_image_t *image,
+					       uint64_t nid, size_t *len_out);
+LCFS_EXTERN const uint8_t *lcfs_image_get_fsverity_digest(lcfs_image_t *image,
+							  uint64_t nid);
+/* Returns the content of files stored in the image, which is split in
+ * the data blocks and the tail stored with the inode */
+LCFS_EXTERN int lcfs_image_get_content(lcfs_image_t *image, uint64_t nid,
+				       const uint8_t **data_out,
+				       size_t *data_len_out,
+				       const uint8_t **tail_out,
+				       size_t *tail_len_out);
+
+/* Iterate by calling these with *cursor set to 0 until they return 0.
+ * They return 1 when an entry was returned, and -1 on errors.
+ * Readdir skips the "." and ".." entries. */
+LCFS_EXTERN int lcfs_image_readdir(lcfs_image_t *image, uint64_t dir_nid,
+				   uint64_t *cursor,
+				   struct lcfs_image_dirent_s *dirent);
+LCFS_EXTERN int lcfs_image_next_xattr(lcfs_image_t *image, uint64_t nid,
+				      uint64_t *cursor,
+				      struct lcfs_image_xattr_s *xattr);
+
+/* Called for each entry of the image, in depth-first dirent order,
+ * starting with the root, which has the path "/" and an empty name.
+ * The path is only valid during the call. Returning < 0 stops the
+ * walk, which then fails. The image is validated first. */
+typedef int (*lcfs_image_visit_cb_t)(lcfs_image_t *image, const char *path,
+				     const struct lcfs_image_dirent_s *dirent,
+				     void *data);
+
+LCFS_EXTERN int lcfs_image_visit(lcfs_image_t *image, lcfs_image_visit_cb_t cb,
+				 void *data);
+
+/* What differs between two entries of the same type */
+enum {
+	LCFS_IMAGE_DIFF_MODE = (1 << 0), /* Permission bits */
+	LCFS_IMAGE_DIFF_OWNER = (1 << 1),
+	LCFS_IMAGE_DIFF_MTIME = (1 << 2),
+	LCFS_IMAGE_DIFF_CONTENT = (1 << 3), /* Size, inline content or rdev */
+	LCFS_IMAGE_DIFF_PAYLOAD = (1 << 4),
+	LCFS_IMAGE_DIFF_DIGEST = (1 << 5),
+	LCFS_IMAGE_DIFF_XATTRS = (1 << 6),
+};
+
+/* Called for each difference, in depth-first dirent order. Old_dirent
+ * is NULL for added entries, and new_dirent is NULL for removed ones.
+ * All entries below an added or removed directory are reported too,
+ * and an entry that changed type is reported as removed and added.
+ * The path is only valid during the call. Returning < 0 stops the
+ * diff, which then fails. */
+typedef int (*lcfs_image_diff_cb_t)(const char *path,
+				    const struct lcfs_image_dirent_s *old_dirent,
+				    const struct lcfs_image_dirent_s *new_dirent,
+				    uint32_t changes, void *data);
+
+/* Walks both images together, so memory use only depends on the depth
+ * of the tree */
+LCFS_EXTERN int lcfs_image_diff(lcfs_image_t *old_image, lcfs_image_t *new_image,
+				lcfs_image_diff_cb_t cb, void *data);
+
+#endif
@@ -124,7 +124,18 @@ struct lcfs_xattr_s {
 	char *value;
 	uint16_t value_len;
 
+	/* Set for xattrs synthesized by the erofs writer, which have a
+	 * static key, and a value made of value_prefix followed by
+	 * data borrowed from the node. value_len includes the prefix,
+	 * so value isn't the whole value. They are only added to the
+	 * writer's private clone of the tree, after which its xattrs
+	 * aren't cloned, read or changed through the node API. */
+	bool erofs_virtual;
+	uint8_t value_prefix_len;
+	uint8_t value_prefix[4];
+
 	/* Used during writing */
+	uint64_t erofs_hash; /* hash of key and value */
 	int64_t erofs_shared_xattr_offset; /* shared offset, or -1 if not shared */
 };
 
@@ -164,6 +175,10 @@ struct lcfs_node_s {
 
 	struct lcfs_inode_s inode;
 
+	/* Set for a lazily loaded directory until its children are
+	 * decoded, erofs_nid is then the nid of the directory */
+	struct lcfs_image_data *image; /* Owns ref */
+
 	/* Used during compute_tree */
 	struct lcfs_node_s *next; /* Use for the queue in compute_tree */
 	bool in_tree;
@@ -175,6 +190,20 @@ struct lcfs_node_s {
 	uint64_t erofs_nid;
 	uint32_t erofs_n_blocks;
 	uint32_t erofs_tailsize;
+	uint64_t erofs_data_block; /* relative to start of data blocks */
+	bool erofs_data_shared; /* data blocks are shared with an earlier node */
+};
+
+struct lcfs_mtime_s {
+	int64_t sec;
+	uint32_t nsec;
+	bool compact; /* Could be stored as compact inode */
+};
+
+struct lcfs_mtimes_s {
+	struct lcfs_mtime_s *mtimes;
+	size_t n_mtimes;
+	size_t alloc_mtimes;
 };
 
 struct lcfs_ctx_s {
@@ -187,13 +216,29 @@ struct lcfs_ctx_s {
 	uint64_t num_inodes;
 	int64_t min_mtim_sec;
 	uint32_t min_mtim_nsec;
+	int64_t build_mtim_sec; /* mtime of compact inodes */
+	uint32_t build_mtim_nsec;
 	bool has_acl;
 
+	/* Collected by lcfs_ctx_add_mtime() if max_version >= 3 */
+	struct lcfs_mtimes_s mtimes;
+
+	/* Set if version >= 3 */
+	int64_t common_mtim_sec;
+	uint32_t common_mtim_nsec;
+
 	void *file;
 	lcfs_write_cb write_cb;
 	off_t bytes_written;
 	FsVerityContext *fsverity_ctx;
 
+	/* Used in LCFS_FLAGS_WRITE_FD mode */
+	int fd;
+	bool fd_seekable;
+	uint8_t *fd_buf;
+	size_t fd_buf_len;
+	off_t fd_offset;
+
 	void (*finalize)(struct lcfs_ctx_s *ctx);
 };
 
@@ -207,11 +252,14 @@ static inline void lcfs_node_unrefp(struct lcfs_node_s **nodep)
 #define cleanup_node __attribute__((cleanup(lcfs_node_unrefp)))
 
 /* lcfs-writer.c */
-size_t hash_memory(const char *string, size_t len, size_t n_buckets);
 int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len);
 int lcfs_write_align(struct lcfs_ctx_s *ctx, size_t align_size);
 int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len);
+int lcfs_write_preallocate(struct lcfs_ctx_s *ctx, off_t size);
 int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root);
+int lcfs_node_check_links(struct lcfs_node_s *node);
+int lcfs_ctx_add_mtime(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node);
+void lcfs_compute_build_mtime(struct lcfs_ctx_s *ctx);
 int lcfs_clone_root(struct lcfs_ctx_s *ctx);
 char *maybe_join_path(const char *a, const char *b);
 struct lcfs_node_s *follow_links(struct lcfs_node_s *node);
@@ -219,11 +267,69 @@ int node_get_dtype(struct lcfs_node_s *node);
 
 int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index,
 			   const char *new_name);
+int lcfs_node_add_virtual_xattr(struct lcfs_node_s *node, const char *name,
+				const uint8_t *prefix, size_t prefix_len,
+				const char *data, size_t data_len);
+void lcfs_node_update_version(struct lcfs_node_s *node,
+			      struct lcfs_write_options_s *options);
+bool lcfs_node_may_be_compact(struct lcfs_node_s *node);
+void lcfs_node_sort_xattrs(struct lcfs_node_s *node);
+void lcfs_node_swap_positions(struct lcfs_node_s *a, struct lcfs_node_s *b);
+
+/* lcfs-writer-stream.c */
+struct lcfs_spill_s;
+
+/* Called with each distinct record and the number of times it was added */
+typedef int (*lcfs_spill_count_cb)(void *data, const uint8_t *record,
+				   size_t len, size_t count);
+
+struct lcfs_spill_s *lcfs_spill_new(const char *tmpdir);
+void lcfs_spill_free(struct lcfs_spill_s *spill);
+int lcfs_spill_write(struct lcfs_spill_s *spill, const void *data, size_t len);
+ssize_t lcfs_spill_write_cb(void *file, void *buf, size_t count);
+int lcfs_spill_add_record(struct lcfs_spill_s *spill, const void *data, size_t len);
+int lcfs_spill_copy_to(struct lcfs_spill_s *spill, struct lcfs_ctx_s *ctx);
+int lcfs_spill_count_records(struct lcfs_write_stream_s *stream,
+			     struct lcfs_spill_s *spill, lcfs_spill_count_cb cb,
+			     void *cb_data);
+
+#define LCFS_STREAM_NODE_ROOT (1 << 0)
+#define LCFS_STREAM_NODE_SYNTHETIC (1 << 1) /* From lcfs_write_stream_add_root_child() */
+#define LCFS_STREAM_NODE_HAS_WHITEOUTS (1 << 2) /* Directory with whiteout children */
+
+int lcfs_write_stream_prepare(struct lcfs_write_stream_s *stream);
+struct lcfs_write_options_s *lcfs_write_stream_get_options(struct lcfs_write_stream_s *stream);
+struct lcfs_node_s *lcfs_write_stream_get_root(struct lcfs_write_stream_s *stream);
+struct lcfs_spill_s *lcfs_write_stream_new_spill(struct lcfs_write_stream_s *stream);
+void lcfs_write_stream_init_ctx(struct lcfs_write_stream_s *stream,
+				struct lcfs_ctx_s *ctx);
+bool lcfs_write_stream_root_has_child(struct lcfs_write_stream_s *stream,
+				      const char *name);
+int lcfs_write_stream_add_root_child(struct lcfs_write_stream_s *stream,
+				     const char *name, struct lcfs_node_s *child);
+int lcfs_write_stream_rewind(struct lcfs_write_stream_s *stream, bool record_nids);
+int lcfs_write_stream_next(struct lcfs_write_stream_s *stream,
+			   struct lcfs_node_s **node_out, int *flags_out);
+int lcfs_write_stream_set_nid(struct lcfs_write_stream_s *stream,
+			      struct lcfs_node_s *node);
 
 /* lcfs-writer-erofs.c */
 
 int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx);
-struct lcfs_ctx_s *lcfs_ctx_erofs_new(void);
+int lcfs_write_erofs_stream_to(struct lcfs_ctx_s *ctx,
+			       struct lcfs_write_stream_s *stream);
+struct lcfs_ctx_s *lcfs_ctx_erofs_new(struct lcfs_write_options_s *options);
+/* Like lcfs_load_node_from_image_ext(), mapping (if not NULL) is
+ * unmapped once the nodes no longer need it */
+struct lcfs_node_s *lcfs_load_node_from_mapping(void *mapping, size_t mapping_size,
+						const uint8_t *image_data,
+						size_t image_data_size, int loadflags,
+						uint32_t threads);
+/* Decodes the children of a lazily loaded directory, clearing
+ * node->image. On failure the node is left as it was. */
+int lcfs_node_load_children(struct lcfs_node_s *node);
+void lcfs_node_remove_all_children(struct lcfs_node_s *node);
+void lcfs_image_data_unref(struct lcfs_image_data *data);
 
 /* lcfs-writer-cfs.c */
 
@@ -46,6 +46,7 @@
 #endif
 
 #include "lcfs-erofs.h"
+#include "erofs_fs_wrapper.h"
 #include "lcfs-utils.h"
 #include "lcfs-internal.h"
 
@@ -241,6 +242,25 @@ static errint_t lcfs_validate_verity_fd(struct lcfs_mount_state_s *state)
 	return 0;
 }
 
+/* The erofs block size from the superblock, capped at the page size
+ * as that is the largest logical block size loop devices support */
+static uint32_t erofs_loop_block_size(int fd)
+{
+	struct erofs_super_block super;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t block_size = EROFS_BLKSIZ;
+
+	if (pread(fd, &super, sizeof(super), EROFS_SUPER_OFFSET) == sizeof(super) &&
+	    super.blkszbits >= LCFS_BLOCK_SIZE_BITS_MIN &&
+	    super.blkszbits <= LCFS_BLOCK_SIZE_BITS_MAX)
+		block_size = 1U << super.blkszbits;
+
+	if (page_size > 0 && block_size > (unsigned long)page_size)
+		block_size = page_size;
+
+	return block_size;
+}
+
 static errint_t setup_loopback(int fd, const char *image_path, char *loopname)
 {
 	struct loop_config loopconfig = { 0 };
@@ -265,8 +285,7 @@ static errint_t setup_loopback(int fd, const char *image_path, char *loopname)
 		return -errno;
 
 	loopconfig.fd = fd;
-	loopconfig.block_size =
-		4096; /* This is what we use for the erofs block size, so probably good */
+	loopconfig.block_size = erofs_loop_block_size(fd);
 	loopconfig.info.lo_flags =
 		LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO | LO_FLAGS_AUTOCLEAR;
 	if (image_path)
@@ -21,6 +21,7 @@
 #include "lcfs-internal.h"
 #include "lcfs-utils.h"
 #include "lcfs-writer.h"
+#include "lcfs-image.h"
 #include "lcfs-fsverity.h"
 #include "lcfs-erofs-internal.h"
 #include "lcfs-utils.h"
@@ -36,7 +37,9 @@
 #include <sys/xattr.h>
 #include <sys/param.h>
 #include <sys/sysmacros.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <pthread.h>
 #include <linux/fsverity.h>
 
 /* The xxh32 hash function is copied from the linux kernel at:
@@ -157,25 +160,67 @@ static uint32_t xxh32(const void *input, const size_t len, const uint32_t seed)
 	return h32;
 }
 
+struct lcfs_erofs_job_s;
+
 struct lcfs_ctx_erofs_s {
 	struct lcfs_ctx_s base;
 
+	uint32_t blkszbits; /* log2 of blksz */
+	uint64_t blksz;
+	uint64_t meta_start; /* nids are relative to this */
 	uint64_t inodes_end; /* start of xattrs */
 	uint64_t shared_xattr_size;
+	uint64_t xattr_prefix_size; /* Long xattr prefixes, after shared xattrs */
 	uint64_t n_data_blocks;
+	uint64_t data_block_start;
 	uint64_t current_end;
 	struct lcfs_xattr_s **shared_xattrs;
 	size_t n_shared_xattrs;
+
+	/* Used when serializing with multiple threads */
+	struct lcfs_erofs_job_s *jobs;
+	size_t n_jobs;
+};
+
+struct lcfs_erofs_buf_s {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+/* A job serializes the inodes and data blocks of the nodes in
+ * [first, end) into two buffers, which are later written in order. */
+struct lcfs_erofs_job_s {
+	struct lcfs_ctx_erofs_s ctx; /* Private copy, writing to the buffers */
+	struct lcfs_node_s *first;
+	struct lcfs_node_s *end;
+	off_t inodes_start;
+	off_t data_start;
+	struct lcfs_erofs_buf_s inodes;
+	struct lcfs_erofs_buf_s data;
+	pthread_t thread;
+	bool started;
+	int err;
 };
 
 static void lcfs_ctx_erofs_finalize(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 
+	for (size_t i = 0; i < ctx_erofs->n_jobs; i++) {
+		struct lcfs_erofs_job_s *job = &ctx_erofs->jobs[i];
+
+		if (job->started)
+			pthread_join(job->thread, NULL);
+		free(job->inodes.data);
+		free(job->data.data);
+	}
+	free(ctx_erofs->jobs);
+
 	free(ctx_erofs->shared_xattrs);
 }
 
-struct lcfs_ctx_s *lcfs_ctx_erofs_new(void)
+struct lcfs_ctx_s *lcfs_ctx_erofs_new(struct lcfs_write_options_s *options)
 {
 	struct lcfs_ctx_erofs_s *ret = calloc(1, sizeof(struct lcfs_ctx_erofs_s));
 	if (ret == NULL) {
@@ -184,6 +229,11 @@ struct lcfs_ctx_s *lcfs_ctx_erofs_new(void)
 
 	ret->base.finalize = lcfs_ctx_erofs_finalize;
 
+	ret->blkszbits = options->block_size_bits;
+	if (ret->blkszbits == 0)
+		ret->blkszbits = EROFS_BLKSIZ_BITS;
+	ret->blksz = 1ULL << ret->blkszbits;
+
 	return &ret->base;
 }
 
@@ -209,7 +259,11 @@ static int erofs_make_file_type(int regular)
 	}
 }
 
-struct hasher_xattr_s {
+/* Open addressing hash table used to find the use count of each
+ * distinct xattr key/value. The 64bit hash of each xattr is computed
+ * once and stored in the xattr, so lookups mostly compare the hashes
+ * stored in the slots. */
+struct erofs_xattr_ent_s {
 	struct lcfs_xattr_s *xattr;
 	uint32_t count;
 
@@ -217,33 +271,208 @@ struct hasher_xattr_s {
 	uint64_t shared_offset; /* offset in bytes from start of shared xattrs */
 };
 
-static size_t xattrs_ht_hasher(const void *d, size_t n)
+struct erofs_xattr_slot_s {
+	uint64_t hash;
+	size_t ent; /* 1 + index into ents, or 0 if the slot is empty */
+};
+
+struct erofs_xattr_table_s {
+	struct erofs_xattr_slot_s *slots;
+	size_t mask;
+	struct erofs_xattr_ent_s *ents;
+	size_t n_ents;
+};
+
+/* Returns the contiguous part of the xattr value starting at offset,
+ * which for virtual xattrs is either in the prefix or the data */
+static size_t xattr_value_span(const struct lcfs_xattr_s *xattr, size_t offset,
+			       const uint8_t **data_out)
+{
+	if (offset < xattr->value_prefix_len) {
+		*data_out = xattr->value_prefix + offset;
+		return xattr->value_prefix_len - offset;
+	}
+
+	*data_out = (const uint8_t *)xattr->value + (offset - xattr->value_prefix_len);
+	return xattr->value_len - offset;
+}
+
+/* Compares the values of two xattrs with the same value_len */
+static int xattr_value_cmp(const struct lcfs_xattr_s *x1, const struct lcfs_xattr_s *x2)
 {
-	const struct hasher_xattr_s *v = d;
-	return (hash_string(v->xattr->key, n) ^
-		hash_memory(v->xattr->value, v->xattr->value_len, n)) %
-	       n;
+	size_t offset = 0;
+
+	while (offset < x1->value_len) {
+		const uint8_t *d1, *d2;
+		size_t n1 = xattr_value_span(x1, offset, &d1);
+		size_t n2 = xattr_value_span(x2, offset, &d2);
+		size_t n = MIN(n1, n2);
+		int r;
+
+		r = memcmp(d1, d2, n);
+		if (r != 0)
+			return r;
+		offset += n;
+	}
+
+	return 0;
 }
 
-static bool xattrs_ht_comparator(const void *d1, const void *d2)
+/* 64bit FNV-1a over the key (including the terminating zero) and value */
+static uint64_t xattr_hash64(const struct lcfs_xattr_s *xattr)
 {
-	const struct hasher_xattr_s *v1 = d1;
-	const struct hasher_xattr_s *v2 = d2;
+	const uint8_t *key = (const uint8_t *)xattr->key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t offset = 0;
 
-	if (v1->xattr->value_len != v2->xattr->value_len)
+	do {
+		hash = (hash ^ *key) * 0x100000001b3ULL;
+	} while (*key++ != 0);
+
+	while (offset < xattr->value_len) {
+		const uint8_t *value;
+		size_t n = xattr_value_span(xattr, offset, &value);
+
+		for (size_t i = 0; i < n; i++)
+			hash = (hash ^ value[i]) * 0x100000001b3ULL;
+		offset += n;
+	}
+
+	return hash;
+}
+
+static bool xattrs_equal(const struct lcfs_xattr_s *x1, const struct lcfs_xattr_s *x2)
+{
+	if (x1->value_len != x2->value_len)
 		return false;
 
-	if (memcmp(v1->xattr->value, v2->xattr->value, v1->xattr->value_len) != 0)
+	if (xattr_value_cmp(x1, x2) != 0)
 		return false;
 
-	return strcmp(v1->xattr->key, v2->xattr->key) == 0;
+	return strcmp(x1->key, x2->key) == 0;
+}
+
+/* Entries that fit in a table with n_slots, keeping the load factor
+ * below 3/4 */
+static size_t erofs_xattr_table_capacity(size_t n_slots)
+{
+	return n_slots / 4 * 3 - 1;
+}
+
+/* The table grows as needed, max_entries only avoids rehashing */
+static int erofs_xattr_table_init(struct erofs_xattr_table_s *table,
+				  size_t max_entries)
+{
+	size_t n_slots = 16;
+
+	while (erofs_xattr_table_capacity(n_slots) < max_entries)
+		n_slots *= 2;
+
+	table->slots = calloc(n_slots, sizeof(struct erofs_xattr_slot_s));
+	table->ents = calloc(erofs_xattr_table_capacity(n_slots),
+			     sizeof(struct erofs_xattr_ent_s));
+	if (table->slots == NULL || table->ents == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	table->mask = n_slots - 1;
+	table->n_ents = 0;
+
+	return 0;
+}
+
+static size_t erofs_xattr_table_free_slot(struct erofs_xattr_table_s *table,
+					  uint64_t hash)
+{
+	size_t i = hash & table->mask;
+
+	while (table->slots[i].ent != 0)
+		i = (i + 1) & table->mask;
+
+	return i;
+}
+
+/* Doubles the number of slots, the entries keep their index */
+static int erofs_xattr_table_grow(struct erofs_xattr_table_s *table)
+{
+	struct erofs_xattr_slot_s *old_slots = table->slots;
+	size_t old_n_slots = table->mask + 1;
+	size_t n_slots = old_n_slots * 2;
+	struct erofs_xattr_slot_s *slots;
+	struct erofs_xattr_ent_s *ents;
+
+	slots = calloc(n_slots, sizeof(struct erofs_xattr_slot_s));
+	ents = reallocarray(table->ents, erofs_xattr_table_capacity(n_slots),
+			    sizeof(struct erofs_xattr_ent_s));
+	if (ents != NULL)
+		table->ents = ents;
+	if (slots == NULL || ents == NULL) {
+		free(slots);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	table->slots = slots;
+	table->mask = n_slots - 1;
+
+	for (size_t i = 0; i < old_n_slots; i++) {
+		if (old_slots[i].ent != 0)
+			slots[erofs_xattr_table_free_slot(table, old_slots[i].hash)] =
+				old_slots[i];
+	}
+	free(old_slots);
+
+	return 0;
+}
+
+static void erofs_xattr_table_free(struct erofs_xattr_table_s *table)
+{
+	free(table->slots);
+	free(table->ents);
+}
+
+/* Returns the entry for the xattr (with xattr->erofs_hash already
+ * computed), adding a new entry if add is true and it is not found.
+ * Returns NULL with errno set if adding fails. */
+static struct erofs_xattr_ent_s *
+erofs_xattr_table_lookup(struct erofs_xattr_table_s *table,
+			 struct lcfs_xattr_s *xattr, bool add)
+{
+	size_t i = xattr->erofs_hash & table->mask;
+
+	for (;; i = (i + 1) & table->mask) {
+		struct erofs_xattr_slot_s *slot = &table->slots[i];
+		struct erofs_xattr_ent_s *ent;
+
+		if (slot->ent == 0)
+			break;
+
+		ent = &table->ents[slot->ent - 1];
+		if (slot->hash == xattr->erofs_hash && xattrs_equal(ent->xattr, xattr))
+			return ent;
+	}
+
+	if (!add)
+		return NULL;
+
+	if (table->n_ents == erofs_xattr_table_capacity(table->mask + 1)) {
+		if (erofs_xattr_table_grow(table) < 0)
+			return NULL;
+		i = erofs_xattr_table_free_slot(table, xattr->erofs_hash);
+	}
+
+	table->slots[i].hash = xattr->erofs_hash;
+	table->slots[i].ent = ++table->n_ents;
+	table->ents[table->n_ents - 1] = (struct erofs_xattr_ent_s){ .xattr = xattr };
+
+	return &table->ents[table->n_ents - 1];
 }
 
 /* Sort alphabetically by key and value to get some canonical order */
-static int xattrs_ht_sort(const void *d1, const void *d2)
+static int xattrs_ent_sort(const void *d1, const void *d2)
 {
-	const struct hasher_xattr_s *v1 = *(const struct hasher_xattr_s **)d1;
-	const struct hasher_xattr_s *v2 = *(const struct hasher_xattr_s **)d2;
+	const struct erofs_xattr_ent_s *v1 = *(const struct erofs_xattr_ent_s **)d1;
+	const struct erofs_xattr_ent_s *v2 = *(const struct erofs_xattr_ent_s **)d2;
 	int r;
 
 	r = strcmp(v2->xattr->key, v1->xattr->key);
@@ -253,7 +482,7 @@ static int xattrs_ht_sort(const void *d1, const void *d2)
 	if (v1->xattr->value_len != v2->xattr->value_len)
 		return (int)v2->xattr->value_len - (int)v1->xattr->value_len;
 
-	return memcmp(v2->xattr->value, v1->xattr->value, v1->xattr->value_len);
+	return xattr_value_cmp(v2->xattr, v1->xattr);
 }
 
 static uint8_t xattr_erofs_entry_index(struct lcfs_xattr_s *xattr, char **rest)
@@ -279,10 +508,53 @@ static uint8_t xattr_erofs_entry_index(struct lcfs_xattr_s *xattr, char **rest)
 	return 0;
 }
 
-static size_t xattr_erofs_entry_size(struct lcfs_xattr_s *xattr)
+/* Long xattr name prefixes, used with format version 2 and later.
+ * These are the xattrs that every backed file has, and the position
+ * in this table is the long prefix index stored on disk. */
+static const struct {
+	uint8_t base_index;
+	const char *infix;
+} erofs_long_xattr_prefixes[] = {
+	{ EROFS_XATTR_INDEX_TRUSTED, OVERLAY_XATTR_PARTIAL_PREFIX "metacopy" },
+	{ EROFS_XATTR_INDEX_TRUSTED, OVERLAY_XATTR_PARTIAL_PREFIX "redirect" },
+};
+
+#define EROFS_N_LONG_XATTR_PREFIXES                                            \
+	(sizeof(erofs_long_xattr_prefixes) / sizeof(erofs_long_xattr_prefixes[0]))
+
+static bool erofs_use_long_xattr_prefixes(struct lcfs_ctx_s *ctx)
+{
+	return ctx->options->version >= 2;
+}
+
+/* Like xattr_erofs_entry_index(), but returns the on-disk name index,
+ * which may refer to a long prefix */
+static uint8_t xattr_erofs_entry_name_index(struct lcfs_ctx_s *ctx,
+					    struct lcfs_xattr_s *xattr, char **rest)
+{
+	uint8_t index = xattr_erofs_entry_index(xattr, rest);
+
+	if (!erofs_use_long_xattr_prefixes(ctx))
+		return index;
+
+	for (size_t i = 0; i < EROFS_N_LONG_XATTR_PREFIXES; i++) {
+		const char *infix = erofs_long_xattr_prefixes[i].infix;
+
+		if (erofs_long_xattr_prefixes[i].base_index == index &&
+		    str_has_prefix(*rest, infix)) {
+			*rest += strlen(infix);
+			return EROFS_XATTR_LONG_PREFIX | i;
+		}
+	}
+
+	return index;
+}
+
+static size_t xattr_erofs_entry_size(struct lcfs_ctx_s *ctx,
+				     struct lcfs_xattr_s *xattr)
 {
 	char *key_suffix;
-	xattr_erofs_entry_index(xattr, &key_suffix);
+	xattr_erofs_entry_name_index(ctx, xattr, &key_suffix);
 
 	return round_up(sizeof(struct erofs_xattr_entry) + strlen(key_suffix) +
 				xattr->value_len,
@@ -310,7 +582,7 @@ static size_t xattr_erofs_inode_size(size_t n_shared_xattrs, size_t unshared_xat
 			sizeof(uint32_t));
 }
 
-static bool erofs_xattr_should_be_shared(struct hasher_xattr_s *ent)
+static bool erofs_xattr_should_be_shared(struct erofs_xattr_ent_s *ent)
 {
 	/* Share multi-use xattrs */
 	if (ent->count > 1)
@@ -319,68 +591,38 @@ static bool erofs_xattr_should_be_shared(struct hasher_xattr_s *ent)
 	return false;
 }
 
-static int compute_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
+/* Picks the xattrs of the table to share and computes their offsets */
+static int assign_erofs_shared_xattrs(struct lcfs_ctx_s *ctx,
+				      struct erofs_xattr_table_s *table)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
-	struct lcfs_node_s *node;
-	Hash_table *xattr_hash;
-	struct hasher_xattr_s **sorted = NULL;
+	cleanup_free struct erofs_xattr_ent_s **sorted = NULL;
 	size_t n_xattrs;
 	uint64_t xattr_offset;
 
-	size_t n_files = 0;
-	for (node = ctx->root; node != NULL; node = node->next)
-		n_files++;
+	/* Compute the xattr list in canonical order */
 
-	/* Find the use count for each xattr key/value in use */
-	xattr_hash = hash_initialize(n_files, NULL, xattrs_ht_hasher,
-				     xattrs_ht_comparator, free);
-	if (xattr_hash == NULL) {
+	n_xattrs = table->n_ents;
+	sorted = calloc(n_xattrs, sizeof(struct erofs_xattr_ent_s *));
+	if (sorted == NULL && n_xattrs > 0) {
 		errno = ENOMEM;
 		return -1;
 	}
-
-	for (node = ctx->root; node != NULL; node = node->next) {
-		for (size_t i = 0; i < node->n_xattrs; i++) {
-			struct hasher_xattr_s hkey = { .xattr = &node->xattrs[i] };
-			struct hasher_xattr_s *ent;
-
-			ent = hash_lookup(xattr_hash, &hkey);
-			if (ent == NULL) {
-				cleanup_free struct hasher_xattr_s *new_ent =
-					calloc(1, sizeof(struct hasher_xattr_s));
-				if (new_ent == NULL) {
-					goto fail;
-				}
-				new_ent->xattr = &node->xattrs[i];
-				ent = hash_insert(xattr_hash, new_ent);
-				if (ent == NULL)
-					goto fail;
-				assert(ent == new_ent); /* Due to result from previously run hash_lookup() */
-				new_ent = NULL;
-			}
-			ent->count++;
-		}
-	}
-
-	/* Compute the xattr list in canonical order */
-
-	n_xattrs = hash_get_n_entries(xattr_hash);
-	sorted = calloc(n_xattrs, sizeof(struct hasher_xattr_s *));
-	if (sorted == NULL)
-		goto fail;
-	n_xattrs = hash_get_entries(xattr_hash, (void **)sorted, n_xattrs);
-	qsort(sorted, n_xattrs, sizeof(struct hasher_xattr_s *), xattrs_ht_sort);
+	for (size_t i = 0; i < n_xattrs; i++)
+		sorted[i] = &table->ents[i];
+	qsort(sorted, n_xattrs, sizeof(struct erofs_xattr_ent_s *), xattrs_ent_sort);
 
 	/* Compute the list of shared (multi-use) xattrs and their offsets */
 	ctx_erofs->shared_xattrs = calloc(n_xattrs, sizeof(struct lcfs_xattr_s *));
-	if (ctx_erofs->shared_xattrs == NULL)
-		goto fail;
+	if (ctx_erofs->shared_xattrs == NULL && n_xattrs > 0) {
+		errno = ENOMEM;
+		return -1;
+	}
 	ctx_erofs->n_shared_xattrs = 0;
 
 	xattr_offset = 0;
 	for (size_t i = 0; i < n_xattrs; i++) {
-		struct hasher_xattr_s *ent = sorted[i];
+		struct erofs_xattr_ent_s *ent = sorted[i];
 		if (erofs_xattr_should_be_shared(ent)) {
 			ent->shared = true;
 			ent->shared_offset = xattr_offset;
@@ -389,51 +631,72 @@ static int compute_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 				ent->xattr;
 			ctx_erofs->n_shared_xattrs++;
 
-			xattr_offset += xattr_erofs_entry_size(ent->xattr);
+			xattr_offset += xattr_erofs_entry_size(ctx, ent->xattr);
 		}
 	}
 
 	ctx_erofs->shared_xattr_size = xattr_offset;
 
-	/* Assign shared xattr offsets for all inodes */
+	return 0;
+}
+
+/* Assigns the shared xattr offsets of the node, with xattr->erofs_hash
+ * already computed. Xattrs not in the table are not shared. */
+static void set_erofs_shared_xattr_offsets(struct erofs_xattr_table_s *table,
+					   struct lcfs_node_s *node)
+{
+	int n_shared = 0;
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		int n_shared = 0;
-		for (size_t i = 0; i < node->n_xattrs; i++) {
-			struct lcfs_xattr_s *xattr = &node->xattrs[i];
-			struct hasher_xattr_s hkey = { .xattr = xattr };
-			struct hasher_xattr_s *ent;
-
-			ent = hash_lookup(xattr_hash, &hkey);
-			assert(ent != NULL);
-			if (ent->shared && n_shared < EROFS_XATTR_LONG_PREFIX) {
-				xattr->erofs_shared_xattr_offset = ent->shared_offset;
-				n_shared++;
-			} else {
-				xattr->erofs_shared_xattr_offset = -1;
-			}
+	for (size_t i = 0; i < node->n_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[i];
+		struct erofs_xattr_ent_s *ent;
+
+		ent = erofs_xattr_table_lookup(table, xattr, false);
+		if (ent != NULL && ent->shared && n_shared < EROFS_XATTR_LONG_PREFIX) {
+			xattr->erofs_shared_xattr_offset = ent->shared_offset;
+			n_shared++;
+		} else {
+			xattr->erofs_shared_xattr_offset = -1;
 		}
 	}
+}
 
-	free(sorted);
-	hash_free(xattr_hash);
-	return 0;
+/* Sorts the final xattrs of node, and counts the uses of each
+ * key/value in the table */
+static int count_erofs_xattrs(struct lcfs_ctx_s *ctx,
+			      struct erofs_xattr_table_s *table,
+			      struct lcfs_node_s *node)
+{
+	lcfs_node_sort_xattrs(node);
 
-fail:
-	errno = ENOMEM;
-	free(sorted);
-	hash_free(xattr_hash);
-	return -1;
+	for (size_t i = 0; i < node->n_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[i];
+		struct erofs_xattr_ent_s *ent;
+
+		xattr->erofs_hash = xattr_hash64(xattr);
+		ent = erofs_xattr_table_lookup(table, xattr, true);
+		if (ent == NULL)
+			return -1;
+		ent->count++;
+
+		/* Compute has_acl */
+		if (strcmp(xattr->key, "system.posix_acl_access") == 0 ||
+		    strcmp(xattr->key, "system.posix_acl_default") == 0)
+			ctx->has_acl = true;
+	}
+
+	return 0;
 }
 
 static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
 				       struct lcfs_node_s *node)
 {
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t size;
 
-	if (node->inode.st_mtim_sec != ctx->min_mtim_sec ||
-	    node->inode.st_mtim_nsec != ctx->min_mtim_nsec) {
+	if (node->inode.st_mtim_sec != ctx->build_mtim_sec ||
+	    node->inode.st_mtim_nsec != ctx->build_mtim_nsec) {
 		return false;
 	}
 
@@ -443,8 +706,7 @@ static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
 	}
 
 	if (type == S_IFDIR) {
-		size = (uint64_t)node->erofs_n_blocks * EROFS_BLKSIZ +
-		       node->erofs_tailsize;
+		size = node->erofs_n_blocks * ctx_erofs->blksz + node->erofs_tailsize;
 	} else {
 		size = node->inode.st_size;
 	}
@@ -455,7 +717,8 @@ static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
 	return true;
 }
 
-static void compute_erofs_dir_size(struct lcfs_node_s *node)
+static void compute_erofs_dir_size(struct lcfs_ctx_erofs_s *ctx_erofs,
+				   struct lcfs_node_s *node)
 {
 	uint32_t n_blocks = 0;
 	size_t block_size = 0;
@@ -463,7 +726,7 @@ static void compute_erofs_dir_size(struct lcfs_node_s *node)
 	for (size_t i = 0; i < node->children_size; i++) {
 		struct lcfs_node_s *child = node->children[i];
 		size_t len = sizeof(struct erofs_dirent) + strlen(child->name);
-		if (block_size + len > EROFS_BLKSIZ) {
+		if (block_size + len > ctx_erofs->blksz) {
 			n_blocks++;
 			block_size = 0;
 		}
@@ -471,7 +734,7 @@ static void compute_erofs_dir_size(struct lcfs_node_s *node)
 	}
 
 	/* As a heuristic, we never inline more than half a block */
-	if (block_size > EROFS_BLKSIZ / 2) {
+	if (block_size > ctx_erofs->blksz / 2) {
 		n_blocks++;
 		block_size = 0;
 	}
@@ -480,7 +743,8 @@ static void compute_erofs_dir_size(struct lcfs_node_s *node)
 	node->erofs_tailsize = block_size;
 }
 
-static uint32_t compute_erofs_chunk_bitsize(struct lcfs_node_s *node)
+static uint32_t compute_erofs_chunk_bitsize(struct lcfs_ctx_erofs_s *ctx_erofs,
+					    struct lcfs_node_s *node)
 {
 	uint64_t file_size = node->inode.st_size;
 
@@ -490,36 +754,38 @@ static uint32_t compute_erofs_chunk_bitsize(struct lcfs_node_s *node)
 	uint32_t chunkbits = ilog2(file_size - 1) + 1;
 
 	// At least one logical block
-	if (chunkbits < EROFS_BLKSIZ_BITS)
-		chunkbits = EROFS_BLKSIZ_BITS;
+	if (chunkbits < ctx_erofs->blkszbits)
+		chunkbits = ctx_erofs->blkszbits;
 
 	// Not larger chunks than max possible
-	if (chunkbits - EROFS_BLKSIZ_BITS > EROFS_CHUNK_FORMAT_BLKBITS_MASK)
-		chunkbits = EROFS_CHUNK_FORMAT_BLKBITS_MASK + EROFS_BLKSIZ_BITS;
+	if (chunkbits - ctx_erofs->blkszbits > EROFS_CHUNK_FORMAT_BLKBITS_MASK)
+		chunkbits = EROFS_CHUNK_FORMAT_BLKBITS_MASK + ctx_erofs->blkszbits;
 
 	return chunkbits;
 }
 
-static void compute_erofs_inode_size(struct lcfs_node_s *node)
+static void compute_erofs_inode_size(struct lcfs_ctx_erofs_s *ctx_erofs,
+				     struct lcfs_node_s *node)
 {
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t file_size = node->inode.st_size;
 
 	if (type == S_IFDIR) {
-		compute_erofs_dir_size(node);
+		compute_erofs_dir_size(ctx_erofs, node);
 	} else if (type == S_IFLNK) {
 		node->erofs_n_blocks = 0;
 		node->erofs_tailsize = strlen(node->payload);
 	} else if (type == S_IFREG && file_size > 0) {
 		if (node->content != NULL) {
-			node->erofs_n_blocks = file_size / EROFS_BLKSIZ;
-			node->erofs_tailsize = file_size % EROFS_BLKSIZ;
-			if (node->erofs_tailsize > EROFS_BLKSIZ / 2) {
+			node->erofs_n_blocks = file_size >> ctx_erofs->blkszbits;
+			node->erofs_tailsize = file_size & (ctx_erofs->blksz - 1);
+			if (node->erofs_tailsize > ctx_erofs->blksz / 2) {
 				node->erofs_n_blocks++;
 				node->erofs_tailsize = 0;
 			}
 		} else {
-			uint32_t chunkbits = compute_erofs_chunk_bitsize(node);
+			uint32_t chunkbits =
+				compute_erofs_chunk_bitsize(ctx_erofs, node);
 			uint64_t chunksize = 1ULL << chunkbits;
 			uint32_t chunk_count = DIV_ROUND_UP(file_size, chunksize);
 
@@ -532,7 +798,8 @@ static void compute_erofs_inode_size(struct lcfs_node_s *node)
 	}
 }
 
-static void compute_erofs_xattr_counts(struct lcfs_node_s *node,
+static void compute_erofs_xattr_counts(struct lcfs_ctx_s *ctx,
+				       struct lcfs_node_s *node,
 				       size_t *n_shared_xattrs_out,
 				       size_t *unshared_xattrs_size_out)
 {
@@ -544,7 +811,7 @@ static void compute_erofs_xattr_counts(struct lcfs_node_s *node,
 		if (xattr->erofs_shared_xattr_offset >= 0) {
 			n_shared_xattrs++;
 		} else {
-			unshared_xattrs_size += xattr_erofs_entry_size(xattr);
+			unshared_xattrs_size += xattr_erofs_entry_size(ctx, xattr);
 		}
 	}
 
@@ -572,10 +839,12 @@ static uint32_t compute_erofs_xattr_filter(struct lcfs_node_s *node)
 	return EROFS_XATTR_FILTER_DEFAULT & ~name_filter;
 }
 
-static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
+static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_ctx_erofs_s *ctx_erofs,
+						     struct lcfs_node_s *node,
 						     uint64_t pos, size_t inode_size,
 						     size_t xattr_size)
 {
+	uint64_t blksz = ctx_erofs->blksz;
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t block_remainder;
 	size_t non_tail_size = inode_size + xattr_size;
@@ -591,20 +860,19 @@ static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
 		 * data in the same block, wheras normally just the
 		 * tail data itself need to be inside a block.
 		 */
-		if (pos / EROFS_BLKSIZ != (pos + total_size - 1) / EROFS_BLKSIZ) {
-			return round_up(pos, EROFS_BLKSIZ) - pos;
+		if (pos / blksz != (pos + total_size - 1) / blksz) {
+			return round_up(pos, blksz) - pos;
 		}
 		return 0;
 	}
 
-	block_remainder = EROFS_BLKSIZ - ((pos + non_tail_size) % EROFS_BLKSIZ);
+	block_remainder = blksz - ((pos + non_tail_size) % blksz);
 	if (block_remainder < node->erofs_tailsize) {
 		/* Add (aligned) padding so that tail starts in new block */
 		uint64_t extra_pad = round_up(block_remainder, EROFS_SLOTSIZE);
 
 		/* Due to the extra_pad round up it is possible the tail does not fit anyway */
-		block_remainder = EROFS_BLKSIZ -
-				  ((pos + non_tail_size + extra_pad) % EROFS_BLKSIZ);
+		block_remainder = blksz - ((pos + non_tail_size + extra_pad) % blksz);
 		if (node->erofs_tailsize <= block_remainder) {
 			/* It fit! */
 			return extra_pad;
@@ -617,59 +885,156 @@ static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
 	return 0;
 }
 
-static int compute_erofs_inodes(struct lcfs_ctx_s *ctx)
+/* The part of the file content that is stored in data blocks, the
+ * rest (if any) is inlined as a tail after the inode. */
+static size_t erofs_node_block_data_size(const struct lcfs_node_s *node)
+{
+	return node->inode.st_size - node->erofs_tailsize;
+}
+
+static size_t data_block_ht_hasher(const void *d, size_t n)
+{
+	const struct lcfs_node_s *node = d;
+
+	return xxh32(node->content, erofs_node_block_data_size(node), 0) % n;
+}
+
+static bool data_block_ht_comparator(const void *d1, const void *d2)
+{
+	const struct lcfs_node_s *node1 = d1;
+	const struct lcfs_node_s *node2 = d2;
+	size_t size = erofs_node_block_data_size(node1);
+
+	return node1->erofs_n_blocks == node2->erofs_n_blocks &&
+	       size == erofs_node_block_data_size(node2) &&
+	       memcmp(node1->content, node2->content, size) == 0;
+}
+
+/* With LCFS_FLAGS_DEDUP_DATA_BLOCKS, point the node at the data
+ * blocks of an earlier node with identical block content, if any. */
+static int dedup_erofs_data_blocks(Hash_table *ht, struct lcfs_node_s *node)
+{
+	const void *matched;
+	int ret;
+
+	if ((node->inode.st_mode & S_IFMT) != S_IFREG ||
+	    node->erofs_n_blocks == 0)
+		return 0;
+
+	ret = hash_insert_if_absent(ht, node, &matched);
+	if (ret < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (ret == 0) {
+		node->erofs_data_shared = true;
+		node->erofs_data_block =
+			((const struct lcfs_node_s *)matched)->erofs_data_block;
+	}
+
+	return 0;
+}
+
+/* Computes the size and position of the node inode, which starts at
+ * or after *pos, and advances *pos past it */
+static int compute_erofs_inode(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node,
+			       uint64_t *pos_inout, Hash_table *data_ht)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
-	struct lcfs_node_s *node;
-	uint64_t pos, ppos;
-	uint64_t meta_start, extra_pad;
+	uint64_t pos = *pos_inout;
+	uint64_t ppos, extra_pad;
+	size_t n_shared_xattrs, unshared_xattrs_size;
+	size_t inode_size, xattr_size;
 
-	// Start inode data directly after superblock
-	pos = EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block);
+	compute_erofs_inode_size(ctx_erofs, node);
+	node->erofs_compact = lcfs_fits_in_erofs_compact(ctx, node);
+	inode_size = node->erofs_compact ? sizeof(struct erofs_inode_compact) :
+					   sizeof(struct erofs_inode_extended);
 
-	// But inode offsets (nids) are relative to start of block
-	meta_start = round_down(pos, EROFS_BLKSIZ);
+	compute_erofs_xattr_counts(ctx, node, &n_shared_xattrs, &unshared_xattrs_size);
+	xattr_size = xattr_erofs_inode_size(n_shared_xattrs, unshared_xattrs_size);
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		size_t n_shared_xattrs, unshared_xattrs_size;
-		size_t inode_size, xattr_size;
-
-		compute_erofs_inode_size(node);
-		node->erofs_compact = lcfs_fits_in_erofs_compact(ctx, node);
-		inode_size = node->erofs_compact ?
-				     sizeof(struct erofs_inode_compact) :
-				     sizeof(struct erofs_inode_extended);
-
-		compute_erofs_xattr_counts(node, &n_shared_xattrs,
-					   &unshared_xattrs_size);
-		xattr_size = xattr_erofs_inode_size(n_shared_xattrs,
-						    unshared_xattrs_size);
-
-		/* Align inode start to next slot */
-		ppos = pos;
-		pos = round_up(pos, EROFS_SLOTSIZE);
-		node->erofs_ipad = pos - ppos;
-
-		/* Ensure tail does not straddle block boundaries */
-		extra_pad = compute_erofs_inode_padding_for_tail(
-			node, pos, inode_size, xattr_size);
-		node->erofs_ipad += extra_pad;
-		pos += extra_pad;
-
-		node->erofs_isize = inode_size + xattr_size + node->erofs_tailsize;
+	/* Align inode start to next slot */
+	ppos = pos;
+	pos = round_up(pos, EROFS_SLOTSIZE);
+	node->erofs_ipad = pos - ppos;
+
+	/* Ensure tail does not straddle block boundaries */
+	extra_pad = compute_erofs_inode_padding_for_tail(ctx_erofs, node, pos,
+							 inode_size, xattr_size);
+	node->erofs_ipad += extra_pad;
+	pos += extra_pad;
+
+	node->erofs_isize = inode_size + xattr_size + node->erofs_tailsize;
+
+	node->erofs_data_block = ctx_erofs->n_data_blocks;
+	node->erofs_data_shared = false;
+	if (data_ht != NULL && dedup_erofs_data_blocks(data_ht, node) < 0)
+		return -1;
+	if (!node->erofs_data_shared)
 		ctx_erofs->n_data_blocks += node->erofs_n_blocks;
-		node->erofs_nid = (pos - meta_start) / EROFS_SLOTSIZE;
+	node->erofs_nid = (pos - ctx_erofs->meta_start) / EROFS_SLOTSIZE;
+
+	/* Assert that tails never span multiple blocks */
+	assert(node->erofs_tailsize == 0 ||
+	       ((pos + inode_size + xattr_size) / ctx_erofs->blksz) ==
+		       ((pos + node->erofs_isize - 1) / ctx_erofs->blksz));
+
+	*pos_inout = pos + node->erofs_isize;
+
+	return 0;
+}
+
+/* Start inode data directly after superblock, returns the position */
+static uint64_t start_erofs_inodes(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	uint64_t pos = EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block);
+
+	// But inode offsets (nids) are relative to start of block
+	ctx_erofs->meta_start = round_down(pos, ctx_erofs->blksz);
+	ctx_erofs->n_data_blocks = 0;
+
+	return pos;
+}
+
+/* Lays out the inodes, and sets the shared xattr offsets */
+static int compute_erofs_inodes(struct lcfs_ctx_s *ctx,
+				struct erofs_xattr_table_s *table)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct lcfs_node_s *node;
+	uint64_t pos;
+	Hash_table *data_ht = NULL;
+
+	if (ctx->options->flags & LCFS_FLAGS_DEDUP_DATA_BLOCKS) {
+		data_ht = hash_initialize(0, NULL, data_block_ht_hasher,
+					  data_block_ht_comparator, NULL);
+		if (data_ht == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
 
-		/* Assert that tails never span multiple blocks */
-		assert(node->erofs_tailsize == 0 ||
-		       ((pos + inode_size + xattr_size) / EROFS_BLKSIZ) ==
-			       ((pos + node->erofs_isize - 1) / EROFS_BLKSIZ));
+	pos = start_erofs_inodes(ctx);
 
-		pos += node->erofs_isize;
+	for (node = ctx->root; node != NULL; node = node->next) {
+		set_erofs_shared_xattr_offsets(table, node);
+
+		if (lcfs_node_check_links(node) < 0 ||
+		    compute_erofs_inode(ctx, node, &pos, data_ht) < 0) {
+			if (data_ht != NULL)
+				hash_free(data_ht);
+			return -1;
+		}
 	}
 
 	ctx_erofs->inodes_end = round_up(pos, EROFS_SLOTSIZE);
 
+	if (data_ht != NULL)
+		hash_free(data_ht);
+
 	return 0;
 }
 
@@ -678,7 +1043,7 @@ static int write_erofs_xattr(struct lcfs_ctx_s *ctx, struct lcfs_xattr_s *xattr)
 	struct erofs_xattr_entry e = { 0 };
 	int ret;
 	char *key_suffix;
-	uint8_t index = xattr_erofs_entry_index(xattr, &key_suffix);
+	uint8_t index = xattr_erofs_entry_name_index(ctx, xattr, &key_suffix);
 
 	e.e_name_len = strlen(key_suffix);
 	e.e_name_index = index;
@@ -692,9 +1057,15 @@ static int write_erofs_xattr(struct lcfs_ctx_s *ctx, struct lcfs_xattr_s *xattr)
 	if (ret < 0)
 		return ret;
 
-	ret = lcfs_write(ctx, xattr->value, xattr->value_len);
-	if (ret < 0)
-		return ret;
+	for (size_t offset = 0; offset < xattr->value_len;) {
+		const uint8_t *value;
+		size_t n = xattr_value_span(xattr, offset, &value);
+
+		ret = lcfs_write(ctx, (void *)value, n);
+		if (ret < 0)
+			return ret;
+		offset += n;
+	}
 
 	return lcfs_write_align(ctx, sizeof(uint32_t));
 }
@@ -737,6 +1108,7 @@ static int write_erofs_dentries_chunk(struct lcfs_ctx_s *ctx,
 static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node,
 				bool write_blocks, bool write_tail)
 {
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 	size_t block_size = 0;
 	size_t block_written = 0;
 	size_t first = 0;
@@ -745,10 +1117,10 @@ static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 	for (size_t i = 0; i < node->children_size; i++) {
 		struct lcfs_node_s *child = node->children[i];
 		size_t len = sizeof(struct erofs_dirent) + strlen(child->name);
-		if (block_size + len > EROFS_BLKSIZ) {
+		if (block_size + len > ctx_erofs->blksz) {
 			if (write_blocks) {
 				ret = write_erofs_dentries_chunk(
-					ctx, node, first, i - first, EROFS_BLKSIZ);
+					ctx, node, first, i - first, ctx_erofs->blksz);
 				if (ret < 0)
 					return ret;
 			}
@@ -766,7 +1138,7 @@ static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 		if (write_blocks) {
 			ret = write_erofs_dentries_chunk(ctx, node, first,
 							 node->children_size - first,
-							 EROFS_BLKSIZ);
+							 ctx_erofs->blksz);
 			if (ret < 0)
 				return ret;
 		}
@@ -786,6 +1158,22 @@ static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 	return 0;
 }
 
+/* Returns the block address of the node data blocks and allocates
+ * them in the data area, unless they are shared with an earlier node. */
+static uint32_t erofs_node_blkaddr(struct lcfs_ctx_erofs_s *ctx_erofs,
+				   struct lcfs_node_s *node)
+{
+	if (!node->erofs_data_shared) {
+		assert(ctx_erofs->current_end ==
+		       ctx_erofs->data_block_start +
+			       node->erofs_data_block * ctx_erofs->blksz);
+		ctx_erofs->current_end += node->erofs_n_blocks * ctx_erofs->blksz;
+	}
+
+	return (uint32_t)((ctx_erofs->data_block_start >> ctx_erofs->blkszbits) +
+			  node->erofs_data_block);
+}
+
 static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
@@ -812,7 +1200,8 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 
 	/* compute xattr details */
 
-	compute_erofs_xattr_counts(node, &n_shared_xattrs, &unshared_xattrs_size);
+	compute_erofs_xattr_counts(ctx, node, &n_shared_xattrs,
+				   &unshared_xattrs_size);
 	xattr_size = xattr_erofs_inode_size(n_shared_xattrs, unshared_xattrs_size);
 	xattr_icount = xattr_erofs_icount(xattr_size);
 	if (xattr_icount > UINT16_MAX) {
@@ -825,18 +1214,18 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 						  EROFS_INODE_FLAT_PLAIN;
 
 	if (type == S_IFDIR || type == S_IFLNK) {
-		size = (uint64_t)node->erofs_n_blocks * EROFS_BLKSIZ +
-		       node->erofs_tailsize;
+		size = node->erofs_n_blocks * ctx_erofs->blksz + node->erofs_tailsize;
 	} else if (type == S_IFREG) {
 		size = node->inode.st_size;
 
 		if (size > 0 && node->content == NULL) {
-			uint32_t chunkbits = compute_erofs_chunk_bitsize(node);
+			uint32_t chunkbits =
+				compute_erofs_chunk_bitsize(ctx_erofs, node);
 			uint64_t chunksize = 1ULL << chunkbits;
 
 			datalayout = EROFS_INODE_CHUNK_BASED;
 			chunk_count = DIV_ROUND_UP(size, chunksize);
-			chunk_format = chunkbits - EROFS_BLKSIZ_BITS;
+			chunk_format = chunkbits - ctx_erofs->blkszbits;
 		}
 	} else {
 		size = 0;
@@ -858,20 +1247,14 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		if (type == S_IFDIR) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
@@ -897,20 +1280,14 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		if (type == S_IFDIR) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
@@ -938,7 +1315,7 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 			struct lcfs_xattr_s *xattr = &node->xattrs[i];
 			if (xattr->erofs_shared_xattr_offset >= 0) {
 				uint64_t offset =
-					ctx_erofs->inodes_end % EROFS_BLKSIZ +
+					ctx_erofs->inodes_end % ctx_erofs->blksz +
 					xattr->erofs_shared_xattr_offset;
 				uint32_t v = lcfs_u32_to_file(
 					(uint32_t)(offset / sizeof(uint32_t)));
@@ -996,13 +1373,34 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 
 static int write_erofs_inodes(struct lcfs_ctx_s *ctx)
 {
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 	struct lcfs_node_s *node;
 	int ret;
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		ret = write_erofs_inode_data(ctx, node);
-		if (ret < 0)
-			return ret;
+	if (ctx_erofs->jobs) {
+		for (size_t i = 0; i < ctx_erofs->n_jobs; i++) {
+			struct lcfs_erofs_job_s *job = &ctx_erofs->jobs[i];
+
+			if (job->started) {
+				pthread_join(job->thread, NULL);
+				job->started = false;
+			}
+			if (job->err != 0) {
+				errno = job->err;
+				return -1;
+			}
+
+			assert(job->inodes_start == ctx->bytes_written);
+			ret = lcfs_write(ctx, job->inodes.data, job->inodes.len);
+			if (ret < 0)
+				return ret;
+		}
+	} else {
+		for (node = ctx->root; node != NULL; node = node->next) {
+			ret = write_erofs_inode_data(ctx, node);
+			if (ret < 0)
+				return ret;
+		}
 	}
 
 	ret = lcfs_write_align(ctx, EROFS_SLOTSIZE);
@@ -1015,17 +1413,19 @@ static int write_erofs_inodes(struct lcfs_ctx_s *ctx)
 /* Writes the non-tailpacked file data, if any */
 static int write_erofs_file_content(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 	int type = node->inode.st_mode & S_IFMT;
 	off_t size = node->inode.st_size;
+	off_t blksz = ctx_erofs->blksz;
 
-	if (type != S_IFREG || node->erofs_n_blocks == 0)
+	if (type != S_IFREG || node->erofs_n_blocks == 0 || node->erofs_data_shared)
 		return 0;
 
 	assert(node->content != NULL);
 
 	for (size_t i = 0; i < node->erofs_n_blocks; i++) {
-		off_t offset = i * EROFS_BLKSIZ;
-		off_t len = min(size - offset, EROFS_BLKSIZ);
+		off_t offset = i * blksz;
+		off_t len = min(size - offset, blksz);
 		int ret;
 
 		ret = lcfs_write(ctx, node->content + offset, len);
@@ -1033,34 +1433,43 @@ static int write_erofs_file_content(struct lcfs_ctx_s *ctx, struct lcfs_node_s *
 			return ret;
 	}
 
-	return lcfs_write_align(ctx, EROFS_BLKSIZ);
+	return lcfs_write_align(ctx, blksz);
 }
 
-static int write_erofs_data_blocks(struct lcfs_ctx_s *ctx)
+static int write_erofs_node_data_blocks(struct lcfs_ctx_s *ctx,
+					struct lcfs_node_s *node)
 {
-	struct lcfs_node_s *node;
 	int ret;
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		ret = write_erofs_dentries(ctx, node, true, false);
-		if (ret < 0)
-			return ret;
-		ret = write_erofs_file_content(ctx, node);
-		if (ret < 0)
-			return ret;
-	}
+	ret = write_erofs_dentries(ctx, node, true, false);
+	if (ret < 0)
+		return ret;
 
-	return 0;
+	return write_erofs_file_content(ctx, node);
 }
 
-static int write_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
+static int write_erofs_data_blocks(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct lcfs_node_s *node;
 	int ret;
 
-	for (size_t i = 0; i < ctx_erofs->n_shared_xattrs; i++) {
-		struct lcfs_xattr_s *xattr = ctx_erofs->shared_xattrs[i];
-		ret = write_erofs_xattr(ctx, xattr);
+	if (ctx_erofs->jobs) {
+		for (size_t i = 0; i < ctx_erofs->n_jobs; i++) {
+			struct lcfs_erofs_job_s *job = &ctx_erofs->jobs[i];
+
+			assert(job->data_start == ctx->bytes_written);
+			ret = lcfs_write(ctx, job->data.data, job->data.len);
+			if (ret < 0)
+				return ret;
+			ctx_erofs->current_end = job->ctx.current_end;
+		}
+
+		return 0;
+	}
+
+	for (node = ctx->root; node != NULL; node = node->next) {
+		ret = write_erofs_node_data_blocks(ctx, node);
 		if (ret < 0)
 			return ret;
 	}
@@ -1068,10 +1477,259 @@ static int write_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 	return 0;
 }
 
-static int add_overlayfs_xattrs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
+static ssize_t erofs_buf_write_cb(void *file, void *buf, size_t count)
 {
-	int type = node->inode.st_mode & S_IFMT;
-	int ret;
+	struct lcfs_erofs_buf_s *b = file;
+
+	/* The buffers are allocated with the exact final size */
+	if (count > b->size - b->len)
+		return -1;
+
+	memcpy(b->data + b->len, buf, count);
+	b->len += count;
+
+	return count;
+}
+
+static int erofs_buf_init(struct lcfs_erofs_buf_s *b, size_t size)
+{
+	if (size > 0) {
+		b->data = malloc(size);
+		if (b->data == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	b->size = size;
+
+	return 0;
+}
+
+static void *write_erofs_job(void *data)
+{
+	struct lcfs_erofs_job_s *job = data;
+	struct lcfs_ctx_s *ctx = &job->ctx.base;
+	struct lcfs_node_s *node;
+
+	ctx->file = &job->inodes;
+	ctx->bytes_written = job->inodes_start;
+	for (node = job->first; node != job->end; node = node->next) {
+		if (write_erofs_inode_data(ctx, node) < 0)
+			goto fail;
+	}
+
+	ctx->file = &job->data;
+	ctx->bytes_written = job->data_start;
+	for (node = job->first; node != job->end; node = node->next) {
+		if (write_erofs_node_data_blocks(ctx, node) < 0)
+			goto fail;
+	}
+
+	assert(job->inodes.len == job->inodes.size);
+	assert(job->data.len == job->data.size);
+
+	return NULL;
+
+fail:
+	job->err = errno;
+	return NULL;
+}
+
+static uint64_t erofs_node_start(struct lcfs_ctx_erofs_s *ctx_erofs,
+				 struct lcfs_node_s *node)
+{
+	return ctx_erofs->meta_start + node->erofs_nid * EROFS_SLOTSIZE -
+	       node->erofs_ipad;
+}
+
+/* Splits the node list in ranges of similar output size and starts a
+ * thread for each that renders the range into memory. Since all
+ * inode and data block offsets are already known, each range can
+ * be serialized independently of the others. */
+static int start_erofs_jobs(struct lcfs_ctx_s *ctx, uint64_t data_block_start)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	size_t n_jobs = ctx->options->threads;
+	uint64_t total_size = 0;
+	uint64_t job_size, data_pos;
+	struct lcfs_node_s *node, *last = NULL;
+
+	if (n_jobs > LCFS_MAX_THREADS)
+		n_jobs = LCFS_MAX_THREADS;
+	if (n_jobs > ctx->num_inodes)
+		n_jobs = ctx->num_inodes;
+	if (n_jobs <= 1)
+		return 0;
+
+	for (node = ctx->root; node != NULL; node = node->next)
+		total_size += node->erofs_ipad + node->erofs_isize +
+			      node->erofs_n_blocks * ctx_erofs->blksz;
+	job_size = DIV_ROUND_UP(total_size, n_jobs);
+
+	ctx_erofs->jobs = calloc(n_jobs, sizeof(struct lcfs_erofs_job_s));
+	if (ctx_erofs->jobs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	node = ctx->root;
+	data_pos = data_block_start;
+	for (size_t i = 0; i < n_jobs && node != NULL; i++) {
+		struct lcfs_erofs_job_s *job = &ctx_erofs->jobs[i];
+		uint64_t size = 0;
+		uint64_t inodes_end;
+
+		ctx_erofs->n_jobs++;
+
+		job->first = node;
+		job->inodes_start = erofs_node_start(ctx_erofs, node);
+		job->data_start = data_pos;
+
+		while (node != NULL && (size < job_size || i == n_jobs - 1)) {
+			uint64_t data_size = node->erofs_data_shared ?
+						     0 :
+						     node->erofs_n_blocks *
+							     ctx_erofs->blksz;
+
+			size += node->erofs_ipad + node->erofs_isize + data_size;
+			data_pos += data_size;
+			last = node;
+			node = node->next;
+		}
+		job->end = node;
+
+		if (node != NULL)
+			inodes_end = erofs_node_start(ctx_erofs, node);
+		else
+			inodes_end = ctx_erofs->meta_start +
+				     last->erofs_nid * EROFS_SLOTSIZE +
+				     last->erofs_isize;
+
+		if (erofs_buf_init(&job->inodes, inodes_end - job->inodes_start) < 0 ||
+		    erofs_buf_init(&job->data, data_pos - job->data_start) < 0)
+			return -1;
+
+		job->ctx = *ctx_erofs;
+		job->ctx.base.fsverity_ctx = NULL;
+		job->ctx.base.fd = -1;
+		job->ctx.base.fd_buf = NULL;
+		job->ctx.base.write_cb = erofs_buf_write_cb;
+		job->ctx.current_end = job->data_start;
+		job->ctx.jobs = NULL;
+		job->ctx.n_jobs = 0;
+	}
+
+	for (size_t i = 0; i < ctx_erofs->n_jobs; i++) {
+		struct lcfs_erofs_job_s *job = &ctx_erofs->jobs[i];
+
+		if (pthread_create(&job->thread, NULL, write_erofs_job, job) == 0)
+			job->started = true;
+		else
+			write_erofs_job(job); /* Fall back to doing it here */
+	}
+
+	return 0;
+}
+
+static int write_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	int ret;
+
+	for (size_t i = 0; i < ctx_erofs->n_shared_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = ctx_erofs->shared_xattrs[i];
+		ret = write_erofs_xattr(ctx, xattr);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static size_t erofs_xattr_prefix_size(size_t i)
+{
+	return round_up(sizeof(uint16_t) + sizeof(struct erofs_xattr_long_prefix) +
+				strlen(erofs_long_xattr_prefixes[i].infix),
+			sizeof(uint32_t));
+}
+
+static void compute_erofs_xattr_prefixes(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+
+	ctx_erofs->xattr_prefix_size = 0;
+	if (!erofs_use_long_xattr_prefixes(ctx))
+		return;
+
+	for (size_t i = 0; i < EROFS_N_LONG_XATTR_PREFIXES; i++)
+		ctx_erofs->xattr_prefix_size += erofs_xattr_prefix_size(i);
+}
+
+static int write_erofs_xattr_prefixes(struct lcfs_ctx_s *ctx)
+{
+	int ret;
+
+	if (!erofs_use_long_xattr_prefixes(ctx))
+		return 0;
+
+	for (size_t i = 0; i < EROFS_N_LONG_XATTR_PREFIXES; i++) {
+		const char *infix = erofs_long_xattr_prefixes[i].infix;
+		struct erofs_xattr_long_prefix p = {
+			.base_index = erofs_long_xattr_prefixes[i].base_index,
+		};
+		uint16_t len = lcfs_u16_to_file((uint16_t)(sizeof(p) + strlen(infix)));
+
+		ret = lcfs_write(ctx, &len, sizeof(len));
+		if (ret < 0)
+			return ret;
+
+		ret = lcfs_write(ctx, &p, sizeof(p));
+		if (ret < 0)
+			return ret;
+
+		ret = lcfs_write(ctx, (char *)infix, strlen(infix));
+		if (ret < 0)
+			return ret;
+
+		ret = lcfs_write_align(ctx, sizeof(uint32_t));
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Mark dir containing whiteouts */
+static int mark_erofs_whiteouts_dir(struct lcfs_ctx_s *ctx, struct lcfs_node_s *dir)
+{
+	int ret;
+
+	ret = lcfs_node_set_xattr(dir, OVERLAY_XATTR_ESCAPED_WHITEOUTS, "", 0);
+	if (ret < 0)
+		return ret;
+	ret = lcfs_node_set_xattr(dir, OVERLAY_XATTR_USERXATTR_WHITEOUTS, "", 0);
+	if (ret < 0)
+		return ret;
+
+	/* Mark dir containing whiteouts with new format as of version 1 */
+	if (ctx->options->version >= 1) {
+		ret = lcfs_node_set_xattr(dir, OVERLAY_XATTR_ESCAPED_OPAQUE, "x", 1);
+		if (ret < 0)
+			return ret;
+		ret = lcfs_node_set_xattr(dir, OVERLAY_XATTR_USERXATTR_OPAQUE, "x", 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* The parent of a whiteout is marked too, unless the node has no
+ * parent, as when streaming where the parent is marked separately */
+static int add_overlayfs_xattrs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
+{
+	int type = node->inode.st_mode & S_IFMT;
+	int ret;
 
 	/* First escape all existing "trusted.overlay.*" xattrs */
 	for (size_t i = 0; i < lcfs_node_get_n_xattr(node); i++) {
@@ -1093,33 +1751,31 @@ static int add_overlayfs_xattrs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 		}
 	}
 
+	/* The metacopy and redirect xattrs are not copied, their values
+	 * refer to the digest and payload of the node */
 	if (type == S_IFREG && node->inode.st_size > 0 && node->content == NULL) {
-		uint8_t xattr_data[4 + LCFS_DIGEST_SIZE];
-		size_t xattr_len = 0;
+		uint8_t header[4];
+		size_t header_len = 0;
 
 		if (node->digest_set) {
-			xattr_len = sizeof(xattr_data);
-			xattr_data[0] = 0; /* version */
-			xattr_data[1] = xattr_len;
-			xattr_data[2] = 0; /* flags */
-			xattr_data[3] = FS_VERITY_HASH_ALG_SHA256;
-			memcpy(xattr_data + 4, node->digest, LCFS_DIGEST_SIZE);
+			header_len = sizeof(header);
+			header[0] = 0; /* version */
+			header[1] = sizeof(header) + LCFS_DIGEST_SIZE;
+			header[2] = 0; /* flags */
+			header[3] = FS_VERITY_HASH_ALG_SHA256;
 		}
 
-		ret = lcfs_node_set_xattr(node, OVERLAY_XATTR_METACOPY,
-					  (const char *)xattr_data, xattr_len);
+		ret = lcfs_node_add_virtual_xattr(
+			node, OVERLAY_XATTR_METACOPY, header, header_len,
+			(const char *)node->digest, header_len ? LCFS_DIGEST_SIZE : 0);
 		if (ret < 0)
 			return ret;
 
-		if (node->payload && strlen(node->payload) > 0) {
-			char *path = maybe_join_path("/", node->payload);
-			if (path == NULL) {
-				errno = ENOMEM;
-				return -1;
-			}
-			ret = lcfs_node_set_xattr(node, OVERLAY_XATTR_REDIRECT,
-						  path, strlen(path));
-			free(path);
+		if (node->payload && node->payload[0] != 0) {
+			ret = lcfs_node_add_virtual_xattr(node, OVERLAY_XATTR_REDIRECT,
+							  (const uint8_t *)"/", 1,
+							  node->payload,
+							  strlen(node->payload));
 			if (ret < 0)
 				return ret;
 		}
@@ -1140,24 +1796,8 @@ static int add_overlayfs_xattrs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 		if (ret < 0)
 			return ret;
 
-		/* Mark parent dir containing whiteouts */
-		ret = lcfs_node_set_xattr(parent,
-					  OVERLAY_XATTR_ESCAPED_WHITEOUTS, "", 0);
-		if (ret < 0)
-			return ret;
-		ret = lcfs_node_set_xattr(parent, OVERLAY_XATTR_USERXATTR_WHITEOUTS,
-					  "", 0);
-		if (ret < 0)
-			return ret;
-
-		/* Mark dir containing whiteouts with new format as of version 1 */
-		if (ctx->options->version >= 1) {
-			ret = lcfs_node_set_xattr(
-				parent, OVERLAY_XATTR_ESCAPED_OPAQUE, "x", 1);
-			if (ret < 0)
-				return ret;
-			ret = lcfs_node_set_xattr(
-				parent, OVERLAY_XATTR_USERXATTR_OPAQUE, "x", 1);
+		if (parent != NULL) {
+			ret = mark_erofs_whiteouts_dir(ctx, parent);
 			if (ret < 0)
 				return ret;
 		}
@@ -1166,72 +1806,114 @@ static int add_overlayfs_xattrs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 	return 0;
 }
 
-static int add_overlay_whiteouts(struct lcfs_node_s *root)
+/* Name of the i:th of the 256 whiteouts in the root directory */
+static void overlay_whiteout_name(int i, char name[3])
 {
 	static const char hexchars[] = "0123456789abcdef";
+
+	name[0] = hexchars[(i >> 4) % 16];
+	name[1] = hexchars[i % 16];
+	name[2] = 0;
+}
+
+static struct lcfs_node_s *new_overlay_whiteout(struct lcfs_node_s *root)
+{
+	cleanup_node struct lcfs_node_s *child = NULL;
 	const char *selinux;
 	size_t selinux_len;
-	int res;
 
+	child = lcfs_node_new();
+	if (child == NULL) {
+		return NULL;
+	}
+
+	lcfs_node_set_mode(child, S_IFCHR | 0644);
+	lcfs_node_set_rdev(child, 0);
+
+	child->inode.st_uid = root->inode.st_uid;
+	child->inode.st_gid = root->inode.st_gid;
+	child->inode.st_mtim_sec = root->inode.st_mtim_sec;
+	child->inode.st_mtim_nsec = root->inode.st_mtim_nsec;
+
+	/* Inherit selinux context from root dir */
 	selinux = lcfs_node_get_xattr(root, "security.selinux", &selinux_len);
+	if (selinux != NULL) {
+		if (lcfs_node_set_xattr(child, "security.selinux", selinux,
+					selinux_len) < 0)
+			return NULL;
+	}
+
+	return steal_pointer(&child);
+}
+
+static int add_overlay_whiteouts(struct lcfs_ctx_s *ctx,
+				 struct erofs_xattr_table_s *table,
+				 struct lcfs_node_s *root)
+{
+	int res;
 
 	for (int i = 0; i <= 255; i++) {
 		struct lcfs_node_s *child;
 		char name[3];
 
-		name[0] = hexchars[(i >> 4) % 16];
-		name[1] = hexchars[i % 16];
-		name[2] = 0;
+		overlay_whiteout_name(i, name);
 
 		child = lcfs_node_lookup_child(root, name);
 		if (child != NULL)
 			continue;
 
-		child = lcfs_node_new();
+		child = new_overlay_whiteout(root);
 		if (child == NULL) {
 			return -1;
 		}
 
-		lcfs_node_set_mode(child, S_IFCHR | 0644);
-		lcfs_node_set_rdev(child, 0);
-
-		child->inode.st_uid = root->inode.st_uid;
-		child->inode.st_gid = root->inode.st_gid;
-		child->inode.st_mtim_sec = root->inode.st_mtim_sec;
-		child->inode.st_mtim_nsec = root->inode.st_mtim_nsec;
-
-		/* Inherit selinux context from root dir */
-		if (selinux != NULL) {
-			res = lcfs_node_set_xattr(child, "security.selinux",
-						  selinux, selinux_len);
-			if (res < 0) {
-				lcfs_node_unref(child);
-				return res;
-			}
-		}
-
 		res = lcfs_node_add_child(root, child, name);
 		if (res < 0) {
 			lcfs_node_unref(child);
 			return res;
 		}
+
+		res = count_erofs_xattrs(ctx, table, child);
+		if (res < 0)
+			return res;
 	}
 
 	return 0;
 }
 
+/* Rewrites the subtree of node as needed for erofs. This is the only
+ * pass over the input tree before the layout, so it also updates the
+ * version, collects the mtimes, fixes up the directory link counts
+ * and counts the xattrs. The xattrs of node itself are counted by the
+ * caller, as its children may still add some. */
 static int rewrite_tree_node_for_erofs(struct lcfs_ctx_s *ctx,
+				       struct erofs_xattr_table_s *table,
 				       struct lcfs_node_s *node,
 				       struct lcfs_node_s *parent)
 {
 	int ret;
 
+	if (!lcfs_node_dirp(node) && node->children_size != 0) {
+		/* Only dirs can have children */
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Update options->version up to options->max_version if needed,
+	 * which must see whiteouts before they are escaped */
+	lcfs_node_update_version(node, ctx->options);
+
+	ret = lcfs_ctx_add_mtime(ctx, node);
+	if (ret < 0)
+		return ret;
+
 	ret = add_overlayfs_xattrs(ctx, node);
 	if (ret < 0)
 		return ret;
 
 	if (lcfs_node_dirp(node)) {
 		struct lcfs_node_s *existing;
+		size_t n_link = 2;
 
 		/* Ensure we have . and .. */
 		existing = lcfs_node_lookup_child(node, ".");
@@ -1265,15 +1947,27 @@ static int rewrite_tree_node_for_erofs(struct lcfs_ctx_s *ctx,
 		for (size_t i = 0; i < node->children_size; ++i) {
 			struct lcfs_node_s *child = node->children[i];
 
+			if ((child->inode.st_mode & S_IFMT) == S_IFDIR) {
+				n_link++;
+			}
+
 			if (child->link_to != NULL) {
 				continue;
 			}
 
-			ret = rewrite_tree_node_for_erofs(ctx, child, node);
+			ret = rewrite_tree_node_for_erofs(ctx, table, child, node);
+			if (ret < 0) {
+				return -1;
+			}
+
+			ret = count_erofs_xattrs(ctx, table, child);
 			if (ret < 0) {
 				return -1;
 			}
 		}
+
+		/* Fix up directory n_links counts, they are 2 + nr of subdirs */
+		node->inode.st_nlink = n_link;
 	}
 
 	return 0;
@@ -1290,11 +1984,13 @@ static int set_overlay_opaque(struct lcfs_node_s *node)
 	return 0;
 }
 
-static int rewrite_tree_for_erofs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+static int rewrite_tree_for_erofs(struct lcfs_ctx_s *ctx,
+				  struct erofs_xattr_table_s *table,
+				  struct lcfs_node_s *root)
 {
 	int res;
 
-	res = rewrite_tree_node_for_erofs(ctx, root, root);
+	res = rewrite_tree_node_for_erofs(ctx, table, root, root);
 	if (res < 0)
 		return res;
 
@@ -1302,17 +1998,55 @@ static int rewrite_tree_for_erofs(struct lcfs_ctx_s *ctx, struct lcfs_node_s *ro
 	if (res < 0)
 		return res;
 
-	res = add_overlay_whiteouts(root);
+	res = add_overlay_whiteouts(ctx, table, root);
+	if (res < 0)
+		return res;
+
+	res = count_erofs_xattrs(ctx, table, root);
 	if (res < 0)
 		return res;
 
 	return 0;
 }
 
-int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
+/* Rewrites the tree, and computes the version, the shared xattrs and
+ * the layout. Besides ordering the tree, this goes over it once before
+ * and once after the shared xattrs are known. */
+static int compute_erofs_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	struct erofs_xattr_table_s table = { 0 };
+
+	if (erofs_xattr_table_init(&table, 0) < 0)
+		goto fail;
+
+	if (rewrite_tree_for_erofs(ctx, &table, root) < 0)
+		goto fail;
+
+	/* The version is final from here */
+	lcfs_compute_build_mtime(ctx);
+
+	if (assign_erofs_shared_xattrs(ctx, &table) < 0)
+		goto fail;
+
+	if (lcfs_compute_tree(ctx, root) < 0)
+		goto fail;
+
+	if (compute_erofs_inodes(ctx, &table) < 0)
+		goto fail;
+
+	erofs_xattr_table_free(&table);
+	return 0;
+
+fail:
+	erofs_xattr_table_free(&table);
+	return -1;
+}
+
+/* Writes the composefs header and the erofs superblock */
+static int write_erofs_superblock(struct lcfs_ctx_s *ctx, uint64_t root_nid,
+				  uint64_t data_block_start)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
-	struct lcfs_node_s *root;
 	struct lcfs_erofs_header_s header = {
 		.magic = lcfs_u32_to_file(LCFS_EROFS_MAGIC),
 		.version = lcfs_u32_to_file(LCFS_EROFS_VERSION),
@@ -1321,34 +2055,9 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	uint32_t header_flags;
 	struct erofs_super_block superblock = {
 		.magic = lcfs_u32_to_file(EROFS_SUPER_MAGIC_V1),
-		.blkszbits = EROFS_BLKSIZ_BITS,
+		.blkszbits = ctx_erofs->blkszbits,
 	};
-	int ret = 0;
-	uint64_t data_block_start;
-
-	/* Clone root so we can make required modifications to it */
-	ret = lcfs_clone_root(ctx);
-	if (ret < 0)
-		return ret;
-
-	root = ctx->root; /* After we cloned it */
-
-	/* Rewrite cloned tree as needed for erofs */
-	ret = rewrite_tree_for_erofs(ctx, root);
-	if (ret < 0)
-		return ret;
-
-	ret = lcfs_compute_tree(ctx, root);
-	if (ret < 0)
-		return ret;
-
-	ret = compute_erofs_shared_xattrs(ctx);
-	if (ret < 0)
-		return ret;
-
-	ret = compute_erofs_inodes(ctx);
-	if (ret < 0)
-		return ret;
+	int ret;
 
 	header_flags = 0;
 	if (ctx->has_acl)
@@ -1367,41 +2076,47 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 		EROFS_FEATURE_COMPAT_MTIME | EROFS_FEATURE_COMPAT_XATTR_FILTER);
 	superblock.inos = lcfs_u64_to_file(ctx->num_inodes);
 
-	superblock.build_time = lcfs_u64_to_file(ctx->min_mtim_sec);
-	superblock.build_time_nsec = lcfs_u32_to_file(ctx->min_mtim_nsec);
+	superblock.build_time = lcfs_u64_to_file(ctx->build_mtim_sec);
+	superblock.build_time_nsec = lcfs_u32_to_file(ctx->build_mtim_nsec);
 
 	/* metadata is stored directly after superblock */
 	superblock.meta_blkaddr = lcfs_u32_to_file(
-		(uint32_t)((EROFS_SUPER_OFFSET + sizeof(superblock)) / EROFS_BLKSIZ));
-	assert(root->erofs_nid < UINT16_MAX);
-	superblock.root_nid = lcfs_u16_to_file((uint16_t)root->erofs_nid);
+		(uint32_t)(ctx_erofs->meta_start >> ctx_erofs->blkszbits));
+	assert(root_nid < UINT16_MAX);
+	superblock.root_nid = lcfs_u16_to_file((uint16_t)root_nid);
 
 	/* shared xattrs is directly after metadata */
 	superblock.xattr_blkaddr =
-		lcfs_u32_to_file((uint32_t)(ctx_erofs->inodes_end / EROFS_BLKSIZ));
-
-	data_block_start =
-		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size,
-			 EROFS_BLKSIZ);
+		lcfs_u32_to_file((uint32_t)(ctx_erofs->inodes_end >> ctx_erofs->blkszbits));
 
 	superblock.blocks =
-		lcfs_u32_to_file((uint32_t)(data_block_start / EROFS_BLKSIZ +
+		lcfs_u32_to_file((uint32_t)((data_block_start >> ctx_erofs->blkszbits) +
 					    ctx_erofs->n_data_blocks));
 
+	/* long xattr prefixes are directly after shared xattrs */
+	if (erofs_use_long_xattr_prefixes(ctx)) {
+		superblock.feature_incompat = lcfs_u32_to_file(
+			EROFS_FEATURE_INCOMPAT_XATTR_PREFIXES);
+		superblock.xattr_prefix_count = EROFS_N_LONG_XATTR_PREFIXES;
+		superblock.xattr_prefix_start = lcfs_u32_to_file((uint32_t)(
+			(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size) /
+			sizeof(uint32_t)));
+	}
+
 	/* TODO: More superblock fields:
 	 *  uuid?
 	 *  volume_name?
 	 */
 
-	ret = lcfs_write(ctx, &superblock, sizeof(superblock));
-	if (ret < 0)
-		return ret;
-
-	ctx_erofs->current_end = data_block_start;
+	return lcfs_write(ctx, &superblock, sizeof(superblock));
+}
 
-	ret = write_erofs_inodes(ctx);
-	if (ret < 0)
-		return ret;
+/* Writes the shared xattrs and long xattr prefixes that follow the
+ * inodes, up to the start of the data blocks */
+static int write_erofs_xattr_area(struct lcfs_ctx_s *ctx, uint64_t data_block_start)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	int ret;
 
 	assert(ctx_erofs->inodes_end == (uint64_t)ctx->bytes_written);
 
@@ -1412,60 +2127,501 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	assert(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size ==
 	       (uint64_t)ctx->bytes_written);
 
-	/* Following are full blocks and must be block-aligned */
-	ret = lcfs_write_align(ctx, EROFS_BLKSIZ);
+	ret = write_erofs_xattr_prefixes(ctx);
 	if (ret < 0)
 		return ret;
 
-	assert(data_block_start == (uint64_t)ctx->bytes_written);
+	assert(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size +
+		       ctx_erofs->xattr_prefix_size ==
+	       (uint64_t)ctx->bytes_written);
 
-	ret = write_erofs_data_blocks(ctx);
+	/* Following are full blocks and must be block-aligned */
+	ret = lcfs_write_align(ctx, ctx_erofs->blksz);
 	if (ret < 0)
 		return ret;
 
-	assert(ctx_erofs->current_end == (uint64_t)ctx->bytes_written);
-	assert(data_block_start + ctx_erofs->n_data_blocks * EROFS_BLKSIZ ==
-	       (uint64_t)ctx->bytes_written);
+	assert(data_block_start == (uint64_t)ctx->bytes_written);
 
 	return 0;
 }
 
-struct hasher_node_s {
-	uint64_t nid;
-	struct lcfs_node_s *node;
-};
+int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct lcfs_node_s *root;
+	int ret = 0;
+	uint64_t data_block_start;
 
-struct lcfs_image_data {
-	const uint8_t *erofs_data;
-	size_t erofs_data_size;
+	/* Clone root so we can make required modifications to it */
+	ret = lcfs_clone_root(ctx);
+	if (ret < 0)
+		return ret;
+
+	root = ctx->root; /* After we cloned it */
+
+	/* Rewrite cloned tree as needed for erofs, and lay it out */
+	ret = compute_erofs_tree(ctx, root);
+	if (ret < 0)
+		return ret;
+
+	compute_erofs_xattr_prefixes(ctx);
+
+	data_block_start =
+		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size +
+				 ctx_erofs->xattr_prefix_size,
+			 ctx_erofs->blksz);
+
+	ret = lcfs_write_preallocate(ctx, data_block_start + ctx_erofs->n_data_blocks *
+								     ctx_erofs->blksz);
+	if (ret < 0)
+		return ret;
+
+	ret = write_erofs_superblock(ctx, root->erofs_nid, data_block_start);
+	if (ret < 0)
+		return ret;
+
+	ctx_erofs->data_block_start = data_block_start;
+	ctx_erofs->current_end = data_block_start;
+
+	ret = start_erofs_jobs(ctx, data_block_start);
+	if (ret < 0)
+		return ret;
+
+	ret = write_erofs_inodes(ctx);
+	if (ret < 0)
+		return ret;
+
+	ret = write_erofs_xattr_area(ctx, data_block_start);
+	if (ret < 0)
+		return ret;
+
+	ret = write_erofs_data_blocks(ctx);
+	if (ret < 0)
+		return ret;
+
+	assert(ctx_erofs->current_end == (uint64_t)ctx->bytes_written);
+	assert(data_block_start + ctx_erofs->n_data_blocks * ctx_erofs->blksz ==
+	       (uint64_t)ctx->bytes_written);
+
+	return 0;
+}
+
+/* The xattrs used more than once when streaming, which are the ones
+ * that can be shared. These are owned here, as the nodes are not kept
+ * in memory. */
+struct erofs_stream_xattrs_s {
+	struct lcfs_xattr_s *xattrs;
+	uint32_t *counts;
+	size_t n_xattrs;
+	size_t alloc_xattrs;
+};
+
+static void erofs_stream_xattrs_free(struct erofs_stream_xattrs_s *sx)
+{
+	for (size_t i = 0; i < sx->n_xattrs; i++) {
+		free(sx->xattrs[i].key);
+		free(sx->xattrs[i].value);
+	}
+	free(sx->xattrs);
+	free(sx->counts);
+}
+
+/* Records are the xattr key, a zero byte and the value */
+static int erofs_stream_xattr_count_cb(void *data, const uint8_t *record,
+				       size_t len, size_t count)
+{
+	struct erofs_stream_xattrs_s *sx = data;
+	const uint8_t *value = memchr(record, 0, len);
+	struct lcfs_xattr_s *xattr;
+
+	if (count <= 1)
+		return 0;
+
+	if (sx->n_xattrs == sx->alloc_xattrs) {
+		size_t new_alloc = sx->alloc_xattrs == 0 ? 64 : sx->alloc_xattrs * 2;
+		struct lcfs_xattr_s *new_xattrs;
+		uint32_t *new_counts;
+
+		new_xattrs = reallocarray(sx->xattrs, new_alloc,
+					  sizeof(struct lcfs_xattr_s));
+		if (new_xattrs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		sx->xattrs = new_xattrs;
+
+		new_counts = reallocarray(sx->counts, new_alloc, sizeof(uint32_t));
+		if (new_counts == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		sx->counts = new_counts;
+		sx->alloc_xattrs = new_alloc;
+	}
+
+	assert(value != NULL);
+	value++;
+
+	xattr = &sx->xattrs[sx->n_xattrs];
+	memset(xattr, 0, sizeof(*xattr));
+	xattr->key = strdup((const char *)record);
+	xattr->value_len = len - (value - record);
+	xattr->value = memdup((const char *)value, xattr->value_len);
+	if (xattr->key == NULL || xattr->value == NULL) {
+		free(xattr->key);
+		free(xattr->value);
+		errno = ENOMEM;
+		return -1;
+	}
+	xattr->erofs_hash = xattr_hash64(xattr);
+	sx->counts[sx->n_xattrs] = min(count, (size_t)UINT32_MAX);
+	sx->n_xattrs++;
+
+	return 0;
+}
+
+/* Returns the next node of the stream, rewritten for erofs as
+ * rewrite_tree_for_erofs() and lcfs_compute_tree() do for a tree */
+static int next_erofs_stream_node(struct lcfs_ctx_s *ctx,
+				  struct lcfs_write_stream_s *stream,
+				  struct lcfs_node_s **node_out)
+{
+	cleanup_node struct lcfs_node_s *node = NULL;
+	int flags;
+	int ret;
+
+	ret = lcfs_write_stream_next(stream, &node, &flags);
+	if (ret <= 0)
+		return ret;
+
+	/* The root whiteouts are added after the rewrite */
+	if ((flags & LCFS_STREAM_NODE_SYNTHETIC) == 0) {
+		ret = add_overlayfs_xattrs(ctx, node);
+		if (ret < 0)
+			return ret;
+
+		if (flags & LCFS_STREAM_NODE_HAS_WHITEOUTS) {
+			ret = mark_erofs_whiteouts_dir(ctx, node);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (flags & LCFS_STREAM_NODE_ROOT) {
+			ret = set_overlay_opaque(node);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	lcfs_node_sort_xattrs(node);
+
+	for (size_t i = 0; i < node->n_xattrs; i++)
+		node->xattrs[i].erofs_hash = xattr_hash64(&node->xattrs[i]);
+
+	*node_out = steal_pointer(&node);
+	return 1;
+}
+
+/* Finds the xattrs to share, which needs a pass over all nodes */
+static int compute_erofs_stream_shared_xattrs(struct lcfs_ctx_s *ctx,
+					      struct lcfs_write_stream_s *stream,
+					      struct erofs_stream_xattrs_s *sx,
+					      struct erofs_xattr_table_s *table)
+{
+	struct lcfs_spill_s *spill;
+	int ret;
+
+	spill = lcfs_write_stream_new_spill(stream);
+	if (spill == NULL)
+		return -1;
+
+	ret = lcfs_write_stream_rewind(stream, false);
+	while (ret == 0) {
+		cleanup_node struct lcfs_node_s *node = NULL;
+
+		ret = next_erofs_stream_node(ctx, stream, &node);
+		if (ret <= 0)
+			break;
+		ret = 0;
+
+		for (size_t i = 0; i < node->n_xattrs && ret == 0; i++) {
+			struct lcfs_xattr_s *xattr = &node->xattrs[i];
+			size_t key_len = strlen(xattr->key) + 1;
+			cleanup_free char *record = malloc(key_len + xattr->value_len);
+
+			if (record == NULL) {
+				errno = ENOMEM;
+				ret = -1;
+				break;
+			}
+			memcpy(record, xattr->key, key_len);
+			for (size_t offset = 0; offset < xattr->value_len;) {
+				const uint8_t *value;
+				size_t n = xattr_value_span(xattr, offset, &value);
+
+				memcpy(record + key_len + offset, value, n);
+				offset += n;
+			}
+
+			ret = lcfs_spill_add_record(spill, record,
+						    key_len + xattr->value_len);
+		}
+	}
+
+	if (ret == 0)
+		ret = lcfs_spill_count_records(stream, spill,
+					       erofs_stream_xattr_count_cb, sx);
+	lcfs_spill_free(spill);
+	if (ret < 0)
+		return ret;
+
+	if (erofs_xattr_table_init(table, sx->n_xattrs) < 0)
+		return -1;
+
+	for (size_t i = 0; i < sx->n_xattrs; i++) {
+		struct erofs_xattr_ent_s *ent =
+			erofs_xattr_table_lookup(table, &sx->xattrs[i], true);
+		ent->count = sx->counts[i];
+	}
+
+	return assign_erofs_shared_xattrs(ctx, table);
+}
+
+/* Like lcfs_write_erofs_to(), but for the nodes of a stream, which
+ * are read in three passes. The first finds the shared xattrs, the
+ * second computes the inode layout and records the nids, and the
+ * third writes the inodes, along with the data blocks to a temporary
+ * file that is appended at the end. */
+int lcfs_write_erofs_stream_to(struct lcfs_ctx_s *ctx,
+			       struct lcfs_write_stream_s *stream)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct lcfs_node_s *root = lcfs_write_stream_get_root(stream);
+	struct erofs_stream_xattrs_s sx = { 0 };
+	struct erofs_xattr_table_s table = { 0 };
+	struct lcfs_spill_s *data_spill = NULL;
+	struct lcfs_ctx_erofs_s data_ctx;
+	uint64_t data_block_start, pos, root_nid = 0;
+	int ret;
+
+	for (int i = 0; i <= 255; i++) {
+		struct lcfs_node_s *child;
+		char name[3];
+
+		overlay_whiteout_name(i, name);
+
+		if (lcfs_write_stream_root_has_child(stream, name))
+			continue;
+
+		child = new_overlay_whiteout(root);
+		if (child == NULL) {
+			ret = -1;
+			goto out;
+		}
+
+		ret = lcfs_write_stream_add_root_child(stream, name, child);
+		if (ret < 0) {
+			lcfs_node_unref(child);
+			goto out;
+		}
+	}
+
+	lcfs_write_stream_init_ctx(stream, ctx);
+
+	ret = compute_erofs_stream_shared_xattrs(ctx, stream, &sx, &table);
+	if (ret < 0)
+		goto out;
+
+	pos = start_erofs_inodes(ctx);
+
+	ret = lcfs_write_stream_rewind(stream, true);
+	while (ret == 0) {
+		cleanup_node struct lcfs_node_s *node = NULL;
+
+		ret = next_erofs_stream_node(ctx, stream, &node);
+		if (ret <= 0)
+			break;
+
+		set_erofs_shared_xattr_offsets(&table, node);
+		ret = compute_erofs_inode(ctx, node, &pos, NULL);
+		if (ret < 0)
+			break;
+
+		if (node->inode_num == 0)
+			root_nid = node->erofs_nid;
+
+		ret = lcfs_write_stream_set_nid(stream, node);
+	}
+	if (ret < 0)
+		goto out;
+
+	ctx_erofs->inodes_end = round_up(pos, EROFS_SLOTSIZE);
+
+	compute_erofs_xattr_prefixes(ctx);
+
+	data_block_start =
+		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size +
+				 ctx_erofs->xattr_prefix_size,
+			 ctx_erofs->blksz);
+
+	ret = lcfs_write_preallocate(ctx, data_block_start + ctx_erofs->n_data_blocks *
+								     ctx_erofs->blksz);
+	if (ret < 0)
+		goto out;
+
+	ret = write_erofs_superblock(ctx, root_nid, data_block_start);
+	if (ret < 0)
+		goto out;
+
+	ctx_erofs->data_block_start = data_block_start;
+	ctx_erofs->current_end = data_block_start;
+
+	/* The data blocks go after all inodes, so they are collected in a
+	 * temporary file, written through a copy of the context */
+	data_spill = lcfs_write_stream_new_spill(stream);
+	if (data_spill == NULL) {
+		ret = -1;
+		goto out;
+	}
+	data_ctx = *ctx_erofs;
+	data_ctx.base.fsverity_ctx = NULL;
+	data_ctx.base.fd = -1;
+	data_ctx.base.fd_buf = NULL;
+	data_ctx.base.write_cb = lcfs_spill_write_cb;
+	data_ctx.base.file = data_spill;
+	data_ctx.base.bytes_written = data_block_start;
+	data_ctx.jobs = NULL;
+	data_ctx.n_jobs = 0;
+
+	pos = start_erofs_inodes(ctx);
+
+	ret = lcfs_write_stream_rewind(stream, false);
+	while (ret == 0) {
+		cleanup_node struct lcfs_node_s *node = NULL;
+		uint64_t nid;
+
+		ret = next_erofs_stream_node(ctx, stream, &node);
+		if (ret <= 0)
+			break;
+
+		set_erofs_shared_xattr_offsets(&table, node);
+		nid = node->erofs_nid;
+		ret = compute_erofs_inode(ctx, node, &pos, NULL);
+		if (ret < 0)
+			break;
+		assert(node->erofs_nid == nid);
+
+		ret = write_erofs_inode_data(ctx, node);
+		if (ret < 0)
+			break;
+
+		ret = write_erofs_node_data_blocks(&data_ctx.base, node);
+	}
+	if (ret < 0)
+		goto out;
+
+	ret = lcfs_write_align(ctx, EROFS_SLOTSIZE);
+	if (ret < 0)
+		goto out;
+
+	ret = write_erofs_xattr_area(ctx, data_block_start);
+	if (ret < 0)
+		goto out;
+
+	assert(data_ctx.base.bytes_written ==
+	       (off_t)(data_block_start + ctx_erofs->n_data_blocks * ctx_erofs->blksz));
+
+	ret = lcfs_spill_copy_to(data_spill, ctx);
+	if (ret < 0)
+		goto out;
+
+	assert(ctx_erofs->current_end == (uint64_t)ctx->bytes_written);
+	assert(data_block_start + ctx_erofs->n_data_blocks * ctx_erofs->blksz ==
+	       (uint64_t)ctx->bytes_written);
+
+out:
+	lcfs_spill_free(data_spill);
+	erofs_xattr_table_free(&table);
+	/* Only referenced by ctx_erofs->shared_xattrs until here */
+	erofs_stream_xattrs_free(&sx);
+	return ret;
+}
+
+/* A hardlink decoded on a worker thread, see lcfs_load_parallel() */
+struct lcfs_image_link_s {
+	struct lcfs_node_s *node;
+	uint64_t nid;
+	uint64_t seq;
+};
+
+/* Refcounted, as lazily loaded directories keep a ref until their
+ * children are decoded */
+struct lcfs_image_data {
+	int ref_count;
+	bool lazy;
+	bool shallow; /* Don't decode the children of directories */
+	void *mapping; /* Unmapped when freed, if set */
+	size_t mapping_size;
+	const uint8_t *erofs_data;
+	size_t erofs_data_size;
 	const uint8_t *erofs_metadata;
 	const uint8_t *erofs_metadata_end;
 	const uint8_t *erofs_xattrdata;
 	const uint8_t *erofs_xattrdata_end;
+	uint32_t erofs_blkszbits;
+	uint64_t erofs_blksz;
 	uint64_t erofs_build_time;
 	uint32_t erofs_build_time_nsec;
-	Hash_table *node_hash;
+	struct erofs_long_xattr_prefix long_prefixes[EROFS_N_LONG_XATTR_PREFIXES_MAX];
+	size_t n_long_prefixes;
+	/* Validated on init, or one directory at a time for lazy loads,
+	 * so only nids need to be checked */
+	lcfs_image_t *view;
+	/* The inodes decoded so far, indexed by nid, so later dirents
+	 * with the same nid become hardlinks. Owns refs. Lazily loaded
+	 * directories are only marked in lazy_dirs, and the tables grow
+	 * as they are decoded. */
+	size_t n_nids;
+	struct lcfs_node_s **nodes;
+	uint8_t *lazy_dirs;
+	/* Used when decoding in parallel, see lcfs_load_parallel() */
+	uint64_t seq;
+	uint64_t *nodes_seq;
+	bool track_links;
+	struct lcfs_image_link_s *links;
+	size_t n_links;
+	size_t links_capacity;
 };
 
+static struct lcfs_image_data *lcfs_image_data_ref(struct lcfs_image_data *data)
+{
+	data->ref_count++;
+	return data;
+}
+
 static const erofs_inode *lcfs_image_get_erofs_inode(struct lcfs_image_data *data,
 						     uint64_t nid)
 {
-	const uint8_t *inode_data = data->erofs_metadata + (nid << EROFS_ISLOTBITS);
-
-	if (inode_data >= data->erofs_metadata_end) {
+	if (data->view ? !lcfs_image_nid_is_valid(data->view, nid) :
+			 nid >= data->n_nids) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	return (const erofs_inode *)inode_data;
+	return (const erofs_inode *)(data->erofs_metadata + (nid << EROFS_ISLOTBITS));
 }
 
 static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *data,
 						      uint64_t nid);
 
+/* Called for each dirent of a directory, except "." and ".." */
+typedef int (*erofs_dirent_cb)(struct lcfs_image_data *data,
+			       struct lcfs_node_s *parent, const char *name,
+			       uint64_t nid, void *user_data);
+
 static int erofs_readdir_block(struct lcfs_image_data *data,
 			       struct lcfs_node_s *parent, const uint8_t *block,
-			       size_t block_size)
+			       size_t block_size, erofs_dirent_cb cb, void *user_data)
 {
 	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
 	size_t dirents_size = lcfs_u16_from_file(dirents[0].nameoff);
@@ -1485,7 +2641,6 @@ static int erofs_readdir_block(struct lcfs_image_data *data,
 		uint16_t nameoff = lcfs_u16_from_file(dirents[i].nameoff);
 		const char *child_name;
 		uint16_t child_name_len;
-		cleanup_node struct lcfs_node_s *child = NULL;
 
 		/* Compute length of the name, which is a bit weird for the last dirent */
 		child_name = (char *)(block + nameoff);
@@ -1505,84 +2660,289 @@ static int erofs_readdir_block(struct lcfs_image_data *data,
 		memcpy(name_buf, child_name, child_name_len);
 		name_buf[child_name_len] = 0;
 
-		child = lcfs_build_node_from_image(data, nid);
-		if (child == NULL) {
-			if (errno == ENOTSUP)
-				continue; /* Skip real whiteouts (00-ff) */
-			else
+		if (cb(data, parent, name_buf, nid, user_data) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int erofs_build_child(struct lcfs_image_data *data,
+			     struct lcfs_node_s *parent, const char *name,
+			     uint64_t nid, void *user_data)
+{
+	cleanup_node struct lcfs_node_s *child = NULL;
+
+	child = lcfs_build_node_from_image(data, nid);
+	if (child == NULL) {
+		if (errno == ENOTSUP)
+			return 0; /* Skip real whiteouts (00-ff) */
+		else
+			return -1;
+	}
+
+	if (lcfs_node_add_child(parent, child, /* Takes ownership on success */
+				name) < 0)
+		return -1;
+	steal_pointer(&child);
+
+	return 0;
+}
+
+static int lcfs_build_node_erofs_xattr(struct lcfs_image_data *data,
+				       struct lcfs_node_s *node, uint8_t name_index,
+				       const char *entry_name, uint8_t name_len,
+				       const char *value, uint16_t value_size)
+{
+	cleanup_free char *name = NULL;
+	uint8_t base_index;
+	const char *infix;
+	size_t infix_len;
+
+	if (erofs_xattr_entry_prefix(name_index, data->long_prefixes,
+				     data->n_long_prefixes, &base_index,
+				     &infix, &infix_len) < 0)
+		return -1;
+
+	name = erofs_get_xattr_name(base_index, infix, infix_len, entry_name,
+				    name_len);
+	if (name == NULL)
+		return -1;
+
+	if (strcmp(name, OVERLAY_XATTR_REDIRECT) == 0) {
+		if ((node->inode.st_mode & S_IFMT) == S_IFREG) {
+			if (value_size > 1 && value[0] == '/') {
+				value_size--;
+				value++;
+			}
+			node->payload = strndup(value, value_size);
+			if (node->payload == NULL) {
+				errno = ENOMEM;
 				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (strcmp(name, OVERLAY_XATTR_METACOPY) == 0) {
+		if ((node->inode.st_mode & S_IFMT) == S_IFREG &&
+		    value_size == 4 + LCFS_DIGEST_SIZE)
+			lcfs_node_set_fsverity_digest(node, (uint8_t *)value + 4);
+		return 0;
+	}
+
+	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUT) == 0 &&
+	    (node->inode.st_mode & S_IFMT) == S_IFREG) {
+		/* Rewrite to regular whiteout */
+		node->inode.st_mode = (node->inode.st_mode & ~S_IFMT) | S_IFCHR;
+		node->inode.st_rdev = makedev(0, 0);
+		node->inode.st_size = 0;
+		return 0;
+	}
+	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUTS) == 0 ||
+	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUT) == 0 ||
+	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUTS) == 0) {
+		/* skip */
+		return 0;
+	}
+
+	if (str_has_prefix(name, OVERLAY_XATTR_PREFIX)) {
+		if (str_has_prefix(name, OVERLAY_XATTR_ESCAPE_PREFIX)) {
+			/* Unescape */
+			memmove(name + strlen(OVERLAY_XATTR_TRUSTED_PREFIX),
+				name + strlen(OVERLAY_XATTR_PREFIX),
+				strlen(name) - strlen(OVERLAY_XATTR_PREFIX) + 1);
+		} else {
+			/* skip */
+			return 0;
+		}
+	}
+
+	if (lcfs_node_set_xattr(node, name, value, value_size) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Calls cb for the directory entries of the inode */
+static int erofs_iterate_dir(struct lcfs_image_data *data,
+			     struct lcfs_node_s *node, const erofs_inode *cino,
+			     erofs_dirent_cb cb, void *user_data)
+{
+	uint32_t mode;
+	uint64_t file_size;
+	uint16_t xattr_icount;
+	uint32_t raw_blkaddr;
+	size_t isize;
+	bool tailpacked;
+	uint64_t n_blocks;
+	uint64_t last_oob_block;
+	size_t tail_size;
+	const uint8_t *tail_data;
+	const uint8_t *oob_data;
+
+	erofs_inode_get_info(cino, &mode, &file_size, &xattr_icount,
+			     &raw_blkaddr, &isize);
+
+	tailpacked = erofs_inode_is_tailpacked(cino);
+	tail_size = tailpacked ? file_size % data->erofs_blksz : 0;
+	tail_data = ((uint8_t *)cino) + isize + erofs_xattr_inode_size(xattr_icount);
+	oob_data = data->erofs_data + raw_blkaddr * data->erofs_blksz;
+
+	n_blocks = round_up(file_size, data->erofs_blksz) >> data->erofs_blkszbits;
+	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
+
+	/* First read the out-of-band blocks */
+	for (uint64_t block = 0; block < last_oob_block; block++) {
+		const uint8_t *block_data = oob_data + block * data->erofs_blksz;
+		size_t block_size = data->erofs_blksz;
+
+		if (!tailpacked && block + 1 == last_oob_block) {
+			block_size = file_size % data->erofs_blksz;
+			if (block_size == 0) {
+				block_size = data->erofs_blksz;
+			}
 		}
 
-		if (lcfs_node_add_child(parent, child, /* Takes ownership on success */
-					name_buf) < 0)
+		if (erofs_readdir_block(data, node, block_data, block_size, cb,
+					user_data) < 0)
+			return -1;
+	}
+
+	/* Then inline */
+	if (tailpacked) {
+		if (erofs_readdir_block(data, node, tail_data, tail_size, cb,
+					user_data) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Decodes the directory entries of the inode into children of node */
+static int erofs_build_dir_children(struct lcfs_image_data *data,
+				    struct lcfs_node_s *node,
+				    const erofs_inode *cino)
+{
+	return erofs_iterate_dir(data, node, cino, erofs_build_child, NULL);
+}
+
+/* Records that nid is decoded into node, so later dirents with the
+ * same nid become hardlinks to it. Fails with EEXIST if another
+ * thread decoded the nid first. */
+static int lcfs_image_add_node(struct lcfs_image_data *data, uint64_t nid,
+			       struct lcfs_node_s *node)
+{
+	struct lcfs_node_s *expected = NULL;
+	int type = node->inode.st_mode & S_IFMT;
+
+	/* Lazily loaded directories hold a ref to data, so data can't
+	 * hold one to them. Valid images have no directory hardlinks,
+	 * the nid is only recorded to detect them. Other inodes are
+	 * only looked up again if they have hardlinks. */
+	if (data->lazy) {
+		if (type == S_IFDIR)
+			data->lazy_dirs[nid / 8] |= 1 << (nid % 8);
+		if (type == S_IFDIR || node->inode.st_nlink <= 1)
+			return 0;
+	}
+
+	lcfs_node_ref(node);
+	if (!__atomic_compare_exchange_n(&data->nodes[nid], &expected, node, false,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		lcfs_node_unref(node);
+		errno = EEXIST;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lcfs_image_track_link(struct lcfs_image_data *data,
+				 struct lcfs_node_s *node, uint64_t nid,
+				 uint64_t seq)
+{
+	struct lcfs_image_link_s *link;
+
+	if (data->n_links == data->links_capacity) {
+		size_t new_capacity = data->links_capacity ? data->links_capacity * 2 : 64;
+		struct lcfs_image_link_s *new_links;
+
+		new_links = reallocarray(data->links, new_capacity,
+					 sizeof(struct lcfs_image_link_s));
+		if (new_links == NULL) {
+			errno = ENOMEM;
 			return -1;
-		steal_pointer(&child);
+		}
+		data->links = new_links;
+		data->links_capacity = new_capacity;
 	}
+	link = &data->links[data->n_links++];
+	link->node = node;
+	link->nid = nid;
+	link->seq = seq;
 
 	return 0;
 }
 
-static int lcfs_build_node_erofs_xattr(struct lcfs_node_s *node, uint8_t name_index,
-				       const char *entry_name, uint8_t name_len,
-				       const char *value, uint16_t value_size)
+static struct lcfs_node_s *lcfs_image_new_link(struct lcfs_image_data *data,
+					       uint64_t nid, uint64_t seq)
 {
-	cleanup_free char *name =
-		erofs_get_xattr_name(name_index, entry_name, name_len);
-	if (name == NULL)
-		return -1;
+	struct lcfs_node_s *target;
+	cleanup_node struct lcfs_node_s *node = NULL;
 
-	if (strcmp(name, OVERLAY_XATTR_REDIRECT) == 0) {
-		if ((node->inode.st_mode & S_IFMT) == S_IFREG) {
-			if (value_size > 1 && value[0] == '/') {
-				value_size++;
-				value++;
-			}
-			node->payload = strndup(value, value_size);
-			if (node->payload == NULL) {
-				errno = ENOMEM;
-				return -1;
-			}
-		}
-		return 0;
+	target = __atomic_load_n(&data->nodes[nid], __ATOMIC_ACQUIRE);
+	if (target == NULL || (target->inode.st_mode & S_IFMT) == S_IFDIR) {
+		errno = EINVAL; /* Hardlinked directory */
+		return NULL;
 	}
 
-	if (strcmp(name, OVERLAY_XATTR_METACOPY) == 0) {
-		if ((node->inode.st_mode & S_IFMT) == S_IFREG &&
-		    value_size == 4 + LCFS_DIGEST_SIZE)
-			lcfs_node_set_fsverity_digest(node, (uint8_t *)value + 4);
-		return 0;
-	}
+	node = lcfs_node_new();
+	if (node == NULL)
+		return NULL;
 
-	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUT) == 0 &&
-	    (node->inode.st_mode & S_IFMT) == S_IFREG) {
-		/* Rewrite to regular whiteout */
-		node->inode.st_mode = (node->inode.st_mode & ~S_IFMT) | S_IFCHR;
-		node->inode.st_rdev = makedev(0, 0);
-		node->inode.st_size = 0;
-		return 0;
-	}
-	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUTS) == 0 ||
-	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUT) == 0 ||
-	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUTS) == 0) {
-		/* skip */
-		return 0;
+	/* Other threads may take refs to the target too, so these
+	 * are resolved by lcfs_load_merge_links() */
+	if (data->track_links) {
+		if (lcfs_image_track_link(data, node, nid, seq) < 0)
+			return NULL;
+	} else {
+		node->link_to = lcfs_node_ref(target);
 	}
 
-	if (str_has_prefix(name, OVERLAY_XATTR_PREFIX)) {
-		if (str_has_prefix(name, OVERLAY_XATTR_ESCAPE_PREFIX)) {
-			/* Unescape */
-			memmove(name + strlen(OVERLAY_XATTR_TRUSTED_PREFIX),
-				name + strlen(OVERLAY_XATTR_PREFIX),
-				strlen(name) - strlen(OVERLAY_XATTR_PREFIX) + 1);
-		} else {
-			/* skip */
-			return 0;
-		}
+	return steal_pointer(&node);
+}
+
+/* Only used by lazy loads, as the others know the number of nids from
+ * validating the image */
+static int lcfs_image_data_grow(struct lcfs_image_data *data, uint64_t nid)
+{
+	size_t n_nids = max(data->n_nids, 64);
+	struct lcfs_node_s **nodes;
+	uint8_t *lazy_dirs;
+
+	while (n_nids <= nid)
+		n_nids *= 2;
+
+	nodes = reallocarray(data->nodes, n_nids, sizeof(struct lcfs_node_s *));
+	if (nodes == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
+	memset(nodes + data->n_nids, 0,
+	       (n_nids - data->n_nids) * sizeof(struct lcfs_node_s *));
+	data->nodes = nodes;
 
-	if (lcfs_node_set_xattr(node, name, value, value_size) < 0)
+	lazy_dirs = realloc(data->lazy_dirs, DIV_ROUND_UP(n_nids, 8));
+	if (lazy_dirs == NULL) {
+		errno = ENOMEM;
 		return -1;
+	}
+	memset(lazy_dirs + DIV_ROUND_UP(data->n_nids, 8), 0,
+	       DIV_ROUND_UP(n_nids, 8) - DIV_ROUND_UP(data->n_nids, 8));
+	data->lazy_dirs = lazy_dirs;
 
+	data->n_nids = n_nids;
 	return 0;
 }
 
@@ -1598,44 +2958,28 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 	size_t isize;
 	bool tailpacked;
 	size_t xattr_size;
-	struct hasher_node_s ht_entry = { nid };
-	cleanup_free struct hasher_node_s *new_ht_entry = NULL;
-	struct hasher_node_s *existing;
+	uint64_t seq = data->seq++;
 	uint64_t n_blocks;
 	uint64_t last_oob_block;
 	size_t tail_size;
 	const uint8_t *tail_data;
-	const uint8_t *oob_data;
 	int ret;
 
 	cino = lcfs_image_get_erofs_inode(data, nid);
 	if (cino == NULL)
 		return NULL;
 
-	node = lcfs_node_new();
-	if (node == NULL) {
+	if (nid >= data->n_nids && lcfs_image_data_grow(data, nid) < 0)
 		return NULL;
-	}
 
-	existing = hash_lookup(data->node_hash, &ht_entry);
-	if (existing) {
-		node->link_to = lcfs_node_ref(existing->node);
-		return steal_pointer(&node);
-	}
+	if (data->lazy_dirs[nid / 8] & (1 << (nid % 8)) ||
+	    __atomic_load_n(&data->nodes[nid], __ATOMIC_ACQUIRE) != NULL)
+		return lcfs_image_new_link(data, nid, seq);
 
-	new_ht_entry = malloc(sizeof(struct hasher_node_s));
-	if (new_ht_entry == NULL) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	new_ht_entry->nid = nid;
-	new_ht_entry->node = node;
-	if (hash_insert(data->node_hash, new_ht_entry) == NULL) {
-		lcfs_node_unref(node);
-		errno = ENOMEM;
+	node = lcfs_node_new();
+	if (node == NULL) {
 		return NULL;
 	}
-	new_ht_entry = NULL;
 
 	if (erofs_inode_is_compact(cino)) {
 		const struct erofs_inode_compact *c = &cino->compact;
@@ -1686,39 +3030,33 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 		return NULL;
 	}
 
+	if (lcfs_image_add_node(data, nid, node) < 0) {
+		if (errno == EEXIST)
+			return lcfs_image_new_link(data, nid, seq);
+		return NULL;
+	}
+	if (data->nodes_seq)
+		data->nodes_seq[nid] = seq;
+
 	xattr_size = erofs_xattr_inode_size(xattr_icount);
 
 	tailpacked = erofs_inode_is_tailpacked(cino);
-	tail_size = tailpacked ? file_size % EROFS_BLKSIZ : 0;
+	tail_size = tailpacked ? file_size % data->erofs_blksz : 0;
 	tail_data = ((uint8_t *)cino) + isize + xattr_size;
-	oob_data = data->erofs_data + raw_blkaddr * EROFS_BLKSIZ;
 
-	n_blocks = round_up(file_size, EROFS_BLKSIZ) / EROFS_BLKSIZ;
+	n_blocks = round_up(file_size, data->erofs_blksz) >> data->erofs_blkszbits;
 	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
 
 	if (type == S_IFDIR) {
-		/* First read the out-of-band blocks */
-		for (uint64_t block = 0; block < last_oob_block; block++) {
-			const uint8_t *block_data = oob_data + block * EROFS_BLKSIZ;
-			size_t block_size = EROFS_BLKSIZ;
-
-			if (!tailpacked && block + 1 == last_oob_block) {
-				block_size = file_size % EROFS_BLKSIZ;
-				if (block_size == 0) {
-					block_size = EROFS_BLKSIZ;
-				}
-			}
-
-			if (erofs_readdir_block(data, node, block_data, block_size) < 0)
-				return NULL;
-		}
-
-		/* Then inline */
-		if (tailpacked) {
-			if (erofs_readdir_block(data, node, tail_data, tail_size) < 0)
-				return NULL;
+		if (data->lazy) {
+			/* Decoded by lcfs_node_load_children() on first use */
+			node->image = lcfs_image_data_ref(data);
+			node->erofs_nid = nid;
+		} else if (data->shallow) {
+			/* Children are added by lcfs_load_parallel() */
+		} else if (erofs_build_dir_children(data, node, cino) < 0) {
+			return NULL;
 		}
-
 	} else if (type == S_IFLNK) {
 		char name_buf[PATH_MAX];
 
@@ -1742,8 +3080,8 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 			return NULL;
 		}
 
-		oob_size = tailpacked ? last_oob_block * EROFS_BLKSIZ : file_size;
-		memcpy(content, data->erofs_data + raw_blkaddr * EROFS_BLKSIZ,
+		oob_size = tailpacked ? last_oob_block * data->erofs_blksz : file_size;
+		memcpy(content, data->erofs_data + raw_blkaddr * data->erofs_blksz,
 		       oob_size);
 		if (tailpacked)
 			memcpy(content + oob_size, tail_data, tail_size);
@@ -1786,7 +3124,7 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 							  name_len + value_size,
 						  4);
 
-			if (lcfs_build_node_erofs_xattr(node, name_index,
+			if (lcfs_build_node_erofs_xattr(data, node, name_index,
 							entry_name, name_len,
 							value, value_size) < 0)
 				return NULL;
@@ -1810,7 +3148,7 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 			uint16_t value_size =
 				lcfs_u16_from_file(entry->e_value_size);
 
-			if (lcfs_build_node_erofs_xattr(node, name_index,
+			if (lcfs_build_node_erofs_xattr(data, node, name_index,
 							entry_name, name_len,
 							value, value_size) < 0)
 				return NULL;
@@ -1820,92 +3158,525 @@ static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *da
 	return steal_pointer(&node);
 }
 
-static size_t node_ht_hasher(const void *d, size_t n)
+static void lcfs_image_data_clear_nodes(struct lcfs_image_data *data)
 {
-	const struct hasher_node_s *v = d;
-	return v->nid % n;
+	for (size_t i = 0; i < data->n_nids; i++) {
+		if (data->nodes[i]) {
+			lcfs_node_unref(data->nodes[i]);
+			data->nodes[i] = NULL;
+		}
+	}
 }
 
-static bool node_ht_comparator(const void *d1, const void *d2)
+void lcfs_image_data_unref(struct lcfs_image_data *data)
 {
-	const struct hasher_node_s *v1 = d1;
-	const struct hasher_node_s *v2 = d2;
+	data->ref_count--;
+
+	if (data->ref_count > 0)
+		return;
 
-	return v1->nid == v2->nid;
+	if (data->nodes) {
+		lcfs_image_data_clear_nodes(data);
+		free(data->nodes);
+	}
+	free(data->lazy_dirs);
+	if (data->view)
+		lcfs_image_close(data->view);
+	if (data->mapping)
+		munmap(data->mapping, data->mapping_size);
+	free(data);
 }
 
-struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_data,
-					      size_t image_data_size)
+/* Checks the headers and sets up data to decode the image, returns the
+ * root nid */
+static int lcfs_image_data_init(struct lcfs_image_data *data,
+				const uint8_t *image_data, size_t image_data_size,
+				uint64_t *root_nid_out)
 {
 	const uint8_t *image_data_end;
-	struct lcfs_image_data data = { image_data, image_data_size };
 	const struct lcfs_erofs_header_s *cfs_header;
 	const struct erofs_super_block *erofs_super;
-	uint64_t erofs_root_nid;
-	struct lcfs_node_s *root;
+	int n_long_prefixes;
 
 	if (image_data_size < EROFS_BLKSIZ) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
 	/* Avoid wrapping */
 	image_data_end = image_data + image_data_size;
 	if (image_data_end < image_data) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
 	cfs_header = (struct lcfs_erofs_header_s *)(image_data);
 	if (lcfs_u32_from_file(cfs_header->magic) != LCFS_EROFS_MAGIC) {
 		errno = EINVAL; /* Wrong cfs magic */
-		return NULL;
+		return -1;
 	}
 
 	if (lcfs_u32_from_file(cfs_header->version) != LCFS_EROFS_VERSION) {
 		errno = ENOTSUP; /* Wrong cfs version */
-		return NULL;
+		return -1;
 	}
 
 	erofs_super = (struct erofs_super_block *)(image_data + EROFS_SUPER_OFFSET);
 
 	if (lcfs_u32_from_file(erofs_super->magic) != EROFS_SUPER_MAGIC_V1) {
 		errno = EINVAL; /* Wrong erofs magic */
-		return NULL;
+		return -1;
 	}
 
-	data.erofs_metadata =
+	if (erofs_super->blkszbits < LCFS_BLOCK_SIZE_BITS_MIN ||
+	    erofs_super->blkszbits > LCFS_BLOCK_SIZE_BITS_MAX) {
+		errno = EINVAL; /* Unsupported block size */
+		return -1;
+	}
+	data->erofs_data = image_data;
+	data->erofs_data_size = image_data_size;
+	data->erofs_blkszbits = erofs_super->blkszbits;
+	data->erofs_blksz = 1ULL << data->erofs_blkszbits;
+
+	data->erofs_metadata =
 		image_data +
-		lcfs_u32_from_file(erofs_super->meta_blkaddr) * EROFS_BLKSIZ;
-	data.erofs_xattrdata =
+		lcfs_u32_from_file(erofs_super->meta_blkaddr) * data->erofs_blksz;
+	data->erofs_xattrdata =
 		image_data +
-		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * EROFS_BLKSIZ;
+		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * data->erofs_blksz;
 
-	if (data.erofs_metadata >= image_data_end ||
-	    data.erofs_xattrdata >= image_data_end) {
+	if (data->erofs_metadata >= image_data_end ||
+	    data->erofs_xattrdata >= image_data_end) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	data.erofs_metadata_end = image_data_end;
-	data.erofs_xattrdata_end = image_data_end;
+	data->erofs_metadata_end = image_data_end;
+	data->erofs_xattrdata_end = image_data_end;
 
-	data.erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
-	data.erofs_build_time_nsec =
+	data->erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
+	data->erofs_build_time_nsec =
 		lcfs_u32_from_file(erofs_super->build_time_nsec);
 
-	erofs_root_nid = lcfs_u16_from_file(erofs_super->root_nid);
+	n_long_prefixes = erofs_read_long_xattr_prefixes(image_data, image_data_size,
+							 erofs_super,
+							 data->long_prefixes);
+	if (n_long_prefixes < 0)
+		return -1;
+	data->n_long_prefixes = n_long_prefixes;
+
+	/* Decoding doesn't check the bounds of the inode data, so
+	 * validate it up front. Lazy loads check each directory before
+	 * decoding it instead, so opening doesn't depend on the size. */
+	data->view = lcfs_image_open_data(image_data, image_data_size);
+	if (data->view == NULL)
+		return -1;
+
+	*root_nid_out = lcfs_u16_from_file(erofs_super->root_nid);
+
+	if (data->lazy)
+		return lcfs_image_validate_root(data->view);
+
+	if (lcfs_image_validate(data->view) < 0)
+		return -1;
+
+	/* Validated nids are bounded by the last inode, so they index a
+	 * table that doesn't cover the xattrs and data blocks */
+	data->n_nids = lcfs_image_get_n_nids(data->view);
+	data->nodes = calloc(data->n_nids, sizeof(struct lcfs_node_s *));
+	data->lazy_dirs = calloc(DIV_ROUND_UP(data->n_nids, 8), 1);
+	if (data->nodes == NULL || data->lazy_dirs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* With LCFS_LOAD_PARALLEL, the directories down to this depth are
+ * decoded first, and the subtrees below them are then decoded on
+ * worker threads. */
+#define LCFS_LOAD_PARALLEL_DEPTH 2
+
+struct lcfs_load_task_s {
+	struct lcfs_image_data data; /* Private copy, with its own links */
+	struct lcfs_node_s *parent;
+	char *name;
+	uint64_t nid;
+	struct lcfs_node_s *node;
+	int err;
+};
+
+struct lcfs_load_parallel_s {
+	struct lcfs_image_data *data;
+	struct lcfs_load_task_s *tasks; /* In serial decode order */
+	size_t n_tasks;
+	size_t tasks_capacity;
+	pthread_mutex_t lock;
+	size_t next_task;
+	int depth;
+};
+
+static int lcfs_load_expand_dir(struct lcfs_load_parallel_s *pl,
+				struct lcfs_node_s *node, uint64_t nid);
+
+static int lcfs_load_add_task(struct lcfs_load_parallel_s *pl,
+			      struct lcfs_node_s *parent, const char *name,
+			      uint64_t nid)
+{
+	struct lcfs_load_task_s *task;
+
+	if (pl->n_tasks == pl->tasks_capacity) {
+		size_t new_capacity = pl->tasks_capacity ? pl->tasks_capacity * 2 : 64;
+		struct lcfs_load_task_s *new_tasks;
+
+		new_tasks = reallocarray(pl->tasks, new_capacity,
+					 sizeof(struct lcfs_load_task_s));
+		if (new_tasks == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		pl->tasks = new_tasks;
+		pl->tasks_capacity = new_capacity;
+	}
+
+	task = &pl->tasks[pl->n_tasks];
+	memset(task, 0, sizeof(*task));
+	task->name = strdup(name);
+	if (task->name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	task->parent = parent;
+	task->nid = nid;
+	pl->n_tasks++;
+
+	return 0;
+}
+
+static int lcfs_load_expand_child(struct lcfs_image_data *data,
+				  struct lcfs_node_s *parent, const char *name,
+				  uint64_t nid, void *user_data)
+{
+	struct lcfs_load_parallel_s *pl = user_data;
+	cleanup_node struct lcfs_node_s *child = NULL;
+	struct lcfs_node_s *dir;
+	const erofs_inode *cino;
+	uint64_t file_size;
+	uint16_t xattr_icount;
+	uint32_t raw_blkaddr;
+	uint32_t mode;
+	size_t isize;
+	int ret;
+
+	cino = lcfs_image_get_erofs_inode(data, nid);
+	if (cino == NULL)
+		return -1;
+
+	erofs_inode_get_info(cino, &mode, &file_size, &xattr_icount,
+			     &raw_blkaddr, &isize);
+	if ((mode & S_IFMT) != S_IFDIR || pl->depth + 1 >= LCFS_LOAD_PARALLEL_DEPTH)
+		return lcfs_load_add_task(pl, parent, name, nid);
+
+	child = lcfs_build_node_from_image(data, nid);
+	if (child == NULL)
+		return -1;
+
+	if (lcfs_node_add_child(parent, child, name) < 0)
+		return -1;
+	dir = steal_pointer(&child);
+
+	pl->depth++;
+	ret = lcfs_load_expand_dir(pl, dir, nid);
+	pl->depth--;
+
+	return ret;
+}
+
+/* Adds the directories near the top of the tree, and a task for
+ * everything below them */
+static int lcfs_load_expand_dir(struct lcfs_load_parallel_s *pl,
+				struct lcfs_node_s *node, uint64_t nid)
+{
+	const erofs_inode *cino;
+
+	cino = lcfs_image_get_erofs_inode(pl->data, nid);
+	if (cino == NULL)
+		return -1;
+
+	return erofs_iterate_dir(pl->data, node, cino, lcfs_load_expand_child, pl);
+}
+
+static void *lcfs_load_worker(void *arg)
+{
+	struct lcfs_load_parallel_s *pl = arg;
+
+	for (;;) {
+		struct lcfs_load_task_s *task;
+		size_t i;
+
+		pthread_mutex_lock(&pl->lock);
+		i = pl->next_task++;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (i >= pl->n_tasks)
+			break;
+
+		task = &pl->tasks[i];
+		task->data = *pl->data;
+		task->data.shallow = false;
+		task->data.track_links = true;
+		/* Orders the nodes of the tasks like the serial decode */
+		task->data.seq = (uint64_t)(i + 1) << 32;
+
+		task->node = lcfs_build_node_from_image(&task->data, task->nid);
+		if (task->node == NULL)
+			task->err = errno;
+	}
+
+	return NULL;
+}
+
+static void lcfs_load_task_free(struct lcfs_load_task_s *task)
+{
+	free(task->data.links);
+	if (task->node)
+		lcfs_node_unref(task->node);
+	free(task->name);
+}
+
+/* Points the hardlinks of a task to their targets. The first thread
+ * to decode an inode owns it, but the serial decode would have
+ * created it at its first dirent, so if that is a hardlink the two
+ * are swapped. Tasks must be merged in order. */
+static void lcfs_load_merge_links(struct lcfs_image_data *data,
+				  struct lcfs_load_task_s *task)
+{
+	for (size_t i = 0; i < task->data.n_links; i++) {
+		struct lcfs_image_link_s *link = &task->data.links[i];
+		struct lcfs_node_s *target = data->nodes[link->nid];
+
+		if (link->seq < data->nodes_seq[link->nid]) {
+			lcfs_node_swap_positions(link->node, target);
+			data->nodes_seq[link->nid] = link->seq;
+		}
+		link->node->link_to = lcfs_node_ref(target);
+	}
+}
+
+/* Decodes the tree on multiple threads, returns NULL with errno set to
+ * EAGAIN if the tree can't be decoded like the serial decode would */
+static struct lcfs_node_s *lcfs_load_parallel(struct lcfs_image_data *data,
+					      uint64_t root_nid, size_t n_threads)
+{
+	struct lcfs_load_parallel_s pl = { data };
+	cleanup_node struct lcfs_node_s *root = NULL;
+	cleanup_free pthread_t *threads = NULL;
+	size_t n_started = 0;
+	bool failed = false;
+
+	data->nodes_seq = calloc(data->n_nids, sizeof(uint64_t));
+	if (data->nodes_seq == NULL) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	data->shallow = true;
+	root = lcfs_build_node_from_image(data, root_nid);
+	if (root != NULL && (root->inode.st_mode & S_IFMT) == S_IFDIR &&
+	    lcfs_load_expand_dir(&pl, root, root_nid) < 0)
+		failed = true;
+	data->shallow = false;
+	if (root == NULL)
+		failed = true;
+
+	if (n_threads > pl.n_tasks)
+		n_threads = pl.n_tasks;
+	if (!failed && n_threads > 1)
+		threads = calloc(n_threads - 1, sizeof(pthread_t));
+
+	pthread_mutex_init(&pl.lock, NULL);
+	for (size_t i = 0; threads != NULL && i < n_threads - 1; i++) {
+		if (pthread_create(&threads[n_started], NULL, lcfs_load_worker,
+				   &pl) == 0)
+			n_started++;
+	}
+	/* This thread works too, and does everything if no threads started */
+	if (!failed)
+		lcfs_load_worker(&pl);
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pl.lock);
+
+	for (size_t i = 0; i < pl.n_tasks && !failed; i++) {
+		struct lcfs_load_task_s *task = &pl.tasks[i];
+
+		if (task->err == ENOTSUP)
+			continue; /* Skip real whiteouts (00-ff) */
+		if (task->err != 0 ||
+		    lcfs_node_add_child(task->parent, task->node, task->name) < 0)
+			failed = true;
+		else
+			task->node = NULL;
+	}
+
+	for (size_t i = 0; i < pl.n_tasks && !failed; i++)
+		lcfs_load_merge_links(data, &pl.tasks[i]);
+
+	for (size_t i = 0; i < pl.n_tasks; i++)
+		lcfs_load_task_free(&pl.tasks[i]);
+	free(pl.tasks);
+	free(steal_pointer(&data->nodes_seq));
+
+	if (failed) {
+		lcfs_image_data_clear_nodes(data);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return steal_pointer(&root);
+}
+
+/* Threads used by LCFS_LOAD_PARALLEL, one per online CPU unless the
+ * caller asked for a number */
+static long lcfs_load_n_threads(uint32_t threads)
+{
+	long n_threads = threads;
+
+	if (n_threads == 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return min(n_threads, LCFS_MAX_THREADS);
+}
+
+static struct lcfs_node_s *lcfs_build_root_from_image(struct lcfs_image_data *data,
+						      uint64_t root_nid,
+						      int loadflags, uint32_t threads)
+{
+	if (loadflags & LCFS_LOAD_PARALLEL) {
+		long n_threads = lcfs_load_n_threads(threads);
+		struct lcfs_node_s *root;
+
+		if (n_threads > 1) {
+			root = lcfs_load_parallel(data, root_nid, n_threads);
+			if (root != NULL || errno != EAGAIN)
+				return root;
+			/* Fall back to the serial decode, which gives the
+			 * same error, or handles the rare cases the
+			 * parallel one doesn't */
+		}
+	}
 
-	data.node_hash =
-		hash_initialize(0, NULL, node_ht_hasher, node_ht_comparator, free);
-	if (data.node_hash == NULL) {
+	return lcfs_build_node_from_image(data, root_nid);
+}
+
+struct lcfs_node_s *lcfs_load_node_from_mapping(void *mapping, size_t mapping_size,
+						const uint8_t *image_data,
+						size_t image_data_size, int loadflags,
+						uint32_t threads)
+{
+	struct lcfs_image_data *data;
+	uint64_t root_nid;
+	struct lcfs_node_s *root;
+	int errsv;
+
+	data = calloc(1, sizeof(struct lcfs_image_data));
+	if (data == NULL) {
+		if (mapping)
+			munmap(mapping, mapping_size);
 		errno = ENOMEM;
 		return NULL;
 	}
+	data->ref_count = 1;
+	data->mapping = mapping;
+	data->mapping_size = mapping_size;
+	data->lazy = (loadflags & LCFS_LOAD_LAZY) != 0;
 
-	root = lcfs_build_node_from_image(&data, erofs_root_nid);
+	if (lcfs_image_data_init(data, image_data, image_data_size, &root_nid) < 0)
+		root = NULL;
+	else
+		root = lcfs_build_root_from_image(data, root_nid, loadflags,
+						  threads);
 
-	hash_free(data.node_hash);
+	errsv = errno;
+	lcfs_image_data_unref(data);
+	errno = errsv;
 
 	return root;
 }
+
+struct lcfs_node_s *lcfs_load_node_from_image_ext(const uint8_t *image_data,
+						  size_t image_data_size,
+						  int loadflags, uint32_t threads)
+{
+	if ((loadflags & ~(LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) != 0 ||
+	    (loadflags & (LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) ==
+		    (LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return lcfs_load_node_from_mapping(NULL, 0, image_data, image_data_size,
+					   loadflags, threads);
+}
+
+struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_data,
+					      size_t image_data_size)
+{
+	return lcfs_load_node_from_image_ext(image_data, image_data_size, 0, 0);
+}
+
+/* Undoes what decoding the dirent did in data. A node that failed
+ * to decode, or to be added to the parent, has no parent. */
+static int erofs_forget_child(struct lcfs_image_data *data,
+			      struct lcfs_node_s *parent, const char *name,
+			      uint64_t nid, void *user_data)
+{
+	struct lcfs_node_s *child;
+
+	/* Not reached before the failure */
+	if (nid >= data->n_nids)
+		return 0;
+
+	/* Directories can't be hardlinked, so only this dirent set it */
+	child = data->nodes[nid];
+	data->lazy_dirs[nid / 8] &= ~(1 << (nid % 8));
+
+	if (child != NULL && (child->parent == NULL || child->parent == parent)) {
+		data->nodes[nid] = NULL;
+		lcfs_node_unref(child);
+	}
+
+	return 0;
+}
+
+int lcfs_node_load_children(struct lcfs_node_s *node)
+{
+	struct lcfs_image_data *data = node->image;
+	const erofs_inode *cino;
+	int errsv;
+
+	/* The inodes of the dirents are bounds checked once, here, as
+	 * lazy loads don't validate the whole image */
+	cino = lcfs_image_get_erofs_inode(data, node->erofs_nid);
+	if (cino == NULL ||
+	    lcfs_image_validate_dir_entries(data->view, node->erofs_nid) < 0)
+		return -1;
+
+	/* Cleared while decoding, as adding the children checks it */
+	node->image = NULL;
+
+	if (erofs_build_dir_children(data, node, cino) == 0) {
+		lcfs_image_data_unref(data);
+		return 0;
+	}
+
+	/* Drop the children decoded so far, so the next call starts over */
+	errsv = errno;
+	erofs_iterate_dir(data, node, cino, erofs_forget_child, NULL);
+	lcfs_node_remove_all_children(node);
+	node->image = data;
+	errno = errsv;
+
+	return -1;
+}
@@ -0,0 +1,1887 @@
+/* lcfs
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-internal.h"
+#include "lcfs-writer.h"
+#include "lcfs-utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+/* The stream writer gets the nodes one at a time, in the order that
+ * composefs-info dump prints them (depth-first, with the entries of
+ * each directory sorted by name), and stores them in temporary files,
+ * one per tree depth. Directories are stored once all their entries
+ * are known. Reading the files in order of depth then gives the nodes
+ * in breadth-first order, which is the default layout of
+ * lcfs_write_to(). The writer makes multiple passes over the files,
+ * and only keeps the entries of the currently open directories, the
+ * hardlinks and the shared xattrs in memory. */
+
+/* Buffer size for reads and writes of temporary files */
+#define LCFS_SPILL_BUF_SIZE (64 * 1024)
+
+/* Counted records are split by hash into partitions of about this
+ * size, each of which is counted in memory */
+#define LCFS_SPILL_PARTITION_SIZE (64 * 1024 * 1024)
+
+struct lcfs_spill_s {
+	int fd;
+	off_t size; /* Including what is still in buf */
+	uint8_t buf[LCFS_SPILL_BUF_SIZE];
+	size_t buf_len;
+};
+
+struct lcfs_spill_reader_s {
+	struct lcfs_spill_s *spill;
+	off_t offset; /* Offset of buf in the file */
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_pos;
+};
+
+enum {
+	LCFS_STREAM_ENTRY_NODE,
+	LCFS_STREAM_ENTRY_LINK,
+	LCFS_STREAM_ENTRY_SYNTHETIC,
+};
+
+struct lcfs_stream_entry_s {
+	char *name;
+	uint8_t kind;
+	uint64_t link; /* Index in links for LCFS_STREAM_ENTRY_LINK */
+	struct lcfs_node_s *node; /* For LCFS_STREAM_ENTRY_SYNTHETIC */
+};
+
+struct lcfs_stream_dir_s {
+	struct lcfs_node_s *node;
+	char *name;
+	struct lcfs_stream_entry_s *entries;
+	size_t n_entries;
+	size_t alloc_entries;
+	size_t n_subdirs;
+	bool has_whiteouts;
+};
+
+struct lcfs_stream_link_s {
+	char *path;
+	char *target_path;
+	bool resolved;
+	uint32_t target_depth;
+	uint64_t target_index;
+
+	/* Set during the layout pass */
+	uint64_t nid;
+	uint32_t mode;
+};
+
+struct lcfs_stream_depth_s {
+	struct lcfs_spill_s *records; /* Serialized nodes */
+	uint64_t n_records;
+	struct lcfs_spill_s *nids; /* nid and mode of each node */
+	struct lcfs_spill_s *parents; /* nid and number of children of each parent */
+};
+
+/* Header of serialized nodes, followed by the digest, payload,
+ * content, xattrs and directory entries */
+struct lcfs_stream_record_s {
+	struct lcfs_inode_s inode;
+	uint32_t flags;
+	uint32_t payload_len;
+	uint32_t n_xattrs;
+	uint64_t n_entries;
+};
+
+#define LCFS_STREAM_RECORD_DIGEST (1 << 0)
+#define LCFS_STREAM_RECORD_PAYLOAD (1 << 1)
+#define LCFS_STREAM_RECORD_CONTENT (1 << 2)
+#define LCFS_STREAM_RECORD_HAS_WHITEOUTS (1 << 3)
+
+struct lcfs_write_stream_s {
+	struct lcfs_write_options_s *options;
+	char *tmpdir;
+
+	struct lcfs_stream_depth_s *depths;
+	size_t n_depths;
+
+	/* Open directories, from the root down */
+	struct lcfs_stream_dir_s *stack;
+	size_t stack_len;
+	size_t stack_alloc;
+
+	struct lcfs_stream_link_s *links;
+	size_t n_links;
+	size_t alloc_links;
+	size_t *links_by_target; /* Link indexes in node order of their targets */
+	char *failed_path; /* Hardlink target that couldn't be resolved */
+
+	struct lcfs_spill_s *paths; /* Depth, index and path of non-directories */
+	struct lcfs_spill_s *mtimes; /* mtimes of possibly compact inodes */
+
+	struct lcfs_node_s *root;
+	struct lcfs_stream_entry_s *root_entries;
+	size_t n_root_entries;
+	bool finished;
+
+	uint64_t n_inodes;
+	int64_t min_mtim_sec;
+	uint32_t min_mtim_nsec;
+	int64_t common_mtim_sec;
+	uint32_t common_mtim_nsec;
+	bool has_acl;
+
+	/* Iteration state */
+	bool record_nids;
+	bool have_nids;
+	size_t it_depth;
+	uint64_t it_index; /* Records read at it_depth */
+	size_t it_root_entry; /* Next entry of root at depth 1 */
+	uint64_t it_inode_num;
+	struct lcfs_spill_reader_s it_records;
+	struct lcfs_spill_reader_s it_nids;
+	struct lcfs_spill_reader_s it_child_nids;
+	struct lcfs_spill_reader_s it_parents;
+	uint64_t it_parent_nid;
+	uint64_t it_parent_remaining;
+	size_t it_link;
+
+	/* The node last returned by lcfs_write_stream_next() */
+	bool cur_synthetic;
+	uint64_t cur_index;
+	uint64_t cur_n_children;
+};
+
+struct lcfs_spill_s *lcfs_spill_new(const char *tmpdir)
+{
+	struct lcfs_spill_s *spill;
+	int fd;
+
+	fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		cleanup_free char *template = str_join(tmpdir, "/lcfs-stream.XXXXXX");
+		if (template == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		fd = mkostemp(template, O_CLOEXEC);
+		if (fd >= 0)
+			(void)unlink(template);
+	}
+	if (fd < 0)
+		return NULL;
+
+	spill = calloc(1, sizeof(struct lcfs_spill_s));
+	if (spill == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	spill->fd = fd;
+
+	return spill;
+}
+
+void lcfs_spill_free(struct lcfs_spill_s *spill)
+{
+	if (spill == NULL)
+		return;
+
+	close(spill->fd);
+	free(spill);
+}
+
+static int lcfs_spill_flush(struct lcfs_spill_s *spill)
+{
+	off_t offset = spill->size - spill->buf_len;
+	size_t done = 0;
+
+	while (done < spill->buf_len) {
+		ssize_t r = pwrite(spill->fd, spill->buf + done,
+				   spill->buf_len - done, offset + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+		done += r;
+	}
+	spill->buf_len = 0;
+
+	return 0;
+}
+
+int lcfs_spill_write(struct lcfs_spill_s *spill, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		size_t n = min(len, LCFS_SPILL_BUF_SIZE - spill->buf_len);
+
+		memcpy(spill->buf + spill->buf_len, p, n);
+		spill->buf_len += n;
+		spill->size += n;
+		p += n;
+		len -= n;
+
+		if (spill->buf_len == LCFS_SPILL_BUF_SIZE &&
+		    lcfs_spill_flush(spill) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+ssize_t lcfs_spill_write_cb(void *file, void *buf, size_t count)
+{
+	if (lcfs_spill_write(file, buf, count) < 0)
+		return -1;
+
+	return count;
+}
+
+/* Adds a length-prefixed record, for lcfs_spill_count_records() */
+int lcfs_spill_add_record(struct lcfs_spill_s *spill, const void *data, size_t len)
+{
+	uint32_t len32 = len;
+
+	if (len > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lcfs_spill_write(spill, &len32, sizeof(len32)) < 0)
+		return -1;
+
+	return lcfs_spill_write(spill, data, len);
+}
+
+static int lcfs_spill_reader_init(struct lcfs_spill_reader_s *r,
+				  struct lcfs_spill_s *spill)
+{
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+
+	if (spill == NULL)
+		return 0;
+
+	if (lcfs_spill_flush(spill) < 0)
+		return -1;
+
+	r->buf = malloc(LCFS_SPILL_BUF_SIZE);
+	if (r->buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	r->spill = spill;
+
+	return 0;
+}
+
+static void lcfs_spill_reader_clear(struct lcfs_spill_reader_s *r)
+{
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+}
+
+static bool lcfs_spill_reader_at_end(struct lcfs_spill_reader_s *r)
+{
+	return r->spill == NULL ||
+	       r->offset + (off_t)r->buf_pos >= r->spill->size;
+}
+
+static int lcfs_spill_read(struct lcfs_spill_reader_s *r, void *data, size_t len)
+{
+	uint8_t *p = data;
+
+	while (len > 0) {
+		size_t n;
+
+		if (r->buf_pos == r->buf_len) {
+			ssize_t res;
+
+			if (lcfs_spill_reader_at_end(r)) {
+				/* Reading past what we wrote */
+				errno = EIO;
+				return -1;
+			}
+
+			r->offset += r->buf_len;
+			r->buf_pos = 0;
+			r->buf_len = 0;
+			do {
+				res = pread(r->spill->fd, r->buf,
+					    LCFS_SPILL_BUF_SIZE, r->offset);
+			} while (res < 0 && errno == EINTR);
+			if (res <= 0) {
+				if (res == 0)
+					errno = EIO;
+				return -1;
+			}
+			r->buf_len = res;
+		}
+
+		n = min(len, r->buf_len - r->buf_pos);
+		memcpy(p, r->buf + r->buf_pos, n);
+		r->buf_pos += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Reads len bytes into a new zero terminated buffer */
+static char *lcfs_spill_read_alloc(struct lcfs_spill_reader_s *r, size_t len)
+{
+	cleanup_free char *data = malloc(len + 1);
+
+	if (data == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (lcfs_spill_read(r, data, len) < 0)
+		return NULL;
+	data[len] = 0;
+
+	return steal_pointer(&data);
+}
+
+/* Copies all the content of the spill to the image */
+int lcfs_spill_copy_to(struct lcfs_spill_s *spill, struct lcfs_ctx_s *ctx)
+{
+	off_t offset = 0;
+
+	if (lcfs_spill_flush(spill) < 0)
+		return -1;
+
+	while (offset < spill->size) {
+		ssize_t r = pread(spill->fd, spill->buf,
+				  min((off_t)LCFS_SPILL_BUF_SIZE, spill->size - offset),
+				  offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+
+		if (lcfs_write(ctx, spill->buf, r) < 0)
+			return -1;
+		offset += r;
+	}
+
+	return 0;
+}
+
+struct lcfs_spill_record_s {
+	const uint8_t *data;
+	uint32_t len;
+};
+
+static int cmp_spill_record(const void *a, const void *b)
+{
+	const struct lcfs_spill_record_s *ra = a;
+	const struct lcfs_spill_record_s *rb = b;
+
+	if (ra->len != rb->len)
+		return ra->len < rb->len ? -1 : 1;
+
+	return memcmp(ra->data, rb->data, ra->len);
+}
+
+static int lcfs_spill_count_partition(struct lcfs_spill_s *spill,
+				      lcfs_spill_count_cb cb, void *cb_data)
+{
+	struct lcfs_spill_reader_s r = { NULL };
+	cleanup_free uint8_t *data = NULL;
+	cleanup_free struct lcfs_spill_record_s *records = NULL;
+	size_t n_records = 0, alloc_records = 0;
+	size_t pos;
+
+	if (spill->size == 0)
+		return 0;
+
+	data = malloc(spill->size);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (lcfs_spill_reader_init(&r, spill) < 0)
+		return -1;
+	if (lcfs_spill_read(&r, data, spill->size) < 0) {
+		lcfs_spill_reader_clear(&r);
+		return -1;
+	}
+	lcfs_spill_reader_clear(&r);
+
+	for (pos = 0; pos < (size_t)spill->size;) {
+		uint32_t len;
+
+		if (n_records == alloc_records) {
+			size_t new_alloc = alloc_records == 0 ? 1024 : alloc_records * 2;
+			struct lcfs_spill_record_s *new_records = reallocarray(
+				records, new_alloc, sizeof(struct lcfs_spill_record_s));
+			if (new_records == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			records = new_records;
+			alloc_records = new_alloc;
+		}
+
+		memcpy(&len, data + pos, sizeof(len));
+		pos += sizeof(len);
+		records[n_records].data = data + pos;
+		records[n_records].len = len;
+		n_records++;
+		pos += len;
+	}
+
+	qsort(records, n_records, sizeof(struct lcfs_spill_record_s),
+	      cmp_spill_record);
+
+	for (size_t i = 0; i < n_records;) {
+		size_t j = i + 1;
+
+		while (j < n_records && cmp_spill_record(&records[i], &records[j]) == 0)
+			j++;
+
+		if (cb(cb_data, records[i].data, records[i].len, j - i) < 0)
+			return -1;
+		i = j;
+	}
+
+	return 0;
+}
+
+/* 64bit FNV-1a */
+static uint64_t lcfs_spill_record_hash(const uint8_t *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* Calls cb once for each distinct record added with
+ * lcfs_spill_add_record(), with the number of times it was added.
+ * Large spills are first split into partitions by record hash, so
+ * that all copies of a record are counted in the same partition. */
+int lcfs_spill_count_records(struct lcfs_write_stream_s *stream,
+			     struct lcfs_spill_s *spill,
+			     lcfs_spill_count_cb cb, void *cb_data)
+{
+	struct lcfs_spill_reader_s r = { NULL };
+	struct lcfs_spill_s **parts;
+	size_t n_parts;
+	cleanup_free uint8_t *data = NULL;
+	size_t data_alloc = 0;
+	int ret = -1;
+
+	if (lcfs_spill_flush(spill) < 0)
+		return -1;
+
+	n_parts = 1 + spill->size / LCFS_SPILL_PARTITION_SIZE;
+	if (n_parts == 1)
+		return lcfs_spill_count_partition(spill, cb, cb_data);
+
+	parts = calloc(n_parts, sizeof(struct lcfs_spill_s *));
+	if (parts == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size_t i = 0; i < n_parts; i++) {
+		parts[i] = lcfs_spill_new(stream->tmpdir);
+		if (parts[i] == NULL)
+			goto out;
+	}
+
+	if (lcfs_spill_reader_init(&r, spill) < 0)
+		goto out;
+
+	while (!lcfs_spill_reader_at_end(&r)) {
+		uint32_t len;
+
+		if (lcfs_spill_read(&r, &len, sizeof(len)) < 0)
+			goto out;
+		if (len > data_alloc) {
+			uint8_t *new_data = realloc(data, len);
+			if (new_data == NULL) {
+				errno = ENOMEM;
+				goto out;
+			}
+			data = new_data;
+			data_alloc = len;
+		}
+		if (lcfs_spill_read(&r, data, len) < 0)
+			goto out;
+
+		if (lcfs_spill_add_record(
+			    parts[lcfs_spill_record_hash(data, len) % n_parts],
+			    data, len) < 0)
+			goto out;
+	}
+
+	for (size_t i = 0; i < n_parts; i++) {
+		if (lcfs_spill_count_partition(parts[i], cb, cb_data) < 0)
+			goto out;
+
+		/* Release the disk space early */
+		lcfs_spill_free(parts[i]);
+		parts[i] = NULL;
+	}
+
+	ret = 0;
+
+out:
+	lcfs_spill_reader_clear(&r);
+	for (size_t i = 0; i < n_parts; i++)
+		lcfs_spill_free(parts[i]);
+	free(parts);
+
+	return ret;
+}
+
+struct lcfs_spill_s *lcfs_write_stream_new_spill(struct lcfs_write_stream_s *stream)
+{
+	return lcfs_spill_new(stream->tmpdir);
+}
+
+static struct lcfs_stream_depth_s *lcfs_write_stream_get_depth(struct lcfs_write_stream_s *stream,
+							       size_t depth)
+{
+	if (depth >= stream->n_depths) {
+		struct lcfs_stream_depth_s *new_depths;
+
+		new_depths = reallocarray(stream->depths, depth + 1,
+					  sizeof(struct lcfs_stream_depth_s));
+		if (new_depths == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(new_depths + stream->n_depths, 0,
+		       (depth + 1 - stream->n_depths) *
+			       sizeof(struct lcfs_stream_depth_s));
+		stream->depths = new_depths;
+		stream->n_depths = depth + 1;
+	}
+
+	if (stream->depths[depth].records == NULL) {
+		stream->depths[depth].records = lcfs_spill_new(stream->tmpdir);
+		if (stream->depths[depth].records == NULL)
+			return NULL;
+	}
+
+	return &stream->depths[depth];
+}
+
+static void lcfs_stream_entries_free(struct lcfs_stream_entry_s *entries,
+				     size_t n_entries)
+{
+	for (size_t i = 0; i < n_entries; i++) {
+		free(entries[i].name);
+		if (entries[i].node)
+			lcfs_node_unref(entries[i].node);
+	}
+	free(entries);
+}
+
+static int lcfs_stream_write_node(struct lcfs_write_stream_s *stream,
+				  size_t depth, struct lcfs_node_s *node,
+				  uint32_t flags,
+				  struct lcfs_stream_entry_s *entries,
+				  size_t n_entries)
+{
+	struct lcfs_stream_depth_s *d;
+	struct lcfs_stream_record_s record;
+	struct lcfs_spill_s *spill;
+
+	d = lcfs_write_stream_get_depth(stream, depth);
+	if (d == NULL)
+		return -1;
+	spill = d->records;
+
+	memset(&record, 0, sizeof(record));
+	record.inode = node->inode;
+	record.flags = flags;
+	if (node->digest_set)
+		record.flags |= LCFS_STREAM_RECORD_DIGEST;
+	if (node->payload) {
+		record.flags |= LCFS_STREAM_RECORD_PAYLOAD;
+		record.payload_len = strlen(node->payload);
+	}
+	if (node->content)
+		record.flags |= LCFS_STREAM_RECORD_CONTENT;
+	record.n_xattrs = node->n_xattrs;
+	record.n_entries = n_entries;
+
+	if (lcfs_spill_write(spill, &record, sizeof(record)) < 0)
+		return -1;
+
+	if (node->digest_set &&
+	    lcfs_spill_write(spill, node->digest, LCFS_DIGEST_SIZE) < 0)
+		return -1;
+
+	if (node->payload &&
+	    lcfs_spill_write(spill, node->payload, record.payload_len) < 0)
+		return -1;
+
+	if (node->content &&
+	    lcfs_spill_write(spill, node->content, node->inode.st_size) < 0)
+		return -1;
+
+	for (size_t i = 0; i < node->n_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[i];
+		uint16_t lens[2] = { strlen(xattr->key), xattr->value_len };
+
+		if (lcfs_spill_write(spill, lens, sizeof(lens)) < 0 ||
+		    lcfs_spill_write(spill, xattr->key, lens[0]) < 0 ||
+		    lcfs_spill_write(spill, xattr->value, lens[1]) < 0)
+			return -1;
+	}
+
+	for (size_t i = 0; i < n_entries; i++) {
+		struct lcfs_stream_entry_s *entry = &entries[i];
+		uint8_t header[2] = { entry->kind, strlen(entry->name) };
+
+		if (lcfs_spill_write(spill, header, sizeof(header)) < 0 ||
+		    lcfs_spill_write(spill, entry->name, header[1]) < 0 ||
+		    lcfs_spill_write(spill, &entry->link, sizeof(entry->link)) < 0)
+			return -1;
+	}
+
+	d->n_records++;
+
+	return 0;
+}
+
+static struct lcfs_node_s *lcfs_stream_read_node(struct lcfs_spill_reader_s *r,
+						 uint32_t *flags_out,
+						 struct lcfs_stream_entry_s **entries_out,
+						 size_t *n_entries_out)
+{
+	cleanup_node struct lcfs_node_s *node = NULL;
+	struct lcfs_stream_record_s record;
+	struct lcfs_stream_entry_s *entries = NULL;
+
+	if (lcfs_spill_read(r, &record, sizeof(record)) < 0)
+		return NULL;
+
+	node = lcfs_node_new();
+	if (node == NULL)
+		return NULL;
+
+	node->inode = record.inode;
+
+	if (record.flags & LCFS_STREAM_RECORD_DIGEST) {
+		if (lcfs_spill_read(r, node->digest, LCFS_DIGEST_SIZE) < 0)
+			return NULL;
+		node->digest_set = true;
+	}
+
+	if (record.flags & LCFS_STREAM_RECORD_PAYLOAD) {
+		node->payload = lcfs_spill_read_alloc(r, record.payload_len);
+		if (node->payload == NULL)
+			return NULL;
+	}
+
+	if (record.flags & LCFS_STREAM_RECORD_CONTENT) {
+		node->content =
+			(uint8_t *)lcfs_spill_read_alloc(r, node->inode.st_size);
+		if (node->content == NULL)
+			return NULL;
+	}
+
+	if (record.n_xattrs > 0) {
+		node->xattrs = calloc(record.n_xattrs, sizeof(struct lcfs_xattr_s));
+		if (node->xattrs == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	for (size_t i = 0; i < record.n_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[i];
+		uint16_t lens[2];
+
+		if (lcfs_spill_read(r, lens, sizeof(lens)) < 0)
+			return NULL;
+
+		xattr->key = lcfs_spill_read_alloc(r, lens[0]);
+		if (xattr->key == NULL)
+			return NULL;
+		node->n_xattrs++;
+
+		xattr->value = lcfs_spill_read_alloc(r, lens[1]);
+		if (xattr->value == NULL)
+			return NULL;
+		xattr->value_len = lens[1];
+	}
+
+	if (record.n_entries > 0) {
+		entries = calloc(record.n_entries, sizeof(struct lcfs_stream_entry_s));
+		if (entries == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	for (size_t i = 0; i < record.n_entries; i++) {
+		struct lcfs_stream_entry_s *entry = &entries[i];
+		uint8_t header[2];
+
+		if (lcfs_spill_read(r, header, sizeof(header)) < 0)
+			goto fail;
+		entry->kind = header[0];
+		entry->name = lcfs_spill_read_alloc(r, header[1]);
+		if (entry->name == NULL)
+			goto fail;
+		if (lcfs_spill_read(r, &entry->link, sizeof(entry->link)) < 0)
+			goto fail;
+	}
+
+	*flags_out = record.flags;
+	*entries_out = entries;
+	*n_entries_out = record.n_entries;
+
+	return steal_pointer(&node);
+
+fail:
+	lcfs_stream_entries_free(entries, record.n_entries);
+	return NULL;
+}
+
+struct lcfs_write_stream_s *lcfs_write_stream_new(struct lcfs_write_options_s *options,
+						  const char *tmpdir)
+{
+	struct lcfs_write_stream_s *stream;
+
+	if ((options->flags & ~LCFS_FLAGS_MASK) != 0 ||
+	    options->format != LCFS_FORMAT_EROFS ||
+	    options->version > LCFS_VERSION_MAX ||
+	    options->max_version > LCFS_VERSION_MAX ||
+	    (options->block_size_bits != 0 &&
+	     (options->block_size_bits < LCFS_BLOCK_SIZE_BITS_MIN ||
+	      options->block_size_bits > LCFS_BLOCK_SIZE_BITS_MAX))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* The nodes are only available in breadth-first order, and
+	 * content is not kept around to find duplicates */
+	if (options->layout != LCFS_LAYOUT_BFS ||
+	    (options->flags & LCFS_FLAGS_DEDUP_DATA_BLOCKS) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (options->max_version < options->version)
+		options->max_version = options->version;
+
+	if (tmpdir == NULL)
+		tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL)
+		tmpdir = "/var/tmp";
+
+	stream = calloc(1, sizeof(struct lcfs_write_stream_s));
+	if (stream == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	stream->options = options;
+
+	stream->tmpdir = strdup(tmpdir);
+	if (stream->tmpdir == NULL) {
+		lcfs_write_stream_free(stream);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	stream->paths = lcfs_spill_new(stream->tmpdir);
+	if (stream->paths == NULL) {
+		PROTECT_ERRNO;
+		lcfs_write_stream_free(stream);
+		return NULL;
+	}
+
+	if (options->max_version >= 3) {
+		stream->mtimes = lcfs_spill_new(stream->tmpdir);
+		if (stream->mtimes == NULL) {
+			PROTECT_ERRNO;
+			lcfs_write_stream_free(stream);
+			return NULL;
+		}
+	}
+
+	return stream;
+}
+
+void lcfs_write_stream_free(struct lcfs_write_stream_s *stream)
+{
+	if (stream == NULL)
+		return;
+
+	for (size_t i = 0; i < stream->n_depths; i++) {
+		lcfs_spill_free(stream->depths[i].records);
+		lcfs_spill_free(stream->depths[i].nids);
+		lcfs_spill_free(stream->depths[i].parents);
+	}
+	free(stream->depths);
+
+	for (size_t i = 0; i < stream->stack_len; i++) {
+		lcfs_node_unref(stream->stack[i].node);
+		free(stream->stack[i].name);
+		lcfs_stream_entries_free(stream->stack[i].entries,
+					 stream->stack[i].n_entries);
+	}
+	free(stream->stack);
+
+	for (size_t i = 0; i < stream->n_links; i++) {
+		free(stream->links[i].path);
+		free(stream->links[i].target_path);
+	}
+	free(stream->links);
+	free(stream->links_by_target);
+	free(stream->failed_path);
+
+	lcfs_spill_free(stream->paths);
+	lcfs_spill_free(stream->mtimes);
+
+	if (stream->root)
+		lcfs_node_unref(stream->root);
+	lcfs_stream_entries_free(stream->root_entries, stream->n_root_entries);
+
+	lcfs_spill_reader_clear(&stream->it_records);
+	lcfs_spill_reader_clear(&stream->it_nids);
+	lcfs_spill_reader_clear(&stream->it_child_nids);
+	lcfs_spill_reader_clear(&stream->it_parents);
+
+	free(stream->tmpdir);
+	free(stream);
+}
+
+/* Returns path in the form "/a/b", or "/" for the root */
+static char *lcfs_canonicalize_path(const char *path)
+{
+	cleanup_free char *res = malloc(strlen(path) + 2);
+	char *out = res;
+
+	if (res == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (;;) {
+		const char *start;
+
+		while (*path == '/')
+			path++;
+		if (*path == 0)
+			break;
+
+		start = path;
+		while (*path != 0 && *path != '/')
+			path++;
+
+		if ((path - start == 1 && start[0] == '.') ||
+		    (path - start == 2 && start[0] == '.' && start[1] == '.')) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (path - start > LCFS_MAX_NAME_LENGTH) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+
+		*out++ = '/';
+		memcpy(out, start, path - start);
+		out += path - start;
+	}
+
+	if (out == res)
+		*out++ = '/';
+	*out = 0;
+
+	return steal_pointer(&res);
+}
+
+static int lcfs_write_stream_close_dir(struct lcfs_write_stream_s *stream)
+{
+	struct lcfs_stream_dir_s *dir = &stream->stack[stream->stack_len - 1];
+	size_t depth = stream->stack_len - 1;
+	int ret;
+
+	/* Directory link counts are 2 + nr of subdirs */
+	dir->node->inode.st_nlink = 2 + dir->n_subdirs;
+
+	ret = lcfs_stream_write_node(stream, depth, dir->node,
+				     dir->has_whiteouts ? LCFS_STREAM_RECORD_HAS_WHITEOUTS : 0,
+				     dir->entries, dir->n_entries);
+	if (ret < 0)
+		return ret;
+
+	if (depth == 0) {
+		stream->root_entries = steal_pointer(&dir->entries);
+		stream->n_root_entries = dir->n_entries;
+	} else {
+		lcfs_stream_entries_free(dir->entries, dir->n_entries);
+	}
+
+	lcfs_node_unref(dir->node);
+	free(dir->name);
+	stream->stack_len--;
+
+	return 0;
+}
+
+/* Closes the open directories that are not a parent of the canonical
+ * path, and returns the parent, or NULL if it is not open. */
+static struct lcfs_stream_dir_s *lcfs_write_stream_open_parent(struct lcfs_write_stream_s *stream,
+							       const char *path,
+							       const char **name_out)
+{
+	const char *name = path + 1;
+	size_t depth = 0;
+
+	for (const char *p = name; *p != 0; p++) {
+		if (*p == '/') {
+			depth++;
+			if (depth >= stream->stack_len ||
+			    strlen(stream->stack[depth].name) != (size_t)(p - name) ||
+			    memcmp(stream->stack[depth].name, name, p - name) != 0) {
+				errno = EINVAL;
+				return NULL;
+			}
+			name = p + 1;
+		}
+	}
+
+	if (stream->stack_len == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (stream->stack_len > depth + 1) {
+		if (lcfs_write_stream_close_dir(stream) < 0)
+			return NULL;
+	}
+
+	*name_out = name;
+	return &stream->stack[depth];
+}
+
+static struct lcfs_stream_entry_s *
+lcfs_stream_dir_add_entry(struct lcfs_stream_dir_s *dir, const char *name, uint8_t kind)
+{
+	struct lcfs_stream_entry_s *entry;
+
+	/* Entries must come in order */
+	if (dir->n_entries > 0) {
+		int cmp = strcmp(name, dir->entries[dir->n_entries - 1].name);
+		if (cmp <= 0) {
+			errno = cmp == 0 ? EEXIST : EINVAL;
+			return NULL;
+		}
+	}
+
+	if (dir->n_entries == dir->alloc_entries) {
+		size_t new_alloc = dir->alloc_entries == 0 ? 16 : dir->alloc_entries * 2;
+		struct lcfs_stream_entry_s *new_entries = reallocarray(
+			dir->entries, new_alloc, sizeof(struct lcfs_stream_entry_s));
+		if (new_entries == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		dir->entries = new_entries;
+		dir->alloc_entries = new_alloc;
+	}
+
+	entry = &dir->entries[dir->n_entries];
+	memset(entry, 0, sizeof(*entry));
+	entry->name = strdup(name);
+	if (entry->name == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	entry->kind = kind;
+	dir->n_entries++;
+
+	return entry;
+}
+
+static int lcfs_write_stream_push_dir(struct lcfs_write_stream_s *stream,
+				      struct lcfs_node_s *node, const char *name)
+{
+	struct lcfs_stream_dir_s *dir;
+
+	if (stream->stack_len == stream->stack_alloc) {
+		size_t new_alloc = stream->stack_alloc == 0 ? 16 : stream->stack_alloc * 2;
+		struct lcfs_stream_dir_s *new_stack = reallocarray(
+			stream->stack, new_alloc, sizeof(struct lcfs_stream_dir_s));
+		if (new_stack == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		stream->stack = new_stack;
+		stream->stack_alloc = new_alloc;
+	}
+
+	dir = &stream->stack[stream->stack_len];
+	memset(dir, 0, sizeof(*dir));
+	dir->name = strdup(name);
+	if (dir->name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	dir->node = lcfs_node_clone(node);
+	if (dir->node == NULL) {
+		free(dir->name);
+		errno = ENOMEM;
+		return -1;
+	}
+	stream->stack_len++;
+
+	return 0;
+}
+
+static int lcfs_write_stream_add_mtime(struct lcfs_write_stream_s *stream,
+				       struct lcfs_node_s *node)
+{
+	uint8_t record[sizeof(int64_t) + sizeof(uint32_t)];
+
+	if (stream->n_inodes == 0 ||
+	    node->inode.st_mtim_sec < stream->min_mtim_sec ||
+	    (node->inode.st_mtim_sec == stream->min_mtim_sec &&
+	     node->inode.st_mtim_nsec < stream->min_mtim_nsec)) {
+		stream->min_mtim_sec = node->inode.st_mtim_sec;
+		stream->min_mtim_nsec = node->inode.st_mtim_nsec;
+	}
+
+	if (stream->mtimes == NULL || !lcfs_node_may_be_compact(node))
+		return 0;
+
+	memcpy(record, &node->inode.st_mtim_sec, sizeof(int64_t));
+	memcpy(record + sizeof(int64_t), &node->inode.st_mtim_nsec,
+	       sizeof(uint32_t));
+
+	return lcfs_spill_add_record(stream->mtimes, record, sizeof(record));
+}
+
+/* Adds a node at path. Nodes must be added in depth-first order with
+ * the entries of each directory sorted by name, starting with the
+ * root directory at "/". The node must not have children, as these
+ * are added separately, and it is not referenced after the call. */
+int lcfs_write_stream_add(struct lcfs_write_stream_s *stream, const char *path,
+			  struct lcfs_node_s *node)
+{
+	cleanup_free char *canonical = NULL;
+	struct lcfs_stream_dir_s *parent;
+	const char *name;
+	size_t depth;
+	int type = node->inode.st_mode & S_IFMT;
+
+	if (stream->finished || node->children_size != 0 || node->link_to != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	canonical = lcfs_canonicalize_path(path);
+	if (canonical == NULL)
+		return -1;
+
+	if (strcmp(canonical, "/") == 0) {
+		if (type != S_IFDIR || stream->n_inodes != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		stream->root = lcfs_node_clone(node);
+		if (stream->root == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		parent = NULL;
+		name = "";
+		depth = 0;
+	} else {
+		parent = lcfs_write_stream_open_parent(stream, canonical, &name);
+		if (parent == NULL)
+			return -1;
+		depth = stream->stack_len;
+
+		if (lcfs_stream_dir_add_entry(parent, name, LCFS_STREAM_ENTRY_NODE) == NULL)
+			return -1;
+	}
+
+	lcfs_node_update_version(node, stream->options);
+
+	if (lcfs_write_stream_add_mtime(stream, node) < 0)
+		return -1;
+
+	if (lcfs_node_get_xattr(node, "system.posix_acl_access", NULL) != NULL ||
+	    lcfs_node_get_xattr(node, "system.posix_acl_default", NULL) != NULL)
+		stream->has_acl = true;
+
+	stream->n_inodes++;
+
+	if (type == S_IFDIR) {
+		if (parent)
+			parent->n_subdirs++;
+
+		return lcfs_write_stream_push_dir(stream, node, name);
+	}
+
+	if (type == S_IFCHR && node->inode.st_rdev == makedev(0, 0))
+		parent->has_whiteouts = true;
+
+	/* Remember where the node is for resolving hardlinks */
+	{
+		uint32_t d = depth;
+		uint64_t index = stream->n_depths > depth ?
+					 stream->depths[depth].n_records :
+					 0;
+
+		if (lcfs_spill_write(stream->paths, &d, sizeof(d)) < 0 ||
+		    lcfs_spill_write(stream->paths, &index, sizeof(index)) < 0 ||
+		    lcfs_spill_add_record(stream->paths, canonical,
+					  strlen(canonical)) < 0)
+			return -1;
+	}
+
+	return lcfs_stream_write_node(stream, depth, node, 0, NULL, 0);
+}
+
+/* Adds a hardlink at path to the non-directory at target_path, which
+ * may be added before or after the link. As in dump files, the link
+ * count of the target is not changed. */
+int lcfs_write_stream_add_hardlink(struct lcfs_write_stream_s *stream,
+				   const char *path, const char *target_path)
+{
+	cleanup_free char *canonical = NULL;
+	cleanup_free char *canonical_target = NULL;
+	struct lcfs_stream_dir_s *parent;
+	struct lcfs_stream_entry_s *entry;
+	struct lcfs_stream_link_s *link;
+	const char *name;
+
+	if (stream->finished) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	canonical = lcfs_canonicalize_path(path);
+	if (canonical == NULL)
+		return -1;
+	canonical_target = lcfs_canonicalize_path(target_path);
+	if (canonical_target == NULL)
+		return -1;
+
+	if (strcmp(canonical, "/") == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	parent = lcfs_write_stream_open_parent(stream, canonical, &name);
+	if (parent == NULL)
+		return -1;
+
+	if (stream->n_links == stream->alloc_links) {
+		size_t new_alloc = stream->alloc_links == 0 ? 16 : stream->alloc_links * 2;
+		struct lcfs_stream_link_s *new_links = reallocarray(
+			stream->links, new_alloc, sizeof(struct lcfs_stream_link_s));
+		if (new_links == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		stream->links = new_links;
+		stream->alloc_links = new_alloc;
+	}
+
+	entry = lcfs_stream_dir_add_entry(parent, name, LCFS_STREAM_ENTRY_LINK);
+	if (entry == NULL)
+		return -1;
+	entry->link = stream->n_links;
+
+	link = &stream->links[stream->n_links++];
+	memset(link, 0, sizeof(*link));
+	link->path = steal_pointer(&canonical);
+	link->target_path = steal_pointer(&canonical_target);
+
+	return 0;
+}
+
+static int cmp_link_target_path(const void *a, const void *b, void *data)
+{
+	const struct lcfs_stream_link_s *links = data;
+	const size_t *ia = a;
+	const size_t *ib = b;
+
+	return strcmp(links[*ia].target_path, links[*ib].target_path);
+}
+
+static int cmp_link_path(const void *a, const void *b, void *data)
+{
+	const struct lcfs_stream_link_s *links = data;
+	const size_t *ia = a;
+	const size_t *ib = b;
+
+	return strcmp(links[*ia].path, links[*ib].path);
+}
+
+static int cmp_link_target_pos(const void *a, const void *b, void *data)
+{
+	const struct lcfs_stream_link_s *links = data;
+	const struct lcfs_stream_link_s *la = &links[*(const size_t *)a];
+	const struct lcfs_stream_link_s *lb = &links[*(const size_t *)b];
+
+	if (la->target_depth != lb->target_depth)
+		return la->target_depth < lb->target_depth ? -1 : 1;
+	if (la->target_index != lb->target_index)
+		return la->target_index < lb->target_index ? -1 : 1;
+	return 0;
+}
+
+/* Returns the index of the link at path, or n_links if there is
+ * none. by_path has the link indexes sorted by their path. */
+static size_t lcfs_write_stream_find_link(struct lcfs_write_stream_s *stream,
+					  const size_t *by_path, const char *path)
+{
+	size_t lo = 0, hi = stream->n_links;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(stream->links[by_path[mid]].path, path);
+
+		if (cmp == 0)
+			return by_path[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return stream->n_links;
+}
+
+/* Resolves hardlinks to other hardlinks by following target_path
+ * until a link that points to a node. Sets failed_path and fails with
+ * ENOENT if there is no such link, or ELOOP if the links form a
+ * loop. */
+static int lcfs_write_stream_resolve_link_chains(struct lcfs_write_stream_s *stream)
+{
+	cleanup_free size_t *by_path = NULL;
+
+	by_path = calloc(stream->n_links, sizeof(size_t));
+	if (by_path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size_t i = 0; i < stream->n_links; i++)
+		by_path[i] = i;
+	qsort_r(by_path, stream->n_links, sizeof(size_t), cmp_link_path,
+		stream->links);
+
+	for (size_t i = 0; i < stream->n_links; i++) {
+		struct lcfs_stream_link_s *target = &stream->links[i];
+		struct lcfs_stream_link_s *link;
+		size_t steps = 0;
+
+		while (!target->resolved) {
+			size_t j = lcfs_write_stream_find_link(stream, by_path,
+							       target->target_path);
+
+			if (j == stream->n_links || ++steps > stream->n_links) {
+				stream->failed_path = strdup(target->target_path);
+				errno = j == stream->n_links ? ENOENT : ELOOP;
+				return -1;
+			}
+			target = &stream->links[j];
+		}
+
+		/* Everything on the way shares the target */
+		for (link = &stream->links[i]; !link->resolved;
+		     link = &stream->links[lcfs_write_stream_find_link(
+			     stream, by_path, link->target_path)]) {
+			link->resolved = true;
+			link->target_depth = target->target_depth;
+			link->target_index = target->target_index;
+		}
+	}
+
+	return 0;
+}
+
+/* Finds the targets of all hardlinks by looking through the paths of
+ * all the non-directories, and then through the other hardlinks. */
+static int lcfs_write_stream_resolve_links(struct lcfs_write_stream_s *stream)
+{
+	struct lcfs_spill_reader_s r = { NULL };
+	size_t *order;
+	int ret = -1;
+
+	order = calloc(stream->n_links, sizeof(size_t));
+	if (order == NULL && stream->n_links > 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	stream->links_by_target = order;
+
+	if (stream->n_links == 0)
+		return 0;
+
+	for (size_t i = 0; i < stream->n_links; i++)
+		order[i] = i;
+	qsort_r(order, stream->n_links, sizeof(size_t), cmp_link_target_path,
+		stream->links);
+
+	if (lcfs_spill_reader_init(&r, stream->paths) < 0)
+		return -1;
+
+	while (!lcfs_spill_reader_at_end(&r)) {
+		cleanup_free char *path = NULL;
+		uint32_t depth, len;
+		uint64_t index;
+		size_t lo = 0, hi = stream->n_links;
+
+		if (lcfs_spill_read(&r, &depth, sizeof(depth)) < 0 ||
+		    lcfs_spill_read(&r, &index, sizeof(index)) < 0 ||
+		    lcfs_spill_read(&r, &len, sizeof(len)) < 0)
+			goto out;
+		path = lcfs_spill_read_alloc(&r, len);
+		if (path == NULL)
+			goto out;
+
+		/* Find the first link to path */
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (strcmp(stream->links[order[mid]].target_path, path) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (; lo < stream->n_links &&
+		       strcmp(stream->links[order[lo]].target_path, path) == 0;
+		     lo++) {
+			struct lcfs_stream_link_s *link = &stream->links[order[lo]];
+
+			link->resolved = true;
+			link->target_depth = depth;
+			link->target_index = index;
+		}
+	}
+
+	/* The rest link to other links, or outside the tree (or to a
+	 * directory) */
+	if (lcfs_write_stream_resolve_link_chains(stream) < 0)
+		goto out;
+
+	qsort_r(order, stream->n_links, sizeof(size_t), cmp_link_target_pos,
+		stream->links);
+
+	ret = 0;
+
+out:
+	lcfs_spill_reader_clear(&r);
+	return ret;
+}
+
+struct lcfs_common_mtime_s {
+	bool found;
+	int64_t sec;
+	uint32_t nsec;
+	size_t count;
+};
+
+static int lcfs_common_mtime_cb(void *data, const uint8_t *record, size_t len,
+				size_t count)
+{
+	struct lcfs_common_mtime_s *m = data;
+	int64_t sec;
+	uint32_t nsec;
+
+	assert(len == sizeof(sec) + sizeof(nsec));
+	memcpy(&sec, record, sizeof(sec));
+	memcpy(&nsec, record + sizeof(sec), sizeof(nsec));
+
+	/* Same as lcfs_compute_common_mtime(), the oldest wins a tie */
+	if (!m->found || count > m->count ||
+	    (count == m->count &&
+	     (sec < m->sec || (sec == m->sec && nsec < m->nsec)))) {
+		m->found = true;
+		m->sec = sec;
+		m->nsec = nsec;
+		m->count = count;
+	}
+
+	return 0;
+}
+
+/* Called when all nodes are added, before the first pass */
+int lcfs_write_stream_prepare(struct lcfs_write_stream_s *stream)
+{
+	struct lcfs_write_options_s *options = stream->options;
+
+	if (stream->finished || stream->root == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (stream->stack_len > 0) {
+		if (lcfs_write_stream_close_dir(stream) < 0)
+			return -1;
+	}
+	stream->finished = true;
+
+	if (lcfs_write_stream_resolve_links(stream) < 0)
+		return -1;
+
+	stream->common_mtim_sec = stream->min_mtim_sec;
+	stream->common_mtim_nsec = stream->min_mtim_nsec;
+
+	/* Version 3 uses the most common mtime as build time */
+	if (stream->mtimes) {
+		struct lcfs_common_mtime_s m = { false };
+
+		if (lcfs_spill_count_records(stream, stream->mtimes,
+					     lcfs_common_mtime_cb, &m) < 0)
+			return -1;
+
+		if (m.found) {
+			stream->common_mtim_sec = m.sec;
+			stream->common_mtim_nsec = m.nsec;
+		}
+
+		if (options->version < 3 &&
+		    (stream->common_mtim_sec != stream->min_mtim_sec ||
+		     stream->common_mtim_nsec != stream->min_mtim_nsec))
+			options->version = 3;
+
+		lcfs_spill_free(stream->mtimes);
+		stream->mtimes = NULL;
+	}
+
+	return 0;
+}
+
+const char *lcfs_write_stream_get_failed_path(struct lcfs_write_stream_s *stream)
+{
+	return stream->failed_path;
+}
+
+struct lcfs_write_options_s *lcfs_write_stream_get_options(struct lcfs_write_stream_s *stream)
+{
+	return stream->options;
+}
+
+struct lcfs_node_s *lcfs_write_stream_get_root(struct lcfs_write_stream_s *stream)
+{
+	return stream->root;
+}
+
+/* Like lcfs_compute_build_mtime(), but for the streamed tree */
+void lcfs_write_stream_init_ctx(struct lcfs_write_stream_s *stream,
+				struct lcfs_ctx_s *ctx)
+{
+	ctx->num_inodes = stream->n_inodes;
+	ctx->min_mtim_sec = stream->min_mtim_sec;
+	ctx->min_mtim_nsec = stream->min_mtim_nsec;
+	ctx->common_mtim_sec = stream->common_mtim_sec;
+	ctx->common_mtim_nsec = stream->common_mtim_nsec;
+	ctx->has_acl = stream->has_acl;
+
+	if (ctx->options->version >= 3) {
+		ctx->build_mtim_sec = ctx->common_mtim_sec;
+		ctx->build_mtim_nsec = ctx->common_mtim_nsec;
+	} else {
+		ctx->build_mtim_sec = ctx->min_mtim_sec;
+		ctx->build_mtim_nsec = ctx->min_mtim_nsec;
+	}
+}
+
+bool lcfs_write_stream_root_has_child(struct lcfs_write_stream_s *stream,
+				      const char *name)
+{
+	size_t lo = 0, hi = stream->n_root_entries;
+
+	/* The entries are sorted by name */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, stream->root_entries[mid].name);
+
+		if (cmp == 0)
+			return true;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return false;
+}
+
+/* Adds a node to the root directory after all other nodes are
+ * added. It is returned by lcfs_write_stream_next() with the
+ * LCFS_STREAM_NODE_SYNTHETIC flag. Takes ownership of child. */
+int lcfs_write_stream_add_root_child(struct lcfs_write_stream_s *stream,
+				     const char *name, struct lcfs_node_s *child)
+{
+	struct lcfs_stream_entry_s *new_entries;
+	size_t pos;
+
+	assert(stream->finished);
+
+	if (lcfs_write_stream_get_depth(stream, 1) == NULL)
+		return -1;
+
+	new_entries = reallocarray(stream->root_entries, stream->n_root_entries + 1,
+				   sizeof(struct lcfs_stream_entry_s));
+	if (new_entries == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	stream->root_entries = new_entries;
+
+	for (pos = 0; pos < stream->n_root_entries; pos++) {
+		if (strcmp(name, stream->root_entries[pos].name) < 0)
+			break;
+	}
+
+	memmove(&stream->root_entries[pos + 1], &stream->root_entries[pos],
+		(stream->n_root_entries - pos) * sizeof(struct lcfs_stream_entry_s));
+	memset(&stream->root_entries[pos], 0, sizeof(struct lcfs_stream_entry_s));
+	stream->n_root_entries++;
+
+	stream->root_entries[pos].kind = LCFS_STREAM_ENTRY_SYNTHETIC;
+	stream->root_entries[pos].name = strdup(name);
+	if (stream->root_entries[pos].name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	stream->root_entries[pos].node = child;
+
+	stream->n_inodes++;
+
+	return 0;
+}
+
+static int lcfs_write_stream_start_depth(struct lcfs_write_stream_s *stream)
+{
+	size_t depth = stream->it_depth;
+	struct lcfs_stream_depth_s *d;
+	struct lcfs_stream_depth_s *next = NULL;
+
+	stream->it_index = 0;
+	stream->it_root_entry = 0;
+	stream->it_parent_remaining = 0;
+
+	if (depth >= stream->n_depths)
+		return 0;
+	d = &stream->depths[depth];
+	if (depth + 1 < stream->n_depths)
+		next = &stream->depths[depth + 1];
+
+	if (lcfs_spill_reader_init(&stream->it_records, d->records) < 0)
+		return -1;
+
+	if (stream->record_nids) {
+		d->nids = lcfs_spill_new(stream->tmpdir);
+		if (d->nids == NULL)
+			return -1;
+		if (next) {
+			next->parents = lcfs_spill_new(stream->tmpdir);
+			if (next->parents == NULL)
+				return -1;
+		}
+	}
+
+	if (stream->have_nids) {
+		if (lcfs_spill_reader_init(&stream->it_nids, d->nids) < 0 ||
+		    lcfs_spill_reader_init(&stream->it_child_nids,
+					   next ? next->nids : NULL) < 0 ||
+		    lcfs_spill_reader_init(&stream->it_parents, d->parents) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Starts a new pass over all nodes. With record_nids, the nid of each
+ * node must be set with lcfs_write_stream_set_nid(), and following
+ * passes fill in the nids of directory entries. */
+int lcfs_write_stream_rewind(struct lcfs_write_stream_s *stream, bool record_nids)
+{
+	assert(stream->finished);
+
+	if (stream->record_nids)
+		stream->have_nids = true;
+	stream->record_nids = record_nids;
+	if (record_nids) {
+		for (size_t i = 0; i < stream->n_depths; i++) {
+			lcfs_spill_free(stream->depths[i].nids);
+			stream->depths[i].nids = NULL;
+			lcfs_spill_free(stream->depths[i].parents);
+			stream->depths[i].parents = NULL;
+		}
+		stream->have_nids = false;
+	}
+
+	stream->it_depth = 0;
+	stream->it_inode_num = 0;
+	stream->it_link = 0;
+
+	return lcfs_write_stream_start_depth(stream);
+}
+
+static bool lcfs_write_stream_depth_done(struct lcfs_write_stream_s *stream)
+{
+	if (stream->it_depth == 1) {
+		while (stream->it_root_entry < stream->n_root_entries &&
+		       stream->root_entries[stream->it_root_entry].kind ==
+			       LCFS_STREAM_ENTRY_LINK)
+			stream->it_root_entry++;
+
+		return stream->it_root_entry == stream->n_root_entries;
+	}
+
+	return stream->it_index == stream->depths[stream->it_depth].n_records;
+}
+
+static int lcfs_write_stream_read_nid(struct lcfs_spill_reader_s *r,
+				      uint64_t *nid, uint32_t *mode)
+{
+	if (lcfs_spill_read(r, nid, sizeof(*nid)) < 0 ||
+	    lcfs_spill_read(r, mode, sizeof(*mode)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int lcfs_stream_add_stub(struct lcfs_node_s *dir, const char *name,
+				uint64_t nid, uint32_t mode)
+{
+	struct lcfs_node_s *stub = lcfs_node_new();
+
+	if (stub == NULL)
+		return -1;
+
+	stub->erofs_nid = nid;
+	stub->inode.st_mode = mode;
+
+	if (lcfs_node_add_child(dir, stub, name) < 0) {
+		lcfs_node_unref(stub);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Adds the entries of the directory as stub child nodes, with the nid
+ * and mode of the entry if known. This includes "." and "..". */
+static int lcfs_write_stream_add_stubs(struct lcfs_write_stream_s *stream,
+				       struct lcfs_node_s *node, uint64_t parent_nid,
+				       struct lcfs_stream_entry_s *entries,
+				       size_t n_entries)
+{
+	if (lcfs_stream_add_stub(node, ".", node->erofs_nid, S_IFDIR) < 0 ||
+	    lcfs_stream_add_stub(node, "..", parent_nid, S_IFDIR) < 0)
+		return -1;
+
+	for (size_t i = 0; i < n_entries; i++) {
+		struct lcfs_stream_entry_s *entry = &entries[i];
+		uint64_t nid = 0;
+		uint32_t mode = 0;
+
+		if (entry->kind == LCFS_STREAM_ENTRY_LINK) {
+			nid = stream->links[entry->link].nid;
+			mode = stream->links[entry->link].mode;
+		} else {
+			stream->cur_n_children++;
+			if (stream->have_nids &&
+			    lcfs_write_stream_read_nid(&stream->it_child_nids,
+						       &nid, &mode) < 0)
+				return -1;
+		}
+
+		if (lcfs_stream_add_stub(node, entry->name, nid, mode) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the next node in breadth-first order in node_out, or 0 if
+ * there are no more. Directories have stub children with the nid and
+ * mode of each entry, which are zero before the nids are known. */
+int lcfs_write_stream_next(struct lcfs_write_stream_s *stream,
+			   struct lcfs_node_s **node_out, int *flags_out)
+{
+	cleanup_node struct lcfs_node_s *node = NULL;
+	struct lcfs_stream_entry_s *entries = NULL;
+	size_t n_entries = 0;
+	uint32_t record_flags = 0;
+	uint64_t parent_nid = 0;
+	int flags = 0;
+	int ret;
+
+	while (stream->it_depth < stream->n_depths &&
+	       lcfs_write_stream_depth_done(stream)) {
+		stream->it_depth++;
+		if (lcfs_write_stream_start_depth(stream) < 0)
+			return -1;
+	}
+	if (stream->it_depth >= stream->n_depths)
+		return 0;
+
+	stream->cur_synthetic = false;
+	stream->cur_n_children = 0;
+
+	if (stream->it_depth == 1 &&
+	    stream->root_entries[stream->it_root_entry].kind ==
+		    LCFS_STREAM_ENTRY_SYNTHETIC) {
+		node = lcfs_node_clone(stream->root_entries[stream->it_root_entry].node);
+		if (node == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		stream->cur_synthetic = true;
+		flags |= LCFS_STREAM_NODE_SYNTHETIC;
+	} else {
+		node = lcfs_stream_read_node(&stream->it_records, &record_flags,
+					     &entries, &n_entries);
+		if (node == NULL)
+			return -1;
+		stream->cur_index = stream->it_index++;
+	}
+	if (stream->it_depth == 1)
+		stream->it_root_entry++;
+
+	if (stream->it_depth == 0) {
+		/* Includes the entries added later */
+		lcfs_stream_entries_free(entries, n_entries);
+		entries = stream->root_entries;
+		n_entries = stream->n_root_entries;
+		flags |= LCFS_STREAM_NODE_ROOT;
+	}
+
+	if (record_flags & LCFS_STREAM_RECORD_HAS_WHITEOUTS)
+		flags |= LCFS_STREAM_NODE_HAS_WHITEOUTS;
+
+	node->inode_num = stream->it_inode_num++;
+
+	if (stream->have_nids) {
+		uint32_t mode;
+
+		if (lcfs_write_stream_read_nid(&stream->it_nids, &node->erofs_nid,
+					       &mode) < 0)
+			goto fail;
+
+		if (stream->it_depth == 0) {
+			parent_nid = node->erofs_nid;
+		} else {
+			while (stream->it_parent_remaining == 0) {
+				if (lcfs_spill_read(&stream->it_parents,
+						    &stream->it_parent_nid,
+						    sizeof(uint64_t)) < 0 ||
+				    lcfs_spill_read(&stream->it_parents,
+						    &stream->it_parent_remaining,
+						    sizeof(uint64_t)) < 0)
+					goto fail;
+			}
+			stream->it_parent_remaining--;
+			parent_nid = stream->it_parent_nid;
+		}
+	}
+
+	if ((node->inode.st_mode & S_IFMT) == S_IFDIR) {
+		ret = lcfs_write_stream_add_stubs(stream, node, parent_nid,
+						  entries, n_entries);
+		if (ret < 0)
+			goto fail;
+	}
+
+	if (stream->it_depth != 0)
+		lcfs_stream_entries_free(entries, n_entries);
+
+	*node_out = steal_pointer(&node);
+	*flags_out = flags;
+	return 1;
+
+fail:
+	if (stream->it_depth != 0)
+		lcfs_stream_entries_free(entries, n_entries);
+	return -1;
+}
+
+/* Records the nid of the node last returned by lcfs_write_stream_next(),
+ * and its final mode, for the directory entries that refer to it. */
+int lcfs_write_stream_set_nid(struct lcfs_write_stream_s *stream,
+			      struct lcfs_node_s *node)
+{
+	struct lcfs_stream_depth_s *d = &stream->depths[stream->it_depth];
+	uint64_t nid = node->erofs_nid;
+	uint32_t mode = node->inode.st_mode;
+
+	assert(stream->record_nids);
+
+	if (lcfs_spill_write(d->nids, &nid, sizeof(nid)) < 0 ||
+	    lcfs_spill_write(d->nids, &mode, sizeof(mode)) < 0)
+		return -1;
+
+	if (stream->cur_n_children > 0) {
+		struct lcfs_spill_s *parents = stream->depths[stream->it_depth + 1].parents;
+
+		if (lcfs_spill_write(parents, &nid, sizeof(nid)) < 0 ||
+		    lcfs_spill_write(parents, &stream->cur_n_children,
+				     sizeof(stream->cur_n_children)) < 0)
+			return -1;
+	}
+
+	if (stream->cur_synthetic)
+		return 0;
+
+	while (stream->it_link < stream->n_links) {
+		struct lcfs_stream_link_s *link =
+			&stream->links[stream->links_by_target[stream->it_link]];
+
+		if (link->target_depth != stream->it_depth ||
+		    link->target_index != stream->cur_index)
+			break;
+
+		link->nid = nid;
+		link->mode = mode;
+		stream->it_link++;
+	}
+
+	return 0;
+}
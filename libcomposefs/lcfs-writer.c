@@ -38,7 +38,11 @@
 #include <sys/mman.h>
 #include <sys/sysmacros.h>
 
-static void lcfs_node_remove_all_children(struct lcfs_node_s *node);
+/* In LCFS_FLAGS_WRITE_FD mode, output is collected into an aligned
+ * buffer of this size and written out in one go. */
+#define LCFS_WRITE_FD_EXTENT_SIZE (1024 * 1024)
+#define LCFS_WRITE_FD_ALIGN 4096
+
 static void lcfs_node_destroy(struct lcfs_node_s *node);
 
 static int lcfs_close(struct lcfs_ctx_s *ctx);
@@ -64,16 +68,6 @@ char *maybe_join_path(const char *a, const char *b)
 	return res;
 }
 
-size_t hash_memory(const char *string, size_t len, size_t n_buckets)
-{
-	size_t i, value = 0;
-
-	for (i = 0; i < len; i++) {
-		value = (value * 31 + string[i]);
-	}
-	return value % n_buckets;
-}
-
 static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 				       struct lcfs_write_options_s *options)
 {
@@ -81,7 +75,7 @@ static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 
 	switch (options->format) {
 	case LCFS_FORMAT_EROFS:
-		ret = lcfs_ctx_erofs_new();
+		ret = lcfs_ctx_erofs_new(options);
 		break;
 
 	default:
@@ -98,6 +92,31 @@ static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 
 	ret->file = options->file;
 	ret->write_cb = options->file_write_cb;
+	ret->fd = -1;
+
+	if (options->flags & LCFS_FLAGS_WRITE_FD) {
+		struct stat st;
+		void *buf;
+
+		if (options->file_fd < 0 || fstat(options->file_fd, &st) < 0) {
+			lcfs_close(ret);
+			errno = EBADF;
+			return NULL;
+		}
+
+		ret->fd = options->file_fd;
+		ret->fd_seekable = S_ISREG(st.st_mode);
+		ret->write_cb = NULL;
+
+		if (posix_memalign(&buf, LCFS_WRITE_FD_ALIGN,
+				   LCFS_WRITE_FD_EXTENT_SIZE) != 0) {
+			lcfs_close(ret);
+			errno = ENOMEM;
+			return NULL;
+		}
+		ret->fd_buf = buf;
+	}
+
 	if (options->digest_out) {
 		ret->fsverity_ctx = lcfs_fsverity_context_new();
 		if (ret->fsverity_ctx == NULL) {
@@ -157,100 +176,177 @@ static int cmp_xattr(const void *a, const void *b)
 	return strcmp(na->key, nb->key);
 }
 
-/* This ensures that the tree is in a well defined order, with
-   children sorted by name, and the nodes visited in breadth-first
-   order.  It also updates the inode offset. */
-int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+/* Canonical order */
+void lcfs_node_sort_xattrs(struct lcfs_node_s *node)
 {
-	uint32_t index;
-	struct lcfs_node_s *node;
+	if (node->xattrs)
+		qsort(node->xattrs, node->n_xattrs, sizeof(node->xattrs[0]),
+		      cmp_xattr);
+}
 
-	/* Start with the root node. */
+static void lcfs_queue_node(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
+{
+	/* Avoid recursion */
+	assert(!node->in_tree);
+	node->in_tree = true;
+	node->inode_num = ctx->num_inodes++;
 
-	ctx->queue_end = root;
-	root->in_tree = true;
+	node->next = NULL;
+	ctx->queue_end->next = node;
+	ctx->queue_end = node;
+}
 
-	ctx->min_mtim_sec = root->inode.st_mtim_sec;
-	ctx->min_mtim_nsec = root->inode.st_mtim_nsec;
-	ctx->has_acl = false;
+static void lcfs_queue_children(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
+{
+	for (size_t i = 0; i < node->children_size; i++) {
+		struct lcfs_node_s *child = node->children[i];
+		if (child->link_to == NULL)
+			lcfs_queue_node(ctx, child);
+	}
+}
 
-	for (node = root, index = 0; node != NULL; node = node->next, index++) {
-		if ((node->inode.st_mode & S_IFMT) != S_IFDIR &&
-		    node->children_size != 0) {
-			/* Only dirs can have children */
-			errno = EINVAL;
+struct lcfs_order_dir_s {
+	struct lcfs_node_s *node;
+	size_t next_child;
+};
+
+struct lcfs_order_stack_s {
+	struct lcfs_order_dir_s *dirs;
+	size_t n_dirs;
+	size_t dirs_size;
+};
+
+/* Queues the children of node and pushes it, to descend into them */
+static int lcfs_order_push_dir(struct lcfs_ctx_s *ctx,
+			       struct lcfs_order_stack_s *stack,
+			       struct lcfs_node_s *node)
+{
+	if (stack->n_dirs == stack->dirs_size) {
+		size_t new_size = stack->dirs_size == 0 ? 16 : stack->dirs_size * 2;
+		struct lcfs_order_dir_s *new_dirs = reallocarray(
+			stack->dirs, new_size, sizeof(struct lcfs_order_dir_s));
+		if (new_dirs == NULL) {
+			errno = ENOMEM;
 			return -1;
 		}
+		stack->dirs = new_dirs;
+		stack->dirs_size = new_size;
+	}
 
-		/* Fix up directory n_links counts, they are 2 + nr of subdirs */
-		if ((node->inode.st_mode & S_IFMT) == S_IFDIR) {
-			size_t n_link = 2;
-			for (size_t i = 0; i < node->children_size; i++) {
-				struct lcfs_node_s *child = node->children[i];
-				if ((child->inode.st_mode & S_IFMT) == S_IFDIR) {
-					n_link++;
-				}
-			}
-			node->inode.st_nlink = n_link;
-		}
+	lcfs_queue_children(ctx, node);
+
+	stack->dirs[stack->n_dirs].node = node;
+	stack->dirs[stack->n_dirs].next_child = 0;
+	stack->n_dirs++;
+	return 0;
+}
 
-		/* Canonical order */
-		if (node->xattrs)
-			qsort(node->xattrs, node->n_xattrs,
-			      sizeof(node->xattrs[0]), cmp_xattr);
+/* Queue all children of each directory, then descend into them in
+ * order. This uses an explicit stack, as trees can be nested deeper
+ * than the C stack allows. */
+static int lcfs_order_dir_children(struct lcfs_ctx_s *ctx,
+				   struct lcfs_node_s *root)
+{
+	struct lcfs_order_stack_s stack = { NULL };
+	int ret = -1;
+
+	if (lcfs_order_push_dir(ctx, &stack, root) < 0)
+		goto out;
 
-		if (node->inode.st_mtim_sec < ctx->min_mtim_sec ||
-		    (node->inode.st_mtim_sec == ctx->min_mtim_sec &&
-		     node->inode.st_mtim_nsec < ctx->min_mtim_nsec)) {
-			ctx->min_mtim_sec = node->inode.st_mtim_sec;
-			ctx->min_mtim_nsec = node->inode.st_mtim_nsec;
+	while (stack.n_dirs > 0) {
+		struct lcfs_order_dir_s *top = &stack.dirs[stack.n_dirs - 1];
+		struct lcfs_node_s *child;
+
+		if (top->next_child == top->node->children_size) {
+			stack.n_dirs--;
+			continue;
 		}
 
-		/* Assign inode index */
-		node->inode_num = index;
+		/* Nodes without children have nothing to queue */
+		child = top->node->children[top->next_child++];
+		if (child->link_to != NULL || child->children_size == 0)
+			continue;
 
-		/* Compute has_acl */
-		if (lcfs_node_get_xattr(node, "system.posix_acl_access", NULL) != NULL ||
-		    lcfs_node_get_xattr(node, "system.posix_acl_default", NULL) != NULL)
-			ctx->has_acl = true;
+		if (lcfs_order_push_dir(ctx, &stack, child) < 0)
+			goto out;
+	}
 
-		node->in_tree = true;
-		/* Append to queue for more work */
-		for (size_t i = 0; i < node->children_size; i++) {
-			struct lcfs_node_s *child = node->children[i];
+	ret = 0;
+out:
+	free(stack.dirs);
+	return ret;
+}
 
-			/* Skip hardlinks, they will not be serialized separately */
-			if (child->link_to != NULL) {
-				continue;
-			}
+/* Links all nodes of the tree via node->next, in the order specified
+ * by the layout option, and assigns the inode indexes in that order.
+ * Hardlinks are skipped, as they will not be serialized separately. */
+static int lcfs_order_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	struct lcfs_node_s *node;
 
-			/* Avoid recursion */
-			assert(!child->in_tree);
+	ctx->queue_end = root;
+	root->in_tree = true;
+	root->inode_num = 0;
+	ctx->num_inodes = 1;
 
-			ctx->queue_end->next = child;
-			ctx->queue_end = child;
-		}
-	}
+	switch (ctx->options->layout) {
+	case LCFS_LAYOUT_DFS:
+		/* Inserting the children directly after each node gives pre-order */
+		for (node = root; node != NULL; node = node->next) {
+			struct lcfs_node_s *prev = node;
 
-	/* Ensure all hardlinks are in tree */
-	for (node = root; node != NULL; node = node->next) {
-		for (size_t i = 0; i < node->children_size; i++) {
-			struct lcfs_node_s *child = node->children[i];
-			struct lcfs_node_s *link_to = follow_links(child);
-			if (child->link_to != NULL && !link_to->in_tree) {
-				/* Link to inode outside tree */
-				errno = EINVAL;
-				return -1;
+			/* The list is final up to node */
+			if (node != root)
+				node->inode_num = ctx->num_inodes++;
+
+			for (size_t i = 0; i < node->children_size; i++) {
+				struct lcfs_node_s *child = node->children[i];
+				if (child->link_to != NULL)
+					continue;
+
+				assert(!child->in_tree);
+				child->in_tree = true;
+				child->next = prev->next;
+				prev->next = child;
+				prev = child;
 			}
 		}
+		break;
+	case LCFS_LAYOUT_DIR_CHILDREN:
+		return lcfs_order_dir_children(ctx, root);
+	default:
+		for (node = root; node != NULL; node = node->next)
+			lcfs_queue_children(ctx, node);
+		break;
 	}
 
-	/* Reset in_tree back to false for multiple uses */
-	for (node = ctx->root; node != NULL; node = node->next) {
-		node->in_tree = false;
-	}
+	return 0;
+}
+
+/* This ensures that the tree is in a well defined order, with the
+   nodes visited in the order given by the layout option
+   (breadth-first by default), and assigns the inode indexes.  The
+   nodes are marked as in_tree, the tree is expected to be a private
+   clone. */
+int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	root->next = NULL;
 
-	ctx->num_inodes = index;
+	return lcfs_order_tree(ctx, root);
+}
+
+/* Checks that the hardlinks among the children of node point to
+ * inodes in the tree, after lcfs_compute_tree() */
+int lcfs_node_check_links(struct lcfs_node_s *node)
+{
+	for (size_t i = 0; i < node->children_size; i++) {
+		struct lcfs_node_s *child = node->children[i];
+		if (child->link_to != NULL && !follow_links(child)->in_tree) {
+			/* Link to inode outside tree */
+			errno = EINVAL;
+			return -1;
+		}
+	}
 
 	return 0;
 }
@@ -262,6 +358,53 @@ struct lcfs_node_s *follow_links(struct lcfs_node_s *node)
 	return node;
 }
 
+static int lcfs_write_flush(struct lcfs_ctx_s *ctx)
+{
+	uint8_t *data = ctx->fd_buf;
+	size_t data_len = ctx->fd_buf_len;
+
+	while (data_len > 0) {
+		ssize_t r;
+
+		if (ctx->fd_seekable)
+			r = pwrite(ctx->fd, data, data_len, ctx->fd_offset);
+		else
+			r = write(ctx->fd, data, data_len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+		data_len -= r;
+		data += r;
+		ctx->fd_offset += r;
+	}
+
+	ctx->fd_buf_len = 0;
+
+	return 0;
+}
+
+/* Called once the final image size is known, before anything is
+ * written. This lets us allocate the output file in one go. */
+int lcfs_write_preallocate(struct lcfs_ctx_s *ctx, off_t size)
+{
+	if (ctx->fd < 0 || !ctx->fd_seekable)
+		return 0;
+
+	if (fallocate(ctx->fd, 0, 0, size) < 0 && errno != EOPNOTSUPP &&
+	    errno != ENOSYS)
+		return -1;
+
+	/* Drop any old content past the end of the image */
+	if (ftruncate(ctx->fd, size) < 0)
+		return -1;
+
+	return 0;
+}
+
 int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len)
 {
 	uint8_t *data = _data;
@@ -270,7 +413,21 @@ int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len)
 
 	ctx->bytes_written += data_len;
 
-	if (ctx->write_cb) {
+	if (ctx->fd_buf) {
+		while (data_len > 0) {
+			size_t to_copy = MIN(data_len, LCFS_WRITE_FD_EXTENT_SIZE -
+							       ctx->fd_buf_len);
+
+			memcpy(ctx->fd_buf + ctx->fd_buf_len, data, to_copy);
+			ctx->fd_buf_len += to_copy;
+			data_len -= to_copy;
+			data += to_copy;
+
+			if (ctx->fd_buf_len == LCFS_WRITE_FD_EXTENT_SIZE &&
+			    lcfs_write_flush(ctx) < 0)
+				return -1;
+		}
+	} else if (ctx->write_cb) {
 		while (data_len > 0) {
 			ssize_t r = ctx->write_cb(ctx->file, data, data_len);
 			if (r <= 0) {
@@ -319,6 +476,8 @@ static int lcfs_close(struct lcfs_ctx_s *ctx)
 
 	if (ctx->fsverity_ctx)
 		lcfs_fsverity_context_free(ctx->fsverity_ctx);
+	free(ctx->fd_buf);
+	free(ctx->mtimes.mtimes);
 	if (ctx->root) {
 		if (ctx->destroy_root) {
 			lcfs_node_destroy(ctx->root);
@@ -331,8 +490,9 @@ static int lcfs_close(struct lcfs_ctx_s *ctx)
 	return 0;
 }
 
-static void lcfs_write_update_version(struct lcfs_node_s *node,
-				      struct lcfs_write_options_s *options)
+/* Updates options->version up to options->max_version if needed for node */
+void lcfs_node_update_version(struct lcfs_node_s *node,
+			      struct lcfs_write_options_s *options)
 {
 	/* Version 1 changed how whiteouts are handled */
 	if (options->version < 1 && options->max_version >= 1) {
@@ -343,15 +503,154 @@ static void lcfs_write_update_version(struct lcfs_node_s *node,
 		}
 	}
 
-	for (size_t i = 0; i < node->children_size; ++i) {
-		struct lcfs_node_s *child = node->children[i];
-		if (child->link_to != NULL) {
-			continue;
+	/* Version 2 stores the overlay metacopy/redirect xattr names of
+	 * backed files using long xattr name prefixes */
+	if (options->version < 2 && options->max_version >= 2) {
+		int type = node->inode.st_mode & S_IFMT;
+
+		if (type == S_IFREG && node->inode.st_size > 0 &&
+		    node->content == NULL) {
+			options->version = 2;
 		}
-		lcfs_write_update_version(child, options);
 	}
 }
 
+static int cmp_mtime(const void *a, const void *b)
+{
+	const struct lcfs_mtime_s *ma = a;
+	const struct lcfs_mtime_s *mb = b;
+
+	if (ma->sec != mb->sec)
+		return ma->sec < mb->sec ? -1 : 1;
+	if (ma->nsec != mb->nsec)
+		return ma->nsec < mb->nsec ? -1 : 1;
+	return 0;
+}
+
+/* Same limits as lcfs_fits_in_erofs_compact(), except that directory
+ * sizes and link counts are not known yet */
+bool lcfs_node_may_be_compact(struct lcfs_node_s *node)
+{
+	int type = node->inode.st_mode & S_IFMT;
+
+	return node->inode.st_uid <= UINT16_MAX && node->inode.st_gid <= UINT16_MAX &&
+	       (type == S_IFDIR || (node->inode.st_nlink <= UINT16_MAX &&
+				    node->inode.st_size <= UINT32_MAX));
+}
+
+/* Accounts for the mtime of node, called for each inode of the input
+ * tree starting with the root */
+int lcfs_ctx_add_mtime(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
+{
+	struct lcfs_mtimes_s *m = &ctx->mtimes;
+	struct lcfs_mtime_s *mtime;
+
+	if (node == ctx->root || node->inode.st_mtim_sec < ctx->min_mtim_sec ||
+	    (node->inode.st_mtim_sec == ctx->min_mtim_sec &&
+	     node->inode.st_mtim_nsec < ctx->min_mtim_nsec)) {
+		ctx->min_mtim_sec = node->inode.st_mtim_sec;
+		ctx->min_mtim_nsec = node->inode.st_mtim_nsec;
+	}
+
+	/* The most common mtime is only needed for version 3 */
+	if (ctx->options->max_version < 3)
+		return 0;
+
+	if (m->n_mtimes == m->alloc_mtimes) {
+		size_t new_alloc = m->alloc_mtimes == 0 ? 1024 : m->alloc_mtimes * 2;
+		struct lcfs_mtime_s *new_mtimes =
+			realloc(m->mtimes, new_alloc * sizeof(struct lcfs_mtime_s));
+		if (new_mtimes == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		m->mtimes = new_mtimes;
+		m->alloc_mtimes = new_alloc;
+	}
+
+	mtime = &m->mtimes[m->n_mtimes++];
+	mtime->sec = node->inode.st_mtim_sec;
+	mtime->nsec = node->inode.st_mtim_nsec;
+	mtime->compact = lcfs_node_may_be_compact(node);
+
+	return 0;
+}
+
+/* Picks the build time used as mtime of compact inodes, once all
+ * mtimes are added. With max_version >= 3 this is the mtime shared by
+ * most inodes that could otherwise be compact, using the oldest one in
+ * case of a tie, and the version is updated to 3 if this differs from
+ * the minimal mtime in the tree. */
+void lcfs_compute_build_mtime(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_write_options_s *options = ctx->options;
+	struct lcfs_mtimes_s *m = &ctx->mtimes;
+	size_t best = 0, best_count = 0;
+
+	if (m->n_mtimes > 0) {
+		qsort(m->mtimes, m->n_mtimes, sizeof(struct lcfs_mtime_s), cmp_mtime);
+
+		for (size_t i = 0; i < m->n_mtimes;) {
+			size_t count = 0, j;
+
+			for (j = i; j < m->n_mtimes &&
+				    cmp_mtime(&m->mtimes[i], &m->mtimes[j]) == 0;
+			     j++) {
+				if (m->mtimes[j].compact)
+					count++;
+			}
+			if (count > best_count) {
+				best = i;
+				best_count = count;
+			}
+			i = j;
+		}
+
+		ctx->common_mtim_sec = m->mtimes[best].sec;
+		ctx->common_mtim_nsec = m->mtimes[best].nsec;
+
+		if (options->version < 3 && best != 0)
+			options->version = 3;
+	}
+
+	free(m->mtimes);
+	m->mtimes = NULL;
+	m->n_mtimes = m->alloc_mtimes = 0;
+
+	/* Compact inodes use the build time as mtime, which since version 3
+	 * is the most common mtime rather than the oldest one */
+	if (options->version >= 3) {
+		ctx->build_mtim_sec = ctx->common_mtim_sec;
+		ctx->build_mtim_nsec = ctx->common_mtim_nsec;
+	} else {
+		ctx->build_mtim_sec = ctx->min_mtim_sec;
+		ctx->build_mtim_nsec = ctx->min_mtim_nsec;
+	}
+}
+
+/* Flushes the output and closes ctx, after writing with result res */
+static int lcfs_write_done(struct lcfs_ctx_s *ctx, int res)
+{
+	struct lcfs_write_options_s *options = ctx->options;
+
+	if (res == 0 && ctx->fd_buf)
+		res = lcfs_write_flush(ctx);
+
+	if (res < 0) {
+		PROTECT_ERRNO;
+		lcfs_close(ctx);
+		return res;
+	}
+
+	if (options->digest_out) {
+		lcfs_fsverity_context_get_digest(ctx->fsverity_ctx,
+						 options->digest_out);
+	}
+
+	lcfs_close(ctx);
+	return 0;
+}
+
 int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options)
 {
 	enum lcfs_format_t format = options->format;
@@ -370,18 +669,30 @@ int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options
 		return -1;
 	}
 
+	if (options->layout > LCFS_LAYOUT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (options->block_size_bits != 0 &&
+	    (options->block_size_bits < LCFS_BLOCK_SIZE_BITS_MIN ||
+	     options->block_size_bits > LCFS_BLOCK_SIZE_BITS_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (options->max_version < options->version) {
 		options->max_version = options->version;
 	}
 
-	/* Update options->version up to options->max_version if needed */
-	lcfs_write_update_version(root, options);
-
 	ctx = lcfs_new_ctx(root, options);
 	if (ctx == NULL) {
 		return -1;
 	}
 
+	/* options->version is updated up to options->max_version as
+	 * needed while the writer goes over the tree */
+
 	if (format == LCFS_FORMAT_EROFS)
 		res = lcfs_write_erofs_to(ctx);
 	else {
@@ -389,19 +700,28 @@ int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options
 		res = -1;
 	}
 
-	if (res < 0) {
-		PROTECT_ERRNO;
-		lcfs_close(ctx);
+	return lcfs_write_done(ctx, res);
+}
+
+int lcfs_write_stream_finish(struct lcfs_write_stream_s *stream)
+{
+	struct lcfs_write_options_s *options = lcfs_write_stream_get_options(stream);
+	struct lcfs_ctx_s *ctx;
+	int res;
+
+	/* Closes all directories and updates options->version */
+	res = lcfs_write_stream_prepare(stream);
+	if (res < 0)
 		return res;
-	}
 
-	if (options->digest_out) {
-		lcfs_fsverity_context_get_digest(ctx->fsverity_ctx,
-						 options->digest_out);
+	ctx = lcfs_new_ctx(lcfs_write_stream_get_root(stream), options);
+	if (ctx == NULL) {
+		return -1;
 	}
 
-	lcfs_close(ctx);
-	return 0;
+	res = lcfs_write_erofs_stream_to(ctx, stream);
+
+	return lcfs_write_done(ctx, res);
 }
 
 static int read_xattrs(struct lcfs_node_s *ret, int dirfd, const char *fname,
@@ -608,6 +928,13 @@ static void digest_to_path(const uint8_t *csum, char *buf)
 
 struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 					     int buildflags)
+{
+	return lcfs_load_node_from_file_ext(dirfd, fname, buildflags,
+					    LCFS_BUILD_INLINE_FILE_SIZE_LIMIT);
+}
+
+struct lcfs_node_s *lcfs_load_node_from_file_ext(int dirfd, const char *fname,
+						 int buildflags, size_t inline_limit)
 {
 	cleanup_node struct lcfs_node_s *ret = NULL;
 	struct stat sb;
@@ -628,6 +955,11 @@ struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 		return NULL;
 	}
 
+	if (inline_limit > LCFS_BUILD_INLINE_FILE_SIZE_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	r = fstatat(dirfd, fname, &sb, AT_SYMLINK_NOFOLLOW);
 	if (r < 0)
 		return NULL;
@@ -649,7 +981,7 @@ struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 		bool is_zerosized = sb.st_size == 0;
 		bool do_digest = !is_zerosized && (compute_digest || by_digest);
 		bool do_inline = !is_zerosized && !no_inline &&
-				 sb.st_size <= LCFS_BUILD_INLINE_FILE_SIZE_LIMIT;
+				 (size_t)sb.st_size <= inline_limit;
 
 		if (do_digest || do_inline) {
 			cleanup_fd int fd =
@@ -679,7 +1011,7 @@ struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 				lseek(fd, 0, SEEK_SET);
 			}
 			if (do_inline) {
-				uint8_t buf[LCFS_BUILD_INLINE_FILE_SIZE_LIMIT];
+				uint8_t buf[LCFS_BUILD_INLINE_FILE_SIZE_MAX];
 
 				r = read_content(fd, sb.st_size, buf);
 				if (r < 0)
@@ -739,13 +1071,24 @@ int lcfs_version_from_fd(int fd)
 
 struct lcfs_node_s *lcfs_load_node_from_fd(int fd)
 {
-	struct lcfs_node_s *node;
+	return lcfs_load_node_from_fd_ext(fd, 0, 0);
+}
+
+struct lcfs_node_s *lcfs_load_node_from_fd_ext(int fd, int loadflags,
+					       uint32_t threads)
+{
 	uint8_t *image_data;
 	size_t image_data_size;
 	struct stat s;
-	int errsv;
 	int r;
 
+	if ((loadflags & ~(LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) != 0 ||
+	    (loadflags & (LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) ==
+		    (LCFS_LOAD_LAZY | LCFS_LOAD_PARALLEL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	r = fstat(fd, &s);
 	if (r < 0) {
 		return NULL;
@@ -758,17 +1101,9 @@ struct lcfs_node_s *lcfs_load_node_from_fd(int fd)
 		return NULL;
 	}
 
-	node = lcfs_load_node_from_image(image_data, image_data_size);
-	if (node == NULL) {
-		errsv = errno;
-		munmap(image_data, image_data_size);
-		errno = errsv;
-		return NULL;
-	}
-
-	munmap(image_data, image_data_size);
-
-	return node;
+	/* Takes ownership of the mapping */
+	return lcfs_load_node_from_mapping(image_data, image_data_size, image_data,
+					   image_data_size, loadflags, threads);
 }
 
 int lcfs_node_set_payload(struct lcfs_node_s *node, const char *payload)
@@ -837,13 +1172,27 @@ const char *lcfs_node_get_name(struct lcfs_node_s *node)
 	return node->name;
 }
 
+int lcfs_node_ensure_children(struct lcfs_node_s *node)
+{
+	if (node->image == NULL)
+		return 0;
+
+	return lcfs_node_load_children(node);
+}
+
 size_t lcfs_node_get_n_children(struct lcfs_node_s *node)
 {
+	if (lcfs_node_ensure_children(node) < 0)
+		return 0;
+
 	return node->children_size;
 }
 
 struct lcfs_node_s *lcfs_node_get_child(struct lcfs_node_s *node, size_t i)
 {
+	if (lcfs_node_ensure_children(node) < 0)
+		return NULL;
+
 	if (i < node->children_size)
 		return node->children[i];
 	return NULL;
@@ -972,6 +1321,9 @@ static struct lcfs_node_s *lcfs_node_bsearch_child(struct lcfs_node_s *node,
 
 struct lcfs_node_s *lcfs_node_lookup_child(struct lcfs_node_s *node, const char *name)
 {
+	if (lcfs_node_ensure_children(node) < 0)
+		return NULL;
+
 	return lcfs_node_bsearch_child(node, name, NULL);
 }
 
@@ -980,6 +1332,24 @@ struct lcfs_node_s *lcfs_node_get_parent(struct lcfs_node_s *node)
 	return node->parent;
 }
 
+/* Exchanges the places of two nodes in the tree */
+void lcfs_node_swap_positions(struct lcfs_node_s *a, struct lcfs_node_s *b)
+{
+	struct lcfs_node_s *parent = a->parent;
+	char *name = a->name;
+	size_t pos_a, pos_b;
+
+	lcfs_node_bsearch_child(a->parent, a->name, &pos_a);
+	lcfs_node_bsearch_child(b->parent, b->name, &pos_b);
+	a->parent->children[pos_a] = b;
+	b->parent->children[pos_b] = a;
+
+	a->parent = b->parent;
+	a->name = b->name;
+	b->parent = parent;
+	b->name = name;
+}
+
 void lcfs_node_make_hardlink(struct lcfs_node_s *node, struct lcfs_node_s *target)
 {
 	target = follow_links(target);
@@ -1014,6 +1384,9 @@ int lcfs_node_add_child(struct lcfs_node_s *parent, struct lcfs_node_s *child,
 		return -1;
 	}
 
+	if (lcfs_node_ensure_children(parent) < 0)
+		return -1;
+
 	if (parent->children_capacity == parent->children_size) {
 		if (parent->children_size == 0)
 			new_capacity = 16;
@@ -1085,11 +1458,16 @@ void lcfs_node_unref(struct lcfs_node_s *node)
 	if (node->link_to)
 		lcfs_node_unref(node->link_to);
 
+	if (node->image)
+		lcfs_image_data_unref(node->image);
+
 	free(node->name);
 	free(node->payload);
 	free(node->content);
 
 	for (i = 0; i < node->n_xattrs; i++) {
+		if (node->xattrs[i].erofs_virtual)
+			continue;
 		free(node->xattrs[i].key);
 		free(node->xattrs[i].value);
 	}
@@ -1098,7 +1476,7 @@ void lcfs_node_unref(struct lcfs_node_s *node)
 	free(node);
 }
 
-static void lcfs_node_remove_all_children(struct lcfs_node_s *node)
+void lcfs_node_remove_all_children(struct lcfs_node_s *node)
 {
 	for (size_t i = 0; i < node->children_size; i++) {
 		struct lcfs_node_s *child = node->children[i];
@@ -1148,13 +1526,15 @@ struct lcfs_node_s *lcfs_node_clone(struct lcfs_node_s *node)
 	}
 
 	if (node->n_xattrs > 0) {
-		new->xattrs = malloc(sizeof(struct lcfs_xattr_s) * node->n_xattrs);
+		new->xattrs = calloc(node->n_xattrs, sizeof(struct lcfs_xattr_s));
 		if (new->xattrs == NULL)
 			return NULL;
 		for (size_t i = 0; i < node->n_xattrs; i++) {
-			char *key = strdup(node->xattrs[i].key);
-			char *value = memdup(node->xattrs[i].value,
-					     node->xattrs[i].value_len);
+			char *key, *value;
+
+			assert(!node->xattrs[i].erofs_virtual);
+			key = strdup(node->xattrs[i].key);
+			value = memdup(node->xattrs[i].value, node->xattrs[i].value_len);
 			if (key == NULL || value == NULL) {
 				free(key);
 				free(value);
@@ -1210,6 +1590,9 @@ static struct lcfs_node_s *_lcfs_node_clone_deep(struct lcfs_node_s *node,
 	data->mapping[data->n_mappings].new = new;
 	data->n_mappings++;
 
+	if (lcfs_node_ensure_children(node) < 0)
+		return NULL;
+
 	for (size_t i = 0; i < node->children_size; ++i) {
 		struct lcfs_node_s *child = node->children[i];
 		struct lcfs_node_s *new_child = _lcfs_node_clone_deep(child, data);
@@ -1266,6 +1649,13 @@ bool lcfs_node_dirp(struct lcfs_node_s *node)
 
 struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 			       char **failed_path_out)
+{
+	return lcfs_build_ext(dirfd, fname, buildflags,
+			      LCFS_BUILD_INLINE_FILE_SIZE_LIMIT, failed_path_out);
+}
+
+struct lcfs_node_s *lcfs_build_ext(int dirfd, const char *fname, int buildflags,
+				   size_t inline_limit, char **failed_path_out)
 {
 	struct lcfs_node_s *node = NULL;
 	struct dirent *de;
@@ -1275,7 +1665,7 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 	const char *failed_subpath = NULL;
 	int errsv;
 
-	node = lcfs_load_node_from_file(dirfd, fname, buildflags);
+	node = lcfs_load_node_from_file_ext(dirfd, fname, buildflags, inline_limit);
 	if (node == NULL) {
 		errsv = errno;
 		goto fail;
@@ -1331,8 +1721,8 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 		}
 
 		if (de->d_type == DT_DIR) {
-			n = lcfs_build(dfd, de->d_name, buildflags,
-				       &free_failed_subpath);
+			n = lcfs_build_ext(dfd, de->d_name, buildflags,
+					   inline_limit, &free_failed_subpath);
 			if (n == NULL) {
 				failed_subpath = free_failed_subpath;
 				errsv = errno;
@@ -1344,7 +1734,8 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 					continue;
 			}
 
-			n = lcfs_load_node_from_file(dfd, de->d_name, buildflags);
+			n = lcfs_load_node_from_file_ext(dfd, de->d_name,
+							 buildflags, inline_limit);
 			if (n == NULL) {
 				errsv = errno;
 				failed_subpath = de->d_name;
@@ -1407,6 +1798,8 @@ const char *lcfs_node_get_xattr(struct lcfs_node_s *node, const char *name,
 
 	if (index >= 0) {
 		struct lcfs_xattr_s *xattr = &node->xattrs[index];
+		/* The value of those is split, see lcfs_xattr_s */
+		assert(!xattr->erofs_virtual);
 		if (length)
 			*length = xattr->value_len;
 		return xattr->value;
@@ -1443,6 +1836,7 @@ int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
 	if (index >= 0) {
 		/* Already set, replace */
 		struct lcfs_xattr_s *xattr = &node->xattrs[index];
+		assert(!xattr->erofs_virtual);
 		v = memdup(value, value_len);
 		if (v == NULL) {
 			errno = ENOMEM;
@@ -1477,14 +1871,56 @@ int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
 		return -1;
 	}
 
-	xattrs[node->n_xattrs].key = k;
-	xattrs[node->n_xattrs].value = v;
-	xattrs[node->n_xattrs].value_len = value_len;
+	xattrs[node->n_xattrs] = (struct lcfs_xattr_s){
+		.key = k,
+		.value = v,
+		.value_len = value_len,
+	};
 	node->n_xattrs++;
 
 	return 0;
 }
 
+/* This is an internal function, used by the erofs writer to add
+ * xattrs without copying their value. The name must not be set
+ * already, and the name and data must outlive the node. The value is
+ * prefix (up to 4 bytes) followed by data, so the xattr can only be
+ * serialized, not read with lcfs_node_get_xattr() or cloned. */
+int lcfs_node_add_virtual_xattr(struct lcfs_node_s *node, const char *name,
+				const uint8_t *prefix, size_t prefix_len,
+				const char *data, size_t data_len)
+{
+	struct lcfs_xattr_s *xattrs;
+	struct lcfs_xattr_s *xattr;
+
+	if (prefix_len > sizeof(xattr->value_prefix) ||
+	    prefix_len + data_len > UINT16_MAX || node->n_xattrs == UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	xattrs = realloc(node->xattrs,
+			 (node->n_xattrs + 1) * sizeof(struct lcfs_xattr_s));
+	if (xattrs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	node->xattrs = xattrs;
+
+	xattr = &xattrs[node->n_xattrs++];
+	*xattr = (struct lcfs_xattr_s){
+		.key = (char *)name,
+		.value = (char *)data,
+		.value_len = prefix_len + data_len,
+		.erofs_virtual = true,
+		.value_prefix_len = prefix_len,
+	};
+	if (prefix_len > 0)
+		memcpy(xattr->value_prefix, prefix, prefix_len);
+
+	return 0;
+}
+
 /* This is an internal function.
  * Be careful to not cause duplicates if new_name already exist */
 int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index, const char *new_name)
@@ -1504,6 +1940,7 @@ int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index, const char *n
 	}
 
 	xattr = &node->xattrs[index];
+	assert(!xattr->erofs_virtual);
 	free(xattr->key);
 	xattr->key = steal_pointer(&dup);
 	return 0;
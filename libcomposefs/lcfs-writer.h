@@ -39,19 +39,48 @@ enum {
 	LCFS_BUILD_BY_DIGEST = (1 << 6), /* Refer to basedir files by fs-verity digest */
 };
 
+enum {
+	LCFS_LOAD_LAZY = (1 << 0), /* Decode directory children on first access */
+	LCFS_LOAD_PARALLEL = (1 << 1), /* Decode subtrees on multiple threads */
+};
+
+/* Max inline_limit for lcfs_build_ext(), files up to one erofs block
+ * can be stored in the image */
+#define LCFS_BUILD_INLINE_FILE_SIZE_MAX 4096
+
+/* Max threads used by lcfs_write_to() and LCFS_LOAD_PARALLEL, larger
+ * values are capped */
+#define LCFS_MAX_THREADS 256
+
 enum lcfs_format_t {
 	LCFS_FORMAT_EROFS,
 };
 
 enum lcfs_flags_t {
 	LCFS_FLAGS_NONE = 0,
-	LCFS_FLAGS_MASK = 0,
+	LCFS_FLAGS_WRITE_FD = (1 << 0), /* Write to file_fd rather than file_write_cb */
+	LCFS_FLAGS_DEDUP_DATA_BLOCKS = (1 << 1), /* Share identical inline file data blocks */
+	LCFS_FLAGS_MASK = LCFS_FLAGS_WRITE_FD | LCFS_FLAGS_DEDUP_DATA_BLOCKS,
 };
 
-#define LCFS_VERSION_MAX 1
+enum lcfs_layout_t {
+	LCFS_LAYOUT_BFS = 0, /* Breadth-first, the default */
+	LCFS_LAYOUT_DFS = 1, /* Depth-first, each directory before its subtree */
+	LCFS_LAYOUT_DIR_CHILDREN = 2, /* All children of a directory together, subtrees depth-first */
+	LCFS_LAYOUT_MAX = LCFS_LAYOUT_DIR_CHILDREN,
+};
+
+/* Range of lcfs_write_options_s.block_size_bits, 0 picks the
+ * default of 12 (4096 byte blocks) */
+#define LCFS_BLOCK_SIZE_BITS_MIN 12
+#define LCFS_BLOCK_SIZE_BITS_MAX 16
+
+#define LCFS_VERSION_MAX 3
 /* Version history:
  * 0 - Initial version
  * 1 - Mark xwhitouts using the opaque=x format (1.0.3)
+ * 2 - Use erofs long xattr name prefixes for overlay metacopy/redirect
+ * 3 - Use the most common mtime as build time, to allow more compact inodes
  */
 
 /* Default value used by tooling, update with care */
@@ -69,7 +98,21 @@ struct lcfs_write_options_s {
 	void *file;
 	lcfs_write_cb file_write_cb;
 	uint32_t max_version;
-	uint32_t reserved[3];
+	/* With LCFS_FLAGS_WRITE_FD, the image is written at offset 0 of
+	 * this fd. Regular files are preallocated to the final image
+	 * size, and all writes are block sized and aligned, so the fd
+	 * may be opened with O_DIRECT. */
+	int file_fd;
+	/* If more than one, inodes and data blocks are serialized in
+	 * parallel on up to this many threads (at most LCFS_MAX_THREADS).
+	 * The output is identical. */
+	uint32_t threads;
+	/* One of lcfs_layout_t, the order in which inodes are stored */
+	uint8_t layout;
+	/* log2 of the erofs block size. Larger blocks can only be
+	 * mounted by kernels with a page size at least that large. */
+	uint8_t block_size_bits;
+	uint8_t reserved[2];
 	void *reserved2[4];
 };
 
@@ -80,9 +123,36 @@ LCFS_EXTERN struct lcfs_node_s *lcfs_node_clone(struct lcfs_node_s *node);
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_clone_deep(struct lcfs_node_s *node);
 LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 							 int buildflags);
+/* Like lcfs_load_node_from_file(), but regular files up to inline_limit
+ * bytes (rather than the default of 64) are stored in the image. */
+LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_file_ext(int dirfd,
+							     const char *fname,
+							     int buildflags,
+							     size_t inline_limit);
 LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_data,
 							  size_t image_data_size);
 LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_fd(int fd);
+/* With LCFS_LOAD_LAZY, directories decode their children the first
+ * time they are accessed through lcfs_node_get_n_children(),
+ * lcfs_node_get_child(), lcfs_node_lookup_child() or when the tree is
+ * cloned or written. Those return 0 or NULL if decoding fails, so
+ * call lcfs_node_ensure_children() first to tell failures apart from
+ * empty directories. Each directory is validated when it is decoded,
+ * so opening doesn't depend on the size of the image. The image data
+ * must then stay valid until all the nodes are freed
+ * (lcfs_load_node_from_fd_ext() keeps its own mapping).
+ * Hardlinks point to the first occurrence that was decoded, so the
+ * target depends on the order the tree is accessed in.
+ * LCFS_LOAD_PARALLEL decodes the tree on up to threads threads (at
+ * most LCFS_MAX_THREADS), or one per online CPU if threads is 0,
+ * giving the same tree as the serial decode. It can't be combined with
+ * LCFS_LOAD_LAZY. threads is ignored without LCFS_LOAD_PARALLEL. */
+LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_image_ext(const uint8_t *image_data,
+							      size_t image_data_size,
+							      int loadflags,
+							      uint32_t threads);
+LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_fd_ext(int fd, int loadflags,
+							   uint32_t threads);
 LCFS_EXTERN int lcfs_version_from_fd(int fd);
 
 LCFS_EXTERN const char *lcfs_node_get_xattr(struct lcfs_node_s *node,
@@ -108,6 +178,10 @@ LCFS_EXTERN int lcfs_node_add_child(struct lcfs_node_s *parent,
 				    struct lcfs_node_s *child, /* Takes ownership on success */
 				    const char *name);
 LCFS_EXTERN const char *lcfs_node_get_name(struct lcfs_node_s *node);
+/* Decodes the children of a directory loaded with LCFS_LOAD_LAZY, if
+ * that wasn't done yet. Returns -1 and sets errno on failure, leaving
+ * the directory to be decoded again on the next access. */
+LCFS_EXTERN int lcfs_node_ensure_children(struct lcfs_node_s *node);
 LCFS_EXTERN size_t lcfs_node_get_n_children(struct lcfs_node_s *node);
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_get_child(struct lcfs_node_s *node,
 						    size_t i);
@@ -143,10 +217,38 @@ LCFS_EXTERN int lcfs_node_set_fsverity_from_fd(struct lcfs_node_s *node, int fd)
 
 LCFS_EXTERN struct lcfs_node_s *lcfs_build(int dirfd, const char *fname,
 					   int buildflags, char **failed_path_out);
+LCFS_EXTERN struct lcfs_node_s *lcfs_build_ext(int dirfd, const char *fname,
+					       int buildflags, size_t inline_limit,
+					       char **failed_path_out);
 
 LCFS_EXTERN int lcfs_write_to(struct lcfs_node_s *root,
 			      struct lcfs_write_options_s *options);
 
+/* Writes an image without having the whole tree in memory. Nodes are
+ * added one at a time, in the order composefs-info dump lists them
+ * (depth-first, with directory entries sorted by name, starting with
+ * "/"), and are kept in temporary files in tmpdir ($TMPDIR or
+ * /var/tmp if NULL) until lcfs_write_stream_finish() writes the
+ * image. The image is the same as lcfs_write_to() writes for the
+ * tree. Only the default layout is supported, without
+ * LCFS_FLAGS_DEDUP_DATA_BLOCKS, and the threads option is ignored.
+ * The options must stay valid until the stream is freed. */
+struct lcfs_write_stream_s;
+
+LCFS_EXTERN struct lcfs_write_stream_s *
+lcfs_write_stream_new(struct lcfs_write_options_s *options, const char *tmpdir);
+LCFS_EXTERN int lcfs_write_stream_add(struct lcfs_write_stream_s *stream,
+				      const char *path, struct lcfs_node_s *node);
+LCFS_EXTERN int lcfs_write_stream_add_hardlink(struct lcfs_write_stream_s *stream,
+					       const char *path,
+					       const char *target_path);
+LCFS_EXTERN int lcfs_write_stream_finish(struct lcfs_write_stream_s *stream);
+/* After lcfs_write_stream_finish() failed with ENOENT or ELOOP, the
+ * hardlink target that couldn't be resolved to a node */
+LCFS_EXTERN const char *
+lcfs_write_stream_get_failed_path(struct lcfs_write_stream_s *stream);
+LCFS_EXTERN void lcfs_write_stream_free(struct lcfs_write_stream_s *stream);
+
 /* fsverity helpers */
 LCFS_EXTERN int lcfs_compute_fsverity_from_content(uint8_t *digest, void *file,
 						   lcfs_read_cb read_cb);
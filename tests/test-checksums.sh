@@ -11,7 +11,8 @@ has_fsck=$(check_erofs_fsck)
 set -e
 tmpfile=$(mktemp /tmp/lcfs-test.XXXXXX)
 tmpfile2=$(mktemp /tmp/lcfs-test.XXXXXX)
-trap 'rm -rf -- "$tmpfile" "$tmpfile2"' EXIT
+tmpfile3=$(mktemp /tmp/lcfs-test.XXXXXX)
+trap 'rm -rf -- "$tmpfile" "$tmpfile2" "$tmpfile3"' EXIT
 
 for format in erofs ; do
     for file in ${TEST_ASSETS} ; do
@@ -41,23 +42,65 @@ for format in erofs ; do
         if [ $has_fsck == y ]; then
             fsck.erofs $tmpfile
         fi
+        ${BINDIR}/composefs-info check $tmpfile
 
         if [ $SHA != $EXPECTED_SHA ]; then
             echo Invalid $format checksum of file generated from $file: $SHA, expected $EXPECTED_SHA
             exit 1
         fi
 
-        # Ensure dump reproduces the same file
-        ${VALGRIND_PREFIX} ${BINDIR}/composefs-dump $tmpfile $tmpfile2
+        # Ensure threaded serialization gives the same result
+        $CAT $ASSET_DIR/$file | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --threads=4 --from-file - $tmpfile2
         if ! cmp $tmpfile $tmpfile2; then
-            echo Dump is not reproducible
+            echo Threaded $format image generated from $file differs
             exit 1
         fi
 
+        # Ensure other layouts store the same tree
+        for layout in dfs dir-children; do
+            $CAT $ASSET_DIR/$file | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --layout=$layout --from-file - $tmpfile2
+            if ! cmp <(${BINDIR}/composefs-info dump $tmpfile) <(${BINDIR}/composefs-info dump $tmpfile2); then
+                echo Image generated from $file with $layout layout has different content
+                exit 1
+            fi
+        done
+
+        # Ensure larger block sizes store the same tree
+        for block_size in 16384 65536; do
+            $CAT $ASSET_DIR/$file | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --block-size=$block_size --from-file - $tmpfile2
+            if [ $has_fsck == y ]; then
+                fsck.erofs $tmpfile2
+            fi
+            ${BINDIR}/composefs-info check $tmpfile2
+            # Directory sizes depend on the block size, so compare the
+            # image re-created with the default block size
+            ${BINDIR}/composefs-info dump $tmpfile2 | ${BINDIR}/mkcomposefs $VERSION_ARG --from-file - $tmpfile3
+            if ! cmp $tmpfile $tmpfile3; then
+                echo Image generated from $file with $block_size byte blocks has different content
+                exit 1
+            fi
+        done
+
+        # Ensure dump reproduces the same file, both when the image is
+        # decoded serially and on multiple threads
+        for threads in 1 4; do
+            ${VALGRIND_PREFIX} ${BINDIR}/composefs-dump --threads=$threads $tmpfile $tmpfile2
+            if ! cmp $tmpfile $tmpfile2; then
+                echo Dump on $threads threads is not reproducible
+                exit 1
+            fi
+        done
+
         ${VALGRIND_PREFIX} ${BINDIR}/composefs-info dump $tmpfile | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --from-file - $tmpfile2
         if ! cmp $tmpfile $tmpfile2; then
             echo Dump is not reproducible via composefs-info dump
             exit 1
         fi
+
+        ${BINDIR}/composefs-info dump $tmpfile | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --stream --from-file - $tmpfile2
+        if ! cmp $tmpfile $tmpfile2; then
+            echo Streamed $format image generated from $file differs
+            exit 1
+        fi
     done
 done
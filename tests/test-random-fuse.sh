@@ -84,6 +84,32 @@ test_random() {
         diff -u $workdir/fuse.dump $workdir/fuse2.dump
         exit 1
     fi
+
+    # Backing files are checked against their fs-verity digests, which
+    # are computed in userspace if the filesystem doesn't support it
+    ${BINDIR}/composefs-fuse -o source=$workdir/root.cfs,basedir=$workdir/objects,verity_userspace $workdir/mnt
+    $(dirname $0)/dumpdir --userxattr --whiteout $workdir/mnt >  $workdir/verity.dump
+    umount $workdir/mnt
+
+    if ! cmp $workdir/root.dump $workdir/verity.dump; then
+        echo Real dir and verity fuse dump differ
+        diff -u $workdir/root.dump $workdir/verity.dump
+        exit 1
+    fi
+
+    # A modified backing file fails to open
+    read path payload < <(${BINDIR}/composefs-info dump $workdir/root.cfs | awk '$3 ~ /^100/ && $9 != "-" && $1 !~ /\\/ { print $1, $9; exit }')
+    if [ -n "$path" ]; then
+        chmod u+w $workdir/objects/$payload
+        echo modified >> $workdir/objects/$payload
+        ${BINDIR}/composefs-fuse -o source=$workdir/root.cfs,basedir=$workdir/objects,verity_userspace $workdir/mnt
+        if cat $workdir/mnt$path > /dev/null 2> $workdir/stderr; then
+            umount $workdir/mnt
+            fatal "modified backing file $path could be opened"
+        fi
+        umount $workdir/mnt
+        assert_file_has_content $workdir/stderr "Input/output error"
+    fi
 }
 
 if [[ -v seed ]]; then
@@ -11,7 +11,8 @@ trap 'rm -rf -- "$workdir"' EXIT
 
 function makeimage () {
     local dir=$1
-    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-store=$dir/objects $dir/root $dir/test.cfs
+    shift
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-store=$dir/objects "$@" $dir/root $dir/test.cfs
 }
 
 function countobjects () {
@@ -46,6 +47,219 @@ function  test_objects () {
     fi
 }
 
+# Ensure the objects of several images are the same on multiple threads
+function  test_objects_threads () {
+    local dir=$1
+    dd if=/dev/zero bs=1 count=1024 2>/dev/null > $dir/root/a-file
+    makeimage $dir
+    cp $dir/test.cfs $dir/test2.cfs
+    yes | head -c 2048 > $dir/root/b-file
+    makeimage $dir
+    $BINDIR/composefs-info objects $dir/test.cfs $dir/test2.cfs $dir/test.cfs > $dir/objects.txt
+    if [ $(wc -l < $dir/objects.txt) != 2 ]; then
+        return 1
+    fi
+    $BINDIR/composefs-info --threads=2 objects $dir/test.cfs $dir/test2.cfs $dir/test.cfs 2> /dev/null | cmp -s $dir/objects.txt - || return 1
+
+    missing=$($BINDIR/composefs-info --threads=2 --basedir=$dir/objects missing-objects $dir/test.cfs $dir/test2.cfs 2> /dev/null)
+    if [ -n "$missing" ]; then
+        return 1
+    fi
+}
+
+# Ensure larger files are inlined with a higher inline limit
+function  test_inline_limit () {
+    local dir=$1
+    dd if=/dev/urandom bs=1 count=1024 2>/dev/null > $dir/root/a-file
+    dd if=/dev/urandom bs=1 count=4097 2>/dev/null > $dir/root/b-file
+
+    makeimage $dir --inline-limit=4096
+
+    objects=$(countobjects $dir)
+    if [ $objects != 1 ]; then
+        return 1
+    fi
+
+    # a-file has no payload, but inline content
+    inline=$($BINDIR/composefs-info dump $dir/test.cfs | awk '$1 == "/a-file" { print $9 != "-" || $10 == "-" }')
+    if [ "$inline" != 0 ]; then
+        return 1
+    fi
+}
+
+# Ensure identical inline files share their data blocks
+function  test_dedup_data_blocks () {
+    local dir=$1
+    dd if=/dev/urandom bs=1 count=3000 2>/dev/null > $dir/root/a-file
+    cp $dir/root/a-file $dir/root/b-file
+    cp $dir/root/a-file $dir/root/c-file
+    dd if=/dev/urandom bs=1 count=3000 2>/dev/null > $dir/root/d-file
+
+    makeimage $dir --inline-limit=4096
+    mv $dir/test.cfs $dir/test-nodedup.cfs
+    makeimage $dir --inline-limit=4096 --dedup-data-blocks
+
+    # Two of the four data blocks are shared
+    size=$(stat -c %s $dir/test.cfs)
+    size_nodedup=$(stat -c %s $dir/test-nodedup.cfs)
+    if [ $((size_nodedup - size)) != 8192 ]; then
+        return 1
+    fi
+
+    if ! cmp -s <($BINDIR/composefs-info dump $dir/test.cfs) <($BINDIR/composefs-info dump $dir/test-nodedup.cfs); then
+        return 1
+    fi
+}
+
+# Ensure ls lists directories, symlinks and backing files
+function  test_ls () {
+    local dir=$1
+    mkdir $dir/root/subdir
+    ln -s target $dir/root/subdir/link
+    dd if=/dev/zero bs=1 count=1024 2>/dev/null > $dir/root/a-file
+
+    makeimage $dir
+
+    $BINDIR/composefs-info ls $dir/test.cfs > $dir/ls.txt
+    assert_file_has_content $dir/ls.txt \
+        "^/subdir/"$'\t'"$" \
+        "^/subdir/link"$'\t'"-> target$" \
+        "^/a-file"$'\t'"@ [0-9a-f][0-9a-f]/[0-9a-f]*$"
+}
+
+# Ensure the layouts store the inodes in different orders, which for
+# this tree are:
+#   bfs:          / a b a/c a/f b/g a/c/h
+#   dfs:          / a a/c a/c/h a/f b b/g
+#   dir-children: / a b a/c a/f a/c/h b/g
+function  test_layouts () {
+    local dir=$1 layout
+    mkdir -p $dir/root/a/c $dir/root/b
+    touch $dir/root/a/c/h $dir/root/a/f $dir/root/b/g
+
+    for layout in bfs dfs dir-children; do
+        makeimage $dir --layout=$layout
+        mv $dir/test.cfs $dir/$layout.cfs
+        cmp -s <($BINDIR/composefs-info dump $dir/bfs.cfs) <($BINDIR/composefs-info dump $dir/$layout.cfs) || return 1
+    done
+
+    if cmp -s $dir/bfs.cfs $dir/dfs.cfs || cmp -s $dir/bfs.cfs $dir/dir-children.cfs ||
+       cmp -s $dir/dfs.cfs $dir/dir-children.cfs; then
+        fatal "layouts give the same image"
+    fi
+}
+
+# Ensure a lazily loaded tree has the same content as an eager load
+function  test_lazy () {
+    local dir=$1 i
+    mkdir -p $dir/root/a/b/c $dir/root/d $dir/root/e
+    for i in 1 2 3 4 5; do
+        echo $i > $dir/root/a/file$i
+        yes $i | head -c 2048 > $dir/root/a/b/big$i
+    done
+    ln $dir/root/a/file1 $dir/root/d/link1
+    ln $dir/root/a/b/big2 $dir/root/a/b/c/link2
+    ln $dir/root/a/b/big2 $dir/root/e/link2
+    ln -s ../a/file3 $dir/root/d/symlink
+
+    makeimage $dir
+
+    $BINDIR/composefs-dump $dir/test.cfs $dir/eager.cfs || return 1
+    $BINDIR/composefs-dump --lazy $dir/test.cfs $dir/lazy.cfs || return 1
+    # Hardlinks may be written from another path, so compare the trees
+    cmp -s <($BINDIR/composefs-info dump $dir/eager.cfs) <($BINDIR/composefs-info dump $dir/lazy.cfs) || return 1
+    cmp -s <($BINDIR/composefs-info dump $dir/test.cfs) <($BINDIR/composefs-info dump $dir/lazy.cfs) || return 1
+}
+
+# Ensure backing file paths starting with "/" survive loading, with
+# lengths that end the redirect xattr on and off an aligned boundary
+function  test_redirect_roundtrip () {
+    local dir=$1 p
+    echo "/ 4096 40755 2 0 0 0 0.0 - - -" > $dir/redirect.dump
+    for p in /a/bc /a/bcd /a/bcde /a/bcdef; do
+        echo "/${p//\//} 4096 100644 1 0 0 0 0.0 $p - - user.foo=bar" >> $dir/redirect.dump
+    done
+    $BINDIR/mkcomposefs --from-file $dir/redirect.dump $dir/test.cfs || return 1
+    $BINDIR/composefs-dump $dir/test.cfs $dir/dump.cfs || return 1
+    cmp -s $dir/test.cfs $dir/dump.cfs || return 1
+    $BINDIR/composefs-info dump $dir/dump.cfs | cmp -s $dir/redirect.dump - || return 1
+}
+
+# Ensure --stream writes the same image for hardlinks to hardlinks
+function  test_stream_links () {
+    local dir=$1
+    cat > $dir/links.dump <<EOF
+/ 4096 40755 2 0 0 0 0.0 - - -
+/a 3 100644 4 0 0 0 0.0 - foo -
+/d 4096 40755 2 0 0 0 0.0 - - -
+/d/y 3 @100644 4 0 0 0 0.0 /z - -
+/d/z 3 @100644 4 0 0 0 0.0 /d/y - -
+/z 3 @100644 4 0 0 0 0.0 /a - -
+EOF
+    $BINDIR/mkcomposefs --from-file $dir/links.dump $dir/tree.cfs || return 1
+    $BINDIR/mkcomposefs --stream --from-file $dir/links.dump $dir/stream.cfs || return 1
+    cmp -s $dir/tree.cfs $dir/stream.cfs || return 1
+
+    sed -i 's|^/z .*|/z 3 @100644 4 0 0 0 0.0 /missing - -|' $dir/links.dump
+    $BINDIR/mkcomposefs --stream --from-file $dir/links.dump $dir/stream.cfs 2> $dir/stderr && return 1
+    assert_file_has_content $dir/stderr "No target at /missing for hardlink"
+
+    sed -i 's|^/z .*|/z 3 @100644 4 0 0 0 0.0 /d/z - -|' $dir/links.dump
+    $BINDIR/mkcomposefs --stream --from-file $dir/links.dump $dir/stream.cfs 2> $dir/stderr && return 1
+    assert_file_has_content $dir/stderr "Hardlink loop at /"
+
+    $BINDIR/mkcomposefs --stream --from-file - $dir/stream.cfs < /dev/null 2> $dir/stderr && return 1
+    assert_file_has_content $dir/stderr "No files in dump file"
+}
+
+function  test_diff () {
+    local dir=$1
+    mkdir $dir/root/subdir
+    echo same > $dir/root/same
+    dd if=/dev/zero bs=1 count=1024 2>/dev/null > $dir/root/changed
+    ln -s target $dir/root/subdir/link
+    touch -d @0 $dir/root/same $dir/root/changed
+    makeimage $dir
+    mv $dir/test.cfs $dir/old.cfs
+
+    rm -r $dir/root/subdir
+    yes | head -c 1024 > $dir/root/changed
+    dd if=/dev/zero bs=1 count=2048 2>/dev/null > $dir/root/added
+    touch -d @0 $dir/root/changed
+    makeimage $dir
+
+    $BINDIR/composefs-info diff $dir/old.cfs $dir/test.cfs > $dir/diff.txt
+    assert_file_has_content $dir/diff.txt \
+        "^+ /added - [0-9a-f][0-9a-f]/[0-9a-f]*$" \
+        "^M /changed payload,digest [0-9a-f][0-9a-f]/[0-9a-f]*$" \
+        "^- /subdir - -$" \
+        "^- /subdir/link - target$"
+    if grep -q " /same " $dir/diff.txt; then
+        fatal "unchanged file listed in diff"
+    fi
+
+    $BINDIR/composefs-info diff $dir/test.cfs $dir/test.cfs > $dir/diff.txt
+    if [ -s $dir/diff.txt ]; then
+        fatal "diff of identical images is not empty"
+    fi
+}
+
+function  test_check () {
+    local dir=$1
+    touch $dir/root/name-k $dir/root/name-m $dir/root/name-p
+    makeimage $dir
+
+    $BINDIR/composefs-info check $dir/test.cfs
+
+    # Break the sort order of the dirents, which lookups rely on
+    offset=$(grep -obUa name-m $dir/test.cfs | cut -d: -f1)
+    printf name-x | dd of=$dir/test.cfs bs=1 seek=$offset conv=notrunc 2>/dev/null
+    if $BINDIR/composefs-info check $dir/test.cfs 2> $dir/stderr; then
+        fatal "invalid image passed check"
+    fi
+    assert_file_has_content $dir/stderr "Invalid image"
+}
+
 function  test_mount_digest () {
     local dir=$1
 
@@ -68,7 +282,7 @@ function  test_mount_digest () {
     fi
 }
 
-TESTS="test_inline test_objects test_mount_digest"
+TESTS="test_inline test_objects test_objects_threads test_inline_limit test_dedup_data_blocks test_ls test_layouts test_lazy test_redirect_roundtrip test_stream_links test_diff test_check test_mount_digest"
 res=0
 for i in $TESTS; do
     testdir=$(mktemp -d $workdir/$i.XXXXXX)
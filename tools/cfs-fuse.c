@@ -23,42 +23,80 @@
 #include <linux/mount.h>
 #include <linux/fsverity.h>
 #include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/sysmacros.h>
 
 #include "libcomposefs/lcfs-erofs-internal.h"
+#include "libcomposefs/lcfs-image.h"
 #include "libcomposefs/lcfs-internal.h"
 #include "libcomposefs/lcfs-utils.h"
+#include "libcomposefs/hash.h"
 
-/* TODO:
- *  Do we want to user ther negative_timeout=T option?
- */
-
+/* The image never changes, so the kernel can cache everything for
+ * long, including failed lookups. These are the defaults of the
+ * timeout options. */
 #define CFS_ENTRY_TIMEOUT 3600.0
 #define CFS_ATTR_TIMEOUT 3600.0
+#define CFS_NEGATIVE_TIMEOUT 3600.0
+
+/* Directories with at least this many blocks get a lookup index */
+#define CFS_DIR_INDEX_MIN_BLOCKS 2
+#define CFS_LOOKUP_CACHE_SIZE_DEFAULT (16 * 1024 * 1024)
+#define CFS_FD_CACHE_SIZE_DEFAULT 256
 
 const uint8_t *erofs_data;
 size_t erofs_data_size;
+uint64_t erofs_blksz;
 uint64_t erofs_root_nid;
 bool erofs_use_acl;
 const struct erofs_super_block *erofs_super;
 const struct lcfs_erofs_header_s *cfs_header;
 const uint8_t *erofs_metadata;
 const uint8_t *erofs_xattrdata;
+struct erofs_long_xattr_prefix erofs_long_prefixes[EROFS_N_LONG_XATTR_PREFIXES_MAX];
+size_t erofs_n_long_prefixes;
 uint64_t erofs_build_time;
 uint32_t erofs_build_time_nsec;
 int basedir_fd;
+double cfs_entry_timeout;
+double cfs_attr_timeout;
+double cfs_negative_timeout;
+/* Set if the kernel can read backing files directly, until that fails */
+bool cfs_use_passthrough;
+/* Validated at startup, so the image data can be used without bounds
+ * checks for the nids it has checked */
+lcfs_image_t *cfs_image;
 
 struct cfs_data {
 	const char *source;
 	const char *basedir;
 	bool noacl;
+	bool verity;
+	bool verity_userspace;
+	unsigned long lookup_cache_size;
+	unsigned long fd_cache_size;
+	double entry_timeout;
+	double attr_timeout;
+	double negative_timeout;
 };
 
 static const struct fuse_opt cfs_opts[] = {
 	{ "source=%s", offsetof(struct cfs_data, source), 0 },
 	{ "basedir=%s", offsetof(struct cfs_data, basedir), 0 },
 	{ "noacl", offsetof(struct cfs_data, noacl), 1 },
+	/* All backing files must match their fs-verity digest */
+	{ "verity", offsetof(struct cfs_data, verity), 1 },
+	/* Like verity, but hash backing files without fs-verity ourselves */
+	{ "verity_userspace", offsetof(struct cfs_data, verity_userspace), 1 },
+	/* Max bytes used by directory lookup indexes, 0 disables them */
+	{ "lookup_cache_size=%lu", offsetof(struct cfs_data, lookup_cache_size), 0 },
+	/* Max number of unused backing files kept open */
+	{ "fd_cache_size=%lu", offsetof(struct cfs_data, fd_cache_size), 0 },
+	/* Seconds the kernel caches names, attributes and failed lookups */
+	{ "entry_timeout=%lf", offsetof(struct cfs_data, entry_timeout), 0 },
+	{ "attr_timeout=%lf", offsetof(struct cfs_data, attr_timeout), 0 },
+	{ "negative_timeout=%lf", offsetof(struct cfs_data, negative_timeout), 0 },
 	FUSE_OPT_END
 };
 
@@ -82,29 +120,12 @@ static const erofs_inode *cfs_get_erofs_inode(fuse_ino_t ino)
 {
 	uint64_t nid = cfs_nid_from_ino(ino);
 
-	/* TODO: Add bounds check */
+	if (!lcfs_image_nid_is_valid(cfs_image, nid))
+		return NULL;
 
 	return (const erofs_inode *)(erofs_metadata + (nid << EROFS_ISLOTBITS));
 }
 
-static int erofs_inode_is_whiteout(const erofs_inode *cino)
-{
-	mode_t mode;
-	dev_t rdev;
-	if (erofs_inode_is_compact(cino)) {
-		const struct erofs_inode_compact *c = &cino->compact;
-		mode = lcfs_u16_from_file(c->i_mode);
-		rdev = lcfs_u32_from_file(c->i_u.rdev);
-	} else {
-		const struct erofs_inode_extended *e = &cino->extended;
-		mode = lcfs_u16_from_file(e->i_mode);
-		rdev = lcfs_u32_from_file(e->i_u.rdev);
-	}
-
-	int type = mode & S_IFMT;
-	return (type == S_IFCHR || type == S_IFBLK) && rdev == makedev(0, 0);
-}
-
 static int cfs_stat(fuse_ino_t ino, const erofs_inode *cino, struct stat *stbuf)
 {
 	stbuf->st_ino = ino;
@@ -160,7 +181,7 @@ static void cfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *f
 	if (cino == NULL || cfs_stat(ino, cino, &stbuf) == -1)
 		fuse_reply_err(req, ENOENT);
 	else
-		fuse_reply_attr(req, &stbuf, CFS_ATTR_TIMEOUT);
+		fuse_reply_attr(req, &stbuf, cfs_attr_timeout);
 }
 
 static mode_t erofs_inode_get_mode(const erofs_inode *cino)
@@ -174,123 +195,298 @@ static mode_t erofs_inode_get_mode(const erofs_inode *cino)
 	}
 }
 
-static void erofs_inode_get_info(const erofs_inode *cino, uint32_t *mode,
-				 uint64_t *file_size, uint16_t *xattr_icount,
-				 uint32_t *raw_blkaddr, size_t *isize)
+/* Lookups in large directories use a hash index of the dirents, which
+ * is built on the first lookup. The indexes are kept in LRU order, and
+ * the least recently used ones are freed when they take more than
+ * lookup_cache_size bytes in total. Directories whose index wouldn't
+ * fit get an entry without slots, so they aren't counted again. */
+
+struct cfs_dir_slot {
+	const char *name; /* NULL for empty slots */
+	uint32_t name_len;
+	uint32_t hash;
+	uint64_t nid;
+};
+
+struct cfs_dir_index {
+	uint64_t nid; /* First, so a nid can be used as the hash table key */
+	size_t size; /* Bytes used by the index */
+	struct cfs_dir_index *lru_prev;
+	struct cfs_dir_index *lru_next;
+	bool too_big; /* No slots, lookups use the dirents */
+	size_t mask; /* The number of slots - 1 */
+	struct cfs_dir_slot slots[];
+};
+
+pthread_mutex_t cfs_lookup_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+Hash_table *cfs_lookup_cache; /* NULL if disabled */
+/* Most recently used first */
+struct cfs_dir_index cfs_lookup_cache_lru = {
+	.lru_prev = &cfs_lookup_cache_lru,
+	.lru_next = &cfs_lookup_cache_lru,
+};
+size_t cfs_lookup_cache_used;
+size_t cfs_lookup_cache_size;
+
+static size_t cfs_lookup_cache_ht_hash(const void *entry, size_t table_size)
 {
-	if (erofs_inode_is_compact(cino)) {
-		const struct erofs_inode_compact *c = &cino->compact;
+	const uint64_t *nid = entry;
+	return *nid % table_size;
+}
 
-		*mode = lcfs_u16_from_file(c->i_mode);
-		*file_size = lcfs_u32_from_file(c->i_size);
-		*xattr_icount = lcfs_u16_from_file(c->i_xattr_icount);
-		*raw_blkaddr = lcfs_u32_from_file(c->i_u.raw_blkaddr);
-		*isize = sizeof(struct erofs_inode_compact);
-	} else {
-		const struct erofs_inode_extended *e = &cino->extended;
-		*mode = lcfs_u16_from_file(e->i_mode);
-		*file_size = lcfs_u64_from_file(e->i_size);
-		*xattr_icount = lcfs_u16_from_file(e->i_xattr_icount);
-		*raw_blkaddr = lcfs_u32_from_file(e->i_u.raw_blkaddr);
-		*isize = sizeof(struct erofs_inode_extended);
-	}
+static bool cfs_lookup_cache_ht_eq(const void *entry1, const void *entry2)
+{
+	const uint64_t *nid1 = entry1;
+	const uint64_t *nid2 = entry2;
+	return *nid1 == *nid2;
 }
 
-/* This is essentially strcmp() for non-null-terminated strings */
-static inline int memcmp2(const void *a, const size_t a_size, const void *b,
-			  size_t b_size)
+/* 64bit FNV-1a, truncated */
+static uint32_t cfs_name_hash(const char *name, size_t name_len)
 {
-	size_t common_size = min(a_size, b_size);
-	int res;
+	uint64_t hash = 0xcbf29ce484222325ULL;
 
-	res = memcmp(a, b, common_size);
-	if (res != 0 || a_size == b_size)
-		return res;
+	for (size_t i = 0; i < name_len; i++)
+		hash = (hash ^ (uint8_t)name[i]) * 0x100000001b3ULL;
 
-	return a_size < b_size ? -1 : 1;
+	return (uint32_t)hash;
 }
 
-static bool cfs_lookup_block(fuse_req_t req, const uint8_t *block,
-			     size_t block_size, const char *name, int *cmp_out)
+static void cfs_dir_index_insert(struct cfs_dir_index *index, const char *name,
+				 size_t name_len, uint64_t nid)
 {
-	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
-	size_t n_dirents;
-	size_t name_len = strlen(name);
-	ssize_t start_dirent, end_dirent;
-	int cmp = -1;
-
-	n_dirents = lcfs_u16_from_file(dirents[0].nameoff) /
-		    sizeof(struct erofs_dirent);
-
-	start_dirent = 0;
-	end_dirent = n_dirents - 1;
-	while (start_dirent <= end_dirent) {
-		ssize_t mid_dirent = start_dirent + (end_dirent - start_dirent) / 2;
-		uint16_t nameoff = lcfs_u16_from_file(dirents[mid_dirent].nameoff);
-		const char *child_name = (const char *)(block + nameoff);
-		uint16_t child_name_len;
+	uint32_t hash = cfs_name_hash(name, name_len);
+	size_t i = hash & index->mask;
 
-		if (mid_dirent + 1 < n_dirents)
-			child_name_len =
-				lcfs_u16_from_file(dirents[mid_dirent + 1].nameoff) -
-				nameoff;
-		else
-			child_name_len = strnlen(child_name, block_size - nameoff);
+	while (index->slots[i].name != NULL)
+		i = (i + 1) & index->mask;
 
-		cmp = memcmp2(name, name_len, child_name, child_name_len);
-		if (cmp == 0) {
-			uint64_t nid = lcfs_u64_from_file(dirents[mid_dirent].nid);
-			const erofs_inode *child_cino = cfs_get_erofs_inode(nid);
-			struct fuse_entry_param e;
+	index->slots[i].name = name;
+	index->slots[i].name_len = name_len;
+	index->slots[i].hash = hash;
+	index->slots[i].nid = nid;
+}
 
-			if (erofs_inode_is_whiteout(child_cino)) {
-				fuse_reply_err(req, ENOENT);
-			} else {
-				memset(&e, 0, sizeof(e));
-				e.ino = cfs_ino_from_nid(nid);
-				e.attr_timeout = CFS_ATTR_TIMEOUT;
-				e.entry_timeout = CFS_ENTRY_TIMEOUT;
-				cfs_stat(e.ino, child_cino, &e.attr);
+static bool cfs_dir_index_lookup(const struct cfs_dir_index *index,
+				 const char *name, size_t name_len,
+				 uint32_t hash, uint64_t *nid_out)
+{
+	for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+		const struct cfs_dir_slot *slot = &index->slots[i];
 
-				fuse_reply_entry(req, &e);
-			}
+		if (slot->name == NULL)
+			return false;
 
+		if (slot->hash == hash && slot->name_len == name_len &&
+		    memcmp(slot->name, name, name_len) == 0) {
+			*nid_out = slot->nid;
 			return true;
-		} else {
-			if (cmp > 0)
-				start_dirent = mid_dirent + 1;
-			else
-				end_dirent = mid_dirent - 1;
 		}
 	}
+}
 
-	if (end_dirent < 0) {
-		*cmp_out = -1;
-	} else if (start_dirent >= n_dirents) {
-		*cmp_out = 1;
-	} else {
-		*cmp_out = 0; /* inside the block */
+/* Returns an index without slots if it would be larger than the cache */
+static struct cfs_dir_index *
+cfs_dir_index_new(uint64_t nid, const uint8_t *oob_data, const uint8_t *tail_data,
+		  uint64_t file_size, bool tailpacked)
+{
+	uint64_t n_blocks = round_up(file_size, erofs_blksz) / erofs_blksz;
+	struct cfs_dir_index *index = NULL;
+	size_t n_dirents = 0;
+	size_t n_slots = 1;
+	size_t size;
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (uint64_t b = 0; b < n_blocks; b++) {
+			const uint8_t *block = (tailpacked && b == n_blocks - 1) ?
+						       tail_data :
+						       oob_data + b * erofs_blksz;
+			size_t block_size = min(erofs_blksz, file_size - b * erofs_blksz);
+			size_t block_n_dirents =
+				erofs_dirent_block_count(block, block_size);
+
+			if (pass == 0) {
+				n_dirents += block_n_dirents;
+				continue;
+			}
+
+			for (size_t i = 0; i < block_n_dirents; i++) {
+				const struct erofs_dirent *dirents =
+					(struct erofs_dirent *)block;
+				const char *name;
+				size_t name_len;
+
+				if (!erofs_dirent_get_name(block, block_size,
+							   block_n_dirents, i,
+							   &name, &name_len)) {
+					free(index);
+					return NULL;
+				}
+
+				cfs_dir_index_insert(index, name, name_len,
+						     lcfs_u64_from_file(dirents[i].nid));
+			}
+		}
+
+		if (pass == 0) {
+			/* Keep the load factor at most 1/2 */
+			while (n_slots < n_dirents * 2)
+				n_slots *= 2;
+
+			size = sizeof(struct cfs_dir_index) +
+			       n_slots * sizeof(struct cfs_dir_slot);
+			if (size > cfs_lookup_cache_size) {
+				index = calloc(1, sizeof(struct cfs_dir_index));
+				if (index == NULL)
+					return NULL;
+
+				index->nid = nid;
+				index->size = sizeof(struct cfs_dir_index);
+				index->too_big = true;
+				return index;
+			}
+
+			index = calloc(1, size);
+			if (index == NULL)
+				return NULL;
+
+			index->nid = nid;
+			index->size = size;
+			index->mask = n_slots - 1;
+		}
 	}
 
-	return false;
+	return index;
+}
+
+static void cfs_lookup_cache_unlink(struct cfs_dir_index *index)
+{
+	index->lru_prev->lru_next = index->lru_next;
+	index->lru_next->lru_prev = index->lru_prev;
+}
+
+static void cfs_lookup_cache_link_first(struct cfs_dir_index *index)
+{
+	index->lru_prev = &cfs_lookup_cache_lru;
+	index->lru_next = cfs_lookup_cache_lru.lru_next;
+	index->lru_next->lru_prev = index;
+	cfs_lookup_cache_lru.lru_next = index;
+}
+
+/* Adds index, which must not be in the cache, and evicts the least
+ * recently used indexes that don't fit. Called with the lock held. */
+static void cfs_lookup_cache_add(struct cfs_dir_index *index)
+{
+	cfs_lookup_cache_link_first(index);
+	cfs_lookup_cache_used += index->size;
+
+	while (cfs_lookup_cache_used > cfs_lookup_cache_size) {
+		struct cfs_dir_index *victim = cfs_lookup_cache_lru.lru_prev;
+
+		if (victim == index)
+			break;
+
+		hash_remove(cfs_lookup_cache, victim);
+		cfs_lookup_cache_unlink(victim);
+		cfs_lookup_cache_used -= victim->size;
+		free(victim);
+	}
+}
+
+/* Like erofs_dir_lookup(), using the index of the directory if it has one */
+static bool cfs_dir_lookup(uint64_t dir_nid, const uint8_t *oob_data,
+			   const uint8_t *tail_data, uint64_t file_size,
+			   bool tailpacked, const char *name, size_t name_len,
+			   uint64_t *nid_out)
+{
+	struct cfs_dir_index *index;
+	struct cfs_dir_index *existing;
+	bool too_big = false;
+	uint32_t hash;
+	bool found = false;
+
+	if (cfs_lookup_cache == NULL ||
+	    file_size < CFS_DIR_INDEX_MIN_BLOCKS * erofs_blksz)
+		return erofs_dir_lookup(oob_data, tail_data, file_size, erofs_blksz,
+					tailpacked, name, name_len, nid_out);
+
+	hash = cfs_name_hash(name, name_len);
+
+	pthread_mutex_lock(&cfs_lookup_cache_lock);
+	index = hash_lookup(cfs_lookup_cache, &dir_nid);
+	if (index != NULL) {
+		cfs_lookup_cache_unlink(index);
+		cfs_lookup_cache_link_first(index);
+		too_big = index->too_big;
+		if (!too_big)
+			found = cfs_dir_index_lookup(index, name, name_len,
+						     hash, nid_out);
+	}
+	pthread_mutex_unlock(&cfs_lookup_cache_lock);
+
+	if (too_big)
+		return erofs_dir_lookup(oob_data, tail_data, file_size, erofs_blksz,
+					tailpacked, name, name_len, nid_out);
+	if (index != NULL)
+		return found;
+
+	/* Build the index without the lock, so other lookups can go on */
+	index = cfs_dir_index_new(dir_nid, oob_data, tail_data, file_size,
+				  tailpacked);
+	if (index == NULL || index->too_big)
+		found = erofs_dir_lookup(oob_data, tail_data, file_size, erofs_blksz,
+					 tailpacked, name, name_len, nid_out);
+	else
+		found = cfs_dir_index_lookup(index, name, name_len, hash, nid_out);
+
+	if (index == NULL)
+		return found;
+
+	pthread_mutex_lock(&cfs_lookup_cache_lock);
+	existing = hash_insert(cfs_lookup_cache, index);
+	if (existing == index)
+		cfs_lookup_cache_add(index);
+	pthread_mutex_unlock(&cfs_lookup_cache_lock);
+
+	/* Out of memory, or another thread added it first */
+	if (existing != index)
+		free(index);
+
+	return found;
+}
+
+/* A zero ino tells the kernel to cache the miss, which only works with
+ * a non-zero timeout */
+static void cfs_reply_noent(fuse_req_t req)
+{
+	struct fuse_entry_param e;
+
+	if (cfs_negative_timeout <= 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.ino = 0;
+	e.entry_timeout = cfs_negative_timeout;
+	fuse_reply_entry(req, &e);
 }
 
 static void cfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	const erofs_inode *parent_cino = cfs_get_erofs_inode(parent);
+	const erofs_inode *child_cino;
 	uint32_t mode;
 	uint64_t file_size;
 	uint16_t xattr_icount;
 	uint32_t raw_blkaddr;
 	size_t xattr_size;
 	size_t isize;
-	uint64_t n_blocks;
-	uint64_t last_oob_block;
 	bool tailpacked;
-	size_t tail_size;
 	const uint8_t *tail_data;
 	const uint8_t *oob_data;
-	int start_block, end_block;
+	uint64_t nid;
+	struct fuse_entry_param e;
 
 	if (parent_cino == NULL) {
 		fuse_reply_err(req, ENOENT);
@@ -308,72 +504,28 @@ static void cfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	xattr_size = erofs_xattr_inode_size(xattr_icount);
 
 	tailpacked = erofs_inode_is_tailpacked(parent_cino);
-	tail_size = tailpacked ? file_size % EROFS_BLKSIZ : 0;
 	tail_data = ((uint8_t *)parent_cino) + isize + xattr_size;
-	n_blocks = round_up(file_size, EROFS_BLKSIZ) / EROFS_BLKSIZ;
-	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
-	oob_data = erofs_data + raw_blkaddr * EROFS_BLKSIZ;
+	oob_data = erofs_data + raw_blkaddr * erofs_blksz;
 
-	/* First read the out-of-band blocks */
-	start_block = 0;
-	end_block = last_oob_block - 1;
-	while (start_block <= end_block) {
-		int mid_block = start_block + (end_block - start_block) / 2;
-		const uint8_t *block_data = oob_data + mid_block * EROFS_BLKSIZ;
-		size_t block_size = EROFS_BLKSIZ;
-		int cmp;
-
-		if (!tailpacked && mid_block + 1 == last_oob_block) {
-			block_size = file_size % EROFS_BLKSIZ;
-			if (block_size == 0) {
-				block_size = EROFS_BLKSIZ;
-			}
-		}
-
-		if (cfs_lookup_block(req, block_data, block_size, name, &cmp)) {
-			return; /* Found a match */
-		}
-
-		if (cmp == 0)
-			/* The name should have been in this block,
-			   but wasn't */
-			goto noent;
-		else if (cmp > 0)
-			start_block = mid_block + 1;
-		else if (mid_block > 0)
-			end_block = mid_block - 1;
+	if (!cfs_dir_lookup(cfs_nid_from_ino(parent), oob_data, tail_data,
+			    file_size, tailpacked, name, strlen(name), &nid)) {
+		cfs_reply_noent(req);
+		return;
 	}
 
-	if (tailpacked && start_block > end_block) {
-		int cmp;
-		if (cfs_lookup_block(req, tail_data, tail_size, name, &cmp))
-			return;
+	child_cino = cfs_get_erofs_inode(nid);
+	if (erofs_inode_is_whiteout(child_cino)) {
+		cfs_reply_noent(req);
+		return;
 	}
 
-noent:
-	fuse_reply_err(req, ENOENT);
-}
+	memset(&e, 0, sizeof(e));
+	e.ino = cfs_ino_from_nid(nid);
+	e.attr_timeout = cfs_attr_timeout;
+	e.entry_timeout = cfs_entry_timeout;
+	cfs_stat(e.ino, child_cino, &e.attr);
 
-static mode_t erofs_file_type_to_mode(int file_type)
-{
-	switch (file_type) {
-	case EROFS_FT_SYMLINK:
-		return S_IFLNK;
-	case EROFS_FT_DIR:
-		return S_IFDIR;
-	case EROFS_FT_REG_FILE:
-		return S_IFREG;
-	case EROFS_FT_BLKDEV:
-		return S_IFBLK;
-	case EROFS_FT_CHRDEV:
-		return S_IFCHR;
-	case EROFS_FT_SOCK:
-		return S_IFSOCK;
-	case EROFS_FT_FIFO:
-		return S_IFIFO;
-	default:
-		return 0;
-	}
+	fuse_reply_entry(req, &e);
 }
 
 struct dirbuf {
@@ -414,7 +566,7 @@ static bool cfs_readdir_block(fuse_req_t req, struct dirbuf *buf,
 	/* Check if it outside the dirents part */
 	if (buf->offset - block_start >= dirents_size) {
 		/* Move to next block */
-		buf->offset = block_start + EROFS_BLKSIZ;
+		buf->offset = block_start + erofs_blksz;
 		return false;
 	}
 
@@ -435,7 +587,7 @@ static bool cfs_readdir_block(fuse_req_t req, struct dirbuf *buf,
 		if (i < n_dirents - 1) {
 			next_offset = buf->offset + sizeof(struct erofs_dirent);
 		} else {
-			next_offset = block_start + EROFS_BLKSIZ;
+			next_offset = block_start + erofs_blksz;
 		}
 
 		/* Compute length of the name, which is a bit weird for the last dirent */
@@ -463,8 +615,8 @@ static bool cfs_readdir_block(fuse_req_t req, struct dirbuf *buf,
 
 			memset(&e, 0, sizeof(e));
 			e.ino = cfs_ino_from_nid(nid);
-			e.attr_timeout = CFS_ATTR_TIMEOUT;
-			e.entry_timeout = CFS_ENTRY_TIMEOUT;
+			e.attr_timeout = cfs_attr_timeout;
+			e.entry_timeout = cfs_entry_timeout;
 			cfs_stat(e.ino, child_cino, &e.attr);
 
 			res = fuse_add_direntry_plus(
@@ -522,12 +674,12 @@ static void _cfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t max_size,
 	xattr_size = erofs_xattr_inode_size(xattr_icount);
 
 	tailpacked = erofs_inode_is_tailpacked(cino);
-	tail_size = tailpacked ? file_size % EROFS_BLKSIZ : 0;
+	tail_size = tailpacked ? file_size % erofs_blksz : 0;
 	tail_data = ((uint8_t *)cino) + isize + xattr_size;
-	n_blocks = round_up(file_size, EROFS_BLKSIZ) / EROFS_BLKSIZ;
+	n_blocks = round_up(file_size, erofs_blksz) / erofs_blksz;
 	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
-	first_block = buf.offset / EROFS_BLKSIZ;
-	oob_data = erofs_data + raw_blkaddr * EROFS_BLKSIZ;
+	first_block = buf.offset / erofs_blksz;
+	oob_data = erofs_data + raw_blkaddr * erofs_blksz;
 
 	if (first_block >= n_blocks) {
 		goto out;
@@ -536,13 +688,13 @@ static void _cfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t max_size,
 	/* First read the out-of-band blocks */
 	done = false;
 	for (uint64_t block = first_block; block < last_oob_block; block++) {
-		size_t block_start = block * EROFS_BLKSIZ;
-		size_t block_size = EROFS_BLKSIZ;
+		size_t block_start = block * erofs_blksz;
+		size_t block_size = erofs_blksz;
 
 		if (!tailpacked && block + 1 == last_oob_block) {
-			block_size = file_size % EROFS_BLKSIZ;
+			block_size = file_size % erofs_blksz;
 			if (block_size == 0) {
-				block_size = EROFS_BLKSIZ;
+				block_size = erofs_blksz;
 			}
 		}
 
@@ -558,7 +710,7 @@ static void _cfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t max_size,
 	}
 
 	if (!done && tailpacked) {
-		size_t block_start = last_oob_block * EROFS_BLKSIZ;
+		size_t block_start = last_oob_block * erofs_blksz;
 
 		if (buf.offset >= block_start && buf.offset < block_start + tail_size) {
 			cfs_readdir_block(req, &buf, tail_data, tail_size,
@@ -667,6 +819,13 @@ static void cfs_init(void *userdata, struct fuse_conn_info *conn)
 		conn->want |= FUSE_CAP_SPLICE_WRITE;
 	if (conn->capable & FUSE_CAP_SPLICE_READ)
 		conn->want |= FUSE_CAP_SPLICE_READ;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		cfs_use_passthrough = true;
+	}
+#endif
 }
 
 #define OVERLAY_XATTR_PARTIAL_PREFIX "overlay."
@@ -695,15 +854,50 @@ static const char *cfs_xattr_rewrite(int name_index, const char *name,
 	return name;
 }
 
+/* Returns the name of the entry after its base prefix, and the base
+ * prefix index. If the entry uses a long prefix the infix and the name
+ * are combined in name_buf. */
+static const char *cfs_xattr_entry_name(const struct erofs_xattr_entry *entry,
+					char name_buf[static UINT8_MAX],
+					uint8_t *name_index_out, uint8_t *name_len_out)
+{
+	const char *name = (const char *)entry + sizeof(struct erofs_xattr_entry);
+	const char *infix;
+	size_t infix_len;
+
+	if (erofs_xattr_entry_prefix(entry->e_name_index, erofs_long_prefixes,
+				     erofs_n_long_prefixes, name_index_out,
+				     &infix, &infix_len) < 0)
+		return NULL;
+
+	if (infix_len == 0) {
+		*name_len_out = entry->e_name_len;
+		return name;
+	}
+
+	if (infix_len + entry->e_name_len > UINT8_MAX)
+		return NULL;
+
+	memcpy(name_buf, infix, infix_len);
+	memcpy(name_buf + infix_len, name, entry->e_name_len);
+	*name_len_out = infix_len + entry->e_name_len;
+	return name_buf;
+}
+
 static errint_t cfs_listxattr_element(const struct erofs_xattr_entry *entry,
 				      char *buf, size_t *buf_size, size_t max_buf_size)
 {
-	const char *name = (const char *)entry + sizeof(struct erofs_xattr_entry);
-	uint8_t name_len = entry->e_name_len;
-	uint8_t name_index = entry->e_name_index;
+	char name_buf[UINT8_MAX];
+	const char *name;
+	uint8_t name_len;
+	uint8_t name_index;
 	size_t full_name_len;
 	const char *prefix;
 
+	name = cfs_xattr_entry_name(entry, name_buf, &name_index, &name_len);
+	if (name == NULL)
+		return 0;
+
 	name = cfs_xattr_rewrite(name_index, name, &name_len);
 	if (name == NULL)
 		return 0;
@@ -819,11 +1013,13 @@ static void cfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t max_size)
 static int match_xattr_entry(const struct erofs_xattr_entry *entry, int name_prefix,
 			     const char *name, size_t name_len, bool filter)
 {
-	uint8_t e_name_len = entry->e_name_len;
-	uint8_t e_name_prefix = entry->e_name_index;
-	const char *e_name = (const char *)entry + sizeof(struct erofs_xattr_entry);
+	char name_buf[UINT8_MAX];
+	uint8_t e_name_len;
+	uint8_t e_name_prefix;
+	const char *e_name;
 
-	if (filter)
+	e_name = cfs_xattr_entry_name(entry, name_buf, &e_name_prefix, &e_name_len);
+	if (e_name != NULL && filter)
 		e_name = cfs_xattr_rewrite(e_name_prefix, e_name, &e_name_len);
 
 	return e_name != NULL && e_name_prefix == name_prefix &&
@@ -950,12 +1146,311 @@ static void cfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 	}
 }
 
+/* With the verity options, backing files are checked against the
+ * digest in the image when opened. The measured digests are kept by
+ * (st_dev, st_ino), so files opened again are not measured again. The
+ * ctime is kept too, so files that were changed since are measured
+ * again when they are hashed in userspace. There is at most one entry
+ * per backing file referenced by the image. */
+
+struct cfs_verified {
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+};
+
+pthread_mutex_t cfs_verified_lock = PTHREAD_MUTEX_INITIALIZER;
+Hash_table *cfs_verified; /* NULL if not verifying */
+bool cfs_verity_userspace;
+
+static size_t cfs_verified_ht_hash(const void *entry, size_t table_size)
+{
+	const struct cfs_verified *v = entry;
+	return (v->ino ^ ((uint64_t)v->dev << 32)) % table_size;
+}
+
+static bool cfs_verified_ht_eq(const void *entry1, const void *entry2)
+{
+	const struct cfs_verified *v1 = entry1;
+	const struct cfs_verified *v2 = entry2;
+	return v1->dev == v2->dev && v1->ino == v2->ino;
+}
+
+static int cfs_measure_verity(int fd, uint8_t digest[LCFS_DIGEST_SIZE])
+{
+	struct {
+		struct fsverity_digest fsv;
+		uint8_t buf[LCFS_DIGEST_SIZE];
+	} buf;
+
+	buf.fsv.digest_size = LCFS_DIGEST_SIZE;
+	if (ioctl(fd, FS_IOC_MEASURE_VERITY, &buf.fsv) == 0) {
+		if (buf.fsv.digest_algorithm != FS_VERITY_HASH_ALG_SHA256 ||
+		    buf.fsv.digest_size != LCFS_DIGEST_SIZE)
+			return -1;
+		memcpy(digest, buf.fsv.digest, LCFS_DIGEST_SIZE);
+		return 0;
+	}
+
+	if (!cfs_verity_userspace ||
+	    (errno != ENODATA && errno != EOPNOTSUPP && errno != ENOTTY))
+		return -1;
+
+	if (lcfs_compute_fsverity_from_fd(digest, fd) < 0)
+		return -1;
+
+	/* Reads use explicit offsets, but leave it as it was anyway */
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Returns 0 if fd has the expected fs-verity digest, or an errno */
+static int cfs_verify_fd(int fd, const uint8_t *expected)
+{
+	struct cfs_verified key;
+	struct cfs_verified *v;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	bool found = false;
+	struct stat st;
+
+	if (expected == NULL)
+		return EIO;
+
+	if (fstat(fd, &st) < 0)
+		return errno;
+
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+
+	pthread_mutex_lock(&cfs_verified_lock);
+	v = hash_lookup(cfs_verified, &key);
+	if (v != NULL && v->ctime.tv_sec == st.st_ctim.tv_sec &&
+	    v->ctime.tv_nsec == st.st_ctim.tv_nsec) {
+		memcpy(digest, v->digest, LCFS_DIGEST_SIZE);
+		found = true;
+	}
+	pthread_mutex_unlock(&cfs_verified_lock);
+
+	if (!found) {
+		if (cfs_measure_verity(fd, digest) < 0)
+			return EIO;
+
+		v = malloc(sizeof(struct cfs_verified));
+		if (v != NULL) {
+			struct cfs_verified *old;
+
+			*v = key;
+			v->ctime = st.st_ctim;
+			memcpy(v->digest, digest, LCFS_DIGEST_SIZE);
+
+			/* Replace any entry for an older version of the file */
+			pthread_mutex_lock(&cfs_verified_lock);
+			old = hash_remove(cfs_verified, v);
+			if (hash_insert(cfs_verified, v) == NULL)
+				free(v);
+			pthread_mutex_unlock(&cfs_verified_lock);
+			free(old);
+		}
+	}
+
+	if (memcmp(digest, expected, LCFS_DIGEST_SIZE) != 0)
+		return EIO;
+
+	return 0;
+}
+
+/* The backing file of a nid is shared by all its open handles, in
+ * fi->fh, and kept open for a while after the last release, so files
+ * that are opened again don't need another openat() in basedir. At
+ * most fd_cache_size unused backing files are kept, in LRU order. */
+
+struct cfs_backing {
+	uint64_t nid; /* First, so a nid can be used as the hash table key */
+	int fd;
+	int backing_id; /* Passthrough id of fd, or 0 */
+	size_t n_open; /* Open handles using it */
+	/* In the unused list, if n_open is 0 */
+	struct cfs_backing *lru_prev;
+	struct cfs_backing *lru_next;
+};
+
+pthread_mutex_t cfs_backings_lock = PTHREAD_MUTEX_INITIALIZER;
+Hash_table *cfs_backings;
+/* Most recently used first */
+struct cfs_backing cfs_backings_unused = {
+	.lru_prev = &cfs_backings_unused,
+	.lru_next = &cfs_backings_unused,
+};
+size_t cfs_n_backings_unused;
+size_t cfs_backings_max_unused;
+
+static size_t cfs_backings_ht_hash(const void *entry, size_t table_size)
+{
+	const uint64_t *nid = entry;
+	return *nid % table_size;
+}
+
+static bool cfs_backings_ht_eq(const void *entry1, const void *entry2)
+{
+	const uint64_t *nid1 = entry1;
+	const uint64_t *nid2 = entry2;
+	return *nid1 == *nid2;
+}
+
+static void cfs_backing_free(fuse_req_t req, struct cfs_backing *backing)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (backing->backing_id > 0)
+		fuse_passthrough_close(req, backing->backing_id);
+#else
+	(void)req;
+#endif
+
+	close(backing->fd);
+	free(backing);
+}
+
+/* Takes a reference to backing. Called with the lock held. */
+static void cfs_backing_ref(struct cfs_backing *backing)
+{
+	if (backing->n_open++ == 0) {
+		backing->lru_prev->lru_next = backing->lru_next;
+		backing->lru_next->lru_prev = backing->lru_prev;
+		cfs_n_backings_unused--;
+	}
+}
+
+static void cfs_backing_unref(fuse_req_t req, struct cfs_backing *backing)
+{
+	struct cfs_backing *victim = NULL;
+
+	pthread_mutex_lock(&cfs_backings_lock);
+
+	if (--backing->n_open == 0) {
+		backing->lru_prev = &cfs_backings_unused;
+		backing->lru_next = cfs_backings_unused.lru_next;
+		backing->lru_next->lru_prev = backing;
+		cfs_backings_unused.lru_next = backing;
+
+		/* At most one is added at a time, so at most one is evicted */
+		if (cfs_n_backings_unused++ == cfs_backings_max_unused) {
+			victim = cfs_backings_unused.lru_prev;
+			victim->lru_prev->lru_next = &cfs_backings_unused;
+			cfs_backings_unused.lru_prev = victim->lru_prev;
+			cfs_n_backings_unused--;
+			hash_remove(cfs_backings, victim);
+		}
+	}
+
+	pthread_mutex_unlock(&cfs_backings_lock);
+
+	if (victim != NULL)
+		cfs_backing_free(req, victim);
+}
+
+/* Opens the backing file of nid, which has the redirect in
+ * path. Returns 0 or an errno. */
+static int cfs_backing_open(fuse_req_t req, const erofs_inode *cino,
+			    uint64_t nid, const char *path,
+			    struct cfs_backing **backing_out)
+{
+	struct cfs_backing *backing;
+	struct cfs_backing *existing;
+	int fd;
+
+	pthread_mutex_lock(&cfs_backings_lock);
+	backing = hash_lookup(cfs_backings, &nid);
+	if (backing != NULL)
+		cfs_backing_ref(backing);
+	pthread_mutex_unlock(&cfs_backings_lock);
+
+	if (backing != NULL) {
+		*backing_out = backing;
+		return 0;
+	}
+
+	while (*path == '/')
+		path++;
+
+	fd = openat(basedir_fd, path, O_CLOEXEC | O_NOCTTY | O_NOFOLLOW | O_RDONLY, 0);
+	if (fd < 0)
+		return errno;
+
+	if (cfs_verified != NULL) {
+		const uint8_t *digest = NULL;
+		const char *metacopy;
+		uint16_t value_size;
+		int r;
+
+		/* Version, length, flags and digest algorithm, then the digest */
+		metacopy = do_getxattr(cino, EROFS_XATTR_INDEX_TRUSTED,
+				       "overlay.metacopy", &value_size, false);
+		if (metacopy != NULL && value_size == 4 + LCFS_DIGEST_SIZE &&
+		    metacopy[3] == FS_VERITY_HASH_ALG_SHA256)
+			digest = (const uint8_t *)metacopy + 4;
+
+		r = cfs_verify_fd(fd, digest);
+		if (r != 0) {
+			close(fd);
+			return r;
+		}
+	}
+
+	backing = calloc(1, sizeof(struct cfs_backing));
+	if (backing == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+	backing->nid = nid;
+	backing->fd = fd;
+	backing->n_open = 1;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	/* Let the kernel read and mmap the backing file directly. The fd
+	 * is kept for lseek. If the kernel refuses, for instance because
+	 * we lack CAP_SYS_ADMIN, reads are spliced in cfs_read(). */
+	if (__atomic_load_n(&cfs_use_passthrough, __ATOMIC_RELAXED)) {
+		int backing_id = fuse_passthrough_open(req, fd);
+
+		if (backing_id > 0)
+			backing->backing_id = backing_id;
+		else
+			__atomic_store_n(&cfs_use_passthrough, false,
+					 __ATOMIC_RELAXED);
+	}
+#endif
+
+	pthread_mutex_lock(&cfs_backings_lock);
+	existing = hash_insert(cfs_backings, backing);
+	if (existing != NULL && existing != backing)
+		cfs_backing_ref(existing);
+	pthread_mutex_unlock(&cfs_backings_lock);
+
+	if (existing == NULL) {
+		cfs_backing_free(req, backing);
+		return ENOMEM;
+	}
+
+	/* Another thread opened it first */
+	if (existing != backing) {
+		cfs_backing_free(req, backing);
+		backing = existing;
+	}
+
+	*backing_out = backing;
+	return 0;
+}
+
 static void cfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	const erofs_inode *cino = cfs_get_erofs_inode(ino);
-	int fd;
+	struct cfs_backing *backing = NULL;
 	const char *redirect;
 	uint16_t value_size;
+	char path_buf[PATH_MAX];
 
 	if ((fi->flags & O_ACCMODE) == O_WRONLY || (fi->flags & O_ACCMODE) == O_RDWR)
 		return (void)fuse_reply_err(req, EROFS);
@@ -968,24 +1463,31 @@ static void cfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	redirect = do_getxattr(cino, EROFS_XATTR_INDEX_TRUSTED,
 			       "overlay.redirect", &value_size, false);
 
-	if (redirect == NULL) {
-		/* Empty files have no redirect */
-		fd = -1;
-	} else {
-		while (*redirect == '/')
-			redirect++;
+	/* Empty files have no redirect */
+	if (redirect != NULL) {
+		int r;
 
-		fd = openat(basedir_fd, redirect,
-			    O_CLOEXEC | O_NOCTTY | O_NOFOLLOW | O_RDONLY, 0);
-		if (fd < 0) {
-			fuse_reply_err(req, errno);
+		/* The value isn't nul-terminated in the image */
+		if (value_size >= PATH_MAX) {
+			fuse_reply_err(req, EIO);
 			return;
 		}
+		memcpy(path_buf, redirect, value_size);
+		path_buf[value_size] = 0;
 
-		/* TODO: Verify fs-verity */
+		r = cfs_backing_open(req, cino, cfs_nid_from_ino(ino), path_buf,
+				     &backing);
+		if (r != 0) {
+			fuse_reply_err(req, r);
+			return;
+		}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+		fi->backing_id = backing->backing_id;
+#endif
 	}
 
-	fi->fh = fd;
+	fi->fh = (uintptr_t)backing;
 	fi->keep_cache = 1;
 
 	return (void)fuse_reply_open(req, fi);
@@ -993,10 +1495,10 @@ static void cfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 
 static void cfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	int fd = fi->fh;
+	struct cfs_backing *backing = (struct cfs_backing *)(uintptr_t)fi->fh;
 
-	if (fd >= 0)
-		close(fd);
+	if (backing != NULL)
+		cfs_backing_unref(req, backing);
 	fuse_reply_err(req, 0);
 }
 
@@ -1031,14 +1533,14 @@ static void cfs_read_inline(fuse_req_t req, fuse_ino_t ino, size_t size,
 	xattr_size = erofs_xattr_inode_size(xattr_icount);
 
 	tailpacked = erofs_inode_is_tailpacked(cino);
-	tail_size = tailpacked ? file_size % EROFS_BLKSIZ : 0;
+	tail_size = tailpacked ? file_size % erofs_blksz : 0;
 	tail_data = ((uint8_t *)cino) + isize + xattr_size;
 
-	n_blocks = round_up(file_size, EROFS_BLKSIZ) / EROFS_BLKSIZ;
+	n_blocks = round_up(file_size, erofs_blksz) / erofs_blksz;
 	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
 
-	oob_data = erofs_data + raw_blkaddr * EROFS_BLKSIZ;
-	oob_size = tailpacked ? last_oob_block * EROFS_BLKSIZ : file_size;
+	oob_data = erofs_data + raw_blkaddr * erofs_blksz;
+	oob_size = tailpacked ? last_oob_block * erofs_blksz : file_size;
 
 	i = 0;
 	if (offset < oob_size) {
@@ -1062,7 +1564,8 @@ static void cfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
 		     struct fuse_file_info *fi)
 {
 	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
-	int fd = fi->fh;
+	const struct cfs_backing *backing = (struct cfs_backing *)(uintptr_t)fi->fh;
+	int fd = backing ? backing->fd : -1;
 
 	if (fd < 0) {
 		cfs_read_inline(req, ino, size, offset, fi);
@@ -1078,7 +1581,8 @@ static void cfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
 static void cfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
 		      struct fuse_file_info *fi)
 {
-	int fd = fi->fh;
+	const struct cfs_backing *backing = (struct cfs_backing *)(uintptr_t)fi->fh;
+	int fd = backing ? backing->fd : -1;
 	off_t res;
 
 	(void)ino;
@@ -1121,11 +1625,19 @@ int main(int argc, char *argv[])
 	struct fuse_session *se;
 	struct fuse_cmdline_opts opts;
 	struct fuse_loop_config config;
-	struct cfs_data data = { .source = NULL };
+	struct cfs_data data = {
+		.source = NULL,
+		.lookup_cache_size = CFS_LOOKUP_CACHE_SIZE_DEFAULT,
+		.fd_cache_size = CFS_FD_CACHE_SIZE_DEFAULT,
+		.entry_timeout = CFS_ENTRY_TIMEOUT,
+		.attr_timeout = CFS_ATTR_TIMEOUT,
+		.negative_timeout = CFS_NEGATIVE_TIMEOUT,
+	};
 	int fd;
 	struct stat s;
 	int r;
 	uint32_t cfs_flags;
+	int n_long_prefixes;
 
 	int ret = -1;
 
@@ -1200,16 +1712,63 @@ int main(int argc, char *argv[])
 		errx(EXIT_FAILURE, "Wrong erofs magic");
 	}
 
+	if (erofs_super->blkszbits < LCFS_BLOCK_SIZE_BITS_MIN ||
+	    erofs_super->blkszbits > LCFS_BLOCK_SIZE_BITS_MAX) {
+		errx(EXIT_FAILURE, "Unsupported erofs block size");
+	}
+	erofs_blksz = 1ULL << erofs_super->blkszbits;
+
 	erofs_metadata = erofs_data + lcfs_u32_from_file(erofs_super->meta_blkaddr) *
-					      EROFS_BLKSIZ;
+					      erofs_blksz;
 	erofs_xattrdata =
 		erofs_data +
-		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * EROFS_BLKSIZ;
+		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * erofs_blksz;
+
+	n_long_prefixes = erofs_read_long_xattr_prefixes(
+		erofs_data, erofs_data_size, erofs_super, erofs_long_prefixes);
+	if (n_long_prefixes < 0) {
+		errx(EXIT_FAILURE, "Invalid erofs long xattr prefixes");
+	}
+	erofs_n_long_prefixes = n_long_prefixes;
 
 	erofs_root_nid = lcfs_u16_from_file(erofs_super->root_nid);
 	erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
 	erofs_build_time_nsec = lcfs_u32_from_file(erofs_super->build_time_nsec);
 
+	cfs_image = lcfs_image_open_data(erofs_data, erofs_data_size);
+	if (cfs_image == NULL || lcfs_image_validate(cfs_image) < 0) {
+		errx(EXIT_FAILURE, "Invalid image %s", data.source);
+	}
+
+	if (data.verity || data.verity_userspace) {
+		cfs_verity_userspace = data.verity_userspace;
+		cfs_verified = hash_initialize(0, NULL, cfs_verified_ht_hash,
+					       cfs_verified_ht_eq, free);
+		if (cfs_verified == NULL) {
+			errx(EXIT_FAILURE, "Out of memory");
+		}
+	}
+
+	cfs_entry_timeout = data.entry_timeout;
+	cfs_attr_timeout = data.attr_timeout;
+	cfs_negative_timeout = data.negative_timeout;
+
+	cfs_backings_max_unused = data.fd_cache_size;
+	cfs_backings = hash_initialize(0, NULL, cfs_backings_ht_hash,
+				       cfs_backings_ht_eq, NULL);
+	if (cfs_backings == NULL) {
+		errx(EXIT_FAILURE, "Out of memory");
+	}
+
+	cfs_lookup_cache_size = data.lookup_cache_size;
+	if (cfs_lookup_cache_size > 0) {
+		cfs_lookup_cache = hash_initialize(0, NULL, cfs_lookup_cache_ht_hash,
+						   cfs_lookup_cache_ht_eq, NULL);
+		if (cfs_lookup_cache == NULL) {
+			errx(EXIT_FAILURE, "Out of memory");
+		}
+	}
+
 	se = fuse_session_new(&args, &cfs_oper, sizeof(cfs_oper), NULL);
 	if (se == NULL)
 		goto err_out1;
@@ -27,10 +27,11 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "usage: %s SRC DEST\n", argv0);
+	fprintf(stderr, "usage: %s [--lazy] [--threads=N] SRC DEST\n", argv0);
 }
 
 static ssize_t write_cb(void *_file, void *buf, size_t count)
@@ -40,14 +41,60 @@ static ssize_t write_cb(void *_file, void *buf, size_t count)
 	return fwrite(buf, 1, count, file);
 }
 
+#define OPT_LAZY 100
+#define OPT_THREADS 101
+
 int main(int argc, char **argv)
 {
 	const char *bin = argv[0];
 	int fd, version;
+	int opt;
+	int loadflags = LCFS_LOAD_PARALLEL;
+	long threads = 0;
+	char *end;
 	struct lcfs_node_s *root;
 	const char *src_path = NULL;
 	const char *dst_path = NULL;
 	struct lcfs_write_options_s options = { 0 };
+	const struct option longopts[] = {
+		{
+			name: "lazy",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_LAZY
+		},
+		{
+			name: "threads",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_THREADS
+		},
+		{},
+	};
+
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (opt) {
+		case OPT_LAZY:
+			/* Decode directories as the writer walks the tree */
+			loadflags = LCFS_LOAD_LAZY;
+			break;
+		case OPT_THREADS:
+			/* Decode on N threads, 0 for one per online CPU */
+			threads = strtol(optarg, &end, 10);
+			if (*optarg == 0 || *end != 0 || threads < 0 ||
+			    threads > LCFS_MAX_THREADS) {
+				fprintf(stderr, "Invalid number of threads %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(bin);
+			exit(1);
+		}
+	}
+
+	argv += optind - 1;
+	argc -= optind - 1;
 
 	if (argc <= 1) {
 		fprintf(stderr, "No source path specified\n");
@@ -73,7 +120,7 @@ int main(int argc, char **argv)
 		err(EXIT_FAILURE, "Failed to get image version '%s'", src_path);
 	}
 
-	root = lcfs_load_node_from_fd(fd);
+	root = lcfs_load_node_from_fd_ext(fd, loadflags, (uint32_t)threads);
 	if (root == NULL) {
 		err(EXIT_FAILURE, "Failed to load '%s'", src_path);
 	}
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "libcomposefs/lcfs-writer.h"
+#include "libcomposefs/lcfs-image.h"
 #include "libcomposefs/lcfs-utils.h"
 #include "libcomposefs/lcfs-internal.h"
 #include "libcomposefs/hash.h"
@@ -32,6 +33,8 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
 #define ESCAPE_STANDARD 0
 #define NOESCAPE_SPACE (1 << 0)
@@ -42,7 +45,7 @@ const char *opt_basedir_path;
 int opt_basedir_fd;
 
 typedef void *(*command_handler_init)(void);
-typedef void (*command_handler)(struct lcfs_node_s *node, void *handler_data);
+typedef void (*command_handler)(lcfs_image_t *image, void *handler_data);
 typedef void (*command_handler_end)(void *handler_data);
 
 static void oom(void)
@@ -110,41 +113,49 @@ static void print_escaped_optional(const char *val, ssize_t len, int escape)
 	}
 }
 
-static void print_node(struct lcfs_node_s *node, char *parent_path)
+static int print_image_entry(lcfs_image_t *image, const char *path,
+			     const struct lcfs_image_dirent_s *dirent, void *data)
 {
-	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
-		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		cleanup_free char *path = NULL;
-		int r;
-
-		r = asprintf(&path, "%s/%s", parent_path, lcfs_node_get_name(child));
-		if (r < 0)
-			oom();
-
-		uint32_t mode = lcfs_node_get_mode(child);
-		uint32_t type = mode & S_IFMT;
-		const char *payload = lcfs_node_get_payload(child);
-
-		print_escaped(path, -1, NOESCAPE_SPACE);
-
-		if (type == S_IFDIR) {
-			printf("/\t");
-		} else if (type == S_IFLNK) {
-			printf("\t-> ");
-			print_escaped(payload, -1, ESCAPE_STANDARD);
-		} else if (type == S_IFREG && payload) {
+	const char *payload;
+	size_t payload_len;
+
+	/* The root is not listed */
+	if (dirent->name_len == 0)
+		return 0;
+
+	print_escaped(path, -1, NOESCAPE_SPACE);
+
+	if (dirent->type == S_IFDIR) {
+		printf("/\t");
+	} else if (dirent->type == S_IFLNK) {
+		payload = lcfs_image_readlink(image, dirent->nid, &payload_len);
+		if (payload == NULL)
+			err(EXIT_FAILURE, "Failed to read symlink '%s'", path);
+		printf("\t-> ");
+		print_escaped(payload, payload_len, ESCAPE_STANDARD);
+	} else if (dirent->type == S_IFREG) {
+		payload = lcfs_image_get_payload(image, dirent->nid, &payload_len);
+		if (payload != NULL) {
 			printf("\t@ ");
-			print_escaped(payload, -1, ESCAPE_STANDARD);
+			print_escaped(payload, payload_len, ESCAPE_STANDARD);
+		} else if (errno != ENODATA) {
+			err(EXIT_FAILURE, "Failed to read '%s'", path);
 		}
-		printf("\n");
-
-		print_node(child, path);
 	}
+	printf("\n");
+
+	return 0;
 }
 
-static void print_node_handler(struct lcfs_node_s *node, void *data)
+static void print_image_handler(lcfs_image_t *image, void *data)
 {
-	print_node(node, "");
+	if (lcfs_image_visit(image, print_image_entry, NULL) < 0)
+		err(EXIT_FAILURE, "Failed to read image");
+}
+
+static void check_image_handler(lcfs_image_t *image, void *data)
+{
+	/* Images are validated when opened */
 }
 
 static void digest_to_string(const uint8_t *csum, char *buf)
@@ -160,67 +171,112 @@ static void digest_to_string(const uint8_t *csum, char *buf)
 	buf[j] = '\0';
 }
 
-static char *node_build_path(struct lcfs_node_s *node)
+/* Path of the first occurrence of a hardlinked inode */
+struct hardlink_s {
+	uint64_t nid;
+	char *path;
+};
+
+static size_t hardlink_ht_hash(const void *entry, size_t table_size)
 {
-	size_t pathlen = 0;
-	for (struct lcfs_node_s *n = node; n != NULL; n = lcfs_node_get_parent(n)) {
-		const char *name = lcfs_node_get_name(n);
+	const struct hardlink_s *h = entry;
+	return h->nid % table_size;
+}
 
-		/* separator after all but final element */
-		if (n != node)
-			pathlen += 1;
+static bool hardlink_ht_eq(const void *entry1, const void *entry2)
+{
+	const struct hardlink_s *h1 = entry1;
+	const struct hardlink_s *h2 = entry2;
+	return h1->nid == h2->nid;
+}
 
-		/* Root has no name */
-		if (name)
-			pathlen += strlen(name);
-	}
+static void hardlink_ht_free(void *entry)
+{
+	struct hardlink_s *h = entry;
+	free(h->path);
+	free(h);
+}
 
-	char *path = malloc(pathlen + 1);
-	char *p = path + pathlen;
-	*p = 0;
+static const char *get_hardlink_path(Hash_table *hardlinks, uint64_t nid,
+				     const char *path)
+{
+	struct hardlink_s key = { nid };
+	struct hardlink_s *h;
 
-	for (struct lcfs_node_s *n = node; n != NULL; n = lcfs_node_get_parent(n)) {
-		const char *name = lcfs_node_get_name(n);
-		if (n != node) {
-			p--;
-			*p = '/';
-		}
-		if (name) {
-			size_t len = strlen(name);
-			p -= len;
-			memcpy(p, name, len);
-		}
-	}
+	h = hash_lookup(hardlinks, &key);
+	if (h != NULL)
+		return h->path;
 
-	return path;
+	h = malloc(sizeof(struct hardlink_s));
+	if (h == NULL)
+		oom();
+	h->nid = nid;
+	h->path = strdup(path);
+	if (h->path == NULL || hash_insert(hardlinks, h) == NULL)
+		oom();
+
+	return NULL;
 }
 
-static void dump_node(struct lcfs_node_s *node, char *path)
+static int dump_image_entry(lcfs_image_t *image, const char *path,
+			    const struct lcfs_image_dirent_s *dirent, void *data)
 {
-	struct lcfs_node_s *target = lcfs_node_get_hardlink_target(node);
-	cleanup_free char *hardlink_path = NULL;
-	if (target == NULL)
-		target = node;
+	Hash_table *hardlinks = data;
+	const char *hardlink_path = NULL;
+	const char *payload = NULL;
+	size_t payload_len = 0;
+	const uint8_t *content = NULL;
+	size_t content_len = 0;
+	const uint8_t *tail = NULL;
+	size_t tail_len = 0;
+	const uint8_t *digest;
+	struct lcfs_image_xattr_s xattr;
+	uint64_t cursor = 0;
+	struct stat st;
+	int r;
+
+	if (lcfs_image_stat(image, dirent->nid, &st) < 0)
+		err(EXIT_FAILURE, "Failed to stat '%s'", path);
+
+	if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+		hardlink_path = get_hardlink_path(hardlinks, dirent->nid, path);
+
+	if (hardlink_path == NULL && (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+		payload = lcfs_image_get_payload(image, dirent->nid, &payload_len);
+		if (payload == NULL && errno != ENODATA)
+			err(EXIT_FAILURE, "Failed to read '%s'", path);
+	}
+
+	if (S_ISREG(st.st_mode) &&
+	    lcfs_image_get_content(image, dirent->nid, &content, &content_len,
+				   &tail, &tail_len) < 0) {
+		if (errno != ENODATA)
+			err(EXIT_FAILURE, "Failed to read '%s'", path);
+	}
+
+	digest = lcfs_image_get_fsverity_digest(image, dirent->nid);
+
+	print_escaped(path, -1, ESCAPE_STANDARD);
+	printf(" %" PRIu64 " %s%o %u %u %u %u %" PRIi64 ".%u ", (uint64_t)st.st_size,
+	       hardlink_path != NULL ? "@" : "", st.st_mode,
+	       (unsigned int)st.st_nlink, st.st_uid, st.st_gid,
+	       (unsigned int)st.st_rdev, (int64_t)st.st_mtim.tv_sec,
+	       (unsigned int)st.st_mtim.tv_nsec);
+	if (hardlink_path != NULL)
+		print_escaped(hardlink_path, -1, ESCAPE_LONE_DASH);
 	else
-		hardlink_path = node_build_path(target);
-
-	struct timespec mtime;
-	lcfs_node_get_mtime(target, &mtime);
-	const char *payload = lcfs_node_get_payload(target);
-	const uint8_t *digest = lcfs_node_get_fsverity_digest(target);
-	const uint8_t *content = lcfs_node_get_content(target);
-	uint64_t size = lcfs_node_get_size(target);
-
-	print_escaped(*path == 0 ? "/" : path, -1, ESCAPE_STANDARD);
-	printf(" %" PRIu64 " %s%o %u %u %u %u %" PRIi64 ".%u ", size,
-	       hardlink_path != NULL ? "@" : "", lcfs_node_get_mode(target),
-	       lcfs_node_get_nlink(target), lcfs_node_get_uid(target),
-	       lcfs_node_get_gid(target), lcfs_node_get_rdev(target),
-	       (int64_t)mtime.tv_sec, (unsigned int)mtime.tv_nsec);
-	print_escaped_optional(hardlink_path ? hardlink_path : payload, -1,
-			       ESCAPE_LONE_DASH);
+		print_escaped_optional(payload, payload_len, ESCAPE_LONE_DASH);
 	printf(" ");
-	print_escaped_optional((char *)content, size, ESCAPE_LONE_DASH);
+	if (content_len + tail_len == 1) {
+		/* Let print_escaped() see a lone dash */
+		print_escaped(content_len ? (char *)content : (char *)tail, 1,
+			      ESCAPE_LONE_DASH);
+	} else if (content_len + tail_len > 0) {
+		print_escaped((char *)content, content_len, ESCAPE_STANDARD);
+		print_escaped((char *)tail, tail_len, ESCAPE_STANDARD);
+	} else {
+		printf("-");
+	}
 
 	if (digest) {
 		char digest_str[LCFS_DIGEST_SIZE * 2 + 1] = { 0 };
@@ -230,40 +286,49 @@ static void dump_node(struct lcfs_node_s *node, char *path)
 		printf(" -");
 	}
 
-	size_t n_xattr = lcfs_node_get_n_xattr(target);
-	for (size_t i = 0; i < n_xattr; i++) {
-		const char *name = lcfs_node_get_xattr_name(target, i);
-		size_t value_len;
-		const char *value = lcfs_node_get_xattr(target, name, &value_len);
-
+	while ((r = lcfs_image_next_xattr(image, dirent->nid, &cursor, &xattr)) > 0) {
 		printf(" ");
-		print_escaped(name, -1, ESCAPE_EQUAL);
+		print_escaped(xattr.prefix, -1, ESCAPE_EQUAL);
+		print_escaped(xattr.infix, xattr.infix_len, ESCAPE_EQUAL);
+		print_escaped(xattr.name, xattr.name_len, ESCAPE_EQUAL);
 		printf("=");
-		print_escaped(value, value_len, ESCAPE_EQUAL);
+		print_escaped(xattr.value, xattr.value_len, ESCAPE_EQUAL);
 	}
+	if (r < 0)
+		err(EXIT_FAILURE, "Failed to read xattrs of '%s'", path);
 
 	printf("\n");
 
-	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
-		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		cleanup_free char *child_path = NULL;
-		int r;
-
-		r = asprintf(&child_path, "%s/%s", path, lcfs_node_get_name(child));
-		if (r < 0)
-			oom();
-
-		dump_node(child, child_path);
-	}
+	return 0;
 }
 
-static void dump_node_handler(struct lcfs_node_s *node, void *data)
+static void dump_image_handler(lcfs_image_t *image, void *data)
 {
-	dump_node(node, "");
+	Hash_table *hardlinks;
+
+	hardlinks = hash_initialize(0, NULL, hardlink_ht_hash, hardlink_ht_eq,
+				    hardlink_ht_free);
+	if (hardlinks == NULL)
+		oom();
+
+	if (lcfs_image_visit(image, dump_image_entry, hardlinks) < 0)
+		err(EXIT_FAILURE, "Failed to read image");
+
+	hash_free(hardlinks);
 }
 
+/* The objects are collected in a set that is split in shards, each
+ * with its own lock, so images can be handled on multiple threads */
+#define OBJECT_SHARDS 64
+
 typedef struct {
+	pthread_mutex_t lock;
 	Hash_table *ht;
+} ObjectShard;
+
+typedef struct {
+	ObjectShard shards[OBJECT_SHARDS];
+	int basedir_fd;
 } PrintData;
 
 static const char *abs_to_rel_path(const char *path)
@@ -273,26 +338,55 @@ static const char *abs_to_rel_path(const char *path)
 	return path;
 }
 
-static void get_objects(struct lcfs_node_s *node, PrintData *data, int basedir_fd)
+static int get_objects_entry(lcfs_image_t *image, const char *path,
+			     const struct lcfs_image_dirent_s *dirent, void *_data)
 {
-	uint32_t mode = lcfs_node_get_mode(node);
-	uint32_t type = mode & S_IFMT;
-	const char *payload = lcfs_node_get_payload(node);
+	PrintData *data = _data;
+	cleanup_free char *payload = NULL;
+	const char *value;
+	size_t value_len;
+	ObjectShard *shard;
+	void *found;
+
+	if (dirent->type != S_IFREG)
+		return 0;
+
+	value = lcfs_image_get_payload(image, dirent->nid, &value_len);
+	if (value == NULL) {
+		if (errno != ENODATA)
+			err(EXIT_FAILURE, "Failed to read '%s'", path);
+		return 0;
+	}
 
-	if (type == S_IFREG && payload && hash_lookup(data->ht, payload) == NULL) {
+	payload = strndup(value, value_len);
+	if (payload == NULL)
+		oom();
+
+	shard = &data->shards[hash_string(payload, OBJECT_SHARDS)];
+
+	pthread_mutex_lock(&shard->lock);
+	found = hash_lookup(shard->ht, payload);
+	pthread_mutex_unlock(&shard->lock);
+	if (found != NULL)
+		return 0;
+
+	if (data->basedir_fd != -1) {
 		struct stat st;
-		if (basedir_fd == -1 || fstatat(basedir_fd, abs_to_rel_path(payload),
-						&st, AT_EMPTY_PATH) < 0) {
-			char *dup = strdup(payload);
-			if (dup == NULL || hash_insert(data->ht, dup) == NULL)
-				oom();
-		}
+		if (fstatat(data->basedir_fd, abs_to_rel_path(payload), &st,
+			    AT_EMPTY_PATH) == 0)
+			return 0;
 	}
 
-	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
-		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		get_objects(child, data, basedir_fd);
-	}
+	/* Another thread may have added it since the lookup */
+	pthread_mutex_lock(&shard->lock);
+	found = hash_insert(shard->ht, payload);
+	pthread_mutex_unlock(&shard->lock);
+	if (found == NULL)
+		oom();
+	if (found == payload)
+		steal_pointer(&payload);
+
+	return 0;
 }
 
 static size_t str_ht_hash(const void *entry, size_t table_size)
@@ -312,77 +406,279 @@ static int cmp_obj(const void *_a, const void *_b)
 	return strcmp(*a, *b);
 }
 
-static void *print_objects_handler_init(void)
+static PrintData *objects_data_new(int basedir_fd)
 {
 	PrintData *data = calloc(1, sizeof(PrintData));
 
 	if (data == NULL)
 		oom();
 
-	data->ht = hash_initialize(0, NULL, str_ht_hash, str_ht_eq, free);
-	if (data->ht == NULL)
-		oom();
+	for (size_t i = 0; i < OBJECT_SHARDS; i++) {
+		pthread_mutex_init(&data->shards[i].lock, NULL);
+		data->shards[i].ht =
+			hash_initialize(0, NULL, str_ht_hash, str_ht_eq, free);
+		if (data->shards[i].ht == NULL)
+			oom();
+	}
+
+	data->basedir_fd = basedir_fd;
 
 	return data;
 }
 
-static void print_objects_handler(struct lcfs_node_s *node, void *_data)
+static void *print_objects_handler_init(void)
 {
-	PrintData *data = _data;
-	get_objects(node, data, -1);
+	return objects_data_new(-1);
+}
+
+static void *print_missing_objects_handler_init(void)
+{
+	return objects_data_new(opt_basedir_fd);
 }
 
-static void print_missing_objects_handler(struct lcfs_node_s *node, void *_data)
+static void print_objects_handler(lcfs_image_t *image, void *_data)
 {
 	PrintData *data = _data;
-	get_objects(node, data, opt_basedir_fd);
+
+	if (lcfs_image_visit(image, get_objects_entry, data) < 0)
+		err(EXIT_FAILURE, "Failed to read image");
 }
 
 static void print_objects_handler_end(void *_data)
 {
 	PrintData *data = _data;
+	size_t n_objects = 0;
+
+	for (size_t i = 0; i < OBJECT_SHARDS; i++)
+		n_objects += hash_get_n_entries(data->shards[i].ht);
 
-	size_t n_objects = hash_get_n_entries(data->ht);
 	cleanup_free char **objects = calloc(n_objects, sizeof(char *));
-	if (objects == NULL)
+	if (objects == NULL && n_objects > 0)
 		oom();
 
-	hash_get_entries(data->ht, (void **)objects, n_objects);
+	n_objects = 0;
+	for (size_t i = 0; i < OBJECT_SHARDS; i++) {
+		Hash_table *ht = data->shards[i].ht;
+
+		n_objects += hash_get_entries(ht, (void **)(objects + n_objects),
+					      hash_get_n_entries(ht));
+	}
 
 	qsort(objects, n_objects, sizeof(char *), cmp_obj);
 
 	for (size_t i = 0; i < n_objects; i++)
 		printf("%s\n", objects[i]);
 
-	hash_free(data->ht);
+	for (size_t i = 0; i < OBJECT_SHARDS; i++) {
+		hash_free(data->shards[i].ht);
+		pthread_mutex_destroy(&data->shards[i].lock);
+	}
 	free(data);
 }
 
+static const struct {
+	uint32_t flag;
+	const char *name;
+} diff_changes[] = {
+	{ LCFS_IMAGE_DIFF_MODE, "mode" },
+	{ LCFS_IMAGE_DIFF_OWNER, "owner" },
+	{ LCFS_IMAGE_DIFF_MTIME, "mtime" },
+	{ LCFS_IMAGE_DIFF_CONTENT, "content" },
+	{ LCFS_IMAGE_DIFF_PAYLOAD, "payload" },
+	{ LCFS_IMAGE_DIFF_DIGEST, "digest" },
+	{ LCFS_IMAGE_DIFF_XATTRS, "xattrs" },
+};
+
+/* Prints "OP PATH CHANGES PAYLOAD", where OP is +, - or M, CHANGES is
+ * a comma-separated list and PAYLOAD is the one of the new entry, or
+ * the removed one. Missing fields are "-". */
+static int print_diff_entry(const char *path,
+			    const struct lcfs_image_dirent_s *old_dirent,
+			    const struct lcfs_image_dirent_s *new_dirent,
+			    uint32_t changes, void *data)
+{
+	lcfs_image_t **images = data;
+	lcfs_image_t *image = new_dirent ? images[1] : images[0];
+	const struct lcfs_image_dirent_s *dirent = new_dirent ? new_dirent : old_dirent;
+	const char *payload = NULL;
+	size_t payload_len = 0;
+
+	printf("%c ", old_dirent == NULL ? '+' : new_dirent == NULL ? '-' : 'M');
+	print_escaped(path, -1, ESCAPE_STANDARD);
+
+	if (changes == 0) {
+		printf(" -");
+	} else {
+		const char *sep = " ";
+
+		for (size_t i = 0; i < sizeof(diff_changes) / sizeof(diff_changes[0]); i++) {
+			if (changes & diff_changes[i].flag) {
+				printf("%s%s", sep, diff_changes[i].name);
+				sep = ",";
+			}
+		}
+	}
+
+	if (dirent->type == S_IFREG || dirent->type == S_IFLNK) {
+		payload = lcfs_image_get_payload(image, dirent->nid, &payload_len);
+		if (payload == NULL && errno != ENODATA)
+			err(EXIT_FAILURE, "Failed to read '%s'", path);
+	}
+
+	printf(" ");
+	if (payload != NULL)
+		print_escaped(payload, payload_len, ESCAPE_LONE_DASH);
+	else
+		printf("-");
+	printf("\n");
+
+	return 0;
+}
+
+static lcfs_image_t *open_image(const char *image_path)
+{
+	cleanup_fd int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "Failed to open '%s'", image_path);
+	}
+
+	lcfs_image_t *image = lcfs_image_open_fd(fd);
+	if (image == NULL) {
+		err(EXIT_FAILURE, "Failed to load '%s'", image_path);
+	}
+
+	if (lcfs_image_validate(image) < 0) {
+		err(EXIT_FAILURE, "Invalid image '%s'", image_path);
+	}
+
+	return image;
+}
+
+static void print_diff(const char *old_path, const char *new_path)
+{
+	lcfs_image_t *images[2];
+
+	images[0] = open_image(old_path);
+	images[1] = open_image(new_path);
+
+	if (lcfs_image_diff(images[0], images[1], print_diff_entry, images) < 0)
+		err(EXIT_FAILURE, "Failed to read images");
+
+	lcfs_image_close(images[0]);
+	lcfs_image_close(images[1]);
+}
+
+struct handle_images_s {
+	char **image_paths;
+	size_t n_images;
+	size_t next; /* Next image to handle, updated atomically */
+	command_handler handler;
+	void *handler_data;
+};
+
+static void *handle_images_worker(void *_data)
+{
+	struct handle_images_s *data = _data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&data->next, 1, __ATOMIC_RELAXED)) <
+	       data->n_images) {
+		lcfs_image_t *image = open_image(data->image_paths[i]);
+
+		data->handler(image, data->handler_data);
+		lcfs_image_close(image);
+	}
+
+	return NULL;
+}
+
+/* Each thread takes the next image that isn't handled yet, so the
+ * handler must be thread-safe */
+static void handle_images_parallel(struct handle_images_s *data, long n_threads)
+{
+	cleanup_free pthread_t *threads = NULL;
+	long n_started = 0;
+
+	if ((size_t)n_threads > data->n_images)
+		n_threads = data->n_images;
+
+	threads = calloc(n_threads, sizeof(pthread_t));
+	if (threads == NULL)
+		oom();
+
+	/* The main thread is a worker too */
+	while (n_started < n_threads - 1) {
+		if (pthread_create(&threads[n_started], NULL,
+				   handle_images_worker, data) != 0)
+			break;
+		n_started++;
+	}
+
+	handle_images_worker(data);
+
+	for (long i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void usage(const char *argv0)
 {
 	fprintf(stderr,
-		"usage: %s [--basedir=path] [ls|objects|dump|missing-objects] IMAGES...\n",
-		argv0);
+		"usage: %s [--basedir=path] [ls|objects|dump|missing-objects|check] IMAGES...\n"
+		"       %s [--basedir=path] [--threads=N] [objects|missing-objects] IMAGES...\n"
+		"       %s diff OLD-IMAGE NEW-IMAGE\n",
+		argv0, argv0, argv0);
 }
 
 #define OPT_BASEDIR 100
+#define OPT_THREADS 101
 
 int main(int argc, char **argv)
 {
 	const char *bin = argv[0];
 	int opt;
-	const struct option longopts[] = { {
-		name: "basedir",
-		has_arg: required_argument,
-		flag: NULL,
-		val: OPT_BASEDIR
-	} };
+	long threads = 1;
+	bool report_speed = false;
+	char *end;
+	const struct option longopts[] = {
+		{
+			name: "basedir",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_BASEDIR
+		},
+		{
+			name: "threads",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_THREADS
+		},
+		{},
+	};
 
 	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
 		switch (opt) {
 		case OPT_BASEDIR:
 			opt_basedir_path = optarg;
 			break;
+		case OPT_THREADS:
+			threads = strtol(optarg, &end, 10);
+			if (*optarg == 0 || *end != 0 || threads < 0 ||
+			    threads > UINT32_MAX) {
+				fprintf(stderr, "Invalid number of threads %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (threads == 0)
+				threads = sysconf(_SC_NPROCESSORS_ONLN);
+			report_speed = true;
+			break;
 		case ':':
 			fprintf(stderr, "option needs a value\n");
 			exit(EXIT_FAILURE);
@@ -403,27 +699,42 @@ int main(int argc, char **argv)
 	}
 	const char *command = argv[1];
 
+	if (strcmp(command, "diff") == 0) {
+		if (argc != 4) {
+			fprintf(stderr, "Two image paths must be specified\n");
+			usage(bin);
+			exit(1);
+		}
+		print_diff(argv[2], argv[3]);
+		return 0;
+	}
+
 	command_handler_init handler_init = NULL;
 	command_handler handler = NULL;
 	command_handler_end handler_end = NULL;
 	void *handler_data = NULL;
 
 	if (strcmp(command, "ls") == 0) {
-		handler = print_node_handler;
+		handler = print_image_handler;
 	} else if (strcmp(command, "dump") == 0) {
-		handler = dump_node_handler;
+		handler = dump_image_handler;
+	} else if (strcmp(command, "check") == 0) {
+		handler = check_image_handler;
 	} else if (strcmp(command, "objects") == 0) {
 		handler = print_objects_handler;
 		handler_init = print_objects_handler_init;
 		handler_end = print_objects_handler_end;
 	} else if (strcmp(command, "missing-objects") == 0) {
-		handler = print_missing_objects_handler;
-		handler_init = print_objects_handler_init;
+		handler = print_objects_handler;
+		handler_init = print_missing_objects_handler_init;
 		handler_end = print_objects_handler_end;
 	} else {
 		errx(EXIT_FAILURE, "Unknown command '%s'\n", command);
 	}
 
+	if (threads != 1 && handler != print_objects_handler)
+		errx(EXIT_FAILURE, "--threads is only supported by objects and missing-objects\n");
+
 	if (opt_basedir_path) {
 		opt_basedir_fd = open(opt_basedir_path,
 				      O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
@@ -441,20 +752,31 @@ int main(int argc, char **argv)
 	if (handler_init)
 		handler_data = handler_init();
 
-	for (int i = 2; i < argc; i++) {
-		const char *image_path = image_path = argv[i];
+	double start = get_time();
 
-		cleanup_fd int fd = open(image_path, O_RDONLY | O_CLOEXEC);
-		if (fd < 0) {
-			err(EXIT_FAILURE, "Failed to open '%s'", image_path);
-		}
+	if (threads > 1) {
+		struct handle_images_s data = {
+			.image_paths = argv + 2,
+			.n_images = argc - 2,
+			.handler = handler,
+			.handler_data = handler_data,
+		};
 
-		cleanup_node struct lcfs_node_s *root = lcfs_load_node_from_fd(fd);
-		if (root == NULL) {
-			err(EXIT_FAILURE, "Failed to load '%s'", image_path);
+		handle_images_parallel(&data, threads);
+	} else {
+		for (int i = 2; i < argc; i++) {
+			lcfs_image_t *image = open_image(argv[i]);
+
+			handler(image, handler_data);
+			lcfs_image_close(image);
 		}
+	}
+
+	if (report_speed) {
+		double elapsed = get_time() - start;
 
-		handler(root, handler_data);
+		fprintf(stderr, "%d images in %.3fs (%.1f images/s)\n", argc - 2,
+			elapsed, elapsed > 0 ? (argc - 2) / elapsed : 0.0);
 	}
 
 	if (handler_end)
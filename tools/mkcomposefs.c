@@ -66,6 +66,12 @@ static __attribute__((format(printf, 1, 2))) char *make_error(const char *fmt, .
 #define OPT_FROM_FILE 113
 #define OPT_MIN_VERSION 114
 #define OPT_MAX_VERSION 115
+#define OPT_THREADS 116
+#define OPT_LAYOUT 117
+#define OPT_INLINE_LIMIT 118
+#define OPT_DEDUP_DATA_BLOCKS 119
+#define OPT_STREAM 120
+#define OPT_BLOCK_SIZE 121
 
 static size_t split_at(const char **start, size_t *length, char split_char,
 		       bool *partial)
@@ -308,6 +314,9 @@ typedef struct dump_info dump_info;
 struct dump_info {
 	struct lcfs_node_s *root;
 	hardlink_fixup *hardlink_fixups;
+	/* If set, nodes are added to this rather than to the tree */
+	struct lcfs_write_stream_s *stream;
+	bool stream_has_nodes;
 };
 
 typedef struct field_info field_info;
@@ -380,6 +389,10 @@ static char *tree_resolve_hardlinks(dump_info *info)
 			return make_error("No target at %s for hardlink",
 					  fixup->target_path);
 
+		/* The target may be a hardlink itself, which make_hardlink follows */
+		while (lcfs_node_get_hardlink_target(target) != NULL)
+			target = lcfs_node_get_hardlink_target(target);
+
 		/* Don't override existing value from image for target nlink */
 		uint32_t old_nlink = lcfs_node_get_nlink(target);
 
@@ -395,6 +408,36 @@ static char *tree_resolve_hardlinks(dump_info *info)
 	return NULL;
 }
 
+static char *stream_add_node(dump_info *info, const char *path,
+			     struct lcfs_node_s *node)
+{
+	if (lcfs_write_stream_add(info->stream, path, node) < 0) {
+		if (errno == EEXIST)
+			return make_error("Path %s already exist", path);
+		if (errno == EINVAL)
+			return make_error("Invalid path %s, or not in dump order", path);
+		return make_error("Can't add %s: %s", path, strerror(errno));
+	}
+	info->stream_has_nodes = true;
+	return NULL;
+}
+
+static char *stream_add_hardlink(dump_info *info, const char *path,
+				 const char *target_path)
+{
+	if (target_path == NULL)
+		return make_error("No target path for the hardlink");
+
+	if (lcfs_write_stream_add_hardlink(info->stream, path, target_path) < 0) {
+		if (errno == EEXIST)
+			return make_error("Path %s already exist", path);
+		if (errno == EINVAL)
+			return make_error("Invalid path %s, or not in dump order", path);
+		return make_error("Can't add %s: %s", path, strerror(errno));
+	}
+	return NULL;
+}
+
 static char *tree_from_dump_line(dump_info *info, const char *line, size_t line_len)
 {
 	int ret;
@@ -430,9 +473,11 @@ static char *tree_from_dump_line(dump_info *info, const char *line, size_t line_
 	}
 	lcfs_node_set_mode(node, mode);
 
-	err = tree_add_node(info, path, node);
-	if (err)
-		return err;
+	if (info->stream == NULL) {
+		err = tree_add_node(info, path, node);
+		if (err)
+			return err;
+	}
 
 	/* For hardlinks, bail out early and handle in a fixup at the
          * end when we can resolve the target path. */
@@ -446,6 +491,8 @@ static char *tree_from_dump_line(dump_info *info, const char *line, size_t line_
 						 NULL, &err);
 		if (target_path == NULL && err)
 			return err;
+		if (info->stream)
+			return stream_add_hardlink(info, path, target_path);
 		tree_add_hardlink_fixup(info, steal_pointer(&target_path), node);
 		return NULL;
 	}
@@ -527,6 +574,9 @@ static char *tree_from_dump_line(dump_info *info, const char *line, size_t line_
 		if (err)
 			return err;
 	}
+
+	if (info->stream)
+		return stream_add_node(info, path, node);
 	return NULL;
 }
 
@@ -591,10 +641,8 @@ static void buffer_free(struct buffer *buf)
 	free(buf->buf);
 }
 
-static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
+static bool read_dump(FILE *input, dump_info *info, char **out_err)
 {
-	dump_info info = { NULL };
-
 	struct buffer buf = { NULL };
 
 	while (!feof(input)) {
@@ -612,11 +660,11 @@ static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
 				split_at(&data, &remaining_data, '\n', &partial);
 
 			if (!partial || short_read) {
-				char *err = tree_from_dump_line(&info, line, line_len);
+				char *err = tree_from_dump_line(info, line, line_len);
 				if (err != NULL) {
 					*out_err = err;
 					buffer_free(&buf);
-					return NULL;
+					return false;
 				}
 			} else {
 				/* Last line didn't have a newline and
@@ -630,6 +678,16 @@ static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
 
 	buffer_free(&buf);
 
+	return true;
+}
+
+static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
+{
+	dump_info info = { NULL };
+
+	if (!read_dump(input, &info, out_err))
+		return NULL;
+
 	/* Fixup hardlinks now that we have all other files */
 	char *err = tree_resolve_hardlinks(&info);
 	if (err) {
@@ -665,6 +723,37 @@ int main(int argc, char **argv)
 	}
 }
 #else
+/* Writes the image while reading the dump, without having the whole
+ * tree in memory */
+static char *stream_from_dump(FILE *input, struct lcfs_write_options_s *options)
+{
+	dump_info info = { NULL };
+	char *err = NULL;
+
+	info.stream = lcfs_write_stream_new(options, NULL);
+	if (info.stream == NULL)
+		return make_error("Can't create image stream: %s", strerror(errno));
+
+	if (!read_dump(input, &info, &err)) {
+		/* err is set */
+	} else if (!info.stream_has_nodes) {
+		err = make_error("No files in dump file");
+	} else if (lcfs_write_stream_finish(info.stream) < 0) {
+		const char *failed_path =
+			lcfs_write_stream_get_failed_path(info.stream);
+
+		if (failed_path == NULL)
+			err = make_error("Can't write image: %s", strerror(errno));
+		else if (errno == ELOOP)
+			err = make_error("Hardlink loop at %s", failed_path);
+		else
+			err = make_error("No target at %s for hardlink", failed_path);
+	}
+
+	lcfs_write_stream_free(info.stream);
+	return err;
+}
+
 static int ensure_dir(const char *path, mode_t mode)
 {
 	struct stat buf;
@@ -958,7 +1047,13 @@ static void usage(const char *argv0)
 		"  --print-digest-only   Print the digest of the image, don't write image\n"
 		"  --from-file           The source is a dump file, not a directory\n"
 		"  --min-version=N       Use this minimal format version (default=%d)\n"
-		"  --max-version=N       Use this maxium format version (default=%d)\n",
+		"  --max-version=N       Use this maxium format version (default=%d)\n"
+		"  --threads=N           Use N threads to serialize the image\n"
+		"  --layout=LAYOUT       Inode order: bfs (default), dfs or dir-children\n"
+		"  --inline-limit=N      Store files up to N bytes in the image (default=64)\n"
+		"  --dedup-data-blocks   Share data blocks of identical inline files\n"
+		"  --stream              Write the dump file without loading it in memory\n"
+		"  --block-size=N        Use N byte erofs blocks, 4096 (default) to 65536\n",
 		bin, LCFS_DEFAULT_VERSION_MIN, LCFS_DEFAULT_VERSION_MAX);
 }
 
@@ -1025,6 +1120,42 @@ int main(int argc, char **argv)
 			flag: NULL,
 			val: OPT_MIN_VERSION
 		},
+		{
+			name: "threads",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_THREADS
+		},
+		{
+			name: "layout",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_LAYOUT
+		},
+		{
+			name: "inline-limit",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_INLINE_LIMIT
+		},
+		{
+			name: "dedup-data-blocks",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_DEDUP_DATA_BLOCKS
+		},
+		{
+			name: "stream",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_STREAM
+		},
+		{
+			name: "block-size",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_BLOCK_SIZE
+		},
 		{},
 	};
 	struct lcfs_write_options_s options = { 0 };
@@ -1041,10 +1172,18 @@ int main(int argc, char **argv)
 	uint8_t digest[LCFS_DIGEST_SIZE];
 	int opt;
 	FILE *out_file;
+	int out_fd = -1;
 	char *failed_path;
 	bool version_set = false;
 	long min_version = 0;
 	long max_version = 0;
+	long threads = 0;
+	uint8_t layout = LCFS_LAYOUT_BFS;
+	long inline_limit = 64;
+	bool dedup_data_blocks = false;
+	bool stream = false;
+	long block_size = 0;
+	uint8_t block_size_bits = 0;
 	char *end;
 
 #ifdef FUZZER
@@ -1095,6 +1234,54 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case OPT_THREADS:
+			threads = strtol(optarg, &end, 10);
+			if (*optarg == 0 || *end != 0 || threads < 0 ||
+			    threads > LCFS_MAX_THREADS) {
+				fprintf(stderr, "Invalid number of threads %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_LAYOUT:
+			if (strcmp(optarg, "bfs") == 0)
+				layout = LCFS_LAYOUT_BFS;
+			else if (strcmp(optarg, "dfs") == 0)
+				layout = LCFS_LAYOUT_DFS;
+			else if (strcmp(optarg, "dir-children") == 0)
+				layout = LCFS_LAYOUT_DIR_CHILDREN;
+			else {
+				fprintf(stderr, "Unknown layout %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_INLINE_LIMIT:
+			inline_limit = strtol(optarg, &end, 10);
+			if (*optarg == 0 || *end != 0 || inline_limit < 0 ||
+			    inline_limit > LCFS_BUILD_INLINE_FILE_SIZE_MAX) {
+				fprintf(stderr, "Invalid inline limit %s, max is %d\n",
+					optarg, LCFS_BUILD_INLINE_FILE_SIZE_MAX);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_DEDUP_DATA_BLOCKS:
+			dedup_data_blocks = true;
+			break;
+		case OPT_STREAM:
+			stream = true;
+			break;
+		case OPT_BLOCK_SIZE:
+			block_size = strtol(optarg, &end, 10);
+			for (block_size_bits = LCFS_BLOCK_SIZE_BITS_MIN;
+			     block_size_bits < LCFS_BLOCK_SIZE_BITS_MAX &&
+			     (1L << block_size_bits) < block_size;
+			     block_size_bits++)
+				;
+			if (*optarg == 0 || *end != 0 ||
+			    block_size != (1L << block_size_bits)) {
+				fprintf(stderr, "Invalid block size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case ':':
 			fprintf(stderr, "option needs a value\n");
 			exit(EXIT_FAILURE);
@@ -1109,6 +1296,16 @@ int main(int argc, char **argv)
 		max_version = LCFS_DEFAULT_VERSION_MAX;
 	}
 
+	if (stream) {
+		if (!from_file)
+			errx(EXIT_FAILURE, "--stream requires --from-file");
+		if (layout != LCFS_LAYOUT_BFS)
+			errx(EXIT_FAILURE, "--stream only supports the bfs layout");
+		if (dedup_data_blocks)
+			errx(EXIT_FAILURE,
+			     "--stream can't be used with --dedup-data-blocks");
+	}
+
 	argv += optind;
 	argc -= optind;
 
@@ -1152,11 +1349,31 @@ int main(int argc, char **argv)
 			errx(EXIT_FAILURE, "stdout is a tty.  Refusing to use it");
 		out_file = stdout;
 	} else {
-		out_file = fopen(out, "we");
-		if (out_file == NULL)
+		out_file = NULL;
+		out_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (out_fd < 0)
 			err(EXIT_FAILURE, "failed to open output file");
 	}
 
+	if (out_file) {
+		options.file = out_file;
+		options.file_write_cb = write_cb;
+	} else if (out_fd >= 0) {
+		options.flags |= LCFS_FLAGS_WRITE_FD;
+		options.file_fd = out_fd;
+	}
+	if (dedup_data_blocks)
+		options.flags |= LCFS_FLAGS_DEDUP_DATA_BLOCKS;
+	if (print_digest)
+		options.digest_out = digest;
+
+	options.format = LCFS_FORMAT_EROFS;
+	options.version = (int)min_version;
+	options.max_version = (int)max_version;
+	options.threads = (uint32_t)threads;
+	options.layout = layout;
+	options.block_size_bits = block_size_bits;
+
 	if (from_file) {
 		FILE *input = NULL;
 		bool close_input = false;
@@ -1170,18 +1387,26 @@ int main(int argc, char **argv)
 		}
 
 		char *err = NULL;
-		root = tree_from_dump(input, &err);
-		if (root == NULL) {
+		if (stream) {
+			root = NULL;
+			err = stream_from_dump(input, &options);
 			if (err)
 				errx(EXIT_FAILURE, "%s", err);
-			else
-				errx(EXIT_FAILURE, "No files in dump file");
+		} else {
+			root = tree_from_dump(input, &err);
+			if (root == NULL) {
+				if (err)
+					errx(EXIT_FAILURE, "%s", err);
+				else
+					errx(EXIT_FAILURE, "No files in dump file");
+			}
 		}
 
 		if (close_input)
 			fclose(input);
 	} else {
-		root = lcfs_build(AT_FDCWD, src_path, buildflags, &failed_path);
+		root = lcfs_build_ext(AT_FDCWD, src_path, buildflags,
+				      (size_t)inline_limit, &failed_path);
 		if (root == NULL)
 			err(EXIT_FAILURE, "error accessing %s", failed_path);
 
@@ -1190,18 +1415,10 @@ int main(int argc, char **argv)
 			err(EXIT_FAILURE, "cannot fill store");
 	}
 
-	if (out_file) {
-		options.file = out_file;
-		options.file_write_cb = write_cb;
-	}
-	if (print_digest)
-		options.digest_out = digest;
-
-	options.format = LCFS_FORMAT_EROFS;
-	options.version = (int)min_version;
-	options.max_version = (int)max_version;
+	if (root != NULL && lcfs_write_to(root, &options) < 0)
+		err(EXIT_FAILURE, "cannot write file");
 
-	if (lcfs_write_to(root, &options) < 0)
+	if (out_fd >= 0 && close(out_fd) < 0)
 		err(EXIT_FAILURE, "cannot write file");
 
 	if (print_digest) {
@@ -1210,7 +1427,8 @@ int main(int argc, char **argv)
 		printf("%s\n", digest_str);
 	}
 
-	lcfs_node_unref(root);
+	if (root != NULL)
+		lcfs_node_unref(root);
 	return 0;
 }
 #endif